@@ -0,0 +1,53 @@
+#!/bin/sh
+# Compares the time taken to unpack a volume with ext2extract against
+# mounting it with ext2fs and copying the tree with cp -a.
+#
+# Usage: ./bench_extract.sh volume_file [scratch_directory]
+
+set -e
+
+VOLUME=$1
+SCRATCH=${2:-$(mktemp -d)}
+
+if [ -z "$VOLUME" ]; then
+  echo "Usage: $0 volume_file [scratch_directory]" >&2
+  exit 1
+fi
+
+MNT=$SCRATCH/mnt
+mkdir -p "$MNT"
+SIZE=$(stat -c %s "$VOLUME")
+
+elapsed() {
+  start=$(date +%s.%N)
+  "$@" > /dev/null
+  end=$(date +%s.%N)
+  echo "$end - $start" | bc
+}
+
+report() {
+  printf "%-28s %8.3f s  %8.1f MiB/s\n" "$1" "$2" "$(echo "$SIZE / 1048576 / $2" | bc -l)"
+}
+
+drop_caches() {
+  sync
+  [ -w /proc/sys/vm/drop_caches ] && echo 3 > /proc/sys/vm/drop_caches || true
+}
+
+echo "Volume: $VOLUME ($SIZE bytes)"
+
+drop_caches
+report "ext2extract" "$(elapsed ./ext2extract "$VOLUME" "$SCRATCH/extract")"
+rm -rf "$SCRATCH/extract"
+
+drop_caches
+report "ext2extract -t" "$(elapsed sh -c "./ext2extract -t '$VOLUME' > /dev/null")"
+
+drop_caches
+./ext2fs "$MNT" "$VOLUME"
+report "ext2fs + cp -a" "$(elapsed cp -a "$MNT" "$SCRATCH/copy")"
+fusermount -u "$MNT"
+rm -rf "$SCRATCH/copy"
+
+drop_caches
+report "cat (raw sequential read)" "$(elapsed cat "$VOLUME")"
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "ext2.h"
 
 #include <stdio.h>
@@ -12,12 +13,31 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 
 #define EXT2_OFFSET_SUPERBLOCK 1024
 
+typedef struct file_backend {
+  volume_backend_t backend;
+  int fd;
+} file_backend_t;
+
+static ssize_t file_backend_pread(volume_backend_t *backend, void *buffer, size_t size, uint64_t offset)
+{
+  return pread(((file_backend_t *) backend)->fd, buffer, size, offset);
+}
+
+static void file_backend_close(volume_backend_t *backend)
+{
+  close(((file_backend_t *) backend)->fd);
+  free(backend);
+}
+
 /* open_volume_file: Opens the specified file and reads the initial
    EXT2 data contained in the file, including the boot sector, file
-   allocation table and root directory.
+   allocation table and root directory. Files created by ext2zconv
+   are recognized and read through the compressed image backend, and
+   http:// URLs are read from the server with Range requests.
 
    Parameters:
      filename: Name of the file containing the volume data.
@@ -29,6 +49,12 @@
 volume_t *open_volume_file(const char *filename)
 {
 
+  if (is_http_url(filename))
+  {
+    volume_backend_t *backend = open_http_backend(filename);
+    return backend ? open_volume_backend(backend, -1) : NULL;
+  }
+
   int fd = open(filename, O_RDONLY);
   if (fd == -1)
     return NULL;
@@ -40,19 +66,117 @@ volume_t *open_volume_file(const char *filename)
     return NULL;
   }
 
-  volume_t *volume = malloc(sizeof(volume_t));
+  if (is_zimage_file(fd))
+  {
+    volume_backend_t *backend = open_zimage_backend(fd);
+    if (!backend)
+    {
+      close(fd);
+      return NULL;
+    }
+    return open_volume_backend(backend, -1);
+  }
+
+  file_backend_t *file = malloc(sizeof(file_backend_t));
+  if (!file)
+  {
+    close(fd);
+    return NULL;
+  }
+  file->backend.pread = file_backend_pread;
+  file->backend.pwrite = NULL; // Volume files are never modified
+  file->backend.close = file_backend_close;
+  file->backend.size = vol_st.st_size;
+  file->fd = fd;
+
+  return open_volume_backend(&file->backend, fd);
+}
+
+/* open_volume_file_direct: Same as open_volume_file, but reads the
+   volume file with direct I/O (O_DIRECT), bypassing the kernel page
+   cache. Volumes opened this way should have a block cache attached,
+   so that their data is cached exactly once. Compressed images and
+   URLs are opened as in open_volume_file, since the page cache does
+   not hold their volume data.
+
+   Parameters:
+     filename: Name of the file containing the volume data.
+   Returns:
+     A pointer to a newly allocated volume_t data structure, or NULL
+     if the file is invalid, or does not support direct I/O (errno is
+     then set to EINVAL).
+ */
+volume_t *open_volume_file_direct(const char *filename)
+{
+
+  if (is_http_url(filename))
+    return open_volume_file(filename);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  int compressed = is_zimage_file(fd);
+  close(fd);
+  if (compressed)
+    return open_volume_file(filename);
+
+  fd = open(filename, O_RDONLY | O_DIRECT);
+  if (fd == -1)
+    return NULL;
+  volume_backend_t *backend = open_direct_backend(fd);
+  if (!backend)
+  {
+    close(fd);
+    return NULL;
+  }
+  // The file descriptor cannot be used for unaligned reads
+  return open_volume_backend(backend, -1);
+}
+
+/* open_volume_backend: Same as open_volume_file, but reads the volume
+   data from an already opened storage backend. The volume takes
+   ownership of the backend, which is closed if the volume is invalid.
+
+   Parameters:
+     backend: Storage backend containing the volume data.
+     fd: File descriptor of the volume file, if the backend reads
+         directly from one, or -1 otherwise.
+   Returns:
+     A pointer to a newly allocated volume_t data structure, or NULL
+     if the data is not a valid volume.
+ */
+volume_t *open_volume_backend(volume_backend_t *backend, int fd)
+{
+
+  volume_t *volume = calloc(1, sizeof(volume_t));
+  if (!volume)
+  {
+    backend->close(backend);
+    return NULL;
+  }
   volume->fd = fd;
-  volume->volume_size = vol_st.st_size;
+  volume->backend = backend;
+  volume->volume_size = backend->size;
 
   /* TO BE COMPLETED BY THE STUDENT */
-  ssize_t x = pread(fd, &volume->super, sizeof(superblock_t), EXT2_OFFSET_SUPERBLOCK);
+  ssize_t x = volume_pread(volume, &volume->super, sizeof(superblock_t), EXT2_OFFSET_SUPERBLOCK);
 
-  if (x != sizeof(superblock_t))
-    return NULL;
-  if (volume->super.s_magic != EXT2_SUPER_MAGIC)
+  if (x != sizeof(superblock_t) || volume->super.s_magic != EXT2_SUPER_MAGIC ||
+      volume->super.s_log_block_size > 6 || // Blocks are at most 64 KiB
+      volume->super.s_blocks_per_group == 0 || volume->super.s_inodes_per_group == 0)
+  {
+    backend->close(backend);
+    free(volume);
     return NULL;
+  }
 
-  volume->block_size = 1024 << volume->super.s_log_block_size;
+  volume->block_shift = 10 + volume->super.s_log_block_size;
+  volume->block_size = 1U << volume->block_shift;
+  // Revision 0 file systems always use 128-byte inodes
+  volume->inode_size = volume->super.s_rev_level == 0 ? sizeof(inode_t) : volume->super.s_inode_size;
+  volume->inode_group_shift = -1;
+  if ((volume->super.s_inodes_per_group & (volume->super.s_inodes_per_group - 1)) == 0)
+    volume->inode_group_shift = __builtin_ctz(volume->super.s_inodes_per_group);
   
   int offset;
   if (volume->block_size == 1024)
@@ -67,8 +191,17 @@ volume_t *open_volume_file(const char *filename)
 
   volume->num_groups = (volume->super.s_blocks_count - 1) / volume->super.s_blocks_per_group + 1;
 
-  volume->groups = malloc(sizeof(group_desc_t) * volume->num_groups);
-  pread(fd, volume->groups, volume->num_groups*sizeof(group_desc_t), offset);
+  size_t groups_size = sizeof(group_desc_t) * volume->num_groups;
+  volume->groups = malloc(groups_size);
+  if (!volume->groups || volume_pread(volume, volume->groups, groups_size, offset) != (ssize_t) groups_size)
+  {
+    backend->close(backend);
+    free(volume->groups);
+    free(volume);
+    return NULL;
+  }
+
+  volume->xattr_cache = create_xattr_cache(); // Attributes are read uncached if NULL
 
   return volume;
 }
@@ -81,7 +214,14 @@ volume_t *open_volume_file(const char *filename)
 void close_volume_file(volume_t *volume)
 {
 
-  close(volume->fd);
+  if (volume->prefetch)
+    end_prefetch(volume, 1);
+  if (volume->trace_blocks)
+    stop_access_trace(volume, NULL);
+  detach_block_cache(volume);
+  detach_verity_tree(volume);
+  destroy_xattr_cache(volume->xattr_cache);
+  volume->backend->close(volume->backend);
   free(volume->groups);
   free(volume);
 }
@@ -99,9 +239,16 @@ void close_volume_file(volume_t *volume)
      size: Number of bytes to read. May be larger than a block size.
      buffer: Pointer to location where data is to be stored.
 
+   If a block cache is attached to the volume, whole blocks are
+   loaded into (and served from) the cache. If a hash tree is
+   attached, every block is verified when it is read from the volume
+   (once per cache miss). If an access trace is being recorded, the
+   blocks read are marked in it.
+
    Returns:
      In case of success, returns the number of bytes read from the
-     disk. In case of error, returns -1.
+     disk. In case of error, returns -1 (EIO if a block does not match
+     the hash tree).
  */
 ssize_t read_block(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_t size, void *buffer)
 {
@@ -116,9 +263,106 @@ ssize_t read_block(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_
     return size;
   }
 
-  ssize_t bytes = pread(volume->fd, buffer, size, offset + block_no*volume->block_size);
+  if (volume->trace_blocks && size > 0)
+    record_block_access(volume, block_no + (offset >> volume->block_shift),
+                        ((offset & (volume->block_size - 1)) + size - 1) / volume->block_size + 1);
+
+  if (volume->cache)
+  {
+    uint32_t read_so_far = 0;
+    block_no += offset >> volume->block_shift;
+    offset &= volume->block_size - 1;
+    while (read_so_far < size)
+    {
+      uint32_t chunk = volume->block_size - offset;
+      if (chunk > size - read_so_far)
+        chunk = size - read_so_far;
+      if (read_cached_block(volume, block_no, offset, chunk, (char *) buffer + read_so_far) < 0)
+        return -1;
+      read_so_far += chunk;
+      block_no++;
+      offset = 0;
+    }
+    return read_so_far;
+  }
+
+  if (volume->verity)
+    return read_verified_blocks(volume, block_no, offset, size, buffer);
+
+  ssize_t bytes = volume_pread(volume, buffer, size, offset + (uint64_t) block_no * volume->block_size);
   // if (bytes > volume->block_size)
   //   return volume->block_size;
 
   return bytes;
 }
+
+/* write_block: Writes data to one or more blocks, updating the block
+   cache if one is attached. Only possible for volumes whose backend
+   supports writes (i.e., with an overlay attached).
+
+   Parameters:
+     volume: pointer to volume.
+     block_no: Block number where start of data is located. Unlike
+               in read_block, block 0 is not a hole: it is used to
+               write the superblock.
+     offset: Offset from beginning of the block to start writing
+             to. May be larger than a block size.
+     size: Number of bytes to write. May be larger than a block size.
+     buffer: Pointer to the data to be written.
+
+   Returns:
+     In case of success, returns 'size'. In case of error, returns -1
+     and sets errno (EROFS if the volume is read-only).
+ */
+ssize_t write_block(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_t size, const void *buffer)
+{
+  if (!volume->backend->pwrite)
+  {
+    errno = EROFS;
+    return -1;
+  }
+  if (block_no == EXT2_INVALID_BLOCK_NUMBER)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  uint64_t start = offset + (uint64_t) block_no * volume->block_size;
+  ssize_t bytes = volume->backend->pwrite(volume->backend, buffer, size, start);
+  if (volume->cache && size > 0)
+    invalidate_cached_blocks(volume, start >> volume->block_shift,
+                             ((start + size - 1) >> volume->block_shift) - (start >> volume->block_shift) + 1);
+  if (bytes >= 0 && bytes != size)
+  {
+    errno = EIO;
+    return -1;
+  }
+  return bytes;
+}
+
+/* run_workers: Runs a function on a pool of threads and waits until
+   all of them return, then calls it once more on the calling thread to
+   do any work left. If threads cannot be started, the calling thread
+   does all of it.
+
+   Parameters:
+     fn: Function run by every thread, which returns once there is no
+         work left.
+     arg: Passed to 'fn'.
+     threads: Number of threads to start. With 0 or 1, none is started
+              and all work is done by the calling thread.
+ */
+void run_workers(void *(*fn)(void *), void *arg, unsigned int threads)
+{
+  if (threads > 1)
+  {
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    unsigned int started = 0;
+    while (workers && started < threads && pthread_create(&workers[started], NULL, fn, arg) == 0)
+      started++;
+    for (unsigned int t = 0; t < started; t++)
+      pthread_join(workers[t], NULL);
+    free(workers);
+  }
+  fn(arg); // Does any remaining work (or all of it)
+}
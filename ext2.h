@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include <sys/stat.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct superblock {
   uint32_t s_inodes_count;      // Total number of inodes
   uint32_t s_blocks_count;      // Total number of blocks
@@ -41,9 +45,12 @@ typedef struct superblock {
   char     s_volume_name[16];   // Volume name
   char     s_last_mounted[64];  // Path where FS was last mounted
   uint32_t s_algo_bitmap;       // Compression algorithm support
+  uint8_t  s_prealloc_blocks;   // Blocks to preallocate for files
+  uint8_t  s_prealloc_dir_blocks; // Blocks to preallocate for directories
+  uint16_t s_reserved_gdt_blocks; // Blocks reserved after the group descriptors (for resizing)
 
-  // Not included: performance hints, journaling support, dir index
-  // support, mount options, reserved
+  // Not included: journaling support, dir index support, mount
+  // options, reserved
 } superblock_t;
 
 typedef struct group_desc {
@@ -57,18 +64,56 @@ typedef struct group_desc {
   char     bg_reserved[12];      // Reserved for future use
 } group_desc_t;
 
+typedef struct block_cache block_cache_t;
+typedef struct xattr_cache xattr_cache_t;
+
+/* Storage a volume is read from (and written to, for overlays).
+   Backends embed this structure as their first member, and are
+   released with their close function.
+ */
+typedef struct volume_backend {
+  ssize_t (*pread)(struct volume_backend *backend, void *buffer, size_t size, uint64_t offset);
+  // Writes data, or NULL if the backend is read-only
+  ssize_t (*pwrite)(struct volume_backend *backend, const void *buffer, size_t size, uint64_t offset);
+  void (*close)(struct volume_backend *backend);
+  uint64_t size; // Size of the (uncompressed) volume data, in bytes
+} volume_backend_t;
+
 typedef struct ext2volume {
   
-  int fd;
+  int fd; // Volume file, or -1 if the backend is not a plain file
+  volume_backend_t *backend;
   
   superblock_t super;
 
   // Values obtained from other fields, saved here for easier computation
   uint32_t block_size;
+  uint32_t block_shift; // log2(block_size)
   uint32_t volume_size;
+  uint32_t inode_size;
+  int inode_group_shift; // log2(s_inodes_per_group), or -1 if it is not a power of two
 
   uint32_t num_groups;
   group_desc_t *groups;
+
+  // Block cache used by read_block (NULL if reads go straight to disk)
+  block_cache_t *cache;
+  size_t cache_bytes; // Bytes this volume currently holds in the cache
+
+  // Parsed extended attribute blocks (NULL if they are not cached)
+  xattr_cache_t *xattr_cache;
+
+  // Bitmap of the blocks read since start_access_trace (NULL if no
+  // trace is being recorded), and prefetch replaying a trace
+  uint64_t *trace_blocks;
+  struct prefetch *prefetch;
+
+  // Hash tree the blocks read are verified against (NULL if reads are
+  // not verified)
+  struct verity *verity;
+
+  // Scheduler the reads of the volume go through (NULL if none)
+  struct io_scheduler *scheduler;
 } volume_t;
 
 typedef struct inode {
@@ -118,6 +163,25 @@ typedef struct dir_entry {
   char     de_name[256]; // name string
 } dir_entry_t;
 
+// Size of the fixed part of a directory entry (up to de_name)
+#define DIR_ENTRY_HEADER_SIZE 8
+
+// Directory entry returned without copying its name
+typedef struct dir_entry_view {
+  uint32_t inode_no;
+  uint8_t  file_type;
+  uint8_t  name_len;
+  const char *name; // Not null-terminated
+} dir_entry_view_t;
+
+typedef struct dir_iterator {
+  volume_t *volume;
+  inode_t *inode;
+  uint64_t offset;      // Offset of the next entry in the directory
+  char *block;          // Caller-owned buffer holding one directory block
+  uint64_t block_start; // Directory offset of the block in 'block'
+} dir_iterator_t;
+
 // Value for s_magic
 #define EXT2_SUPER_MAGIC 0xEF53
 
@@ -137,6 +201,12 @@ typedef struct dir_entry {
 #define EXT2_OS_FREEBSD 3
 #define EXT2_OS_LITES   4
 
+// Values for s_feature_compat
+#define EXT2_FEATURE_COMPAT_RESIZE_INODE 0x0010 // Group descriptor blocks reserved for resizing
+
+// Values for s_feature_incompat
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002 // Directory entries record the file type
+
 // Values for s_feature_ro_compat
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001 // Sparse Superblock
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002 // Large file support, 64-bit file size
@@ -149,6 +219,7 @@ typedef struct dir_entry {
 #define EXT2_ACL_DATA_INO    4 // ACL data (deprecated)
 #define EXT2_BOOT_LOADER_INO 5 // Boot loader
 #define EXT2_UNDEL_DIR_INO   6 // Undelete (trash) directory
+#define EXT2_RESIZE_INO      7 // Reserved group descriptor blocks
 
 // Inode flags (i_flags)
 #define EXT2_SECRM_FL        0x00000001     // must be overwritten before deletion
@@ -173,9 +244,62 @@ typedef struct dir_entry {
 
 // For ext2.c
 volume_t *open_volume_file(const char *filename);
+volume_t *open_volume_file_direct(const char *filename);
+volume_t *open_volume_backend(volume_backend_t *backend, int fd);
 void close_volume_file(volume_t *volume);
 
 ssize_t read_block(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_t size, void *buffer);
+ssize_t write_block(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_t size, const void *buffer);
+
+void run_workers(void *(*fn)(void *), void *arg, unsigned int threads);
+
+// For ext2cache.c
+block_cache_t *create_block_cache(size_t budget);
+void destroy_block_cache(block_cache_t *cache);
+void attach_block_cache(volume_t *volume, block_cache_t *cache);
+void detach_block_cache(volume_t *volume);
+void block_cache_stats(block_cache_t *cache, size_t *used, uint64_t *hits, uint64_t *misses);
+ssize_t read_cached_block(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_t size, void *buffer);
+ssize_t prefetch_cached_blocks(volume_t *volume, uint32_t block_no, uint32_t count, void *buffer);
+void invalidate_cached_blocks(volume_t *volume, uint32_t block_no, uint32_t count);
+
+// For ext2chunk.c
+typedef struct chunk_cache chunk_cache_t;
+typedef int (*chunk_loader_t)(void *ctx, uint64_t chunk_no, void *buffer);
+chunk_cache_t *create_chunk_cache(uint32_t chunk_size, uint64_t data_size, size_t budget,
+                                  unsigned int readahead, unsigned int threads,
+                                  chunk_loader_t load, void *ctx);
+void destroy_chunk_cache(chunk_cache_t *cache);
+ssize_t chunk_cache_read(chunk_cache_t *cache, void *buffer, size_t size, uint64_t offset);
+
+// For ext2sched.c
+typedef enum io_class { IO_METADATA, IO_BULK } io_class_t;
+
+typedef struct io_scheduler_stats {
+  uint64_t metadata_reads;
+  uint64_t metadata_waits; // Metadata reads that waited for a free slot
+  uint64_t bulk_reads;     // Including each piece of a split read
+  uint64_t bulk_waits;
+} io_scheduler_stats_t;
+
+io_class_t set_io_class(io_class_t io_class);
+void set_io_stream(uint64_t stream);
+int attach_io_scheduler(volume_t *volume, unsigned int depth, unsigned int bulk_depth);
+void io_scheduler_stats(volume_t *volume, io_scheduler_stats_t *stats);
+
+// For ext2direct.c
+volume_backend_t *open_direct_backend(int fd);
+
+// For ext2http.c
+int is_http_url(const char *name);
+volume_backend_t *open_http_backend(const char *url);
+
+// For ext2zimage.c
+#define ZIMAGE_MAGIC "EXT2ZIMG"
+int is_zimage_file(int fd);
+volume_backend_t *open_zimage_backend(int fd);
+int convert_to_zimage(int in_fd, int out_fd, uint32_t chunk_size, int level, unsigned int threads);
+int convert_from_zimage(int in_fd, int out_fd);
 
 // For ext2file.c
 ssize_t read_inode(volume_t *volume, uint32_t inode_no, inode_t *buffer);
@@ -183,14 +307,204 @@ uint32_t get_inode_block_no(volume_t *volume, inode_t *inode, uint64_t block_idx
 ssize_t read_file_block(volume_t *volume, inode_t *inode, uint64_t offset, uint64_t max_size, void *buffer);
 ssize_t read_file_content(volume_t *volume, inode_t *inode, uint64_t offset, uint64_t max_size, void *buffer);
 
+// For ext2extent.c
+typedef struct file_extent {
+  uint64_t logical;  // Index of the first block in the file
+  uint32_t physical; // Number of the first block in the volume, or 0 for a hole
+  uint64_t length;   // Number of blocks
+} file_extent_t;
+
+int64_t get_file_extents(volume_t *volume, inode_t *inode, uint64_t first_block,
+                         file_extent_t *extents, size_t max_extents);
+int64_t file_seek_data(volume_t *volume, inode_t *inode, uint64_t offset, int whence);
+
+// For ext2layout.c
+typedef struct file_layout {
+  uint64_t data_blocks;
+  uint64_t hole_blocks;
+  uint64_t fragments;
+  uint64_t indirect_blocks;
+  uint64_t seeks;
+  uint64_t block_preads;
+} file_layout_t;
+
+int get_file_layout(volume_t *volume, inode_t *inode, file_layout_t *layout);
+double file_layout_contiguity(const file_layout_t *layout);
+
+// For ext2arena.c
+typedef uint64_t arena_mark_t;
+void *arena_alloc(size_t size);
+arena_mark_t arena_mark(void);
+void arena_release(arena_mark_t mark);
+void arena_reset(void);
+
 // For ext2dir.c
 int64_t next_directory_entry(volume_t *volume, inode_t *dir_inode, off_t *offset, dir_entry_t *dir_entry);
+void open_directory_iterator(dir_iterator_t *iterator, volume_t *volume, inode_t *dir_inode,
+                             uint64_t offset, void *block_buffer);
+int64_t next_directory_view(dir_iterator_t *iterator, dir_entry_view_t *view);
+mode_t dir_entry_type_mode(uint8_t file_type);
 int64_t find_file_in_directory(volume_t *volume, inode_t *inode, const char *name, dir_entry_t *buffer);
 uint32_t find_file_from_path(volume_t *volume, const char *path, inode_t *dest_inode);
 
+// For ext2batch.c
+typedef struct path_lookup {
+  uint32_t inode_no; // Inode number of the file, or 0 if not found
+  int status;        // 0 on success, otherwise -ENOENT, -ENOTDIR or -EIO
+  inode_t inode;     // Inode of the file, if found
+} path_lookup_t;
+
+int find_files_from_paths(volume_t *volume, const char *const *paths, size_t count,
+                          path_lookup_t *results, unsigned int threads);
+
+// For ext2trace.c
+#define TRACE_MAGIC "EXT2TRCE"
+int start_access_trace(volume_t *volume);
+void record_block_access(volume_t *volume, uint32_t block_no, uint32_t count);
+int64_t stop_access_trace(volume_t *volume, const char *path);
+int start_prefetch(volume_t *volume, const char *path, size_t max_bytes);
+int64_t end_prefetch(volume_t *volume, int cancel);
+
+// For ext2verity.c
+#define VERITY_MAGIC "EXT2VRTY"
+#define VERITY_HASH_SIZE 32 // SHA-256
+int build_verity_tree(volume_t *volume, const char *path, unsigned int threads, unsigned char *root_hash);
+int attach_verity_tree(volume_t *volume, const char *path, const unsigned char *root_hash);
+void detach_verity_tree(volume_t *volume);
+int verify_block(volume_t *volume, uint32_t block_no, const void *data);
+ssize_t read_verified_blocks(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_t size, void *buffer);
+void verity_stats(volume_t *volume, uint64_t *blocks, uint64_t *nodes, uint64_t *failures);
+
+// For ext2check.c
+typedef enum check_problem_type {
+  CHECK_READ_ERROR,        // A metadata block could not be read
+  CHECK_BAD_BLOCK_NUMBER,  // A block pointer (found) is outside of the volume
+  CHECK_DUPLICATE_BLOCK,   // A block is used more than once (by files or metadata)
+  CHECK_BLOCK_COUNT,       // i_blocks (found) differs from the blocks the inode maps (expected)
+  CHECK_BLOCK_BITMAP,      // The bitmap bit (found) of 'count' blocks differs from their use (expected)
+  CHECK_INODE_BITMAP,      // The bitmap bit (found) of an inode differs from its state (expected)
+  CHECK_LINK_COUNT,        // i_links_count (found) differs from the entries referring to the inode (expected)
+  CHECK_DIR_ENTRY,         // Invalid entry in a directory block (found: rec_len, expected: offset)
+  CHECK_BAD_INODE_NUMBER,  // A directory entry refers to an invalid inode number (found)
+  CHECK_ENTRY_TARGET,      // An inode not in use is referred to by directory entries (found)
+  CHECK_FILE_TYPE,         // The type in directory entries (found) differs from the inode's (expected)
+  CHECK_FREE_BLOCKS,       // Free block count (found) differs from the bitmap (expected)
+  CHECK_FREE_INODES,       // Free inode count (found) differs from the bitmap (expected)
+  CHECK_USED_DIRS,         // Directory count (found) differs from the inode table (expected)
+} check_problem_type_t;
+
+#define CHECK_SUPERBLOCK UINT32_MAX // Group of problems found in superblock counts
+
+typedef struct check_problem {
+  check_problem_type_t type;
+  uint32_t group;    // Block group, or CHECK_SUPERBLOCK
+  uint32_t inode_no; // Inode concerned (the directory, for entries), or 0
+  uint32_t block_no; // First block concerned, or 0
+  uint32_t count;    // Number of blocks concerned
+  int64_t expected;  // Values compared (see above)
+  int64_t found;
+} check_problem_t;
+
+typedef struct check_summary {
+  uint32_t groups;
+  uint64_t inodes;      // Inodes in use
+  uint64_t directories;
+  uint64_t blocks;      // Blocks used by metadata and files
+  uint64_t entries;     // Directory entries, including "." and ".."
+  uint64_t problems;
+} check_summary_t;
+
+typedef void (*check_report_t)(void *ctx, const check_problem_t *problem);
+const char *check_problem_name(check_problem_type_t type);
+int64_t check_volume(volume_t *volume, unsigned int threads, check_report_t report, void *ctx,
+                     check_summary_t *summary);
+
+// For ext2compare.c
+typedef enum diff_kind { DIFF_ADDED, DIFF_REMOVED, DIFF_MODIFIED } diff_kind_t;
+
+// Changes of a modified file
+#define DIFF_TYPE    0x01 // Type of file (nothing else is compared)
+#define DIFF_MODE    0x02 // Permission bits
+#define DIFF_OWNER   0x04 // User or group
+#define DIFF_MTIME   0x08 // Modification time (not for directories)
+#define DIFF_CONTENT 0x10 // Data, symbolic link target or device number
+#define DIFF_XATTR   0x20 // Extended attributes
+
+typedef struct diff_range {
+  uint64_t first; // Index of the first block of the file
+  uint64_t count;
+} diff_range_t;
+
+typedef struct diff_entry {
+  diff_kind_t kind;
+  const char *path;
+  uint32_t old_inode_no;      // 0 for added files
+  uint32_t new_inode_no;      // 0 for removed files
+  uint16_t mode;              // Type of file (S_IFMT bits), in the new volume if present
+  uint32_t changes;           // DIFF_* flags of modified files
+  const diff_range_t *ranges; // Blocks of a regular file whose content changed
+  uint32_t num_ranges;
+} diff_entry_t;
+
+typedef struct diff_summary {
+  uint32_t groups;             // Groups whose inode tables were compared
+  uint32_t groups_changed;     // Groups whose descriptor or inode table differ
+  uint64_t table_blocks;       // Inode table blocks compared
+  uint64_t table_blocks_same;  // Identical inode table blocks, skipped
+  uint64_t inodes_changed;     // Inode records that differ
+  uint64_t directories;        // Directories listed
+  uint64_t files_compared;     // Files whose content was compared
+  uint64_t bytes_compared;     // Bytes read from both volumes to compare content
+  uint64_t added;
+  uint64_t removed;
+  uint64_t modified;
+} diff_summary_t;
+
+typedef void (*diff_report_t)(void *ctx, const diff_entry_t *entry);
+int64_t diff_volumes(volume_t *old_volume, volume_t *new_volume, unsigned int threads, diff_report_t report,
+                     void *ctx, diff_summary_t *summary);
+
+// For ext2index.c
+typedef struct name_index name_index_t;
+name_index_t *build_name_index(volume_t *volume, unsigned int threads);
+void destroy_name_index(name_index_t *index);
+int64_t search_name_index(name_index_t *index, const char *pattern, uint32_t **matches);
+ssize_t name_index_path(name_index_t *index, uint32_t entry, char *buffer, size_t size, uint32_t *inode_no);
+void name_index_stats(name_index_t *index, uint32_t *entries, size_t *bytes, uint32_t *errors);
+
+// For ext2xattr.c
+#define EXT2_XATTR_MAGIC 0xEA020000
+
+xattr_cache_t *create_xattr_cache(void);
+void destroy_xattr_cache(xattr_cache_t *cache);
+ssize_t get_xattr(volume_t *volume, uint32_t inode_no, inode_t *inode, const char *name, void *value, size_t size);
+ssize_t list_xattrs(volume_t *volume, uint32_t inode_no, inode_t *inode, char *list, size_t size);
+
+// For ext2overlay.c
+int attach_overlay(volume_t *volume, const char *delta_path);
+int sync_overlay(volume_t *volume);
+int64_t commit_delta(int delta_fd, int base_fd);
+int64_t discard_delta(int delta_fd);
+int64_t count_delta_blocks(int delta_fd);
+
+// For ext2write.c
+int write_inode(volume_t *volume, uint32_t inode_no, inode_t *inode);
+ssize_t write_file_content(volume_t *volume, uint32_t inode_no, inode_t *inode, uint64_t offset,
+                           uint64_t size, const void *buffer);
+int truncate_file(volume_t *volume, uint32_t inode_no, inode_t *inode, uint64_t size);
+int set_file_attributes(volume_t *volume, uint32_t inode_no, int32_t mode, int64_t uid, int64_t gid,
+                        int64_t atime, int64_t mtime);
+int64_t create_file(volume_t *volume, uint32_t dir_inode_no, const char *name, uint16_t mode,
+                    uint32_t uid, uint32_t gid, inode_t *inode);
+int remove_file(volume_t *volume, uint32_t dir_inode_no, const char *name);
+
 // For ext2symlink.c
 int32_t read_symlink_target(volume_t *volume, inode_t *inode, char *buffer, size_t size);
 
+static inline ssize_t volume_pread(volume_t *volume, void *buffer, size_t size, uint64_t offset) {
+  return volume->backend->pread(volume->backend, buffer, size, offset);
+}
+
 static inline int inode_is_regular_file(inode_t *inode) {
   return (inode->i_mode & S_IFMT) == S_IFREG;
 }
@@ -211,3 +525,21 @@ static inline uint64_t inode_file_size(volume_t *volume, inode_t *inode) {
   else
     return inode->i_size;
 }
+
+/* read_data_block: Same as read_block, for blocks holding the content
+   of a file. If the volume has an I/O scheduler, reading the content
+   of a regular file is a bulk read.
+ */
+static inline ssize_t read_data_block(volume_t *volume, inode_t *inode, uint32_t block_no,
+                                      uint32_t offset, uint32_t size, void *buffer) {
+  if (!volume->scheduler || !inode_is_regular_file(inode))
+    return read_block(volume, block_no, offset, size, buffer);
+  io_class_t previous = set_io_class(IO_BULK);
+  ssize_t rv = read_block(volume, block_no, offset, size, buffer);
+  set_io_class(previous);
+  return rv;
+}
+
+#ifdef __cplusplus
+}
+#endif
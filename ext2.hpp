@@ -0,0 +1,331 @@
+#pragma once
+
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include "ext2.h"
+
+/* C++ interface to the ext2 library (C++20, header only).
+
+   The classes below are thin wrappers around the C functions: entries
+   and file data are never copied into std::string or std::vector, and
+   nothing is allocated on the heap other than what the C functions
+   allocate themselves. Errors are reported with std::system_error,
+   holding the errno value set by the C function (EIO if none).
+
+   Volume owns a volume_t and closes it when destroyed. File and
+   Directory refer to the volume they come from, which must outlive
+   them.
+ */
+
+namespace ext2 {
+
+[[noreturn]] inline void throw_error(const char *what, int error = errno) {
+  throw std::system_error(error ? error : EIO, std::generic_category(), what);
+}
+
+/* BlockGeometry: Block size arithmetic for a block size known at
+   compile time, so that offsets are split with constant shifts and
+   masks. with_block_geometry calls a generic function with the
+   geometry matching a volume's block size.
+ */
+template <uint32_t BlockSize>
+struct BlockGeometry {
+  static_assert(BlockSize >= 1024 && BlockSize <= 65536 && std::has_single_bit(BlockSize),
+                "ext2 blocks are a power of two between 1 and 64 KiB");
+
+  static constexpr uint32_t size = BlockSize;
+  static constexpr uint32_t shift = std::countr_zero(BlockSize);
+  static constexpr uint32_t addresses_per_block = BlockSize / sizeof(uint32_t);
+
+  // Blocks that can be mapped by the direct, 1-, 2- and 3-indirect blocks
+  static constexpr uint64_t max_file_blocks =
+    12 + addresses_per_block + (uint64_t) addresses_per_block * addresses_per_block +
+    (uint64_t) addresses_per_block * addresses_per_block * addresses_per_block;
+
+  static constexpr uint64_t block_index(uint64_t offset) noexcept { return offset >> shift; }
+  static constexpr uint32_t block_offset(uint64_t offset) noexcept { return offset & (size - 1); }
+  static constexpr uint64_t blocks_for(uint64_t bytes) noexcept { return (bytes + size - 1) >> shift; }
+  static constexpr uint64_t bytes_for(uint64_t blocks) noexcept { return blocks << shift; }
+};
+
+static_assert(BlockGeometry<1024>::shift == 10 && BlockGeometry<4096>::block_offset(4097) == 1);
+static_assert(BlockGeometry<1024>::max_file_blocks == 12 + 256 + 65536 + 16777216);
+
+template <typename F>
+decltype(auto) with_block_geometry(uint32_t block_size, F &&f) {
+  switch (block_size) {
+  case 1024:  return std::forward<F>(f)(BlockGeometry<1024>{});
+  case 2048:  return std::forward<F>(f)(BlockGeometry<2048>{});
+  case 4096:  return std::forward<F>(f)(BlockGeometry<4096>{});
+  case 8192:  return std::forward<F>(f)(BlockGeometry<8192>{});
+  case 16384: return std::forward<F>(f)(BlockGeometry<16384>{});
+  case 32768: return std::forward<F>(f)(BlockGeometry<32768>{});
+  case 65536: return std::forward<F>(f)(BlockGeometry<65536>{});
+  }
+  throw_error("with_block_geometry", EINVAL);
+}
+
+class File;
+class Directory;
+
+/* Extents: Range over the data and hole extents of a file, as returned
+   by get_file_extents. Extents are fetched EXTENT_BATCH at a time into
+   the range itself. The range can be iterated only once.
+ */
+class Extents {
+ public:
+  static constexpr size_t EXTENT_BATCH = 64;
+
+  class iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = file_extent_t;
+    using difference_type = std::ptrdiff_t;
+
+    iterator() = default;
+    explicit iterator(Extents *extents) : extents_(extents) {
+      if (extents_->index_ == extents_->count_ && !extents_->fill())
+        extents_ = nullptr;
+    }
+
+    const file_extent_t &operator*() const { return extents_->batch_[extents_->index_]; }
+    const file_extent_t *operator->() const { return &**this; }
+    iterator &operator++() {
+      if (++extents_->index_ == extents_->count_ && !extents_->fill())
+        extents_ = nullptr;
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+    friend bool operator==(const iterator &it, std::default_sentinel_t) { return !it.extents_; }
+
+   private:
+    Extents *extents_ = nullptr;
+  };
+
+  Extents(volume_t *volume, const inode_t &inode, uint64_t first_block)
+    : volume_(volume), inode_(inode), next_block_(first_block) {}
+  Extents(const Extents &) = delete;
+  Extents &operator=(const Extents &) = delete;
+
+  iterator begin() { return iterator(this); }
+  std::default_sentinel_t end() const noexcept { return {}; }
+
+ private:
+  // Fetches the next batch; returns false when there are no more extents
+  bool fill() {
+    index_ = count_ = 0;
+    if (last_batch_)
+      return false;
+    int64_t count = get_file_extents(volume_, &inode_, next_block_, batch_, EXTENT_BATCH);
+    if (count < 0)
+      throw_error("get_file_extents");
+    count_ = count;
+    last_batch_ = count_ < EXTENT_BATCH;
+    if (count_ > 0)
+      next_block_ = batch_[count_ - 1].logical + batch_[count_ - 1].length;
+    return count_ > 0;
+  }
+
+  volume_t *volume_;
+  inode_t inode_;
+  uint64_t next_block_;
+  size_t index_ = 0, count_ = 0;
+  bool last_batch_ = false;
+  file_extent_t batch_[EXTENT_BATCH];
+};
+
+/* File: An inode of a volume, with its number. Holds a copy of the
+   inode, like the inode_t filled by find_file_from_path.
+ */
+class File {
+ public:
+  File(volume_t *volume, uint32_t inode_no, const inode_t &inode) noexcept
+    : volume_(volume), inode_no_(inode_no), inode_(inode) {}
+
+  volume_t *volume() const noexcept { return volume_; }
+  uint32_t inode_no() const noexcept { return inode_no_; }
+  const inode_t &inode() const noexcept { return inode_; }
+  uint64_t size() const noexcept { return inode_file_size(volume_, c_inode()); }
+  mode_t mode() const noexcept { return inode_.i_mode; }
+  bool is_regular_file() const noexcept { return inode_is_regular_file(c_inode()); }
+  bool is_directory() const noexcept { return inode_is_directory(c_inode()); }
+  bool is_symlink() const noexcept { return inode_is_symlink(c_inode()); }
+
+  /* read_into: Reads file content at 'offset' straight into 'buffer'
+     (read_file_content). Returns the number of bytes read, which is
+     smaller than the buffer only at the end of the file.
+   */
+  size_t read_into(std::span<std::byte> buffer, uint64_t offset = 0) const {
+    ssize_t bytes = read_file_content(volume_, c_inode(), offset, buffer.size(), buffer.data());
+    if (bytes < 0)
+      throw_error("read_file_content");
+    return bytes;
+  }
+
+  size_t read_into(std::span<char> buffer, uint64_t offset = 0) const {
+    return read_into(std::as_writable_bytes(buffer), offset);
+  }
+
+  // Extents of the file from block 'first_block' on
+  Extents extents(uint64_t first_block = 0) const { return Extents(volume_, inode_, first_block); }
+
+  // Entries of the directory; throws ENOTDIR if the file is not one
+  Directory directory() const;
+
+ private:
+  // The C functions take non-const inodes, but do not modify them
+  inode_t *c_inode() const noexcept { return const_cast<inode_t *>(&inode_); }
+
+  volume_t *volume_;
+  uint32_t inode_no_;
+  inode_t inode_;
+};
+
+/* Directory: Range over the entries of a directory, with names viewing
+   the directory block they are stored in (next_directory_view). A name
+   is only valid until the iterator is advanced.
+
+   The block buffer comes from the thread arena, like the one of
+   find_file_in_directory: a Directory must be destroyed by the thread
+   that created it, after any Directory created after it. It can be
+   neither copied nor moved, and is meant to live in a local variable
+   or a range-for statement.
+ */
+class Directory {
+ public:
+  struct Entry {
+    uint32_t inode_no;
+    uint8_t file_type;     // de_file_type (0 if not recorded)
+    std::string_view name; // Not null-terminated
+
+    // Type bits of the file mode (dir_entry_type_mode), or 0 if unknown
+    mode_t type() const noexcept { return dir_entry_type_mode(file_type); }
+  };
+
+  class iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Entry;
+    using difference_type = std::ptrdiff_t;
+
+    iterator() = default;
+    explicit iterator(dir_iterator_t *state) : state_(state) { ++*this; }
+
+    const Entry &operator*() const noexcept { return entry_; }
+    const Entry *operator->() const noexcept { return &entry_; }
+    iterator &operator++() {
+      dir_entry_view_t view;
+      int64_t rv = next_directory_view(state_, &view);
+      if (rv < 0)
+        throw_error("next_directory_view", EIO);
+      if (rv == 0)
+        state_ = nullptr;
+      else
+        entry_ = Entry{ view.inode_no, view.file_type, std::string_view(view.name, view.name_len) };
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+    friend bool operator==(const iterator &it, std::default_sentinel_t) { return !it.state_; }
+
+   private:
+    dir_iterator_t *state_ = nullptr;
+    Entry entry_{};
+  };
+
+  explicit Directory(const File &file) : volume_(file.volume()), inode_(file.inode()) {
+    if (!inode_is_directory(&inode_))
+      throw_error("Directory", ENOTDIR);
+    mark_ = arena_mark();
+    if (!(block_ = arena_alloc(volume_->block_size))) {
+      arena_release(mark_);
+      throw_error("Directory", ENOMEM);
+    }
+  }
+  ~Directory() { arena_release(mark_); }
+  Directory(const Directory &) = delete;
+  Directory &operator=(const Directory &) = delete;
+
+  // Starts from the first entry; only one iteration may be in progress
+  iterator begin() {
+    open_directory_iterator(&state_, volume_, &inode_, 0, block_);
+    return iterator(&state_);
+  }
+  std::default_sentinel_t end() const noexcept { return {}; }
+
+ private:
+  volume_t *volume_;
+  inode_t inode_;
+  arena_mark_t mark_;
+  void *block_;
+  dir_iterator_t state_;
+};
+
+inline Directory File::directory() const { return Directory(*this); }
+
+static_assert(std::input_iterator<Extents::iterator> &&
+              std::sentinel_for<std::default_sentinel_t, Extents::iterator>);
+static_assert(std::input_iterator<Directory::iterator> &&
+              std::sentinel_for<std::default_sentinel_t, Directory::iterator>);
+
+/* Volume: Owns an open volume, closed (with its backend, cache and
+   other attachments) when the Volume is destroyed. Move-only.
+ */
+class Volume {
+ public:
+  // Takes ownership of a volume opened with the C functions
+  explicit Volume(volume_t *volume) noexcept : volume_(volume) {}
+
+  // Opens a volume file (open_volume_file, or open_volume_file_direct)
+  explicit Volume(const char *filename, bool direct = false)
+    : volume_(direct ? open_volume_file_direct(filename) : open_volume_file(filename)) {
+    if (!volume_)
+      throw_error(filename);
+  }
+
+  Volume(Volume &&other) noexcept : volume_(std::exchange(other.volume_, nullptr)) {}
+  Volume &operator=(Volume &&other) noexcept {
+    std::swap(volume_, other.volume_);
+    return *this;
+  }
+  ~Volume() {
+    if (volume_)
+      close_volume_file(volume_);
+  }
+
+  volume_t *get() const noexcept { return volume_; }
+  volume_t *release() noexcept { return std::exchange(volume_, nullptr); }
+  uint32_t block_size() const noexcept { return volume_->block_size; }
+
+  // Reads an inode by number
+  File file(uint32_t inode_no) const {
+    inode_t inode;
+    if (read_inode(volume_, inode_no, &inode) < 0)
+      throw_error("read_inode");
+    return File(volume_, inode_no, inode);
+  }
+
+  File root() const { return file(EXT2_ROOT_INO); }
+
+  // Looks up an absolute path; empty if the file does not exist
+  std::optional<File> lookup(const char *path) const {
+    inode_t inode;
+    uint32_t inode_no = find_file_from_path(volume_, path, &inode);
+    if (!inode_no)
+      return std::nullopt;
+    return File(volume_, inode_no, inode);
+  }
+
+ private:
+  volume_t *volume_;
+};
+
+} // namespace ext2
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ext2.h"
+
+/* ext2analyze: Reports how the files of a volume are laid out on disk
+   (fragments, contiguity, indirect blocks, holes) and predicts the
+   cost of reading each of them sequentially, as JSON or CSV.
+
+   The inodes of each block group are analyzed by a pool of threads,
+   one group at a time. The directory tree is then walked once to
+   name each file and to total the files directly inside each
+   directory.
+ */
+
+#define DEFAULT_THREADS 8
+#define METADATA_CACHE  (32 << 20)
+
+typedef struct inode_info {
+  int analyzed;           // Whether the inode is in use and was analyzed
+  int error;              // Whether its block map could not be read
+  uint16_t mode;
+  uint64_t size;
+  file_layout_t layout;
+} inode_info_t;
+
+typedef struct totals {
+  uint64_t files;
+  uint64_t directories;
+  uint64_t fragmented_files; // Files with more than one fragment
+  uint64_t files_with_data;
+  file_layout_t layout;
+} totals_t;
+
+static volume_t *volume;
+static inode_info_t *inodes;
+static int csv;
+static int errors;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t next_group;
+
+/* analyze_group: Computes the layout of every inode in use in a block
+   group, as recorded by the group's inode bitmap.
+ */
+static void analyze_group(uint32_t group, uint8_t *bitmap) {
+
+  uint32_t per_group = volume->super.s_inodes_per_group;
+  if (read_block(volume, volume->groups[group].bg_inode_bitmap, 0, (per_group + 7) / 8, bitmap) < 0) {
+    fprintf(stderr, "Could not read inode bitmap of group %" PRIu32 "\n", group);
+    errors = 1;
+    return;
+  }
+
+  for (uint32_t i = 0; i < per_group; i++) {
+    uint32_t inode_no = group * per_group + i + 1;
+    inode_t inode;
+    if (!(bitmap[i / 8] & (1 << (i % 8))) || inode_no > volume->super.s_inodes_count)
+      continue;
+    if (read_inode(volume, inode_no, &inode) < 0 || inode.i_mode == 0)
+      continue;
+    inode_info_t *info = &inodes[inode_no - 1];
+    info->mode = inode.i_mode;
+    info->size = inode_file_size(volume, &inode);
+    info->error = get_file_layout(volume, &inode, &info->layout) < 0;
+    info->analyzed = 1;
+  }
+}
+
+static void *analyze_thread(void *arg) {
+
+  uint8_t *bitmap = malloc(volume->block_size);
+  if (!bitmap)
+    return NULL;
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    uint32_t group = next_group++;
+    pthread_mutex_unlock(&lock);
+    if (group >= volume->num_groups)
+      break;
+    analyze_group(group, bitmap);
+  }
+  free(bitmap);
+  return NULL;
+}
+
+/* totals_contiguity: Returns the fraction of consecutive pairs of data
+   blocks, within the same file, that are also adjacent on disk.
+ */
+static double totals_contiguity(const totals_t *totals) {
+  uint64_t pairs = totals->layout.data_blocks - totals->files_with_data;
+  return pairs ? (double) (pairs - (totals->layout.fragments - totals->files_with_data)) / pairs : 1.0;
+}
+
+static const char *type_name(uint16_t mode) {
+  switch (mode & S_IFMT) {
+  case S_IFREG: return "file";
+  case S_IFDIR: return "directory";
+  case S_IFLNK: return "symlink";
+  default: return "special";
+  }
+}
+
+static void print_string(const char *s) {
+  if (csv) {
+    putchar('"');
+    for (; *s; s++) {
+      if (*s == '"')
+        putchar('"');
+      putchar(*s);
+    }
+    putchar('"');
+    return;
+  }
+  putchar('"');
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (c < 0x20)
+      printf("\\u%04x", c);
+    else
+      putchar(c);
+  }
+  putchar('"');
+}
+
+/* print_record: Prints the layout of one file. For directories,
+   'children' holds the totals of the entries directly inside it (NULL
+   for other files).
+ */
+static void print_record(const char *path, uint32_t inode_no, const char *type, uint64_t size,
+                         const file_layout_t *layout, double contiguity, const totals_t *children) {
+
+  static int first = 1;
+  uint64_t blocks = layout->data_blocks + layout->hole_blocks;
+
+  if (csv) {
+    print_string(path);
+    printf(",%" PRIu32 ",%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.4f,%" PRIu64 ",%.2f,%"
+           PRIu64 ",%" PRIu64, inode_no, type, size, layout->data_blocks, layout->hole_blocks,
+           layout->fragments, contiguity, layout->indirect_blocks,
+           blocks ? 100.0 * layout->hole_blocks / blocks : 0.0, layout->seeks, layout->block_preads);
+    if (children)
+      printf(",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", children->files + children->directories,
+             children->layout.fragments, children->fragmented_files);
+    else
+      printf(",,,\n");
+    return;
+  }
+
+  printf("%s\n    {\"path\": ", first ? "" : ",");
+  first = 0;
+  print_string(path);
+  printf(", \"inode\": %" PRIu32 ", \"type\": \"%s\", \"size\": %" PRIu64 ", \"data_blocks\": %" PRIu64
+         ", \"hole_blocks\": %" PRIu64 ", \"fragments\": %" PRIu64 ", \"contiguity\": %.4f"
+         ", \"indirect_blocks\": %" PRIu64 ", \"sparse_pct\": %.2f, \"seeks\": %" PRIu64
+         ", \"block_preads\": %" PRIu64, inode_no, type, size, layout->data_blocks, layout->hole_blocks,
+         layout->fragments, contiguity, layout->indirect_blocks,
+         blocks ? 100.0 * layout->hole_blocks / blocks : 0.0, layout->seeks, layout->block_preads);
+  if (children)
+    printf(", \"entries\": %" PRIu64 ", \"entry_fragments\": %" PRIu64 ", \"fragmented_entries\": %" PRIu64,
+           children->files + children->directories, children->layout.fragments, children->fragmented_files);
+  printf("}");
+}
+
+static void add_totals(totals_t *totals, inode_info_t *info) {
+  if ((info->mode & S_IFMT) == S_IFDIR)
+    totals->directories++;
+  else
+    totals->files++;
+  totals->fragmented_files += info->layout.fragments > 1;
+  totals->files_with_data += info->layout.data_blocks > 0;
+  totals->layout.data_blocks += info->layout.data_blocks;
+  totals->layout.hole_blocks += info->layout.hole_blocks;
+  totals->layout.fragments += info->layout.fragments;
+  totals->layout.indirect_blocks += info->layout.indirect_blocks;
+  totals->layout.seeks += info->layout.seeks;
+  totals->layout.block_preads += info->layout.block_preads;
+}
+
+/* report_directory: Prints the records of the entries of a directory
+   (recursively), followed by the record of the directory itself.
+   Files with several hard links are counted once in 'volume_totals'.
+ */
+static void report_directory(uint32_t dir_inode_no, char *path, size_t path_len, uint8_t *counted,
+                             totals_t *volume_totals) {
+
+  inode_info_t *dir_info = &inodes[dir_inode_no - 1];
+  totals_t children = { 0 };
+  dir_entry_t entry;
+  off_t offset = 0;
+  inode_t inode;
+  int64_t entry_inode_no;
+
+  if (read_inode(volume, dir_inode_no, &inode) < 0) {
+    errors = 1;
+    return;
+  }
+  while ((entry_inode_no = next_directory_entry(volume, &inode, &offset, &entry)) > 0) {
+    if (!strcmp(entry.de_name, ".") || !strcmp(entry.de_name, ".."))
+      continue;
+    if (entry_inode_no > volume->super.s_inodes_count || !inodes[entry_inode_no - 1].analyzed) {
+      fprintf(stderr, "%s/%s: inode %" PRId64 " not in use\n", path, entry.de_name, entry_inode_no);
+      errors = 1;
+      continue;
+    }
+    inode_info_t *info = &inodes[entry_inode_no - 1];
+    size_t len = path_len + 1 + strlen(entry.de_name);
+    if (len >= PATH_MAX) {
+      fprintf(stderr, "%s/%s: path too long\n", path, entry.de_name);
+      errors = 1;
+      continue;
+    }
+    path[path_len] = '/';
+    strcpy(path + path_len + 1, entry.de_name);
+
+    add_totals(&children, info);
+    if ((info->mode & S_IFMT) == S_IFDIR) {
+      report_directory(entry_inode_no, path, len, counted, volume_totals);
+    } else {
+      print_record(path, entry_inode_no, type_name(info->mode), info->size, &info->layout,
+                   file_layout_contiguity(&info->layout), NULL);
+      if (!counted[entry_inode_no - 1])
+        add_totals(volume_totals, info);
+    }
+    counted[entry_inode_no - 1] = 1;
+    path[path_len] = '\0';
+  }
+  if (entry_inode_no < 0) {
+    fprintf(stderr, "%s: could not read directory\n", path_len ? path : "/");
+    errors = 1;
+  }
+
+  add_totals(volume_totals, dir_info);
+  print_record(path_len ? path : "/", dir_inode_no, "directory", dir_info->size, &dir_info->layout,
+               file_layout_contiguity(&dir_info->layout), &children);
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int threads = DEFAULT_THREADS;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:f:")) != -1) {
+    switch (opt) {
+    case 'j': threads = strtoul(optarg, NULL, 10); break;
+    case 'f':
+      if (strcmp(optarg, "json") && strcmp(optarg, "csv"))
+        goto usage;
+      csv = !strcmp(optarg, "csv");
+      break;
+    default: goto usage;
+    }
+  }
+  if (argc - optind != 1 || threads == 0) {
+  usage:
+    fprintf(stderr, "Usage: %s [-j threads] [-f json|csv] volume_file\n"
+            "  -j  number of block groups analyzed in parallel (default %d)\n"
+            "  -f  output format (default json)\n", argv[0], DEFAULT_THREADS);
+    return 1;
+  }
+
+  volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 1;
+  }
+  block_cache_t *cache = create_block_cache(METADATA_CACHE);
+  if (cache)
+    attach_block_cache(volume, cache);
+
+  inodes = calloc(volume->super.s_inodes_count, sizeof(inode_info_t));
+  uint8_t *counted = calloc(volume->super.s_inodes_count, 1);
+  char *path = malloc(PATH_MAX);
+  if (!inodes || !counted || !path) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  run_workers(analyze_thread, NULL, threads);
+
+  for (uint32_t i = 0; i < volume->super.s_inodes_count; i++)
+    if (inodes[i].analyzed && inodes[i].error) {
+      fprintf(stderr, "Inode %" PRIu32 ": could not read block map\n", i + 1);
+      errors = 1;
+    }
+
+  totals_t totals = { 0 };
+  if (csv)
+    printf("path,inode,type,size,data_blocks,hole_blocks,fragments,contiguity,indirect_blocks,"
+           "sparse_pct,seeks,block_preads,entries,entry_fragments,fragmented_entries\n");
+  else {
+    printf("{\n  \"volume\": ");
+    print_string(argv[optind]);
+    printf(",\n  \"block_size\": %" PRIu32 ",\n  \"files\": [", volume->block_size);
+  }
+
+  path[0] = '\0';
+  if (inodes[EXT2_ROOT_INO - 1].analyzed)
+    report_directory(EXT2_ROOT_INO, path, 0, counted, &totals);
+  else
+    errors = 1;
+
+  if (csv) {
+    print_record("", 0, "total", 0, &totals.layout, totals_contiguity(&totals), &totals);
+  } else {
+    printf("\n  ],\n  \"summary\": {\"files\": %" PRIu64 ", \"directories\": %" PRIu64
+           ", \"fragmented_files\": %" PRIu64 ", \"data_blocks\": %" PRIu64 ", \"hole_blocks\": %" PRIu64
+           ", \"fragments\": %" PRIu64 ", \"contiguity\": %.4f, \"indirect_blocks\": %" PRIu64
+           ", \"seeks\": %" PRIu64 ", \"block_preads\": %" PRIu64 "}\n}\n",
+           totals.files, totals.directories, totals.fragmented_files, totals.layout.data_blocks,
+           totals.layout.hole_blocks, totals.layout.fragments, totals_contiguity(&totals),
+           totals.layout.indirect_blocks, totals.layout.seeks, totals.layout.block_preads);
+  }
+
+  free(path);
+  free(counted);
+  free(inodes);
+  close_volume_file(volume);
+  destroy_block_cache(cache);
+  return errors;
+}
@@ -0,0 +1,116 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/* Per-thread bump allocator for scratch buffers used while serving a
+   request (e.g., directory blocks). Memory is carved out of blocks
+   that are kept for the life of the thread, so once a thread has
+   warmed up, allocating and releasing scratch memory never calls
+   malloc.
+
+   A mark, returned by arena_mark, records the current position; all
+   memory allocated after it is released at once by arena_release.
+ */
+
+#define ARENA_BLOCKS     16
+#define ARENA_FIRST_SIZE (64 << 10)
+#define ARENA_ALIGN      16
+
+typedef struct arena {
+  char *blocks[ARENA_BLOCKS];
+  size_t sizes[ARENA_BLOCKS];
+  unsigned int current; // Block allocations are made from
+  size_t used;          // Bytes used in the current block
+} arena_t;
+
+static __thread arena_t *thread_arena;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void free_arena(void *arg) {
+  arena_t *arena = arg;
+  for (unsigned int i = 0; i < ARENA_BLOCKS; i++)
+    free(arena->blocks[i]);
+  free(arena);
+}
+
+static void create_arena_key(void) {
+  pthread_key_create(&arena_key, free_arena);
+}
+
+static arena_t *get_arena(void) {
+
+  if (!thread_arena) {
+    pthread_once(&arena_key_once, create_arena_key);
+    thread_arena = calloc(1, sizeof(arena_t));
+    if (thread_arena)
+      pthread_setspecific(arena_key, thread_arena);
+  }
+  return thread_arena;
+}
+
+/* arena_alloc: Allocates scratch memory from the calling thread's
+   arena. The memory remains valid until released with arena_release
+   or arena_reset, and must not be passed to free.
+
+   Returns:
+     A pointer to the memory (aligned to 16 bytes), or NULL if memory
+     could not be allocated.
+ */
+void *arena_alloc(size_t size) {
+
+  arena_t *arena = get_arena();
+  if (!arena)
+    return NULL;
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  while (!arena->blocks[arena->current] || arena->used + size > arena->sizes[arena->current]) {
+    if (arena->blocks[arena->current] && arena->used + size > arena->sizes[arena->current]) {
+      if (arena->current + 1 == ARENA_BLOCKS)
+        return NULL;
+      arena->current++;
+      arena->used = 0;
+    }
+    if (!arena->blocks[arena->current]) {
+      size_t block_size = (size_t) ARENA_FIRST_SIZE << arena->current;
+      if (block_size < size)
+        block_size = size;
+      arena->blocks[arena->current] = malloc(block_size);
+      if (!arena->blocks[arena->current])
+        return NULL;
+      arena->sizes[arena->current] = block_size;
+    }
+  }
+
+  void *ptr = arena->blocks[arena->current] + arena->used;
+  arena->used += size;
+  return ptr;
+}
+
+/* arena_mark: Returns the current position of the calling thread's
+   arena, to be passed to arena_release.
+ */
+arena_mark_t arena_mark(void) {
+  arena_t *arena = get_arena();
+  return arena ? ((arena_mark_t) arena->current << 48) | arena->used : 0;
+}
+
+/* arena_release: Releases all memory allocated from the calling
+   thread's arena since 'mark' was obtained.
+ */
+void arena_release(arena_mark_t mark) {
+  arena_t *arena = thread_arena;
+  if (!arena)
+    return;
+  arena->current = mark >> 48;
+  arena->used = mark & ((1ULL << 48) - 1);
+}
+
+/* arena_reset: Releases all memory allocated from the calling
+   thread's arena. Called at the start of each request, so scratch
+   memory leaked by an error path never accumulates.
+ */
+void arena_reset(void) {
+  arena_release(0);
+}
@@ -0,0 +1,255 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Batched path lookups. All paths are first merged into a trie of
+   path components, so that every directory shared by several paths
+   is only resolved once. Each directory in the trie is then listed a
+   single time, matching every entry against all the children
+   requested from it. Directories are resolved by a pool of threads
+   as soon as their parent has been listed.
+ */
+
+#define LOOKUP_PENDING 1 // Status of nodes not resolved yet
+
+typedef struct lookup_node {
+  const char *name;      // Component name (not null-terminated)
+  uint32_t name_len;
+  uint32_t parent;       // Index of the parent node (root is its own parent)
+  uint32_t num_children; // Number of distinct children requested
+  uint32_t inode_no;
+  int status;
+  int list_status;       // Error listing the node's children, if any
+  inode_t inode;
+} lookup_node_t;
+
+typedef struct lookup_batch {
+  volume_t *volume;
+  lookup_node_t *nodes;
+  uint32_t num_nodes;
+  uint32_t *table;       // Hash table of node indices by (parent, name)
+  uint32_t table_mask;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  uint32_t *queue;       // Directories ready to be listed
+  uint32_t queue_len;
+  unsigned int busy;
+} lookup_batch_t;
+
+static uint32_t lookup_hash(uint32_t parent, const char *name, uint32_t len) {
+  uint32_t hash = 2166136261u ^ parent;
+  for (uint32_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+  return hash;
+}
+
+/* lookup_child: Returns the index of the child of 'parent' with the
+   given name, or 0 if it was not requested (node 0 is the root, which
+   is never a child).
+ */
+static uint32_t lookup_child(lookup_batch_t *batch, uint32_t parent, const char *name, uint32_t len) {
+  for (uint32_t slot = lookup_hash(parent, name, len) & batch->table_mask; batch->table[slot];
+       slot = (slot + 1) & batch->table_mask) {
+    lookup_node_t *node = &batch->nodes[batch->table[slot]];
+    if (node->parent == parent && node->name_len == len && !memcmp(node->name, name, len))
+      return batch->table[slot];
+  }
+  return 0;
+}
+
+static uint32_t add_child(lookup_batch_t *batch, uint32_t parent, const char *name, uint32_t len) {
+  uint32_t slot = lookup_hash(parent, name, len) & batch->table_mask;
+  while (batch->table[slot]) {
+    lookup_node_t *node = &batch->nodes[batch->table[slot]];
+    if (node->parent == parent && node->name_len == len && !memcmp(node->name, name, len))
+      return batch->table[slot];
+    slot = (slot + 1) & batch->table_mask;
+  }
+  uint32_t index = batch->num_nodes++;
+  batch->nodes[index] = (lookup_node_t) { .name = name, .name_len = len, .parent = parent,
+                                          .status = LOOKUP_PENDING };
+  batch->nodes[parent].num_children++;
+  batch->table[slot] = index;
+  return index;
+}
+
+/* resolve_directory: Lists the directory of a resolved node once,
+   resolving all of its requested children. Children that are
+   directories with children of their own are queued. Must be called
+   without the lock held.
+ */
+static void resolve_directory(lookup_batch_t *batch, uint32_t dir) {
+
+  lookup_node_t *node = &batch->nodes[dir];
+  dir_iterator_t iterator;
+  dir_entry_view_t entry;
+  uint32_t found = 0;
+  int64_t entry_inode_no = 0;
+
+  arena_mark_t mark = arena_mark();
+  void *block = arena_alloc(batch->volume->block_size);
+  if (!block) {
+    node->list_status = -EIO;
+    return;
+  }
+  open_directory_iterator(&iterator, batch->volume, &node->inode, 0, block);
+
+  while (found < node->num_children && (entry_inode_no = next_directory_view(&iterator, &entry)) > 0) {
+    uint32_t child_index = lookup_child(batch, dir, entry.name, entry.name_len);
+    if (!child_index || batch->nodes[child_index].status != LOOKUP_PENDING)
+      continue;
+
+    lookup_node_t *child = &batch->nodes[child_index];
+    found++;
+    child->inode_no = entry.inode_no;
+    if (read_inode(batch->volume, child->inode_no, &child->inode) < 0) {
+      child->status = -EIO;
+      continue;
+    }
+    child->status = 0;
+    if (child->num_children > 0 && !inode_is_directory(&child->inode)) {
+      child->list_status = -ENOTDIR;
+    } else if (child->num_children > 0) {
+      pthread_mutex_lock(&batch->lock);
+      batch->queue[batch->queue_len++] = child_index;
+      pthread_cond_signal(&batch->work);
+      pthread_mutex_unlock(&batch->lock);
+    }
+  }
+  if (found < node->num_children && entry_inode_no < 0)
+    node->list_status = -EIO; // Children not found yet inherit the error
+  arena_release(mark);
+}
+
+static void *lookup_thread(void *arg) {
+
+  lookup_batch_t *batch = arg;
+
+  pthread_mutex_lock(&batch->lock);
+  for (;;) {
+    while (batch->queue_len == 0 && batch->busy > 0)
+      pthread_cond_wait(&batch->work, &batch->lock);
+    if (batch->queue_len == 0)
+      break;
+    uint32_t dir = batch->queue[--batch->queue_len];
+    batch->busy++;
+    pthread_mutex_unlock(&batch->lock);
+
+    resolve_directory(batch, dir);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->busy--;
+    if (batch->busy == 0 && batch->queue_len == 0)
+      pthread_cond_broadcast(&batch->work);
+  }
+  pthread_mutex_unlock(&batch->lock);
+  return NULL;
+}
+
+/* find_files_from_paths: Looks up many paths at once. Gives the same
+   results as calling find_file_from_path for each path, but lists
+   each directory at most once however many of the paths go through
+   it.
+
+   Parameters:
+     volume: Pointer to volume.
+     paths: Array of 'count' absolute paths, as accepted by
+            find_file_from_path. Must not be modified until the
+            function returns.
+     count: Number of paths.
+     results: Array of 'count' elements where the result for each
+              path is stored: inode_no and inode are set if the file
+              exists, and status is 0 on success, -ENOENT if the file
+              does not exist, -ENOTDIR if a component of the path is
+              not a directory, or -EIO in case of error.
+     threads: Number of threads listing directories in parallel (see
+              run_workers).
+
+   Returns:
+     0 on success (even if some paths were not found), or -1 if memory
+     could not be allocated.
+ */
+int find_files_from_paths(volume_t *volume, const char *const *paths, size_t count,
+                          path_lookup_t *results, unsigned int threads) {
+
+  lookup_batch_t batch = { .volume = volume };
+  size_t max_nodes = 1;
+  uint32_t *terminal = malloc(count * sizeof(uint32_t));
+  int rv = -1;
+
+  // Every '/'-separated component may become a node
+  for (size_t i = 0; i < count; i++)
+    for (const char *p = paths[i]; *p; p++)
+      max_nodes += *p != '/' && (p == paths[i] || p[-1] == '/');
+  if (max_nodes >= UINT32_MAX / 2)
+    goto out;
+
+  batch.table_mask = 1;
+  while (batch.table_mask < 2 * max_nodes)
+    batch.table_mask <<= 1;
+  batch.table = calloc(batch.table_mask, sizeof(uint32_t));
+  batch.table_mask--;
+  batch.nodes = malloc(max_nodes * sizeof(lookup_node_t));
+  batch.queue = malloc(max_nodes * sizeof(uint32_t));
+  if (!terminal || !batch.table || !batch.nodes || !batch.queue)
+    goto out;
+
+  batch.nodes[0] = (lookup_node_t) { .status = LOOKUP_PENDING };
+  batch.num_nodes = 1;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t node = 0;
+    const char *p = paths[i];
+    while (*p) {
+      p += strspn(p, "/");
+      uint32_t len = strcspn(p, "/");
+      if (len > 0)
+        node = add_child(&batch, node, p, len);
+      p += len;
+    }
+    terminal[i] = node;
+  }
+
+  if (read_inode(volume, EXT2_ROOT_INO, &batch.nodes[0].inode) < 0) {
+    batch.nodes[0].status = -EIO;
+  } else {
+    batch.nodes[0].inode_no = EXT2_ROOT_INO;
+    batch.nodes[0].status = 0;
+    if (batch.nodes[0].num_children > 0)
+      batch.queue[batch.queue_len++] = 0;
+  }
+
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.work, NULL);
+  run_workers(lookup_thread, &batch, threads);
+  pthread_cond_destroy(&batch.work);
+  pthread_mutex_destroy(&batch.lock);
+
+  // Nodes are created after their parents, so a single pass in order
+  // propagates failures down the trie
+  for (uint32_t n = 1; n < batch.num_nodes; n++) {
+    lookup_node_t *node = &batch.nodes[n];
+    lookup_node_t *parent = &batch.nodes[node->parent];
+    if (node->status == LOOKUP_PENDING)
+      node->status = parent->status < 0 ? parent->status : parent->list_status < 0 ? parent->list_status : -ENOENT;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    lookup_node_t *node = &batch.nodes[terminal[i]];
+    results[i].status = node->status;
+    results[i].inode_no = node->status == 0 ? node->inode_no : 0;
+    if (node->status == 0)
+      results[i].inode = node->inode;
+  }
+  rv = 0;
+
+out:
+  free(batch.queue);
+  free(batch.nodes);
+  free(batch.table);
+  free(terminal);
+  return rv;
+}
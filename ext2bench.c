@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "ext2.h"
+
+/* Microbenchmark of the block mapping and read routines. The volume
+   is served from a block cache large enough to hold all the blocks
+   touched, so the time measured is CPU time spent mapping and copying
+   rather than I/O.
+
+   With -i, buffered and direct I/O (open_volume_file_direct) are
+   compared instead: the file is read once starting with an empty
+   page cache, and then again from the block cache, and the memory
+   holding volume data in each cache is reported.
+
+   With -V, the throughput of reads verified against a hash tree is
+   compared with unverified reads, with the volume file in the page
+   cache: every pass starts with an empty block cache, so that every
+   block read is verified once.
+
+   With -L, the latency of metadata reads (inodes read at random, as
+   getattr does) is measured while other threads stream a large file,
+   without and then with an I/O scheduler. The volume is read from a
+   simulated device with a single queue, so that the results do not
+   depend on the page cache or on the actual storage: each read takes
+   DEVICE_ACCESS_US plus the time to transfer its data at
+   DEVICE_MB_PER_S, and reads are served in arrival order.
+ */
+
+#define DEFAULT_ROUNDS   20
+#define DEFAULT_CACHE_MB 256
+#define READ_SIZE        4096
+#define DEFAULT_STREAMS  8
+#define LATENCY_LOOKUPS  2000
+#define LATENCY_WARMUP   0.5 // Seconds of streaming before the lookups
+#define SCHED_DEPTH      4
+#define DEVICE_ACCESS_US 100
+#define DEVICE_MB_PER_S  200
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-i | -V tree_file | -L] [-n rounds] [-m cache_mb] [-s streams] volume_file path\n"
+          "  -i  compare buffered and direct I/O instead of timing the mapping routines\n"
+          "  -V  compare reads with and without verification against a hash tree\n"
+          "  -L  measure metadata read latency while 'streams' threads read the file\n"
+          "  -n  number of passes over the file and inode table (default %d)\n"
+          "  -m  block cache size in MiB (default %d)\n"
+          "  -s  number of threads streaming the file with -L (default %d)\n",
+          prog, DEFAULT_ROUNDS, DEFAULT_CACHE_MB, DEFAULT_STREAMS);
+}
+
+/* run_benchmark: Maps every block of the file, reads the file in
+   READ_SIZE pieces, and reads every inode, 'rounds' times each.
+   Prints the time per operation, labelled with 'label'.
+ */
+static void run_benchmark(volume_t *volume, const char *label, inode_t *inode, unsigned int rounds,
+                          char *buffer) {
+
+  uint64_t size = inode_file_size(volume, inode);
+  uint64_t num_blocks = (size + volume->block_size - 1) / volume->block_size;
+  uint32_t num_inodes = volume->super.s_inodes_count;
+  uint64_t checksum = 0;
+  inode_t other;
+  double start;
+
+  printf("%-14s", label);
+
+  start = now();
+  for (unsigned int r = 0; r < rounds; r++)
+    for (uint64_t i = 0; i < num_blocks; i++)
+      checksum += get_inode_block_no(volume, inode, i);
+  printf("  %8.1f ns/map", (now() - start) * 1e9 / (rounds * (num_blocks ? num_blocks : 1)));
+
+  start = now();
+  for (unsigned int r = 0; r < rounds; r++)
+    for (uint64_t offset = 0; offset < size; offset += READ_SIZE)
+      checksum += read_file_content(volume, inode, offset, READ_SIZE, buffer);
+  printf("  %8.1f ns/read", (now() - start) * 1e9 / (rounds * ((size + READ_SIZE - 1) / READ_SIZE ?: 1)));
+
+  start = now();
+  for (unsigned int r = 0; r < rounds; r++)
+    for (uint32_t n = 1; n <= num_inodes; n++)
+      checksum += read_inode(volume, n, &other);
+  printf("  %8.1f ns/inode", (now() - start) * 1e9 / (rounds * (uint64_t) num_inodes));
+
+  printf("  (checksum %" PRIx64 ")\n", checksum);
+}
+
+/* page_cache_bytes: Returns how much of a file is currently held in
+   the kernel page cache.
+ */
+static uint64_t page_cache_bytes(const char *filename) {
+
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  uint64_t bytes = 0;
+  if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+    if (fd != -1)
+      close(fd);
+    return 0;
+  }
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t pages = (st.st_size + page_size - 1) / page_size;
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  unsigned char *resident = malloc(pages);
+  if (map != MAP_FAILED && resident && mincore(map, st.st_size, resident) == 0)
+    for (size_t i = 0; i < pages; i++)
+      bytes += (resident[i] & 1) * page_size;
+  free(resident);
+  if (map != MAP_FAILED)
+    munmap(map, st.st_size);
+  close(fd);
+  return bytes;
+}
+
+/* drop_page_cache: Asks the kernel to drop a file from the page
+   cache, so that the next read starts cold.
+ */
+static void drop_page_cache(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd != -1) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+/* run_io_benchmark: Reads a file in READ_SIZE pieces through a block
+   cache, once cold and then 'rounds' times warm, with buffered or
+   direct I/O. Prints the throughput and the memory used by the block
+   cache and by the page cache for the volume file.
+
+   Returns 0 on success, or -1 if the volume or file cannot be opened.
+ */
+static int run_io_benchmark(const char *filename, const char *path, int direct, size_t cache_bytes,
+                            unsigned int rounds, char *buffer) {
+
+  drop_page_cache(filename);
+  volume_t *volume = direct ? open_volume_file_direct(filename) : open_volume_file(filename);
+  block_cache_t *cache = create_block_cache(cache_bytes);
+  inode_t inode;
+  if (!volume || !cache || !find_file_from_path(volume, path, &inode)) {
+    fprintf(stderr, "%s: could not open %s with %s I/O.\n", filename, path, direct ? "direct" : "buffered");
+    if (volume)
+      close_volume_file(volume);
+    destroy_block_cache(cache);
+    return -1;
+  }
+  attach_block_cache(volume, cache);
+
+  uint64_t size = inode_file_size(volume, &inode);
+  uint64_t checksum = 0;
+  double start = now();
+  for (uint64_t offset = 0; offset < size; offset += READ_SIZE)
+    checksum += read_file_content(volume, &inode, offset, READ_SIZE, buffer);
+  double cold = now() - start;
+
+  start = now();
+  for (unsigned int r = 0; r < rounds; r++)
+    for (uint64_t offset = 0; offset < size; offset += READ_SIZE)
+      checksum += read_file_content(volume, &inode, offset, READ_SIZE, buffer);
+  double warm = (now() - start) / rounds;
+
+  size_t used;
+  uint64_t hits, misses;
+  block_cache_stats(cache, &used, &hits, &misses);
+  printf("%-10s  cold %8.1f MiB/s  warm %8.1f MiB/s  block cache %7.1f MiB  page cache %7.1f MiB"
+         "  (checksum %" PRIx64 ")\n", direct ? "direct" : "buffered",
+         size / 1048576.0 / cold, size / 1048576.0 / warm, used / 1048576.0,
+         page_cache_bytes(filename) / 1048576.0, checksum);
+
+  close_volume_file(volume);
+  destroy_block_cache(cache);
+  return 0;
+}
+
+/* read_throughput: Reads a file in READ_SIZE pieces 'rounds' times,
+   each time through a new block cache of 'cache_bytes' (or without a
+   cache if 0).
+
+   Returns the throughput, in MiB/s.
+ */
+static double read_throughput(volume_t *volume, inode_t *inode, size_t cache_bytes, unsigned int rounds,
+                              char *buffer, uint64_t *checksum) {
+
+  uint64_t size = inode_file_size(volume, inode);
+  double elapsed = 0;
+  for (unsigned int r = 0; r < rounds; r++) {
+    block_cache_t *cache = cache_bytes ? create_block_cache(cache_bytes) : NULL;
+    if (cache)
+      attach_block_cache(volume, cache);
+    double start = now();
+    for (uint64_t offset = 0; offset < size; offset += READ_SIZE)
+      *checksum += read_file_content(volume, inode, offset, READ_SIZE, buffer);
+    elapsed += now() - start;
+    if (cache) {
+      detach_block_cache(volume);
+      destroy_block_cache(cache);
+    }
+  }
+  return size / 1048576.0 * rounds / elapsed;
+}
+
+/* run_verity_benchmark: Reads a file with and without verification
+   against a hash tree, through a block cache and without one. Prints
+   the throughput of each, and of the first verified pass (which also
+   loads the hash blocks from the tree file).
+
+   Returns 0 on success, or -1 if the volume, file or tree cannot be
+   opened.
+ */
+static int run_verity_benchmark(const char *filename, const char *path, const char *tree, size_t cache_bytes,
+                                unsigned int rounds, char *buffer) {
+
+  volume_t *volume = open_volume_file(filename);
+  inode_t inode;
+  if (!volume || !find_file_from_path(volume, path, &inode)) {
+    fprintf(stderr, "%s: could not open %s.\n", filename, path);
+    if (volume)
+      close_volume_file(volume);
+    return -1;
+  }
+
+  uint64_t checksum = 0;
+  read_throughput(volume, &inode, 0, 1, buffer, &checksum); // Loads the file into the page cache
+  double plain_cached = read_throughput(volume, &inode, cache_bytes, rounds, buffer, &checksum);
+  double plain_uncached = read_throughput(volume, &inode, 0, rounds, buffer, &checksum);
+  if (attach_verity_tree(volume, tree, NULL) < 0) {
+    fprintf(stderr, "%s: invalid hash tree (%s).\n", tree, strerror(errno));
+    close_volume_file(volume);
+    return -1;
+  }
+  double first = read_throughput(volume, &inode, cache_bytes, 1, buffer, &checksum);
+  double verified_cached = read_throughput(volume, &inode, cache_bytes, rounds, buffer, &checksum);
+  double verified_uncached = read_throughput(volume, &inode, 0, rounds, buffer, &checksum);
+  uint64_t blocks, nodes, failures;
+  verity_stats(volume, &blocks, &nodes, &failures);
+
+  printf("Block size %" PRIu32 ", file size %" PRIu64 "\n", volume->block_size, inode_file_size(volume, &inode));
+  printf("unverified  cached %8.1f MiB/s  uncached %8.1f MiB/s\n", plain_cached, plain_uncached);
+  printf("verified    cached %8.1f MiB/s  uncached %8.1f MiB/s  first pass %8.1f MiB/s\n",
+         verified_cached, verified_uncached, first);
+  printf("%" PRIu64 " blocks verified, %" PRIu64 " hash blocks loaded, %" PRIu64 " failures  (checksum %" PRIx64 ")\n",
+         blocks, nodes, failures, checksum);
+  close_volume_file(volume);
+  return 0;
+}
+
+typedef struct simulated_device {
+  volume_backend_t backend;
+  int fd;
+  pthread_mutex_t lock;
+  double busy_until; // Time the last read queued will be done
+} simulated_device_t;
+
+static ssize_t device_pread(volume_backend_t *backend, void *buffer, size_t size, uint64_t offset) {
+
+  simulated_device_t *device = (simulated_device_t *) backend;
+  pthread_mutex_lock(&device->lock);
+  double start = now() > device->busy_until ? now() : device->busy_until;
+  double done = start + DEVICE_ACCESS_US / 1e6 + size / (DEVICE_MB_PER_S * 1e6);
+  device->busy_until = done;
+  pthread_mutex_unlock(&device->lock);
+
+  struct timespec ts = { (time_t) done, (long) ((done - (time_t) done) * 1e9) };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+    ;
+  return pread(device->fd, buffer, size, offset);
+}
+
+static void device_close(volume_backend_t *backend) {
+  simulated_device_t *device = (simulated_device_t *) backend;
+  close(device->fd);
+  pthread_mutex_destroy(&device->lock);
+  free(device);
+}
+
+/* open_simulated_device: Opens a volume file, read through a simulated
+   device (see above). Returns NULL if the volume is invalid.
+ */
+static volume_t *open_simulated_device(const char *filename) {
+
+  simulated_device_t *device = calloc(1, sizeof(simulated_device_t));
+  struct stat st;
+  if (!device || (device->fd = open(filename, O_RDONLY)) == -1 || fstat(device->fd, &st) == -1) {
+    free(device);
+    return NULL;
+  }
+  pthread_mutex_init(&device->lock, NULL);
+  device->backend = (volume_backend_t) { device_pread, NULL, device_close, st.st_size };
+  return open_volume_backend(&device->backend, -1);
+}
+
+typedef struct stream_reader {
+  pthread_t thread;
+  volume_t *volume;
+  inode_t *inode;
+  uint64_t start;          // Offset the thread starts reading from
+  volatile int *stop;
+  uint64_t bytes;
+} stream_reader_t;
+
+/* stream_thread: Reads a file sequentially in 128 KiB pieces, from
+   its start offset and wrapping around, until told to stop.
+ */
+static void *stream_thread(void *arg) {
+
+  stream_reader_t *reader = arg;
+  char *buffer = malloc(128 << 10);
+  uint64_t offset = reader->start;
+  while (buffer && !*reader->stop) {
+    ssize_t bytes = read_file_content(reader->volume, reader->inode, offset, 128 << 10, buffer);
+    if (bytes <= 0) {
+      offset = 0;
+      continue;
+    }
+    reader->bytes += bytes;
+    offset += bytes;
+  }
+  free(buffer);
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* run_latency_benchmark: Reads LATENCY_LOOKUPS inodes at random while
+   'streams' threads read a file from a simulated device, with or
+   without an I/O scheduler. Prints the latency percentiles of the inode reads
+   and the throughput of the streams.
+
+   Returns 0 on success, or -1 if the volume or file cannot be opened.
+ */
+static int run_latency_benchmark(const char *filename, const char *path, int scheduled, size_t cache_bytes,
+                                 unsigned int streams) {
+
+  volume_t *volume = open_simulated_device(filename);
+  block_cache_t *cache = create_block_cache(cache_bytes);
+  inode_t inode;
+  if (!volume || !cache || (scheduled && attach_io_scheduler(volume, SCHED_DEPTH, SCHED_DEPTH / 2) < 0) ||
+      !find_file_from_path(volume, path, &inode)) {
+    fprintf(stderr, "%s: could not open %s.\n", filename, path);
+    if (volume)
+      close_volume_file(volume);
+    destroy_block_cache(cache);
+    return -1;
+  }
+  attach_block_cache(volume, cache);
+
+  volatile int stop = 0;
+  stream_reader_t *readers = calloc(streams, sizeof(stream_reader_t));
+  double *latencies = malloc(LATENCY_LOOKUPS * sizeof(double));
+  uint64_t size = inode_file_size(volume, &inode);
+  unsigned int started = 0;
+  while (readers && latencies && started < streams) {
+    stream_reader_t *reader = &readers[started];
+    *reader = (stream_reader_t) { 0, volume, &inode, size / streams * started & ~(uint64_t) 0xFFFF, &stop, 0 };
+    if (pthread_create(&reader->thread, NULL, stream_thread, reader) != 0)
+      break;
+    started++;
+  }
+  if (started > 0)
+    usleep(LATENCY_WARMUP * 1e6);
+
+  // The same inodes are read in every run
+  uint64_t state = 0x9E3779B97F4A7C15ULL, checksum = 0;
+  double start = now();
+  for (unsigned int i = 0; latencies && started > 0 && i < LATENCY_LOOKUPS; i++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    inode_t other;
+    double lookup_start = now();
+    checksum += read_inode(volume, state % volume->super.s_inodes_count + 1, &other);
+    latencies[i] = now() - lookup_start;
+  }
+  double elapsed = now() - start + LATENCY_WARMUP;
+  stop = 1;
+  uint64_t streamed = 0, slowest = UINT64_MAX, fastest = 0;
+  for (unsigned int t = 0; t < started; t++) {
+    pthread_join(readers[t].thread, NULL);
+    streamed += readers[t].bytes;
+    slowest = readers[t].bytes < slowest ? readers[t].bytes : slowest;
+    fastest = readers[t].bytes > fastest ? readers[t].bytes : fastest;
+  }
+
+  if (started > 0 && latencies) {
+    io_scheduler_stats_t stats;
+    io_scheduler_stats(volume, &stats);
+    qsort(latencies, LATENCY_LOOKUPS, sizeof(double), compare_doubles);
+    printf("%-12s  inode read p50 %6.2f ms  p99 %6.2f ms  max %6.2f ms  streaming %6.1f MiB/s"
+           " (%.1f-%.1f per stream)", scheduled ? "scheduled" : "unscheduled",
+           latencies[LATENCY_LOOKUPS / 2] * 1e3, latencies[LATENCY_LOOKUPS * 99 / 100] * 1e3,
+           latencies[LATENCY_LOOKUPS - 1] * 1e3, streamed / 1048576.0 / elapsed,
+           slowest / 1048576.0 / elapsed, fastest / 1048576.0 / elapsed);
+    if (scheduled)
+      printf("  (%" PRIu64 "/%" PRIu64 " metadata reads waited)", stats.metadata_waits, stats.metadata_reads);
+    printf("  (checksum %" PRIx64 ")\n", checksum);
+  }
+  free(readers);
+  free(latencies);
+  close_volume_file(volume);
+  destroy_block_cache(cache);
+  return started > 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int rounds = DEFAULT_ROUNDS;
+  unsigned long cache_mb = DEFAULT_CACHE_MB;
+  unsigned int streams = DEFAULT_STREAMS;
+  int io_mode = 0, latency_mode = 0;
+  const char *tree = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "iV:Ln:m:s:")) != -1) {
+    switch (opt) {
+    case 'i': io_mode = 1; break;
+    case 'V': tree = optarg; break;
+    case 'L': latency_mode = 1; break;
+    case 's': streams = strtoul(optarg, NULL, 10); break;
+    case 'n': rounds = strtoul(optarg, NULL, 10); break;
+    case 'm': cache_mb = strtoul(optarg, NULL, 10); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind != 2 || rounds == 0 || streams == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (latency_mode)
+    return run_latency_benchmark(argv[optind], argv[optind + 1], 0, cache_mb << 20, streams) < 0 ||
+      run_latency_benchmark(argv[optind], argv[optind + 1], 1, cache_mb << 20, streams) < 0;
+
+  if (tree) {
+    char *buffer = malloc(READ_SIZE);
+    int rv = run_verity_benchmark(argv[optind], argv[optind + 1], tree, cache_mb << 20, rounds, buffer) < 0;
+    free(buffer);
+    return rv;
+  }
+
+  if (io_mode) {
+    char *buffer = malloc(READ_SIZE);
+    int rv = run_io_benchmark(argv[optind], argv[optind + 1], 0, cache_mb << 20, rounds, buffer) < 0 ||
+      run_io_benchmark(argv[optind], argv[optind + 1], 1, cache_mb << 20, rounds, buffer) < 0;
+    free(buffer);
+    return rv;
+  }
+
+  volume_t *volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 1;
+  }
+  block_cache_t *cache = create_block_cache(cache_mb << 20);
+  if (!cache) {
+    fprintf(stderr, "Could not create block cache.\n");
+    return 1;
+  }
+  attach_block_cache(volume, cache);
+
+  inode_t inode;
+  if (!find_file_from_path(volume, argv[optind + 1], &inode)) {
+    fprintf(stderr, "%s: file not found in volume.\n", argv[optind + 1]);
+    return 1;
+  }
+  char *buffer = malloc(READ_SIZE);
+
+  printf("Block size %" PRIu32 ", %" PRIu32 " inodes per group, file size %" PRIu64 "\n",
+         volume->block_size, volume->super.s_inodes_per_group, inode_file_size(volume, &inode));
+  run_benchmark(volume, "(warm-up)", &inode, 1, buffer);
+  run_benchmark(volume, "cached", &inode, rounds, buffer);
+
+  free(buffer);
+  close_volume_file(volume);
+  destroy_block_cache(cache);
+  return 0;
+}
@@ -0,0 +1,401 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Number of entries inspected from the cold end of the LRU list when
+// looking for a block owned by a volume above its fair share.
+#define CACHE_EVICTION_SCAN 64
+
+// Evicted entries kept for reuse, so that a full cache does not call
+// malloc and free for every miss.
+#define CACHE_MAX_SPARE 32
+
+typedef struct cache_entry {
+  volume_t *volume;
+  uint32_t block_no;
+  uint32_t size;
+  struct cache_entry *hash_next;
+  struct cache_entry *lru_prev;
+  struct cache_entry *lru_next;
+  char data[];
+} cache_entry_t;
+
+struct block_cache {
+  pthread_mutex_t lock;
+  size_t budget;        // Maximum number of bytes of block data kept
+  size_t used;          // Bytes of block data currently kept
+  uint32_t num_volumes; // Volumes currently attached to this cache
+  uint32_t num_buckets; // Always a power of two
+  cache_entry_t **buckets;
+  cache_entry_t lru;    // Sentinel: lru.lru_next is the most recently used
+  cache_entry_t *spare; // Evicted entries, linked through hash_next
+  uint32_t num_spare;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t generation;  // Incremented whenever blocks are invalidated
+};
+
+static inline uint32_t cache_bucket(block_cache_t *cache, volume_t *volume, uint32_t block_no) {
+  uint64_t key = ((uint64_t) (uintptr_t) volume >> 4) * 0x9E3779B97F4A7C15ULL ^ block_no;
+  key ^= key >> 29;
+  key *= 0xBF58476D1CE4E5B9ULL;
+  key ^= key >> 32;
+  return key & (cache->num_buckets - 1);
+}
+
+static inline void lru_unlink(cache_entry_t *entry) {
+  entry->lru_prev->lru_next = entry->lru_next;
+  entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static inline void lru_push_front(block_cache_t *cache, cache_entry_t *entry) {
+  entry->lru_prev = &cache->lru;
+  entry->lru_next = cache->lru.lru_next;
+  cache->lru.lru_next->lru_prev = entry;
+  cache->lru.lru_next = entry;
+}
+
+static cache_entry_t *cache_lookup(block_cache_t *cache, volume_t *volume, uint32_t block_no) {
+  cache_entry_t *entry = cache->buckets[cache_bucket(cache, volume, block_no)];
+  while (entry && (entry->volume != volume || entry->block_no != block_no))
+    entry = entry->hash_next;
+  return entry;
+}
+
+static void cache_remove(block_cache_t *cache, cache_entry_t *entry) {
+  cache_entry_t **link = &cache->buckets[cache_bucket(cache, entry->volume, entry->block_no)];
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  lru_unlink(entry);
+  cache->used -= entry->size;
+  entry->volume->cache_bytes -= entry->size;
+  if (cache->num_spare < CACHE_MAX_SPARE) {
+    entry->hash_next = cache->spare;
+    cache->spare = entry;
+    cache->num_spare++;
+  } else {
+    free(entry);
+  }
+}
+
+/* cache_evict: Frees entries until 'needed' more bytes fit in the
+   budget. Victims are taken from the cold end of the LRU list,
+   preferring blocks of volumes that use more than an even split of
+   the budget, so one busy volume cannot flush every other volume's
+   working set.
+ */
+static void cache_evict(block_cache_t *cache, size_t needed) {
+
+  while (cache->used + needed > cache->budget && cache->lru.lru_prev != &cache->lru) {
+    size_t fair_share = cache->budget / (cache->num_volumes ? cache->num_volumes : 1);
+    cache_entry_t *victim = cache->lru.lru_prev;
+    cache_entry_t *entry = victim;
+    for (int i = 0; i < CACHE_EVICTION_SCAN && entry != &cache->lru; i++, entry = entry->lru_prev) {
+      if (entry->volume->cache_bytes > fair_share) {
+        victim = entry;
+        break;
+      }
+    }
+    cache_remove(cache, victim);
+  }
+}
+
+/* cache_new_entry: Returns memory for an entry holding 'size' bytes,
+   reusing an evicted entry of the same size if possible (evicting one
+   if the cache is full).
+ */
+static cache_entry_t *cache_new_entry(block_cache_t *cache, uint32_t size) {
+
+  pthread_mutex_lock(&cache->lock);
+  if (cache->used + size > cache->budget)
+    cache_evict(cache, size);
+  cache_entry_t **link = &cache->spare;
+  while (*link && (*link)->size != size)
+    link = &(*link)->hash_next;
+  cache_entry_t *entry = *link;
+  if (entry) {
+    *link = entry->hash_next;
+    cache->num_spare--;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  if (!entry) {
+    entry = malloc(sizeof(cache_entry_t) + size);
+    if (entry)
+      entry->size = size;
+  }
+  return entry;
+}
+
+/* create_block_cache: Creates a block cache that can be shared by
+   any number of volumes.
+
+   Parameters:
+     budget: Maximum number of bytes of block data kept in memory,
+             across all volumes attached to the cache.
+
+   Returns:
+     A pointer to the new cache, or NULL if memory could not be
+     allocated.
+ */
+block_cache_t *create_block_cache(size_t budget) {
+
+  block_cache_t *cache = calloc(1, sizeof(block_cache_t));
+  if (!cache)
+    return NULL;
+
+  cache->budget = budget;
+  cache->num_buckets = 1024;
+  while (cache->num_buckets < budget / 4096)
+    cache->num_buckets <<= 1;
+  cache->buckets = calloc(cache->num_buckets, sizeof(cache_entry_t *));
+  if (!cache->buckets) {
+    free(cache);
+    return NULL;
+  }
+  cache->lru.lru_next = cache->lru.lru_prev = &cache->lru;
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
+}
+
+/* destroy_block_cache: Frees a block cache. All volumes must have
+   been detached (or closed) beforehand.
+ */
+void destroy_block_cache(block_cache_t *cache) {
+
+  if (!cache)
+    return;
+  while (cache->lru.lru_next != &cache->lru)
+    cache_remove(cache, cache->lru.lru_next);
+  while (cache->spare) {
+    cache_entry_t *next = cache->spare->hash_next;
+    free(cache->spare);
+    cache->spare = next;
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->buckets);
+  free(cache);
+}
+
+/* attach_block_cache: Makes all subsequent block reads of a volume go
+   through a (possibly shared) block cache.
+ */
+void attach_block_cache(volume_t *volume, block_cache_t *cache) {
+
+  detach_block_cache(volume);
+  pthread_mutex_lock(&cache->lock);
+  cache->num_volumes++;
+  pthread_mutex_unlock(&cache->lock);
+  volume->cache = cache;
+}
+
+/* detach_block_cache: Drops every cached block of a volume and stops
+   using the cache for it. Does nothing if no cache is attached.
+ */
+void detach_block_cache(volume_t *volume) {
+
+  block_cache_t *cache = volume->cache;
+  if (!cache)
+    return;
+
+  pthread_mutex_lock(&cache->lock);
+  for (uint32_t b = 0; b < cache->num_buckets && volume->cache_bytes; b++) {
+    cache_entry_t *entry = cache->buckets[b];
+    while (entry) {
+      cache_entry_t *next = entry->hash_next;
+      if (entry->volume == volume)
+        cache_remove(cache, entry);
+      entry = next;
+    }
+  }
+  cache->num_volumes--;
+  pthread_mutex_unlock(&cache->lock);
+  volume->cache = NULL;
+}
+
+/* block_cache_stats: Reports the current state of a block cache. Any
+   of the output pointers may be NULL.
+ */
+void block_cache_stats(block_cache_t *cache, size_t *used, uint64_t *hits, uint64_t *misses) {
+
+  pthread_mutex_lock(&cache->lock);
+  if (used) *used = cache->used;
+  if (hits) *hits = cache->hits;
+  if (misses) *misses = cache->misses;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/* read_cached_block: Same as read_block for a single, non-sparse
+   block, but serves the data from the volume's block cache, loading
+   the whole block into the cache on a miss.
+
+   Parameters:
+     volume: Pointer to volume. Must have a cache attached.
+     block_no: Block number to read.
+     offset: Offset inside the block; must be smaller than the block size.
+     size: Number of bytes to read; offset+size must not exceed the
+           block size.
+     buffer: Pointer to location where data is to be stored.
+
+   Returns:
+     In case of success, returns 'size'. In case of error, returns -1.
+ */
+ssize_t read_cached_block(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_t size, void *buffer) {
+
+  block_cache_t *cache = volume->cache;
+
+  pthread_mutex_lock(&cache->lock);
+  cache_entry_t *entry = cache_lookup(cache, volume, block_no);
+  if (entry) {
+    cache->hits++;
+    lru_unlink(entry);
+    lru_push_front(cache, entry);
+    memcpy(buffer, entry->data + offset, size);
+    pthread_mutex_unlock(&cache->lock);
+    return size;
+  }
+  cache->misses++;
+  uint64_t generation = cache->generation;
+  pthread_mutex_unlock(&cache->lock);
+
+  // The lock is not held during I/O, so two threads may load the same
+  // block concurrently; the second one to finish drops its copy.
+  entry = cache_new_entry(cache, volume->block_size);
+  if (!entry)
+    return -1;
+  if (volume_pread(volume, entry->data, volume->block_size,
+                   (uint64_t) block_no * volume->block_size) != volume->block_size) {
+    free(entry);
+    return -1;
+  }
+  if (volume->verity && verify_block(volume, block_no, entry->data) < 0) {
+    free(entry);
+    return -1;
+  }
+  memcpy(buffer, entry->data + offset, size);
+  if (volume->block_size > cache->budget) {
+    free(entry);
+    return size;
+  }
+
+  entry->volume = volume;
+  entry->block_no = block_no;
+
+  pthread_mutex_lock(&cache->lock);
+  if (cache->generation != generation || cache_lookup(cache, volume, block_no)) {
+    // Either another thread cached the block first, or the block may
+    // have been written while it was being read
+    pthread_mutex_unlock(&cache->lock);
+    free(entry);
+    return size;
+  }
+  cache_evict(cache, entry->size);
+  uint32_t bucket = cache_bucket(cache, volume, block_no);
+  entry->hash_next = cache->buckets[bucket];
+  cache->buckets[bucket] = entry;
+  lru_push_front(cache, entry);
+  cache->used += entry->size;
+  volume->cache_bytes += entry->size;
+  pthread_mutex_unlock(&cache->lock);
+
+  return size;
+}
+
+/* prefetch_cached_blocks: Loads consecutive blocks into the block
+   cache of a volume with a single read, ahead of the reads that will
+   need them. Blocks already cached are left as they are.
+
+   Parameters:
+     volume: Pointer to volume. Must have a cache attached.
+     block_no: First block to load.
+     count: Number of consecutive blocks to load.
+     buffer: Pointer to at least 'count' blocks of memory, used for
+             the read.
+
+   Returns:
+     The number of blocks added to the cache, or -1 if the blocks
+     could not be read.
+ */
+ssize_t prefetch_cached_blocks(volume_t *volume, uint32_t block_no, uint32_t count, void *buffer) {
+
+  block_cache_t *cache = volume->cache;
+  size_t size = (size_t) count * volume->block_size;
+
+  pthread_mutex_lock(&cache->lock);
+  uint64_t generation = cache->generation;
+  pthread_mutex_unlock(&cache->lock);
+  if (volume_pread(volume, buffer, size, (uint64_t) block_no * volume->block_size) != (ssize_t) size)
+    return -1;
+  if (volume->block_size > cache->budget)
+    return 0;
+
+  ssize_t added = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    // Blocks written since the read started are not cached, as in
+    // read_cached_block
+    pthread_mutex_lock(&cache->lock);
+    int skip = cache_lookup(cache, volume, block_no + i) != NULL;
+    int stale = cache->generation != generation;
+    pthread_mutex_unlock(&cache->lock);
+    if (stale)
+      break;
+    if (skip)
+      continue;
+    // Blocks that do not match the hash tree are left for the read that
+    // needs them to fail
+    if (volume->verity && verify_block(volume, block_no + i, (char *) buffer + (size_t) i * volume->block_size) < 0)
+      continue;
+
+    cache_entry_t *entry = cache_new_entry(cache, volume->block_size);
+    if (!entry)
+      break;
+    memcpy(entry->data, (char *) buffer + (size_t) i * volume->block_size, volume->block_size);
+    entry->volume = volume;
+    entry->block_no = block_no + i;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->generation != generation || cache_lookup(cache, volume, block_no + i)) {
+      pthread_mutex_unlock(&cache->lock);
+      free(entry);
+      continue;
+    }
+    cache_evict(cache, entry->size);
+    uint32_t bucket = cache_bucket(cache, volume, block_no + i);
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    lru_push_front(cache, entry);
+    cache->used += entry->size;
+    volume->cache_bytes += entry->size;
+    pthread_mutex_unlock(&cache->lock);
+    added++;
+  }
+  return added;
+}
+
+/* invalidate_cached_blocks: Drops cached copies of blocks that were
+   just written, so that later reads see the new data.
+
+   Parameters:
+     volume: Pointer to volume.
+     block_no: First block written.
+     count: Number of consecutive blocks written.
+ */
+void invalidate_cached_blocks(volume_t *volume, uint32_t block_no, uint32_t count) {
+
+  block_cache_t *cache = volume->cache;
+  if (!cache)
+    return;
+
+  pthread_mutex_lock(&cache->lock);
+  cache->generation++;
+  for (uint32_t i = 0; i < count; i++) {
+    cache_entry_t *entry = cache_lookup(cache, volume, block_no + i);
+    if (entry)
+      cache_remove(cache, entry);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
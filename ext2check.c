@@ -0,0 +1,554 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Consistency checker. The rest of the library trusts the volume
+   (rec_len chains, block pointers, counts); this checks them before a
+   volume is served.
+
+   The volume is read in large sequential reads, one block group at a
+   time, by a pool of threads. The first pass reads the bitmaps and
+   the whole inode table of each group, walks the block map of every
+   inode in use (marking each block it maps in a shared bitmap, with
+   atomic operations), and parses the blocks of every directory
+   (counting the entries that refer to each inode). Once every group
+   has been read, a second pass compares, group by group, the block
+   and inode bitmaps with what the inodes actually use, link counts
+   with the references found, and the group and superblock counts
+   with the bitmaps. Paths are never walked.
+ */
+
+#define CHECK_TYPE_BITS 8 // Bits of the entry type masks (file types 0 to 7)
+
+typedef struct checker {
+  volume_t *volume;
+  check_report_t report;
+  void *ctx;
+  uint32_t first_ino;        // First non-reserved inode
+  uint32_t block_bitmap_bytes;
+  uint32_t inode_bitmap_bytes;
+
+  uint64_t *used_blocks;     // Blocks used by metadata or mapped by a file
+  uint64_t *xattr_blocks;    // Blocks used as EA blocks (may be shared)
+  uint32_t *references;      // Directory entries referring to each inode
+  uint8_t *entry_types;      // Mask of the file types entries give each inode
+  uint16_t *modes;           // Mode of each inode in use (0 if not in use)
+  uint16_t *links;           // i_links_count of each inode in use
+  uint8_t *block_bitmaps;    // Block bitmap of each group, one after another
+  uint8_t *inode_bitmaps;
+  uint8_t *bitmaps_read;     // Whether each group's bitmaps could be read
+  uint32_t *group_dirs;      // Directories in use in each group
+
+  pthread_mutex_t lock;      // Protects the fields below
+  uint32_t next_group;
+  uint64_t free_blocks;      // Totals of the bitmaps
+  uint64_t free_inodes;
+  int failed;                // Out of memory
+  check_summary_t summary;
+} checker_t;
+
+// State of one thread
+typedef struct check_worker {
+  checker_t *checker;
+  char *inode_table;         // Inode table of one group
+  char *tables;              // One block per level of indirection
+  char *block;               // Directory block
+  check_summary_t summary;
+} check_worker_t;
+
+// File whose block map is being walked
+typedef struct check_file {
+  uint32_t inode_no;
+  uint32_t group;
+  int is_directory;
+  uint64_t size_blocks;      // Blocks within i_size (directories only)
+  uint64_t blocks;           // Blocks mapped, including indirect blocks
+} check_file_t;
+
+static const char *problem_names[] = {
+  "read_error", "bad_block_number", "duplicate_block", "block_count", "block_bitmap", "inode_bitmap",
+  "link_count", "dir_entry", "bad_inode_number", "entry_target", "file_type", "free_blocks",
+  "free_inodes", "used_dirs",
+};
+
+/* check_problem_name: Returns a short name for a type of problem
+   (e.g., "block_bitmap"), used in reports.
+ */
+const char *check_problem_name(check_problem_type_t type) {
+  return type < sizeof(problem_names) / sizeof(problem_names[0]) ? problem_names[type] : "unknown";
+}
+
+static void report_problem(checker_t *checker, check_problem_type_t type, uint32_t group, uint32_t inode_no,
+                           uint32_t block_no, uint32_t count, int64_t expected, int64_t found) {
+
+  check_problem_t problem = { type, group, inode_no, block_no, count, expected, found };
+  pthread_mutex_lock(&checker->lock);
+  checker->summary.problems++;
+  if (checker->report)
+    checker->report(checker->ctx, &problem);
+  pthread_mutex_unlock(&checker->lock);
+}
+
+static inline int test_bit(const uint8_t *bitmap, uint64_t bit) {
+  return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+static inline int test_word_bit(const uint64_t *bitmap, uint64_t bit) {
+  return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+/* use_block: Marks a block as used by an inode (or by metadata, with
+   inode_no 0), reporting blocks outside of the volume and blocks
+   already used.
+
+   Returns 0 if the block number is valid, or -1 otherwise.
+ */
+static int use_block(checker_t *checker, uint32_t group, uint32_t inode_no, uint32_t block_no) {
+
+  superblock_t *super = &checker->volume->super;
+  if (block_no < super->s_first_data_block || block_no >= super->s_blocks_count) {
+    report_problem(checker, CHECK_BAD_BLOCK_NUMBER, group, inode_no, 0, 1, 0, block_no);
+    return -1;
+  }
+  uint64_t bit = 1ULL << (block_no % 64);
+  if (__atomic_fetch_or(&checker->used_blocks[block_no / 64], bit, __ATOMIC_RELAXED) & bit)
+    report_problem(checker, CHECK_DUPLICATE_BLOCK, group, inode_no, block_no, 1, 0, 0);
+  return 0;
+}
+
+/* group_has_superblock: Returns whether a group starts with a copy of
+   the superblock and group descriptors.
+ */
+static int group_has_superblock(volume_t *volume, uint32_t group) {
+  if (group <= 1 || !(volume->super.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+    return 1;
+  for (uint64_t base = 3; base <= 7; base += 2) {
+    uint64_t power = base;
+    while (power < group)
+      power *= base;
+    if (power == group)
+      return 1;
+  }
+  return 0;
+}
+
+/* use_metadata_blocks: Marks the blocks holding the metadata of every
+   group (superblock copies, group descriptors, bitmaps and inode
+   tables) as used.
+ */
+static void use_metadata_blocks(checker_t *checker) {
+
+  volume_t *volume = checker->volume;
+  uint32_t descriptor_blocks = (volume->num_groups * sizeof(group_desc_t) + volume->block_size - 1) /
+                               volume->block_size;
+  uint32_t reserved = volume->super.s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INODE ?
+                      volume->super.s_reserved_gdt_blocks : 0;
+  uint32_t table_blocks = ((uint64_t) volume->super.s_inodes_per_group * volume->inode_size +
+                           volume->block_size - 1) / volume->block_size;
+
+  for (uint32_t g = 0; g < volume->num_groups; g++) {
+    uint32_t start = volume->super.s_first_data_block + g * volume->super.s_blocks_per_group;
+    if (group_has_superblock(volume, g))
+      for (uint32_t b = 0; b < 1 + descriptor_blocks + reserved; b++)
+        use_block(checker, g, 0, start + b);
+    use_block(checker, g, 0, volume->groups[g].bg_block_bitmap);
+    use_block(checker, g, 0, volume->groups[g].bg_inode_bitmap);
+    for (uint32_t b = 0; b < table_blocks; b++)
+      if (use_block(checker, g, 0, volume->groups[g].bg_inode_table + b) < 0)
+        break;
+  }
+}
+
+/* check_dir_block: Checks the chain of entries in a directory block,
+   and counts the references they make to inodes.
+ */
+static void check_dir_block(check_worker_t *worker, check_file_t *file, uint32_t block_no, uint64_t logical) {
+
+  checker_t *checker = worker->checker;
+  volume_t *volume = checker->volume;
+  int has_types = volume->super.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE;
+  uint32_t offset = 0;
+  unsigned int index = 0;
+
+  if (read_block(volume, block_no, 0, volume->block_size, worker->block) < 0) {
+    report_problem(checker, CHECK_READ_ERROR, file->group, file->inode_no, block_no, 1, 0, 0);
+    return;
+  }
+
+  while (offset < volume->block_size) {
+    dir_entry_t *entry = (dir_entry_t *) (worker->block + offset);
+    if (offset + DIR_ENTRY_HEADER_SIZE > volume->block_size || entry->de_rec_len < DIR_ENTRY_HEADER_SIZE ||
+        entry->de_rec_len % 4 || offset + entry->de_rec_len > volume->block_size ||
+        (entry->de_inode_no && (entry->de_name_len == 0 ||
+                                DIR_ENTRY_HEADER_SIZE + entry->de_name_len > entry->de_rec_len))) {
+      report_problem(checker, CHECK_DIR_ENTRY, file->group, file->inode_no, block_no, 1, offset,
+                     offset + DIR_ENTRY_HEADER_SIZE > volume->block_size ? 0 : entry->de_rec_len);
+      return; // The rest of the block cannot be located
+    }
+
+    // A directory starts with "." (itself) and ".."
+    if (logical == 0 && index < 2 &&
+        (entry->de_name_len != index + 1 || memcmp(entry->de_name, "..", index + 1) ||
+         (index == 0 && entry->de_inode_no != file->inode_no)))
+      report_problem(checker, CHECK_DIR_ENTRY, file->group, file->inode_no, block_no, 1, offset,
+                     entry->de_rec_len);
+
+    if (entry->de_inode_no > volume->super.s_inodes_count) {
+      report_problem(checker, CHECK_BAD_INODE_NUMBER, file->group, file->inode_no, block_no, 1, 0,
+                     entry->de_inode_no);
+    } else if (entry->de_inode_no) {
+      __atomic_fetch_add(&checker->references[entry->de_inode_no - 1], 1, __ATOMIC_RELAXED);
+      if (has_types)
+        __atomic_fetch_or(&checker->entry_types[entry->de_inode_no - 1],
+                          1 << (entry->de_file_type % CHECK_TYPE_BITS), __ATOMIC_RELAXED);
+      worker->summary.entries++;
+    }
+    offset += entry->de_rec_len;
+    index++;
+  }
+}
+
+/* walk_table: Marks the blocks mapped by a table of block numbers as
+   used by a file. With depth 0, each entry is a data block, starting
+   at logical block 'base'; otherwise it is a table of the next level,
+   each entry covering (entries per block)^depth logical blocks.
+   Directory blocks are checked as they are found.
+ */
+static void walk_table(check_worker_t *worker, check_file_t *file, const uint32_t *table, uint32_t entries,
+                       int depth, uint64_t base) {
+
+  checker_t *checker = worker->checker;
+  volume_t *volume = checker->volume;
+  uint32_t per_block = volume->block_size / 4;
+  uint64_t span = 1;
+  for (int d = 0; d < depth; d++)
+    span *= per_block;
+
+  for (uint32_t i = 0; i < entries; i++) {
+    if (table[i] == 0 || use_block(checker, file->group, file->inode_no, table[i]) < 0)
+      continue;
+    file->blocks++;
+    if (depth > 0) {
+      uint32_t *child = (uint32_t *) (worker->tables + (depth - 1) * volume->block_size);
+      if (read_block(volume, table[i], 0, volume->block_size, child) < 0)
+        report_problem(checker, CHECK_READ_ERROR, file->group, file->inode_no, table[i], 1, 0, 0);
+      else
+        walk_table(worker, file, child, per_block, depth - 1, base + i * span);
+    } else if (file->is_directory && base + i < file->size_blocks) {
+      check_dir_block(worker, file, table[i], base + i);
+    }
+  }
+}
+
+/* check_inode: Checks one inode of the inode table, and walks its
+   block map if it is in use.
+ */
+static void check_inode(check_worker_t *worker, uint32_t group, uint32_t inode_no, inode_t *inode, int marked) {
+
+  checker_t *checker = worker->checker;
+  volume_t *volume = checker->volume;
+  int reserved = inode_no < checker->first_ino && inode_no != EXT2_ROOT_INO;
+  int in_use = reserved ? 1 : inode->i_mode != 0 && inode->i_links_count > 0 && inode->i_dtime == 0;
+
+  if (in_use != !!marked)
+    report_problem(checker, CHECK_INODE_BITMAP, group, inode_no, 0, 1, in_use, !!marked);
+  if (!in_use || (reserved && inode->i_mode == 0 && inode_no != EXT2_BAD_INO))
+    return;
+
+  checker->modes[inode_no - 1] = inode->i_mode;
+  checker->links[inode_no - 1] = inode->i_links_count;
+  worker->summary.inodes++;
+  if (inode_is_directory(inode) && !reserved) {
+    worker->summary.directories++;
+    checker->group_dirs[group]++;
+  }
+
+  if (inode_no == EXT2_RESIZE_INO && (volume->super.s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INODE)) {
+    // Maps the reserved descriptor blocks, which are metadata already
+    if (inode->i_block_2ind)
+      use_block(checker, group, inode_no, inode->i_block_2ind);
+    return;
+  }
+
+  check_file_t file = { .inode_no = inode_no, .group = group, .is_directory = inode_is_directory(inode) };
+  file.size_blocks = (inode_file_size(volume, inode) + volume->block_size - 1) / volume->block_size;
+  if (inode_no == EXT2_BAD_INO || inode_is_regular_file(inode) || inode_is_directory(inode) ||
+      (inode_is_symlink(inode) && inode->i_size >= sizeof(inode->i_symlink_target))) {
+    uint32_t per_block = volume->block_size / 4;
+    walk_table(worker, &file, inode->i_block, 12, 0, 0);
+    walk_table(worker, &file, &inode->i_block_1ind, 1, 1, 12);
+    walk_table(worker, &file, &inode->i_block_2ind, 1, 2, 12 + per_block);
+    walk_table(worker, &file, &inode->i_block_3ind, 1, 3, 12 + per_block + (uint64_t) per_block * per_block);
+  }
+  if (inode->i_file_acl) {
+    uint32_t block_no = inode->i_file_acl;
+    if (block_no < volume->super.s_first_data_block || block_no >= volume->super.s_blocks_count) {
+      report_problem(checker, CHECK_BAD_BLOCK_NUMBER, group, inode_no, 0, 1, 0, block_no);
+    } else {
+      __atomic_fetch_or(&checker->xattr_blocks[block_no / 64], 1ULL << (block_no % 64), __ATOMIC_RELAXED);
+      file.blocks++;
+    }
+  }
+
+  uint64_t sectors = file.blocks * (volume->block_size / 512);
+  if (sectors != inode->i_blocks)
+    report_problem(checker, CHECK_BLOCK_COUNT, group, inode_no, 0, 1, sectors, inode->i_blocks);
+}
+
+/* read_group: First pass over a group: reads its bitmaps and inode
+   table, and checks every inode.
+ */
+static void read_group(check_worker_t *worker, uint32_t group) {
+
+  checker_t *checker = worker->checker;
+  volume_t *volume = checker->volume;
+  group_desc_t *desc = &volume->groups[group];
+  uint8_t *block_bitmap = checker->block_bitmaps + (uint64_t) group * checker->block_bitmap_bytes;
+  uint8_t *inode_bitmap = checker->inode_bitmaps + (uint64_t) group * checker->inode_bitmap_bytes;
+  uint32_t per_group = volume->super.s_inodes_per_group;
+
+  if (read_block(volume, desc->bg_block_bitmap, 0, checker->block_bitmap_bytes, block_bitmap) < 0 ||
+      read_block(volume, desc->bg_inode_bitmap, 0, checker->inode_bitmap_bytes, inode_bitmap) < 0) {
+    report_problem(checker, CHECK_READ_ERROR, group, 0, desc->bg_block_bitmap, 1, 0, 0);
+    return;
+  }
+  checker->bitmaps_read[group] = 1;
+  if (read_block(volume, desc->bg_inode_table, 0, per_group * volume->inode_size, worker->inode_table) < 0) {
+    report_problem(checker, CHECK_READ_ERROR, group, 0, desc->bg_inode_table, 1, 0, 0);
+    return;
+  }
+
+  for (uint32_t i = 0; i < per_group; i++) {
+    uint32_t inode_no = group * per_group + i + 1;
+    inode_t inode;
+    if (inode_no > volume->super.s_inodes_count)
+      break;
+    memcpy(&inode, worker->inode_table + (size_t) i * volume->inode_size, sizeof(inode_t));
+    check_inode(worker, group, inode_no, &inode, test_bit(inode_bitmap, i));
+  }
+}
+
+/* compare_group: Second pass over a group: compares its bitmaps and
+   counts with the use found in the first pass, and the link counts of
+   its inodes with the references found.
+ */
+static void compare_group(check_worker_t *worker, uint32_t group) {
+
+  checker_t *checker = worker->checker;
+  volume_t *volume = checker->volume;
+  superblock_t *super = &volume->super;
+  group_desc_t *desc = &volume->groups[group];
+  uint8_t *block_bitmap = checker->block_bitmaps + (uint64_t) group * checker->block_bitmap_bytes;
+  uint8_t *inode_bitmap = checker->inode_bitmaps + (uint64_t) group * checker->inode_bitmap_bytes;
+  uint32_t start = super->s_first_data_block + group * super->s_blocks_per_group;
+  uint32_t end = super->s_blocks_count - start < super->s_blocks_per_group ?
+                 super->s_blocks_count : start + super->s_blocks_per_group;
+  uint32_t free_blocks = 0, free_inodes = 0, used_blocks = 0;
+
+  if (!checker->bitmaps_read[group])
+    return;
+
+  // Runs of blocks whose bitmap bit is wrong are reported at once
+  uint32_t run_start = 0, run_length = 0;
+  int run_bit = 0;
+  for (uint32_t b = start; b <= end; b++) {
+    int bit = 0, used = 0;
+    if (b < end) {
+      bit = !!test_bit(block_bitmap, b - start);
+      int xattr = test_word_bit(checker->xattr_blocks, b);
+      used = test_word_bit(checker->used_blocks, b) || xattr;
+      if (xattr && test_word_bit(checker->used_blocks, b))
+        report_problem(checker, CHECK_DUPLICATE_BLOCK, group, 0, b, 1, 0, 0);
+      free_blocks += !bit;
+      used_blocks += used;
+    }
+    if (run_length > 0 && (b == end || bit == used || bit != run_bit || b != run_start + run_length)) {
+      report_problem(checker, CHECK_BLOCK_BITMAP, group, 0, run_start, run_length, !run_bit, run_bit);
+      run_length = 0;
+    }
+    if (b < end && bit != used) {
+      if (run_length == 0) {
+        run_start = b;
+        run_bit = bit;
+      }
+      run_length++;
+    }
+  }
+
+  uint32_t per_group = super->s_inodes_per_group;
+  for (uint32_t i = 0; i < per_group; i++) {
+    uint32_t inode_no = group * per_group + i + 1;
+    if (inode_no > super->s_inodes_count)
+      break;
+    free_inodes += !test_bit(inode_bitmap, i);
+
+    uint16_t mode = checker->modes[inode_no - 1];
+    uint32_t references = checker->references[inode_no - 1];
+    if (mode == 0) {
+      if (references > 0)
+        report_problem(checker, CHECK_ENTRY_TARGET, group, inode_no, 0, 1, 0, references);
+      continue;
+    }
+    if (inode_no >= checker->first_ino || inode_no == EXT2_ROOT_INO) {
+      if (references != checker->links[inode_no - 1])
+        report_problem(checker, CHECK_LINK_COUNT, group, inode_no, 0, 1, references, checker->links[inode_no - 1]);
+    }
+    uint8_t types = checker->entry_types[inode_no - 1];
+    for (uint8_t type = 0; type < CHECK_TYPE_BITS; type++) {
+      if ((types & (1 << type)) && dir_entry_type_mode(type) != (mode & S_IFMT)) {
+        uint8_t expected = 0;
+        while (expected < CHECK_TYPE_BITS && dir_entry_type_mode(expected) != (mode & S_IFMT))
+          expected++;
+        report_problem(checker, CHECK_FILE_TYPE, group, inode_no, 0, 1, expected, type);
+      }
+    }
+  }
+
+  if (free_blocks != desc->bg_free_blocks_count)
+    report_problem(checker, CHECK_FREE_BLOCKS, group, 0, 0, 1, free_blocks, desc->bg_free_blocks_count);
+  if (free_inodes != desc->bg_free_inodes_count)
+    report_problem(checker, CHECK_FREE_INODES, group, 0, 0, 1, free_inodes, desc->bg_free_inodes_count);
+  if (checker->group_dirs[group] != desc->bg_used_dirs_count)
+    report_problem(checker, CHECK_USED_DIRS, group, 0, 0, 1, checker->group_dirs[group], desc->bg_used_dirs_count);
+
+  worker->summary.blocks += used_blocks;
+  pthread_mutex_lock(&checker->lock);
+  checker->free_blocks += free_blocks;
+  checker->free_inodes += free_inodes;
+  pthread_mutex_unlock(&checker->lock);
+}
+
+typedef struct check_pass {
+  checker_t *checker;
+  void (*process)(check_worker_t *worker, uint32_t group);
+} check_pass_t;
+
+static void *check_thread(void *arg) {
+
+  check_pass_t *pass = arg;
+  checker_t *checker = pass->checker;
+  volume_t *volume = checker->volume;
+  check_worker_t worker = { .checker = checker };
+
+  worker.inode_table = malloc((size_t) volume->super.s_inodes_per_group * volume->inode_size);
+  worker.tables = malloc(3 * volume->block_size);
+  worker.block = malloc(volume->block_size);
+  if (!worker.inode_table || !worker.tables || !worker.block) {
+    pthread_mutex_lock(&checker->lock);
+    checker->failed = 1;
+    pthread_mutex_unlock(&checker->lock);
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&checker->lock);
+    uint32_t group = checker->failed ? volume->num_groups : checker->next_group++;
+    pthread_mutex_unlock(&checker->lock);
+    if (group >= volume->num_groups)
+      break;
+    pass->process(&worker, group);
+  }
+
+  pthread_mutex_lock(&checker->lock);
+  checker->summary.inodes += worker.summary.inodes;
+  checker->summary.directories += worker.summary.directories;
+  checker->summary.blocks += worker.summary.blocks;
+  checker->summary.entries += worker.summary.entries;
+  pthread_mutex_unlock(&checker->lock);
+  free(worker.inode_table);
+  free(worker.tables);
+  free(worker.block);
+  return NULL;
+}
+
+/* run_pass: Processes every group with a pool of threads, and waits
+   until all of them are done.
+ */
+static void run_pass(checker_t *checker, void (*process)(check_worker_t *, uint32_t), unsigned int threads) {
+
+  check_pass_t pass = { checker, process };
+  checker->next_group = 0;
+  run_workers(check_thread, &pass, threads);
+}
+
+/* check_volume: Checks the consistency of a volume: block pointers,
+   block and inode bitmaps, link counts, directory entries, and the
+   free counts of groups and of the superblock.
+
+   Parameters:
+     volume: Pointer to volume.
+     threads: Number of threads checking groups in parallel (see
+              run_workers).
+     report: Function called for each problem found (may be NULL),
+             from any of the threads but never concurrently.
+     ctx: Passed to 'report'.
+     summary: Where the totals of the volume are stored (may be NULL).
+
+   Returns:
+     The number of problems found (0 if the volume is consistent), or
+     -1 (ENOMEM) if the check could not be completed.
+ */
+int64_t check_volume(volume_t *volume, unsigned int threads, check_report_t report, void *ctx,
+                     check_summary_t *summary) {
+
+  superblock_t *super = &volume->super;
+  checker_t checker = { .volume = volume, .report = report, .ctx = ctx };
+  uint64_t inodes = super->s_inodes_count;
+  uint64_t words = super->s_blocks_count / 64 + 1;
+  int64_t rv = -1;
+
+  checker.first_ino = super->s_rev_level == 0 ? 11 : super->s_first_ino;
+  checker.block_bitmap_bytes = (super->s_blocks_per_group + 7) / 8;
+  checker.inode_bitmap_bytes = (super->s_inodes_per_group + 7) / 8;
+  checker.summary.groups = volume->num_groups;
+  checker.used_blocks = calloc(words, sizeof(uint64_t));
+  checker.xattr_blocks = calloc(words, sizeof(uint64_t));
+  checker.references = calloc(inodes, sizeof(uint32_t));
+  checker.entry_types = calloc(inodes, 1);
+  checker.modes = calloc(inodes, sizeof(uint16_t));
+  checker.links = calloc(inodes, sizeof(uint16_t));
+  checker.block_bitmaps = malloc((uint64_t) volume->num_groups * checker.block_bitmap_bytes);
+  checker.inode_bitmaps = malloc((uint64_t) volume->num_groups * checker.inode_bitmap_bytes);
+  checker.bitmaps_read = calloc(volume->num_groups, 1);
+  checker.group_dirs = calloc(volume->num_groups, sizeof(uint32_t));
+  pthread_mutex_init(&checker.lock, NULL);
+  if (!checker.used_blocks || !checker.xattr_blocks || !checker.references || !checker.entry_types ||
+      !checker.modes || !checker.links || !checker.block_bitmaps || !checker.inode_bitmaps ||
+      !checker.bitmaps_read || !checker.group_dirs)
+    goto out;
+
+  use_metadata_blocks(&checker);
+  run_pass(&checker, read_group, threads);
+  if (!checker.failed)
+    run_pass(&checker, compare_group, threads);
+  if (checker.failed)
+    goto out;
+
+  if (checker.free_blocks != super->s_free_blocks_count)
+    report_problem(&checker, CHECK_FREE_BLOCKS, CHECK_SUPERBLOCK, 0, 0, 1, checker.free_blocks,
+                   super->s_free_blocks_count);
+  if (checker.free_inodes != super->s_free_inodes_count)
+    report_problem(&checker, CHECK_FREE_INODES, CHECK_SUPERBLOCK, 0, 0, 1, checker.free_inodes,
+                   super->s_free_inodes_count);
+  if (summary)
+    *summary = checker.summary;
+  rv = checker.summary.problems;
+
+out:
+  if (rv < 0)
+    errno = ENOMEM;
+  pthread_mutex_destroy(&checker.lock);
+  free(checker.used_blocks);
+  free(checker.xattr_blocks);
+  free(checker.references);
+  free(checker.entry_types);
+  free(checker.modes);
+  free(checker.links);
+  free(checker.block_bitmaps);
+  free(checker.inode_bitmaps);
+  free(checker.bitmaps_read);
+  free(checker.group_dirs);
+  return rv;
+}
@@ -0,0 +1,339 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Cache of fixed-size chunks of volume data produced by a loader
+   function (e.g., decompressed or fetched remotely), used by storage
+   backends where producing a chunk is much more expensive than
+   copying it. A chunk is only ever loaded by one thread at a time;
+   other readers of the same chunk wait for it. When reads are
+   sequential, the following chunks are loaded ahead of time by a
+   pool of worker threads.
+ */
+
+#define CHUNK_LOADING 0
+#define CHUNK_READY   1
+#define CHUNK_FAILED  2
+
+typedef struct chunk {
+  uint64_t chunk_no;
+  int state;
+  unsigned int users;     // Readers currently copying from data
+  struct chunk *hash_next;
+  struct chunk *lru_prev;
+  struct chunk *lru_next;
+  char data[];
+} chunk_t;
+
+struct chunk_cache {
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;  // Signalled whenever a chunk leaves CHUNK_LOADING
+  pthread_cond_t work;    // Signalled when readahead work is queued
+
+  uint32_t chunk_size;
+  uint64_t data_size;
+  uint64_t num_chunks;
+  chunk_loader_t load;
+  void *ctx;
+
+  size_t budget;
+  size_t used;
+  uint32_t num_buckets;
+  chunk_t **buckets;
+  chunk_t lru;            // Sentinel: lru.lru_next is the most recently used
+
+  unsigned int readahead; // Number of chunks loaded ahead of a sequential reader
+  uint64_t last_chunk;    // Last chunk requested by a reader
+  uint64_t *queue;        // Ring buffer of chunks to be loaded ahead
+  unsigned int queue_head;
+  unsigned int queue_len;
+  unsigned int num_threads;
+  pthread_t *threads;
+  int stopping;
+};
+
+static inline uint32_t chunk_bucket(chunk_cache_t *cache, uint64_t chunk_no) {
+  return (chunk_no * 0x9E3779B97F4A7C15ULL >> 32) & (cache->num_buckets - 1);
+}
+
+static chunk_t *chunk_lookup(chunk_cache_t *cache, uint64_t chunk_no) {
+  chunk_t *chunk = cache->buckets[chunk_bucket(cache, chunk_no)];
+  while (chunk && chunk->chunk_no != chunk_no)
+    chunk = chunk->hash_next;
+  return chunk;
+}
+
+static inline void chunk_lru_unlink(chunk_t *chunk) {
+  chunk->lru_prev->lru_next = chunk->lru_next;
+  chunk->lru_next->lru_prev = chunk->lru_prev;
+}
+
+static inline void chunk_lru_push_front(chunk_cache_t *cache, chunk_t *chunk) {
+  chunk->lru_prev = &cache->lru;
+  chunk->lru_next = cache->lru.lru_next;
+  cache->lru.lru_next->lru_prev = chunk;
+  cache->lru.lru_next = chunk;
+}
+
+static void chunk_remove(chunk_cache_t *cache, chunk_t *chunk) {
+  chunk_t **link = &cache->buckets[chunk_bucket(cache, chunk->chunk_no)];
+  while (*link != chunk)
+    link = &(*link)->hash_next;
+  *link = chunk->hash_next;
+  chunk_lru_unlink(chunk);
+  cache->used -= cache->chunk_size;
+  free(chunk);
+}
+
+/* chunk_start_load: Inserts a new chunk in the CHUNK_LOADING state,
+   evicting idle chunks to make room for it. Must be called with the
+   lock held. Returns NULL if memory could not be allocated.
+ */
+static chunk_t *chunk_start_load(chunk_cache_t *cache, uint64_t chunk_no) {
+
+  chunk_t *victim = cache->lru.lru_prev;
+  while (cache->used + cache->chunk_size > cache->budget && victim != &cache->lru) {
+    chunk_t *prev = victim->lru_prev;
+    if (victim->state != CHUNK_LOADING && victim->users == 0)
+      chunk_remove(cache, victim);
+    victim = prev;
+  }
+
+  chunk_t *chunk = malloc(sizeof(chunk_t) + cache->chunk_size);
+  if (!chunk)
+    return NULL;
+  chunk->chunk_no = chunk_no;
+  chunk->state = CHUNK_LOADING;
+  chunk->users = 0;
+  uint32_t bucket = chunk_bucket(cache, chunk_no);
+  chunk->hash_next = cache->buckets[bucket];
+  cache->buckets[bucket] = chunk;
+  chunk_lru_push_front(cache, chunk);
+  cache->used += cache->chunk_size;
+  return chunk;
+}
+
+/* chunk_finish_load: Runs the loader for a chunk created by
+   chunk_start_load. Must be called with the lock held; the lock is
+   released while the loader runs. Returns 0 if the chunk was loaded,
+   or -1 if the loader failed (in which case 'chunk' may be freed).
+ */
+static int chunk_finish_load(chunk_cache_t *cache, chunk_t *chunk) {
+
+  chunk->users++;
+  pthread_mutex_unlock(&cache->lock);
+  int rv = cache->load(cache->ctx, chunk->chunk_no, chunk->data);
+  pthread_mutex_lock(&cache->lock);
+  chunk->users--;
+  chunk->state = rv < 0 ? CHUNK_FAILED : CHUNK_READY;
+  pthread_cond_broadcast(&cache->loaded);
+
+  // Failed chunks are not kept, so that the next reader retries
+  if (rv < 0 && chunk->users == 0)
+    chunk_remove(cache, chunk);
+  return rv < 0 ? -1 : 0;
+}
+
+static void *chunk_readahead_thread(void *arg) {
+
+  chunk_cache_t *cache = arg;
+
+  pthread_mutex_lock(&cache->lock);
+  while (!cache->stopping) {
+    if (cache->queue_len == 0) {
+      pthread_cond_wait(&cache->work, &cache->lock);
+      continue;
+    }
+    uint64_t chunk_no = cache->queue[cache->queue_head];
+    cache->queue_head = (cache->queue_head + 1) % cache->readahead;
+    cache->queue_len--;
+    if (chunk_lookup(cache, chunk_no))
+      continue;
+    chunk_t *chunk = chunk_start_load(cache, chunk_no);
+    if (chunk)
+      chunk_finish_load(cache, chunk);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return NULL;
+}
+
+/* chunk_queue_readahead: Queues the chunks following 'chunk_no' that
+   are not cached yet. Must be called with the lock held.
+ */
+static void chunk_queue_readahead(chunk_cache_t *cache, uint64_t chunk_no) {
+
+  // Never queue more than half the budget, or readahead would evict
+  // the chunks currently being read
+  uint64_t limit = cache->budget / cache->chunk_size / 2;
+  if (limit > cache->readahead)
+    limit = cache->readahead;
+
+  for (uint64_t next = chunk_no + 1; next <= chunk_no + limit && next < cache->num_chunks; next++) {
+    if (cache->queue_len == cache->readahead)
+      break;
+    if (chunk_lookup(cache, next))
+      continue;
+    int queued = 0;
+    for (unsigned int i = 0; i < cache->queue_len && !queued; i++)
+      queued = cache->queue[(cache->queue_head + i) % cache->readahead] == next;
+    if (queued)
+      continue;
+    cache->queue[(cache->queue_head + cache->queue_len) % cache->readahead] = next;
+    cache->queue_len++;
+    pthread_cond_signal(&cache->work);
+  }
+}
+
+/* create_chunk_cache: Creates a cache of chunks of volume data.
+
+   Parameters:
+     chunk_size: Number of bytes in each chunk (the last chunk of the
+                 data may be shorter).
+     data_size: Total number of bytes of data.
+     budget: Maximum number of bytes used for cached chunks. At least
+             two chunks are always kept.
+     readahead: Number of chunks loaded ahead of sequential readers,
+                or 0 to disable readahead.
+     threads: Number of threads loading chunks ahead.
+     load: Function called to produce the content of a chunk. Must
+           fill the whole chunk (zero-filling past the end of the
+           data) and return 0, or return -1 on error. May be called
+           concurrently for different chunks.
+     ctx: Value passed as first parameter to 'load'.
+
+   Returns:
+     A pointer to the new cache, or NULL on error.
+ */
+chunk_cache_t *create_chunk_cache(uint32_t chunk_size, uint64_t data_size, size_t budget,
+                                  unsigned int readahead, unsigned int threads,
+                                  chunk_loader_t load, void *ctx) {
+
+  chunk_cache_t *cache = calloc(1, sizeof(chunk_cache_t));
+  if (!cache)
+    return NULL;
+
+  cache->chunk_size = chunk_size;
+  cache->data_size = data_size;
+  cache->num_chunks = (data_size + chunk_size - 1) / chunk_size;
+  cache->load = load;
+  cache->ctx = ctx;
+  cache->budget = budget < 2 * (size_t) chunk_size ? 2 * (size_t) chunk_size : budget;
+  cache->num_buckets = 64;
+  while (cache->num_buckets < cache->budget / chunk_size)
+    cache->num_buckets <<= 1;
+  cache->buckets = calloc(cache->num_buckets, sizeof(chunk_t *));
+  cache->lru.lru_next = cache->lru.lru_prev = &cache->lru;
+  cache->last_chunk = UINT64_MAX;
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->loaded, NULL);
+  pthread_cond_init(&cache->work, NULL);
+
+  if (readahead > 0 && threads > 0) {
+    cache->readahead = readahead;
+    cache->queue = malloc(readahead * sizeof(uint64_t));
+    cache->threads = malloc(threads * sizeof(pthread_t));
+    for (unsigned int i = 0; i < threads; i++)
+      if (pthread_create(&cache->threads[cache->num_threads], NULL, chunk_readahead_thread, cache) == 0)
+        cache->num_threads++;
+    if (cache->num_threads == 0)
+      cache->readahead = 0;
+  }
+
+  if (!cache->buckets) {
+    destroy_chunk_cache(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+/* destroy_chunk_cache: Stops the readahead threads and frees all
+   chunks.
+ */
+void destroy_chunk_cache(chunk_cache_t *cache) {
+
+  pthread_mutex_lock(&cache->lock);
+  cache->stopping = 1;
+  pthread_cond_broadcast(&cache->work);
+  pthread_mutex_unlock(&cache->lock);
+  for (unsigned int i = 0; i < cache->num_threads; i++)
+    pthread_join(cache->threads[i], NULL);
+
+  while (cache->lru.lru_next != &cache->lru)
+    chunk_remove(cache, cache->lru.lru_next);
+  pthread_cond_destroy(&cache->work);
+  pthread_cond_destroy(&cache->loaded);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->threads);
+  free(cache->queue);
+  free(cache->buckets);
+  free(cache);
+}
+
+/* chunk_cache_read: Reads data through the chunk cache, loading any
+   chunk that is not cached yet.
+
+   Parameters:
+     cache: Pointer to the chunk cache.
+     buffer: Pointer to location where data is to be stored.
+     size: Number of bytes to read.
+     offset: Offset of the first byte to read in the data.
+
+   Returns:
+     The number of bytes read, which is only smaller than 'size' if
+     the end of the data is reached, or -1 in case of error.
+ */
+ssize_t chunk_cache_read(chunk_cache_t *cache, void *buffer, size_t size, uint64_t offset) {
+
+  size_t read_so_far = 0;
+
+  if (offset >= cache->data_size)
+    return 0;
+  if (size > cache->data_size - offset)
+    size = cache->data_size - offset;
+
+  pthread_mutex_lock(&cache->lock);
+  while (read_so_far < size) {
+    uint64_t chunk_no = (offset + read_so_far) / cache->chunk_size;
+    uint32_t chunk_offset = (offset + read_so_far) % cache->chunk_size;
+    size_t chunk_bytes = cache->chunk_size - chunk_offset;
+    if (chunk_bytes > size - read_so_far)
+      chunk_bytes = size - read_so_far;
+
+    if (cache->readahead && chunk_no != cache->last_chunk &&
+        (chunk_no == cache->last_chunk + 1 || chunk_no == 0))
+      chunk_queue_readahead(cache, chunk_no);
+    cache->last_chunk = chunk_no;
+
+    chunk_t *chunk = chunk_lookup(cache, chunk_no);
+    if (!chunk) {
+      chunk = chunk_start_load(cache, chunk_no);
+      if (!chunk || chunk_finish_load(cache, chunk) < 0)
+        break;
+    }
+    if (chunk->state == CHUNK_LOADING) {
+      chunk->users++;
+      while (chunk->state == CHUNK_LOADING)
+        pthread_cond_wait(&cache->loaded, &cache->lock);
+      chunk->users--;
+    }
+    if (chunk->state == CHUNK_FAILED) {
+      if (chunk->users == 0)
+        chunk_remove(cache, chunk);
+      break;
+    }
+
+    chunk_lru_unlink(chunk);
+    chunk_lru_push_front(cache, chunk);
+    chunk->users++;
+    pthread_mutex_unlock(&cache->lock);
+    memcpy((char *) buffer + read_so_far, chunk->data + chunk_offset, chunk_bytes);
+    pthread_mutex_lock(&cache->lock);
+    chunk->users--;
+    read_so_far += chunk_bytes;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return read_so_far == size ? (ssize_t) read_so_far : -1;
+}
@@ -0,0 +1,756 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Volume comparison. Two volumes (typically two revisions of the same
+   image) are compared in layers, from the cheapest to the costliest,
+   so that each layer only looks at what the previous one could not
+   rule out:
+
+   1. Group descriptors and inode tables. The inode table of each
+      group is read from both volumes with one read each, by a pool of
+      threads. Identical inode table blocks, which are most of them
+      between revisions, are skipped after a single memcmp; in the
+      others, each inode record is compared, and the inodes whose
+      records differ are marked. As in rsync's quick check, a file
+      whose inode record is unchanged is assumed to have unchanged
+      content. Volumes with a different inode layout skip this layer,
+      and all their inodes are considered changed.
+   2. Directory trees. Both trees are walked together by the same
+      threads, which take pairs of directories from a shared queue.
+      Each directory is listed in both volumes, even if its inode is
+      unchanged (images built by mke2fs -d keep the times of their
+      source, and directories are small anyway), and the entries are
+      merged by name, giving the added and removed files. Entries
+      referring to the same, unchanged inode are skipped
+      (subdirectories are still descended into).
+   3. Block maps. For each changed file present in both volumes, the
+      extents of both versions are obtained: ranges that are holes in
+      both are never read, and the others are read with one read per
+      contiguous extent.
+   4. Content, compared block by block, giving the changed block
+      ranges of each modified file.
+ */
+
+#define DIFF_CHUNK_SIZE (256 << 10) // Content compared at a time (a multiple of any block size)
+#define DIFF_EXTENTS    64          // Extents obtained per call to get_file_extents
+
+// Pair of directories to compare, one of them missing if the
+// directory was added or removed
+typedef struct diff_task {
+  uint32_t old_dir;
+  uint32_t new_dir;
+  char *path;                // Without a trailing '/' ("" for the root)
+} diff_task_t;
+
+typedef struct differ {
+  volume_t *old_volume;
+  volume_t *new_volume;
+  diff_report_t report;
+  void *ctx;
+  uint32_t inodes;           // Inodes tracked in 'changed'
+  uint32_t groups;           // Groups whose inode tables are compared
+  uint64_t *changed;         // Inodes whose records differ
+
+  pthread_mutex_t lock;      // Protects the fields below
+  pthread_cond_t work;
+  uint32_t next_group;
+  diff_task_t *queue;        // Directories ready to be compared
+  size_t queue_len;
+  size_t queue_capacity;
+  unsigned int busy;
+  int failed;                // errno of the first error, or 0
+  diff_summary_t summary;
+} differ_t;
+
+// Entry of a listed directory
+typedef struct diff_name {
+  size_t name_offset;        // Offset of the name in the listing's names
+  const char *name;          // Set once the listing is complete
+  uint32_t inode_no;
+  uint16_t mode;             // Type of file only
+  uint8_t name_len;
+} diff_name_t;
+
+typedef struct diff_listing {
+  diff_name_t *entries;
+  size_t num_entries;
+  size_t entries_capacity;
+  char *names;
+  size_t names_size;
+  size_t names_capacity;
+} diff_listing_t;
+
+// State of one thread
+typedef struct diff_worker {
+  differ_t *differ;
+  char *old_table;           // Inode tables of one group
+  char *new_table;
+  char *block;               // Directory block
+  char *old_data;            // DIFF_CHUNK_SIZE bytes of content
+  char *new_data;
+  diff_listing_t old_list;
+  diff_listing_t new_list;
+  file_extent_t *old_extents;
+  size_t old_extents_capacity;
+  file_extent_t *new_extents;
+  size_t new_extents_capacity;
+  diff_range_t *ranges;      // Changed blocks of the file being compared
+  size_t num_ranges;
+  size_t ranges_capacity;
+  char *path;
+  size_t path_capacity;
+  diff_summary_t summary;
+} diff_worker_t;
+
+static int grow(void **array, size_t *capacity, size_t needed, size_t element_size) {
+
+  if (needed <= *capacity)
+    return 0;
+  size_t new_capacity = *capacity ? *capacity * 2 : 64;
+  while (new_capacity < needed)
+    new_capacity *= 2;
+  void *new_array = realloc(*array, new_capacity * element_size);
+  if (!new_array) {
+    errno = ENOMEM;
+    return -1;
+  }
+  *array = new_array;
+  *capacity = new_capacity;
+  return 0;
+}
+
+static void fail(differ_t *differ, int error) {
+  pthread_mutex_lock(&differ->lock);
+  if (!differ->failed)
+    differ->failed = error;
+  pthread_cond_broadcast(&differ->work);
+  pthread_mutex_unlock(&differ->lock);
+}
+
+static inline int is_changed(differ_t *differ, uint32_t inode_no) {
+  uint32_t bit = inode_no - 1;
+  return inode_no == 0 || inode_no > differ->inodes || (differ->changed[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void report_entry(differ_t *differ, diff_kind_t kind, const char *path, uint32_t old_inode_no,
+                         uint32_t new_inode_no, uint16_t mode, uint32_t changes, diff_worker_t *worker) {
+
+  diff_entry_t entry = { kind, path, old_inode_no, new_inode_no, mode, changes, NULL, 0 };
+  if (worker) {
+    entry.ranges = worker->ranges;
+    entry.num_ranges = worker->num_ranges;
+  }
+  pthread_mutex_lock(&differ->lock);
+  if (kind == DIFF_ADDED)
+    differ->summary.added++;
+  else if (kind == DIFF_REMOVED)
+    differ->summary.removed++;
+  else
+    differ->summary.modified++;
+  if (differ->report)
+    differ->report(differ->ctx, &entry);
+  pthread_mutex_unlock(&differ->lock);
+}
+
+/* compare_group: First layer: compares the descriptor and the inode
+   table of a group in both volumes, and marks the inodes that differ.
+ */
+static void compare_group(diff_worker_t *worker, uint32_t group) {
+
+  differ_t *differ = worker->differ;
+  volume_t *old_volume = differ->old_volume, *new_volume = differ->new_volume;
+  uint32_t inode_size = new_volume->inode_size;
+  uint32_t per_group = new_volume->super.s_inodes_per_group;
+  size_t table_size = (size_t) per_group * inode_size;
+
+  if (read_block(old_volume, old_volume->groups[group].bg_inode_table, 0, table_size, worker->old_table) < 0 ||
+      read_block(new_volume, new_volume->groups[group].bg_inode_table, 0, table_size, worker->new_table) < 0) {
+    fail(differ, EIO);
+    return;
+  }
+
+  int changed = memcmp(&old_volume->groups[group], &new_volume->groups[group], sizeof(group_desc_t)) != 0;
+  for (size_t offset = 0; offset < table_size; offset += new_volume->block_size) {
+    size_t size = table_size - offset < new_volume->block_size ? table_size - offset : new_volume->block_size;
+    worker->summary.table_blocks++;
+    if (!memcmp(worker->old_table + offset, worker->new_table + offset, size)) {
+      worker->summary.table_blocks_same++;
+      continue;
+    }
+    changed = 1;
+    for (size_t i = offset / inode_size; i < (offset + size) / inode_size; i++) {
+      if (memcmp(worker->old_table + i * inode_size, worker->new_table + i * inode_size, inode_size)) {
+        uint64_t bit = (uint64_t) group * per_group + i;
+        __atomic_fetch_or(&differ->changed[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+        worker->summary.inodes_changed++;
+      }
+    }
+  }
+  worker->summary.groups++;
+  worker->summary.groups_changed += changed;
+}
+
+static int compare_names(const void *a, const void *b) {
+
+  const diff_name_t *x = a, *y = b;
+  int rv = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+  return rv ? rv : x->name_len - y->name_len;
+}
+
+/* list_directory: Lists the entries of a directory (except "." and
+   ".."), sorted by name.
+
+   Returns 0 on success, or -1 (setting errno) in case of error.
+ */
+static int list_directory(diff_worker_t *worker, volume_t *volume, uint32_t inode_no, diff_listing_t *list) {
+
+  inode_t inode, child;
+  dir_iterator_t iterator;
+  dir_entry_view_t view;
+  int64_t rv;
+
+  list->num_entries = list->names_size = 0;
+  if (read_inode(volume, inode_no, &inode) < 0 || !inode_is_directory(&inode)) {
+    errno = EIO;
+    return -1;
+  }
+  open_directory_iterator(&iterator, volume, &inode, 0, worker->block);
+  while ((rv = next_directory_view(&iterator, &view)) > 0) {
+    if ((view.name_len == 1 && view.name[0] == '.') ||
+        (view.name_len == 2 && view.name[0] == '.' && view.name[1] == '.'))
+      continue;
+    if (grow((void **) &list->entries, &list->entries_capacity, list->num_entries + 1, sizeof(diff_name_t)) < 0 ||
+        grow((void **) &list->names, &list->names_capacity, list->names_size + view.name_len + 1, 1) < 0)
+      return -1;
+    mode_t mode = dir_entry_type_mode(view.file_type);
+    if (!mode && read_inode(volume, view.inode_no, &child) >= 0)
+      mode = child.i_mode & S_IFMT;
+    list->entries[list->num_entries++] = (diff_name_t) {
+      .name_offset = list->names_size, .inode_no = view.inode_no, .mode = mode, .name_len = view.name_len
+    };
+    memcpy(list->names + list->names_size, view.name, view.name_len);
+    list->names[list->names_size + view.name_len] = '\0';
+    list->names_size += view.name_len + 1;
+  }
+  if (rv < 0) {
+    errno = EIO;
+    return -1;
+  }
+
+  for (size_t i = 0; i < list->num_entries; i++)
+    list->entries[i].name = list->names + list->entries[i].name_offset;
+  if (list->num_entries > 1)
+    qsort(list->entries, list->num_entries, sizeof(diff_name_t), compare_names);
+  return 0;
+}
+
+/* get_all_extents: Lists all the extents of a file in a growable
+   array. Returns their number, or -1 in case of error.
+ */
+static int64_t get_all_extents(volume_t *volume, inode_t *inode, file_extent_t **extents, size_t *capacity) {
+
+  size_t count = 0;
+  for (;;) {
+    if (grow((void **) extents, capacity, count + DIFF_EXTENTS, sizeof(file_extent_t)) < 0)
+      return -1;
+    uint64_t first = count ? (*extents)[count - 1].logical + (*extents)[count - 1].length : 0;
+    int64_t found = get_file_extents(volume, inode, first, *extents + count, DIFF_EXTENTS);
+    if (found < 0) {
+      errno = EIO;
+      return -1;
+    }
+    count += found;
+    if (found < DIFF_EXTENTS)
+      return count;
+  }
+}
+
+/* read_extents: Reads 'size' bytes of a file from offset 'offset',
+   with one read per extent. Holes, and bytes past the end of the
+   file, are zero-filled. 'cursor' is the first extent that may
+   overlap the data, and is moved forward; reads must be in increasing
+   order of offset.
+
+   Returns the number of bytes actually read (0 if all the data is a
+   hole), or -1 in case of error.
+ */
+static ssize_t read_extents(volume_t *volume, const file_extent_t *extents, size_t count, size_t *cursor,
+                            uint64_t file_size, uint64_t offset, uint32_t size, char *buffer) {
+
+  uint64_t block_size = volume->block_size;
+  uint64_t end = offset + size < file_size ? offset + size : file_size;
+  uint64_t pos = offset;
+  ssize_t bytes = 0;
+
+  memset(buffer, 0, size);
+  while (pos < end) {
+    while (*cursor < count && (extents[*cursor].logical + extents[*cursor].length) * block_size <= pos)
+      (*cursor)++;
+    if (*cursor == count)
+      break;
+    const file_extent_t *extent = &extents[*cursor];
+    uint64_t start = extent->logical * block_size;
+    if (start >= end)
+      break;
+    if (start > pos)
+      pos = start;
+    uint64_t stop = (extent->logical + extent->length) * block_size;
+    if (stop > end)
+      stop = end;
+    if (extent->physical) {
+      uint64_t skip = pos - start;
+      if (read_block(volume, extent->physical + skip / block_size, skip % block_size, stop - pos,
+                     buffer + (pos - offset)) < 0)
+        return -1;
+      bytes += stop - pos;
+    }
+    pos = stop;
+  }
+  return bytes;
+}
+
+static int add_changed_block(diff_worker_t *worker, uint64_t block) {
+
+  if (worker->num_ranges > 0) {
+    diff_range_t *last = &worker->ranges[worker->num_ranges - 1];
+    if (last->first + last->count == block) {
+      last->count++;
+      return 0;
+    }
+  }
+  if (grow((void **) &worker->ranges, &worker->ranges_capacity, worker->num_ranges + 1, sizeof(diff_range_t)) < 0)
+    return -1;
+  worker->ranges[worker->num_ranges++] = (diff_range_t) { block, 1 };
+  return 0;
+}
+
+/* compare_content: Third and fourth layers: compares the data of two
+   versions of a regular file, storing the changed blocks (of the new
+   volume's block size) in the worker's ranges. Blocks past the end of
+   the shorter version always count as changed.
+
+   Returns 1 if the content differs, 0 if it is the same, or -1 (with
+   errno set) in case of error.
+ */
+static int compare_content(diff_worker_t *worker, inode_t *old_inode, inode_t *new_inode) {
+
+  differ_t *differ = worker->differ;
+  volume_t *old_volume = differ->old_volume, *new_volume = differ->new_volume;
+  uint64_t old_size = inode_file_size(old_volume, old_inode), new_size = inode_file_size(new_volume, new_inode);
+  uint64_t size = old_size > new_size ? old_size : new_size;
+  uint64_t common = old_size < new_size ? old_size : new_size;
+  uint32_t unit = new_volume->block_size;
+  size_t old_cursor = 0, new_cursor = 0;
+
+  int64_t old_count = get_all_extents(old_volume, old_inode, &worker->old_extents, &worker->old_extents_capacity);
+  int64_t new_count = get_all_extents(new_volume, new_inode, &worker->new_extents, &worker->new_extents_capacity);
+  if (old_count < 0 || new_count < 0)
+    return -1;
+  worker->summary.files_compared++;
+
+  for (uint64_t offset = 0; offset < size; offset += DIFF_CHUNK_SIZE) {
+    uint32_t chunk = size - offset < DIFF_CHUNK_SIZE ? size - offset : DIFF_CHUNK_SIZE;
+    ssize_t old_bytes = read_extents(old_volume, worker->old_extents, old_count, &old_cursor, old_size, offset,
+                                     chunk, worker->old_data);
+    ssize_t new_bytes = read_extents(new_volume, worker->new_extents, new_count, &new_cursor, new_size, offset,
+                                     chunk, worker->new_data);
+    if (old_bytes < 0 || new_bytes < 0) {
+      errno = EIO;
+      return -1;
+    }
+    worker->summary.bytes_compared += old_bytes + new_bytes;
+    // Holes in both versions, within both sizes
+    if (old_bytes == 0 && new_bytes == 0 && offset + chunk <= common)
+      continue;
+    for (uint32_t pos = 0; pos < chunk; pos += unit) {
+      uint32_t length = chunk - pos < unit ? chunk - pos : unit;
+      if ((offset + pos + length > common && old_size != new_size) ||
+          memcmp(worker->old_data + pos, worker->new_data + pos, length))
+        if (add_changed_block(worker, (offset + pos) / unit) < 0)
+          return -1;
+    }
+  }
+  return worker->num_ranges > 0;
+}
+
+/* compare_xattrs: Compares the EA blocks of two inodes, as raw blocks
+   (except for their reference counts, which depend on other files).
+
+   Returns 1 if they differ, 0 if not, or -1 in case of error.
+ */
+static int compare_xattrs(diff_worker_t *worker, inode_t *old_inode, inode_t *new_inode) {
+
+  volume_t *old_volume = worker->differ->old_volume, *new_volume = worker->differ->new_volume;
+  if (!old_inode->i_file_acl || !new_inode->i_file_acl)
+    return old_inode->i_file_acl != new_inode->i_file_acl;
+  if (old_volume->block_size != new_volume->block_size)
+    return 1;
+  if (read_block(old_volume, old_inode->i_file_acl, 0, old_volume->block_size, worker->old_data) < 0 ||
+      read_block(new_volume, new_inode->i_file_acl, 0, new_volume->block_size, worker->new_data) < 0) {
+    errno = EIO;
+    return -1;
+  }
+  worker->summary.bytes_compared += 2 * new_volume->block_size;
+  return memcmp(worker->old_data, worker->new_data, 4) != 0 ||
+         memcmp(worker->old_data + 8, worker->new_data + 8, new_volume->block_size - 8) != 0;
+}
+
+/* compare_inodes: Finds the changes between two versions of a file.
+   Directory content is not compared here (their entries are), and
+   neither is the content of a regular file whose size, block map and
+   modification time are unchanged.
+
+   Returns the DIFF_* flags of the changes, or -1 in case of error.
+ */
+static int64_t compare_inodes(diff_worker_t *worker, inode_t *old_inode, inode_t *new_inode, int same_inode) {
+
+  uint32_t changes = 0;
+  int rv;
+
+  worker->num_ranges = 0;
+  if ((old_inode->i_mode & S_IFMT) != (new_inode->i_mode & S_IFMT))
+    return DIFF_TYPE;
+  if ((old_inode->i_mode & 07777) != (new_inode->i_mode & 07777))
+    changes |= DIFF_MODE;
+  if (old_inode->i_uid != new_inode->i_uid || old_inode->i_gid != new_inode->i_gid ||
+      old_inode->l_i_uid_high != new_inode->l_i_uid_high || old_inode->l_i_gid_high != new_inode->l_i_gid_high)
+    changes |= DIFF_OWNER;
+  if ((rv = compare_xattrs(worker, old_inode, new_inode)) < 0)
+    return -1;
+  if (rv)
+    changes |= DIFF_XATTR;
+  if (inode_is_directory(new_inode))
+    return changes;
+
+  if (old_inode->i_mtime != new_inode->i_mtime)
+    changes |= DIFF_MTIME;
+  if (inode_is_regular_file(new_inode)) {
+    if (same_inode && old_inode->i_size == new_inode->i_size && old_inode->i_dir_acl == new_inode->i_dir_acl &&
+        old_inode->i_mtime == new_inode->i_mtime &&
+        !memcmp(old_inode->i_block, new_inode->i_block, sizeof(old_inode->i_block)) &&
+        old_inode->i_block_1ind == new_inode->i_block_1ind && old_inode->i_block_2ind == new_inode->i_block_2ind &&
+        old_inode->i_block_3ind == new_inode->i_block_3ind)
+      return changes;
+    if ((rv = compare_content(worker, old_inode, new_inode)) < 0)
+      return -1;
+  } else if (inode_is_symlink(new_inode)) {
+    int32_t old_length = read_symlink_target(worker->differ->old_volume, old_inode, worker->old_data,
+                                             DIFF_CHUNK_SIZE);
+    int32_t new_length = read_symlink_target(worker->differ->new_volume, new_inode, worker->new_data,
+                                             DIFF_CHUNK_SIZE);
+    rv = old_length != new_length || memcmp(worker->old_data, worker->new_data, new_length);
+  } else {
+    // Device numbers are kept in the block map
+    rv = memcmp(old_inode->i_block, new_inode->i_block, sizeof(old_inode->i_block)) != 0;
+  }
+  return rv ? changes | DIFF_CONTENT : changes;
+}
+
+static int queue_task(differ_t *differ, uint32_t old_dir, uint32_t new_dir, const char *path) {
+
+  char *copy = strdup(path);
+  pthread_mutex_lock(&differ->lock);
+  if (!copy || grow((void **) &differ->queue, &differ->queue_capacity, differ->queue_len + 1,
+                    sizeof(diff_task_t)) < 0) {
+    pthread_mutex_unlock(&differ->lock);
+    free(copy);
+    errno = ENOMEM;
+    return -1;
+  }
+  differ->queue[differ->queue_len++] = (diff_task_t) { old_dir, new_dir, copy };
+  pthread_cond_signal(&differ->work);
+  pthread_mutex_unlock(&differ->lock);
+  return 0;
+}
+
+/* compare_pair: Compares a file present with the same name in both
+   volumes, reporting it if it was modified, and queues it if it is a
+   directory.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int compare_pair(diff_worker_t *worker, const char *path, const diff_name_t *old_entry,
+                        const diff_name_t *new_entry) {
+
+  differ_t *differ = worker->differ;
+  inode_t old_inode, new_inode;
+
+  if (old_entry->inode_no == new_entry->inode_no && !is_changed(differ, new_entry->inode_no))
+    return S_ISDIR(new_entry->mode) ? queue_task(differ, old_entry->inode_no, new_entry->inode_no, path) : 0;
+
+  if (read_inode(differ->old_volume, old_entry->inode_no, &old_inode) < 0 ||
+      read_inode(differ->new_volume, new_entry->inode_no, &new_inode) < 0) {
+    errno = EIO;
+    return -1;
+  }
+  int64_t changes = compare_inodes(worker, &old_inode, &new_inode, old_entry->inode_no == new_entry->inode_no);
+  if (changes < 0)
+    return -1;
+  if (changes)
+    report_entry(differ, DIFF_MODIFIED, path, old_entry->inode_no, new_entry->inode_no,
+                 new_inode.i_mode & S_IFMT, changes, worker);
+
+  // A directory replaced by another type of file is listed as removed
+  // or added, with everything in it
+  int old_dir = inode_is_directory(&old_inode), new_dir = inode_is_directory(&new_inode);
+  if (old_dir || new_dir)
+    return queue_task(differ, old_dir ? old_entry->inode_no : 0, new_dir ? new_entry->inode_no : 0, path);
+  return 0;
+}
+
+/* compare_directory: Second layer: compares the entries of a pair of
+   directories, reporting added and removed files, and compares the
+   files found in both.
+
+   Returns 0 on success, or -1 (setting errno) in case of error.
+ */
+static int compare_directory(diff_worker_t *worker, diff_task_t *task) {
+
+  differ_t *differ = worker->differ;
+  diff_listing_t *old_list = &worker->old_list, *new_list = &worker->new_list;
+  size_t path_len = strlen(task->path);
+
+  old_list->num_entries = new_list->num_entries = 0;
+  if ((task->new_dir && list_directory(worker, differ->new_volume, task->new_dir, new_list) < 0) ||
+      (task->old_dir && list_directory(worker, differ->old_volume, task->old_dir, old_list) < 0))
+    return -1;
+  worker->summary.directories++;
+
+  // Changes to the root directory itself
+  if (path_len == 0 && (task->old_dir != task->new_dir || is_changed(differ, task->new_dir))) {
+    diff_name_t old_root = { .inode_no = task->old_dir, .mode = S_IFDIR };
+    diff_name_t new_root = { .inode_no = task->new_dir, .mode = S_IFDIR };
+    inode_t old_inode, new_inode;
+    if (read_inode(differ->old_volume, old_root.inode_no, &old_inode) < 0 ||
+        read_inode(differ->new_volume, new_root.inode_no, &new_inode) < 0) {
+      errno = EIO;
+      return -1;
+    }
+    int64_t changes = compare_inodes(worker, &old_inode, &new_inode, old_root.inode_no == new_root.inode_no);
+    if (changes < 0)
+      return -1;
+    if (changes)
+      report_entry(differ, DIFF_MODIFIED, "/", old_root.inode_no, new_root.inode_no, S_IFDIR, changes, NULL);
+  }
+
+  if (grow((void **) &worker->path, &worker->path_capacity, path_len + 258, 1) < 0)
+    return -1;
+  memcpy(worker->path, task->path, path_len);
+  worker->path[path_len] = '/';
+
+  size_t o = 0, n = 0;
+  while (o < old_list->num_entries || n < new_list->num_entries) {
+    diff_name_t *old_entry = o < old_list->num_entries ? &old_list->entries[o] : NULL;
+    diff_name_t *new_entry = n < new_list->num_entries ? &new_list->entries[n] : NULL;
+    int order = !old_entry ? 1 : !new_entry ? -1 : compare_names(old_entry, new_entry);
+    diff_name_t *entry = order > 0 ? new_entry : old_entry;
+    memcpy(worker->path + path_len + 1, entry->name, entry->name_len);
+    worker->path[path_len + 1 + entry->name_len] = '\0';
+
+    int rv = 0;
+    if (order < 0) {
+      report_entry(differ, DIFF_REMOVED, worker->path, entry->inode_no, 0, entry->mode, 0, NULL);
+      if (S_ISDIR(entry->mode))
+        rv = queue_task(differ, entry->inode_no, 0, worker->path);
+      o++;
+    } else if (order > 0) {
+      report_entry(differ, DIFF_ADDED, worker->path, 0, entry->inode_no, entry->mode, 0, NULL);
+      if (S_ISDIR(entry->mode))
+        rv = queue_task(differ, 0, entry->inode_no, worker->path);
+      n++;
+    } else {
+      rv = compare_pair(worker, worker->path, old_entry, new_entry);
+      o++;
+      n++;
+    }
+    if (rv < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static void walk_trees(diff_worker_t *worker) {
+
+  differ_t *differ = worker->differ;
+
+  pthread_mutex_lock(&differ->lock);
+  for (;;) {
+    while (differ->queue_len == 0 && differ->busy > 0 && !differ->failed)
+      pthread_cond_wait(&differ->work, &differ->lock);
+    if (differ->queue_len == 0 || differ->failed)
+      break;
+    diff_task_t task = differ->queue[--differ->queue_len];
+    differ->busy++;
+    pthread_mutex_unlock(&differ->lock);
+
+    int rv = compare_directory(worker, &task);
+    int error = errno;
+    free(task.path);
+
+    pthread_mutex_lock(&differ->lock);
+    if (rv < 0 && !differ->failed)
+      differ->failed = error;
+    differ->busy--;
+    if ((differ->busy == 0 && differ->queue_len == 0) || differ->failed)
+      pthread_cond_broadcast(&differ->work);
+  }
+  pthread_mutex_unlock(&differ->lock);
+}
+
+static void compare_tables(diff_worker_t *worker) {
+
+  differ_t *differ = worker->differ;
+  for (;;) {
+    pthread_mutex_lock(&differ->lock);
+    uint32_t group = differ->failed ? differ->groups : differ->next_group++;
+    pthread_mutex_unlock(&differ->lock);
+    if (group >= differ->groups)
+      break;
+    compare_group(worker, group);
+  }
+}
+
+typedef struct diff_pass {
+  differ_t *differ;
+  int walk;                  // Second layer (directory trees) rather than the first
+} diff_pass_t;
+
+static void *diff_thread(void *arg) {
+
+  diff_pass_t *pass = arg;
+  differ_t *differ = pass->differ;
+  diff_worker_t worker = { .differ = differ };
+  size_t table_size = (size_t) differ->new_volume->super.s_inodes_per_group * differ->new_volume->inode_size;
+  uint32_t block_size = differ->old_volume->block_size > differ->new_volume->block_size ?
+                        differ->old_volume->block_size : differ->new_volume->block_size;
+
+  if (pass->walk) {
+    worker.block = malloc(block_size);
+    worker.old_data = malloc(DIFF_CHUNK_SIZE);
+    worker.new_data = malloc(DIFF_CHUNK_SIZE);
+  } else {
+    worker.old_table = malloc(table_size);
+    worker.new_table = malloc(table_size);
+  }
+  if (pass->walk ? !worker.block || !worker.old_data || !worker.new_data : !worker.old_table || !worker.new_table)
+    fail(differ, ENOMEM);
+  else if (pass->walk)
+    walk_trees(&worker);
+  else
+    compare_tables(&worker);
+
+  pthread_mutex_lock(&differ->lock);
+  differ->summary.groups += worker.summary.groups;
+  differ->summary.groups_changed += worker.summary.groups_changed;
+  differ->summary.table_blocks += worker.summary.table_blocks;
+  differ->summary.table_blocks_same += worker.summary.table_blocks_same;
+  differ->summary.inodes_changed += worker.summary.inodes_changed;
+  differ->summary.directories += worker.summary.directories;
+  differ->summary.files_compared += worker.summary.files_compared;
+  differ->summary.bytes_compared += worker.summary.bytes_compared;
+  pthread_mutex_unlock(&differ->lock);
+  free(worker.old_table);
+  free(worker.new_table);
+  free(worker.block);
+  free(worker.old_data);
+  free(worker.new_data);
+  free(worker.old_list.entries);
+  free(worker.old_list.names);
+  free(worker.new_list.entries);
+  free(worker.new_list.names);
+  free(worker.old_extents);
+  free(worker.new_extents);
+  free(worker.ranges);
+  free(worker.path);
+  return NULL;
+}
+
+/* run_pass: Runs one layer with a pool of threads, and waits until all
+   of them are done.
+ */
+static void run_pass(differ_t *differ, int walk, unsigned int threads) {
+
+  diff_pass_t pass = { differ, walk };
+  run_workers(diff_thread, &pass, threads);
+}
+
+/* diff_volumes: Compares two volumes, and reports the files added,
+   removed and modified in the new one, with the changed blocks of
+   modified regular files. Inode tables are compared first, so that
+   only the files whose inode changed (or whose directory entry did)
+   are compared further. Times other than the modification time, link
+   counts and the location of the data are not reported as changes.
+
+   Parameters:
+     old_volume: Pointer to the volume to compare against.
+     new_volume: Pointer to the volume reported on.
+     threads: Number of threads comparing groups and directories in
+              parallel (see run_workers).
+     report: Function called for each file added, removed or modified
+             (may be NULL), from any of the threads but never
+             concurrently, in no particular order. The files inside an
+             added or removed directory are reported too. The entry
+             and what it points to are only valid during the call.
+     ctx: Passed to 'report'.
+     summary: Where the totals of the comparison are stored (may be
+              NULL).
+
+   Returns:
+     The number of files reported (0 if the volumes hold the same
+     files), or -1 if the volumes could not be compared: errno is then
+     set to ENOMEM, or to EIO if data could not be read.
+ */
+int64_t diff_volumes(volume_t *old_volume, volume_t *new_volume, unsigned int threads, diff_report_t report,
+                     void *ctx, diff_summary_t *summary) {
+
+  superblock_t *old_super = &old_volume->super, *new_super = &new_volume->super;
+  differ_t differ = { .old_volume = old_volume, .new_volume = new_volume, .report = report, .ctx = ctx };
+  int same_layout = old_super->s_inodes_count == new_super->s_inodes_count &&
+                    old_super->s_inodes_per_group == new_super->s_inodes_per_group &&
+                    old_volume->inode_size == new_volume->inode_size &&
+                    old_volume->block_size == new_volume->block_size;
+  int64_t rv = -1;
+
+  differ.inodes = old_super->s_inodes_count > new_super->s_inodes_count ?
+                  old_super->s_inodes_count : new_super->s_inodes_count;
+  differ.groups = same_layout ? new_super->s_inodes_count / new_super->s_inodes_per_group : 0;
+  if (differ.groups > new_volume->num_groups || differ.groups > old_volume->num_groups)
+    differ.groups = 0;
+  differ.changed = calloc(differ.inodes / 64 + 1, sizeof(uint64_t));
+  if (!differ.changed) {
+    errno = ENOMEM;
+    return -1;
+  }
+  // Without the first layer, every inode has to be compared
+  if (differ.groups == 0)
+    memset(differ.changed, 0xff, (differ.inodes / 64 + 1) * sizeof(uint64_t));
+  pthread_mutex_init(&differ.lock, NULL);
+  pthread_cond_init(&differ.work, NULL);
+
+  if (differ.groups > 0)
+    run_pass(&differ, 0, threads);
+  if (!differ.failed && queue_task(&differ, EXT2_ROOT_INO, EXT2_ROOT_INO, "") < 0)
+    differ.failed = ENOMEM;
+  if (!differ.failed)
+    run_pass(&differ, 1, threads);
+
+  if (!differ.failed) {
+    if (summary)
+      *summary = differ.summary;
+    rv = differ.summary.added + differ.summary.removed + differ.summary.modified;
+  }
+  for (size_t i = 0; i < differ.queue_len; i++)
+    free(differ.queue[i].path);
+  free(differ.queue);
+  free(differ.changed);
+  pthread_cond_destroy(&differ.work);
+  pthread_mutex_destroy(&differ.lock);
+  if (rv < 0)
+    errno = differ.failed;
+  return rv;
+}
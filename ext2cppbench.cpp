@@ -0,0 +1,322 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "ext2.hpp"
+
+/* Benchmark of the C++ interface (ext2.hpp) against the C functions it
+   wraps, and against a wrapper that copies names and data into
+   std::string and std::vector, as hand-written bindings usually do.
+   Every variant walks the whole directory tree of the volume, reads
+   the file in READ_SIZE pieces and lists its extents, 'rounds' times,
+   with the volume served from a block cache, so that the time
+   measured is CPU time rather than I/O. The number of C++ heap
+   allocations per pass is counted by replacing operator new; the C
+   functions called, and their own allocations, are the same in every
+   variant.
+
+   The checksums of all variants must match: the exit status is 1 if
+   they do not.
+ */
+
+#define DEFAULT_ROUNDS   20
+#define DEFAULT_CACHE_MB 256
+#define READ_SIZE        4096
+#define MAX_DEPTH        64
+
+static uint64_t allocations;
+
+void *operator new(std::size_t size) {
+  allocations++;
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Totals of one pass, compared between variants
+struct totals {
+  uint64_t entries, names, bytes, extents, data_bytes, checksum;
+};
+
+static bool is_dot(const char *name, size_t len) {
+  return (len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+/* C functions */
+
+static void walk_c(volume_t *volume, inode_t *dir, unsigned int depth, totals &t) {
+  dir_iterator_t iterator;
+  dir_entry_view_t view;
+  arena_mark_t mark = arena_mark();
+  void *block = arena_alloc(volume->block_size);
+  if (!block)
+    return;
+  open_directory_iterator(&iterator, volume, dir, 0, block);
+  while (next_directory_view(&iterator, &view) > 0) {
+    t.entries++;
+    t.names += view.name_len;
+    t.checksum += view.inode_no;
+    if (depth < MAX_DEPTH && dir_entry_type_mode(view.file_type) != S_IFREG && !is_dot(view.name, view.name_len)) {
+      inode_t child;
+      if (read_inode(volume, view.inode_no, &child) >= 0 && inode_is_directory(&child))
+        walk_c(volume, &child, depth + 1, t);
+    }
+  }
+  arena_release(mark);
+}
+
+static void read_c(volume_t *volume, inode_t *inode, char *buffer, totals &t) {
+  uint64_t size = inode_file_size(volume, inode);
+  for (uint64_t offset = 0; offset < size; offset += READ_SIZE) {
+    ssize_t bytes = read_file_content(volume, inode, offset, READ_SIZE, buffer);
+    if (bytes <= 0)
+      break;
+    t.bytes += bytes;
+    t.checksum += (unsigned char) buffer[bytes - 1];
+  }
+}
+
+static void extents_c(volume_t *volume, inode_t *inode, totals &t) {
+  file_extent_t extents[64];
+  uint64_t first = 0;
+  int64_t count;
+  while ((count = get_file_extents(volume, inode, first, extents, 64)) > 0) {
+    for (int64_t i = 0; i < count; i++) {
+      t.extents++;
+      if (extents[i].physical)
+        t.data_bytes += extents[i].length << volume->block_shift;
+    }
+    first = extents[count - 1].logical + extents[count - 1].length;
+  }
+}
+
+/* Copying wrapper */
+
+struct copied_entry {
+  uint32_t inode_no;
+  uint8_t file_type;
+  std::string name;
+};
+
+static std::vector<copied_entry> list_copied(volume_t *volume, inode_t *dir) {
+  std::vector<copied_entry> entries;
+  std::vector<char> block(volume->block_size);
+  dir_iterator_t iterator;
+  dir_entry_view_t view;
+  open_directory_iterator(&iterator, volume, dir, 0, block.data());
+  while (next_directory_view(&iterator, &view) > 0)
+    entries.push_back({ view.inode_no, view.file_type, std::string(view.name, view.name_len) });
+  return entries;
+}
+
+static void walk_copied(volume_t *volume, inode_t *dir, unsigned int depth, totals &t) {
+  for (const copied_entry &entry : list_copied(volume, dir)) {
+    t.entries++;
+    t.names += entry.name.size();
+    t.checksum += entry.inode_no;
+    if (depth < MAX_DEPTH && dir_entry_type_mode(entry.file_type) != S_IFREG && entry.name != "." && entry.name != "..") {
+      inode_t child;
+      if (read_inode(volume, entry.inode_no, &child) >= 0 && inode_is_directory(&child))
+        walk_copied(volume, &child, depth + 1, t);
+    }
+  }
+}
+
+static std::vector<char> read_copied(volume_t *volume, inode_t *inode, uint64_t offset, size_t size) {
+  std::vector<char> data(size);
+  ssize_t bytes = read_file_content(volume, inode, offset, size, data.data());
+  data.resize(bytes > 0 ? bytes : 0);
+  return data;
+}
+
+static void read_copied(volume_t *volume, inode_t *inode, totals &t) {
+  uint64_t size = inode_file_size(volume, inode);
+  for (uint64_t offset = 0; offset < size; offset += READ_SIZE) {
+    std::vector<char> data = read_copied(volume, inode, offset, READ_SIZE);
+    if (data.empty())
+      break;
+    t.bytes += data.size();
+    t.checksum += (unsigned char) data.back();
+  }
+}
+
+static void extents_copied(volume_t *volume, inode_t *inode, totals &t) {
+  std::vector<file_extent_t> all;
+  file_extent_t extents[64];
+  uint64_t first = 0;
+  int64_t count;
+  while ((count = get_file_extents(volume, inode, first, extents, 64)) > 0) {
+    all.insert(all.end(), extents, extents + count);
+    first = extents[count - 1].logical + extents[count - 1].length;
+  }
+  for (const file_extent_t &extent : all) {
+    t.extents++;
+    if (extent.physical)
+      t.data_bytes += extent.length << volume->block_shift;
+  }
+}
+
+/* ext2.hpp */
+
+static void walk_cpp(const ext2::Volume &volume, const ext2::File &dir, unsigned int depth, totals &t) {
+  for (const ext2::Directory::Entry &entry : dir.directory()) {
+    t.entries++;
+    t.names += entry.name.size();
+    t.checksum += entry.inode_no;
+    if (depth < MAX_DEPTH && entry.type() != S_IFREG && entry.name != "." && entry.name != "..") {
+      ext2::File child = volume.file(entry.inode_no);
+      if (child.is_directory())
+        walk_cpp(volume, child, depth + 1, t);
+    }
+  }
+}
+
+static void read_cpp(const ext2::File &file, std::span<char> buffer, totals &t) {
+  for (uint64_t offset = 0; offset < file.size(); offset += buffer.size()) {
+    size_t bytes = file.read_into(buffer, offset);
+    if (bytes == 0)
+      break;
+    t.bytes += bytes;
+    t.checksum += (unsigned char) buffer[bytes - 1];
+  }
+}
+
+static void extents_cpp(const ext2::File &file, totals &t) {
+  ext2::with_block_geometry(file.volume()->block_size, [&](auto geometry) {
+    for (const file_extent_t &extent : file.extents()) {
+      t.extents++;
+      if (extent.physical)
+        t.data_bytes += geometry.bytes_for(extent.length);
+    }
+  });
+}
+
+enum variant { C_API, COPYING, CPP_API };
+
+/* run_variant: Runs one pass of each operation 'rounds' times with the
+   given variant, prints the time per operation and the allocations
+   per pass after 'label', and returns the totals of the last pass.
+ */
+static totals run_variant(variant v, const char *label, const ext2::Volume &volume, const ext2::File &file,
+                          unsigned int rounds, char *buffer) {
+
+  volume_t *vol = volume.get();
+  inode_t root, inode = file.inode();
+  if (read_inode(vol, EXT2_ROOT_INO, &root) < 0)
+    ext2::throw_error("read_inode");
+  totals t{};
+  double start;
+
+  printf("%-10s", label);
+  uint64_t allocated = allocations;
+  start = now();
+  for (unsigned int r = 0; r < rounds; r++) {
+    t = totals{};
+    switch (v) {
+    case C_API:   walk_c(vol, &root, 0, t); break;
+    case COPYING: walk_copied(vol, &root, 0, t); break;
+    case CPP_API: walk_cpp(volume, volume.root(), 0, t); break;
+    }
+  }
+  printf("  %7.1f ns/entry", (now() - start) * 1e9 / (rounds * (t.entries ?: 1)));
+
+  start = now();
+  for (unsigned int r = 0; r < rounds; r++) {
+    switch (v) {
+    case C_API:   read_c(vol, &inode, buffer, t); break;
+    case COPYING: read_copied(vol, &inode, t); break;
+    case CPP_API: read_cpp(file, std::span<char>(buffer, READ_SIZE), t); break;
+    }
+  }
+  uint64_t reads = (file.size() + READ_SIZE - 1) / READ_SIZE;
+  printf("  %7.1f ns/read", (now() - start) * 1e9 / (rounds * (reads ?: 1)));
+
+  start = now();
+  for (unsigned int r = 0; r < rounds; r++) {
+    switch (v) {
+    case C_API:   extents_c(vol, &inode, t); break;
+    case COPYING: extents_copied(vol, &inode, t); break;
+    case CPP_API: extents_cpp(file, t); break;
+    }
+  }
+  printf("  %7.1f ns/extent", (now() - start) * 1e9 / (rounds * (t.extents / rounds ?: 1)));
+
+  printf("  %9.1f allocations/pass\n", (double) (allocations - allocated) / rounds);
+  t.bytes /= rounds;
+  t.extents /= rounds;
+  t.data_bytes /= rounds;
+  return t;
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int rounds = DEFAULT_ROUNDS;
+  unsigned long cache_mb = DEFAULT_CACHE_MB;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+    switch (opt) {
+    case 'n': rounds = strtoul(optarg, NULL, 10); break;
+    case 'm': cache_mb = strtoul(optarg, NULL, 10); break;
+    default: goto usage;
+    }
+  }
+  if (argc - optind != 2 || rounds == 0) {
+  usage:
+    fprintf(stderr, "Usage: %s [-n rounds] [-m cache_mb] volume_file path\n"
+            "  -n  number of passes over the directory tree and the file (default %d)\n"
+            "  -m  block cache size in MiB (default %d)\n",
+            argv[0], DEFAULT_ROUNDS, DEFAULT_CACHE_MB);
+    return 1;
+  }
+
+  try {
+    // Declared first, so that the volume is closed before the cache is destroyed
+    std::unique_ptr<block_cache_t, void (*)(block_cache_t *)> cache(create_block_cache(cache_mb << 20),
+                                                                    destroy_block_cache);
+    if (!cache) {
+      fprintf(stderr, "Could not create block cache.\n");
+      return 1;
+    }
+    ext2::Volume volume(argv[optind]);
+    attach_block_cache(volume.get(), cache.get());
+
+    std::optional<ext2::File> file = volume.lookup(argv[optind + 1]);
+    if (!file) {
+      fprintf(stderr, "%s: file not found in volume.\n", argv[optind + 1]);
+      return 1;
+    }
+    std::vector<char> buffer(READ_SIZE);
+
+    printf("Block size %" PRIu32 ", file size %" PRIu64 "\n", volume.block_size(), file->size());
+    run_variant(C_API, "(warm-up)", volume, *file, 1, buffer.data()); // Fills the block cache
+    totals c = run_variant(C_API, "C", volume, *file, rounds, buffer.data());
+    totals copied = run_variant(COPYING, "copying", volume, *file, rounds, buffer.data());
+    totals cpp = run_variant(CPP_API, "ext2.hpp", volume, *file, rounds, buffer.data());
+    printf("%" PRIu64 " entries, %" PRIu64 " bytes read, %" PRIu64 " extents\n", c.entries, c.bytes, c.extents);
+
+    if (memcmp(&c, &copied, sizeof(totals)) || memcmp(&c, &cpp, sizeof(totals))) {
+      fprintf(stderr, "Variants disagree.\n");
+      return 1;
+    }
+  } catch (const std::system_error &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ext2.h"
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s info delta_file\n"
+          "       %s commit delta_file volume_file\n"
+          "       %s discard delta_file\n"
+          "  info     show the number of blocks held in the delta file\n"
+          "  commit   apply the changes in the delta file to the volume file\n"
+          "  discard  drop the changes in the delta file\n",
+          prog, prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc < 3) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *command = argv[1];
+  int commit = !strcmp(command, "commit");
+  if ((commit && argc != 4) || (!commit && argc != 3) ||
+      (!commit && strcmp(command, "info") && strcmp(command, "discard"))) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int delta_fd = open(argv[2], !strcmp(command, "discard") ? O_RDWR : O_RDONLY);
+  if (delta_fd == -1) {
+    fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+    return 1;
+  }
+
+  int64_t blocks;
+  if (commit) {
+    int base_fd = open(argv[3], O_RDWR);
+    if (base_fd == -1) {
+      fprintf(stderr, "%s: %s\n", argv[3], strerror(errno));
+      return 1;
+    }
+    blocks = commit_delta(delta_fd, base_fd);
+    close(base_fd);
+  } else if (!strcmp(command, "discard")) {
+    blocks = discard_delta(delta_fd);
+  } else {
+    blocks = count_delta_blocks(delta_fd);
+  }
+  if (blocks < 0) {
+    fprintf(stderr, "%s: %s\n", argv[2],
+            errno == EINVAL ? "not a valid delta file for this volume" : strerror(errno));
+    return 1;
+  }
+
+  printf("%s: %lld blocks %s\n", argv[2], (long long) blocks,
+         commit ? "committed" : !strcmp(command, "discard") ? "discarded" : "changed");
+  close(delta_fd);
+  return 0;
+}
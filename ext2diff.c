@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "ext2.h"
+
+/* ext2diff: Lists the files added (A), removed (D) and modified (M)
+   between two volumes, sorted by path. Directories end with '/'.
+   Modified files are followed by what changed and, for regular files,
+   the ranges of blocks whose content changed, e.g.:
+
+     M /etc/passwd mtime,content blocks=0-1,4
+
+   Exit status: 0 if the volumes hold the same files, 1 if they
+   differ, 2 if they could not be compared.
+ */
+
+#define DEFAULT_THREADS 8
+
+typedef struct change {
+  diff_kind_t kind;
+  uint16_t mode;
+  uint32_t changes;
+  char *path;
+  diff_range_t *ranges;
+  uint32_t num_ranges;
+} change_t;
+
+static change_t *changes;
+static size_t num_changes, changes_capacity;
+static int out_of_memory;
+
+static void add_change(void *ctx, const diff_entry_t *entry) {
+
+  if (num_changes == changes_capacity) {
+    size_t capacity = changes_capacity ? changes_capacity * 2 : 256;
+    change_t *array = realloc(changes, capacity * sizeof(change_t));
+    if (!array) {
+      out_of_memory = 1;
+      return;
+    }
+    changes = array;
+    changes_capacity = capacity;
+  }
+  change_t *change = &changes[num_changes];
+  *change = (change_t) { entry->kind, entry->mode, entry->changes, strdup(entry->path), NULL, entry->num_ranges };
+  if (entry->num_ranges) {
+    change->ranges = malloc(entry->num_ranges * sizeof(diff_range_t));
+    if (change->ranges)
+      memcpy(change->ranges, entry->ranges, entry->num_ranges * sizeof(diff_range_t));
+  }
+  if (!change->path || (entry->num_ranges && !change->ranges)) {
+    free(change->path);
+    free(change->ranges);
+    out_of_memory = 1;
+    return;
+  }
+  num_changes++;
+}
+
+static int compare_changes(const void *a, const void *b) {
+  return strcmp(((const change_t *) a)->path, ((const change_t *) b)->path);
+}
+
+static void print_change(const change_t *change) {
+
+  static const char kinds[] = { 'A', 'D', 'M' };
+  static const char *flags[] = { "type", "mode", "owner", "mtime", "content", "xattr" };
+
+  printf("%c %s%s", kinds[change->kind], change->path,
+         S_ISDIR(change->mode) && strcmp(change->path, "/") ? "/" : "");
+  if (change->kind == DIFF_MODIFIED) {
+    const char *separator = " ";
+    for (int i = 0; i < 6; i++)
+      if (change->changes & (1 << i)) {
+        printf("%s%s", separator, flags[i]);
+        separator = ",";
+      }
+  }
+  for (uint32_t r = 0; r < change->num_ranges; r++) {
+    const diff_range_t *range = &change->ranges[r];
+    printf("%s%" PRIu64, r ? "," : " blocks=", range->first);
+    if (range->count > 1)
+      printf("-%" PRIu64, range->first + range->count - 1);
+  }
+  putchar('\n');
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int threads = DEFAULT_THREADS;
+  int show_summary = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:s")) != -1) {
+    switch (opt) {
+    case 'j': threads = strtoul(optarg, NULL, 10); break;
+    case 's': show_summary = 1; break;
+    default: goto usage;
+    }
+  }
+  if (argc - optind != 2 || threads == 0) {
+  usage:
+    fprintf(stderr, "Usage: %s [-j threads] [-s] old_volume_file new_volume_file\n"
+            "  -j  number of groups and directories compared in parallel (default %d)\n"
+            "  -s  print a summary of the comparison to stderr\n",
+            argv[0], DEFAULT_THREADS);
+    return 2;
+  }
+
+  volume_t *old_volume = open_volume_file(argv[optind]);
+  if (!old_volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 2;
+  }
+  volume_t *new_volume = open_volume_file(argv[optind + 1]);
+  if (!new_volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind + 1]);
+    close_volume_file(old_volume);
+    return 2;
+  }
+
+  struct timespec start, end;
+  diff_summary_t summary;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int64_t found = diff_volumes(old_volume, new_volume, threads, add_change, NULL, &summary);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  close_volume_file(old_volume);
+  close_volume_file(new_volume);
+  if (found < 0 || out_of_memory) {
+    perror("Could not compare volumes");
+    return 2;
+  }
+
+  if (num_changes > 1)
+    qsort(changes, num_changes, sizeof(change_t), compare_changes);
+  for (size_t i = 0; i < num_changes; i++) {
+    print_change(&changes[i]);
+    free(changes[i].path);
+    free(changes[i].ranges);
+  }
+  free(changes);
+
+  if (show_summary)
+    fprintf(stderr, "Groups compared    : %" PRIu32 " (%" PRIu32 " changed)\n"
+            "Inode table blocks : %" PRIu64 " (%" PRIu64 " identical)\n"
+            "Inodes changed     : %" PRIu64 "\n"
+            "Directories listed : %" PRIu64 "\n"
+            "Files compared     : %" PRIu64 " (%.1f MiB read)\n"
+            "Added/removed/mod. : %" PRIu64 "/%" PRIu64 "/%" PRIu64 "\n"
+            "Time               : %.3f s\n",
+            summary.groups, summary.groups_changed, summary.table_blocks, summary.table_blocks_same,
+            summary.inodes_changed, summary.directories, summary.files_compared,
+            summary.bytes_compared / 1048576.0, summary.added, summary.removed, summary.modified,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  return found ? 1 : 0;
+}
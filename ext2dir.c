@@ -1,7 +1,6 @@
 #include "ext2.h"
 
 #include <string.h>
-#include <stdlib.h>
 #include <assert.h>
 
 /* next_directory_entry: Reads and returns one entry in a
@@ -32,35 +31,163 @@ int64_t next_directory_entry(volume_t *volume, inode_t *dir_inode,
 {
 
   /* TO BE COMPLETED BY THE STUDENT */
-  if (*offset > dir_inode->i_size)
-    return 0;
   if (!inode_is_directory(dir_inode))
     return -1;
-  ssize_t bytes = read_file_content(volume, dir_inode, *offset, sizeof(dir_entry_t), dir_entry);
-  *offset = *offset + dir_entry->de_rec_len;
-  dir_entry->de_name[dir_entry->de_name_len] = '\0';
-  if (*offset > dir_inode->i_size)
-    return 0;
 
-  while (dir_entry->de_inode_no == 0)
+  // Only the fixed-size header and the name itself are read, rather
+  // than a full dir_entry_t
+  while (*offset + DIR_ENTRY_HEADER_SIZE <= dir_inode->i_size)
   {
-    bytes = read_file_content(volume, dir_inode, *offset, sizeof(dir_entry_t), dir_entry);
-    *offset = *offset + dir_entry->de_rec_len;
-    dir_entry->de_name[dir_entry->de_name_len] = '\0';
-    if (*offset > dir_inode->i_size)
-      return 0;
-    else if (bytes < 0)
+    if (read_file_content(volume, dir_inode, *offset, DIR_ENTRY_HEADER_SIZE, dir_entry) != DIR_ENTRY_HEADER_SIZE)
+      return -1;
+    if (dir_entry->de_rec_len < DIR_ENTRY_HEADER_SIZE + dir_entry->de_name_len)
+      return -1;
+    if (dir_entry->de_inode_no != 0 &&
+        read_file_content(volume, dir_inode, *offset + DIR_ENTRY_HEADER_SIZE,
+                          dir_entry->de_name_len, dir_entry->de_name) != dir_entry->de_name_len)
       return -1;
+    *offset = *offset + dir_entry->de_rec_len;
+    if (dir_entry->de_inode_no != 0)
+    {
+      dir_entry->de_name[dir_entry->de_name_len] = '\0';
+      return dir_entry->de_inode_no;
+    }
   }
+  return 0;
+}
 
-  if (bytes < 0)
-  {
+/* open_directory_iterator: Prepares to list the entries of a
+   directory with next_directory_view. Unlike next_directory_entry,
+   each directory block is read only once, and entries are not
+   copied.
+
+   Parameters:
+     iterator: Iterator to initialize.
+     volume: Pointer to volume.
+     dir_inode: Pointer to inode structure for the directory. Must
+                remain valid while the iterator is used.
+     offset: Offset of the first entry to return; 0 for the start of
+             the directory, or a value previously stored in
+             iterator->offset.
+     block_buffer: Buffer of at least one block, owned by the caller,
+                   where directory blocks are read.
+ */
+void open_directory_iterator(dir_iterator_t *iterator, volume_t *volume, inode_t *dir_inode,
+                             uint64_t offset, void *block_buffer)
+{
+  iterator->volume = volume;
+  iterator->inode = dir_inode;
+  iterator->offset = offset;
+  iterator->block = block_buffer;
+  iterator->block_start = UINT64_MAX;
+}
+
+/* next_directory_view: Returns the next entry of a directory opened
+   with open_directory_iterator.
+
+   Parameters:
+     iterator: Directory iterator. Its offset field is updated to the
+               offset of the entry following the one returned.
+     view: Set to the entry found. Its name is not null-terminated,
+           and points into the iterator's block buffer, so it is only
+           valid until the next call.
+
+   Returns:
+     On success returns the inode number for the next entry. If the
+     inode is not a directory, or there is an error reading the
+     directory data (including malformed entries), returns -1. If
+     there are no more entries in the directory, returns 0 (zero).
+ */
+int64_t next_directory_view(dir_iterator_t *iterator, dir_entry_view_t *view)
+{
+  volume_t *volume = iterator->volume;
+  uint64_t size = iterator->inode->i_size;
+
+  if (!inode_is_directory(iterator->inode))
     return -1;
+
+  while (iterator->offset + DIR_ENTRY_HEADER_SIZE <= size)
+  {
+    uint64_t block_start = iterator->offset & ~(uint64_t) (volume->block_size - 1);
+    uint32_t in_block = iterator->offset - block_start;
+
+    if (block_start != iterator->block_start)
+    {
+      if (read_file_block(volume, iterator->inode, block_start, volume->block_size, iterator->block) <= 0)
+        return -1;
+      iterator->block_start = block_start;
+    }
+
+    dir_entry_t *entry = (dir_entry_t *) (iterator->block + in_block);
+    if (in_block + DIR_ENTRY_HEADER_SIZE > volume->block_size ||
+        entry->de_rec_len < DIR_ENTRY_HEADER_SIZE + entry->de_name_len ||
+        in_block + entry->de_rec_len > volume->block_size)
+      return -1;
+
+    iterator->offset += entry->de_rec_len;
+    if (entry->de_inode_no != 0)
+    {
+      view->inode_no = entry->de_inode_no;
+      view->file_type = entry->de_file_type;
+      view->name_len = entry->de_name_len;
+      view->name = entry->de_name;
+      return view->inode_no;
+    }
   }
-  else
+  return 0;
+}
+
+/* dir_entry_type_mode: Converts the file type stored in a directory
+   entry into the corresponding S_IF* bits of a file mode, so that the
+   type of a file is known without reading its inode.
+
+   Parameters:
+     file_type: de_file_type or file_type field of a directory entry.
+
+   Returns:
+     The type bits, or 0 if the type is not recorded in the entry
+     (always the case in revision 0 volumes).
+ */
+mode_t dir_entry_type_mode(uint8_t file_type)
+{
+  static const mode_t modes[] = { 0, S_IFREG, S_IFDIR, S_IFCHR, S_IFBLK, S_IFIFO, S_IFSOCK, S_IFLNK };
+  return file_type < sizeof(modes) / sizeof(modes[0]) ? modes[file_type] : 0;
+}
+
+/* find_name_in_directory: Same as find_file_in_directory, with the
+   name given as a pointer and length, and without saving the
+   directory entry. Does not allocate memory other than scratch
+   memory from the thread arena.
+ */
+static int64_t find_name_in_directory(volume_t *volume, inode_t *inode, const char *name, size_t len,
+                                      dir_entry_t *buffer)
+{
+  dir_iterator_t iterator;
+  dir_entry_view_t view;
+  int64_t inode_no;
+
+  if (inode_is_directory(inode) == 0) return -1;
+
+  arena_mark_t mark = arena_mark();
+  void *block = arena_alloc(volume->block_size);
+  if (block == NULL)
+    return -1;
+
+  open_directory_iterator(&iterator, volume, inode, 0, block);
+  while ((inode_no = next_directory_view(&iterator, &view)) > 0)
   {
-    return dir_entry->de_inode_no;
+    if (view.name_len == len && memcmp(view.name, name, len) == 0)
+    {
+      if (buffer != NULL)
+      {
+        memcpy(buffer, view.name - DIR_ENTRY_HEADER_SIZE, DIR_ENTRY_HEADER_SIZE + len);
+        buffer->de_name[len] = '\0';
+      }
+      break;
+    }
   }
+  arena_release(mark);
+  return inode_no;
 }
 
 /* find_file_in_directory: Searches for a file in a directory.
@@ -86,26 +213,7 @@ int64_t find_file_in_directory(volume_t *volume, inode_t *inode, const char *nam
 {
 
   /* TO BE COMPLETED BY THE STUDENT */
-  off_t offset = 0;
-  int64_t inode_no;
-  if (inode_is_directory(inode) == 0) return -1;
-  dir_entry_t *de = malloc(sizeof(dir_entry_t));
-
-
-  while ((inode_no = next_directory_entry(volume, inode, &offset, de)) > 0)
-  {
-    if (strcmp(name, de->de_name) == 0)
-    {
-      if (buffer != NULL)
-      {
-        memcpy(buffer, de, sizeof(dir_entry_t));
-      }
-      inode_no = de->de_inode_no;
-      free(de);
-      return inode_no;
-    }
-  }
-  return 0;
+  return find_name_in_directory(volume, inode, name, strlen(name), buffer);
 }
 
 /* find_file_from_path: Searches for a file based on its full path.
@@ -131,31 +239,28 @@ uint32_t find_file_from_path(volume_t *volume, const char *path, inode_t *dest_i
 {
 
   /* TO BE COMPLETED BY THE STUDENT */
-  dir_entry_t entry;
   inode_t inode;
-  int64_t inode_no;
-  char *p = strdup(path);
-  char *fun;
+  int64_t inode_no = EXT2_ROOT_INO;
 
   if (read_inode(volume, EXT2_ROOT_INO, &inode) < 0)
   {
     return 0;
   }
 
-  fun = strtok(p, "/");
-
-  while (fun != NULL)
+  // Components are matched in place, without copying the path
+  while (*path != '\0')
   {
-    while ((inode_no = find_file_in_directory(volume, &inode, fun, &entry)) > 0)
-    {
-      if (strcmp(entry.de_name, fun) == 0)
-      {
-        // strcat
-        break;
-      }
-    }
+    path += strspn(path, "/");
+    size_t len = strcspn(path, "/");
+    if (len == 0)
+      break;
+    inode_no = find_name_in_directory(volume, &inode, path, len, NULL);
+    if (inode_no <= 0 || read_inode(volume, inode_no, &inode) < 0)
+      return 0;
+    path += len;
   }
 
-  // find_file_in_directory(volume, dest_inode, path, &entry);
-  return entry.de_inode_no;
+  if (dest_inode != NULL)
+    *dest_inode = inode;
+  return inode_no;
 }
@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+/* Direct I/O backend. The volume file is opened with O_DIRECT, so data
+   read from it is not kept in the kernel page cache as well as in the
+   block cache. O_DIRECT requires the file offset, the size and the
+   memory address of every read to be aligned (to the logical block
+   size of the device), so reads that are not are done through a fixed
+   pool of aligned buffers and copied out. The pool is allocated when
+   the volume is opened, and readers wait for a free buffer instead of
+   allocating more, so memory usage does not depend on the load.
+
+   Without the page cache there is no kernel readahead either, so a
+   read that continues where the previous one ended fills a whole pool
+   buffer, and later reads are served from the buffers while they hold
+   the data. This is the only data held outside the block cache.
+ */
+
+#define DIRECT_POOL_BUFFERS 8
+#define DIRECT_BUFFER_SIZE  (128 << 10)
+#define DIRECT_MIN_ALIGN    4096 // Used if the alignment cannot be queried
+
+typedef struct direct_buffer {
+  char *data;
+  uint64_t start;  // File offset of the data held
+  uint32_t length; // Bytes of valid data (0 if none)
+} direct_buffer_t;
+
+typedef struct direct_backend {
+  volume_backend_t backend;
+  int fd;
+  uint32_t offset_align; // Alignment of file offsets and sizes
+  uint32_t mem_align;    // Alignment of buffer addresses
+
+  pthread_mutex_t lock;
+  pthread_cond_t buffer_freed;
+  char *pool;            // DIRECT_POOL_BUFFERS buffers, one after another
+  direct_buffer_t buffers[DIRECT_POOL_BUFFERS];
+  // Buffers not in use, least recently used first
+  direct_buffer_t *free_buffers[DIRECT_POOL_BUFFERS];
+  unsigned int num_free;
+  uint64_t next_offset;  // End of the last read, to detect sequential reads
+} direct_backend_t;
+
+/* take_buffer: Takes a buffer from the pool, waiting until one is
+   free. Returns a buffer holding 'offset' if there is one, or else
+   the least recently used one.
+ */
+static direct_buffer_t *take_buffer(direct_backend_t *direct, uint64_t offset) {
+
+  pthread_mutex_lock(&direct->lock);
+  while (direct->num_free == 0)
+    pthread_cond_wait(&direct->buffer_freed, &direct->lock);
+  unsigned int i = direct->num_free - 1;
+  while (i > 0 && !(direct->free_buffers[i]->start <= offset &&
+                    offset < direct->free_buffers[i]->start + direct->free_buffers[i]->length))
+    i--;
+  direct_buffer_t *buffer = direct->free_buffers[i];
+  memmove(&direct->free_buffers[i], &direct->free_buffers[i + 1],
+          (direct->num_free - i - 1) * sizeof(direct_buffer_t *));
+  direct->num_free--;
+  pthread_mutex_unlock(&direct->lock);
+  return buffer;
+}
+
+static void return_buffer(direct_backend_t *direct, direct_buffer_t *buffer) {
+  pthread_mutex_lock(&direct->lock);
+  direct->free_buffers[direct->num_free++] = buffer;
+  pthread_cond_signal(&direct->buffer_freed);
+  pthread_mutex_unlock(&direct->lock);
+}
+
+/* direct_pread: Reads data with O_DIRECT. Aligned requests are read
+   straight into the caller's buffer; others are served from, or read
+   into, pool buffers (see above).
+ */
+static ssize_t direct_pread(volume_backend_t *backend, void *buffer, size_t size, uint64_t offset) {
+
+  direct_backend_t *direct = (direct_backend_t *) backend;
+  uint64_t mask = direct->offset_align - 1;
+  uint64_t file_end = (direct->backend.size + mask) & ~mask;
+  size_t done = 0;
+
+  if (((uintptr_t) buffer & (direct->mem_align - 1)) == 0 && (offset & mask) == 0 && (size & mask) == 0)
+    return pread(direct->fd, buffer, size, offset);
+
+  int sequential = offset == direct->next_offset;
+  direct->next_offset = offset + size; // Only a hint: races are harmless
+  while (done < size) {
+    uint64_t pos = offset + done;
+    direct_buffer_t *bounce = take_buffer(direct, pos);
+
+    if (!(bounce->start <= pos && pos < bounce->start + bounce->length)) {
+      uint64_t start = pos & ~mask;
+      uint64_t end = sequential ? file_end : (offset + size + mask) & ~mask;
+      size_t span = end - start < DIRECT_BUFFER_SIZE ? end - start : DIRECT_BUFFER_SIZE;
+      ssize_t bytes = pread(direct->fd, bounce->data, span, start);
+      bounce->start = start;
+      bounce->length = bytes > 0 ? bytes : 0;
+      if (bytes < 0) {
+        return_buffer(direct, bounce);
+        return done ? (ssize_t) done : -1;
+      }
+      if ((uint64_t) bytes <= pos - start) {
+        return_buffer(direct, bounce);
+        break; // End of file
+      }
+    }
+
+    size_t chunk = bounce->length - (pos - bounce->start);
+    if (chunk > size - done)
+      chunk = size - done;
+    memcpy((char *) buffer + done, bounce->data + (pos - bounce->start), chunk);
+    done += chunk;
+    return_buffer(direct, bounce);
+    if (pos + chunk == bounce->start + bounce->length && bounce->length & mask)
+      break; // Short read at the end of the file
+  }
+  return done;
+}
+
+static void direct_close(volume_backend_t *backend) {
+  direct_backend_t *direct = (direct_backend_t *) backend;
+  close(direct->fd);
+  pthread_mutex_destroy(&direct->lock);
+  pthread_cond_destroy(&direct->buffer_freed);
+  free(direct->pool);
+  free(direct);
+}
+
+/* get_direct_alignment: Finds the alignment O_DIRECT requires for a
+   file: the logical block size of a block device, or what the file
+   system reports for a regular file.
+
+   Returns 0 on success, or -1 (EINVAL) if the file does not support
+   direct I/O.
+ */
+static int get_direct_alignment(int fd, uint32_t *offset_align, uint32_t *mem_align) {
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return -1;
+
+  *offset_align = *mem_align = DIRECT_MIN_ALIGN;
+  if (S_ISBLK(st.st_mode)) {
+    int sector_size;
+    if (ioctl(fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0)
+      *offset_align = *mem_align = sector_size;
+    return 0;
+  }
+#ifdef STATX_DIOALIGN
+  struct statx stx;
+  if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN)) {
+    if (stx.stx_dio_offset_align == 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    *offset_align = stx.stx_dio_offset_align;
+    *mem_align = stx.stx_dio_mem_align;
+  }
+#endif
+  return 0;
+}
+
+/* open_direct_backend: Creates a storage backend reading a volume file
+   with direct I/O. A block cache should be attached to volumes using
+   it, since nothing else caches their data.
+
+   Parameters:
+     fd: File descriptor of the volume file, opened with O_DIRECT. It
+         is closed along with the backend.
+
+   Returns:
+     A pointer to the new backend, or NULL with errno set in case of
+     error (EINVAL if the file does not support direct I/O).
+ */
+volume_backend_t *open_direct_backend(int fd) {
+
+  struct stat st;
+  direct_backend_t *direct = calloc(1, sizeof(direct_backend_t));
+  if (!direct)
+    return NULL;
+  if (fstat(fd, &st) == -1 || get_direct_alignment(fd, &direct->offset_align, &direct->mem_align) < 0) {
+    free(direct);
+    return NULL;
+  }
+  if ((direct->offset_align & (direct->offset_align - 1)) || direct->offset_align > DIRECT_BUFFER_SIZE) {
+    free(direct);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  size_t align = direct->mem_align > DIRECT_MIN_ALIGN ? direct->mem_align : DIRECT_MIN_ALIGN;
+  if (posix_memalign((void **) &direct->pool, align, DIRECT_POOL_BUFFERS * DIRECT_BUFFER_SIZE)) {
+    free(direct);
+    errno = ENOMEM;
+    return NULL;
+  }
+  for (unsigned int i = 0; i < DIRECT_POOL_BUFFERS; i++) {
+    direct->buffers[i].data = direct->pool + i * DIRECT_BUFFER_SIZE;
+    direct->free_buffers[i] = &direct->buffers[i];
+  }
+  direct->num_free = DIRECT_POOL_BUFFERS;
+  pthread_mutex_init(&direct->lock, NULL);
+  pthread_cond_init(&direct->buffer_freed, NULL);
+
+  direct->fd = fd;
+  direct->backend.pread = direct_pread;
+  direct->backend.close = direct_close;
+  direct->backend.size = st.st_size;
+  if (S_ISBLK(st.st_mode)) {
+    uint64_t device_size;
+    if (ioctl(fd, BLKGETSIZE64, &device_size) == 0)
+      direct->backend.size = device_size;
+  }
+  return &direct->backend;
+}
@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Accumulates consecutive blocks of a file into extents while its
+   block map is walked.
+ */
+typedef struct extent_builder {
+  file_extent_t *extents;
+  size_t max_extents;
+  size_t count;
+  file_extent_t current; // Extent being built (length 0 if none)
+  uint32_t *tables;      // One block of entries per level of indirection
+} extent_builder_t;
+
+/* extent_add: Appends 'length' blocks starting at logical block
+   'logical' and disk block 'physical' (0 for a hole). Returns 1 once
+   the output array is full, 0 otherwise.
+ */
+static int extent_add(extent_builder_t *b, uint64_t logical, uint32_t physical, uint64_t length) {
+
+  file_extent_t *cur = &b->current;
+  if (cur->length > 0 && cur->logical + cur->length == logical &&
+      (physical == 0 ? cur->physical == 0 :
+       cur->physical != 0 && cur->physical + cur->length == physical)) {
+    cur->length += length;
+    return 0;
+  }
+  if (cur->length > 0) {
+    if (b->count == b->max_extents)
+      return 1;
+    b->extents[b->count++] = *cur;
+  }
+  cur->logical = logical;
+  cur->physical = physical;
+  cur->length = length;
+  return 0;
+}
+
+/* walk_block_table: Adds the blocks in [start, end) mapped by a table
+   of block numbers, where entry i covers 'span' blocks starting at
+   logical block base + i * span. With depth 0, each entry is a data
+   block; otherwise it is a table of the next level. Tables that are
+   not allocated are added as holes without being read.
+
+   Returns 1 if the output is full, 0 if all blocks were added, or -1
+   in case of error.
+ */
+static int walk_block_table(volume_t *volume, extent_builder_t *b, uint32_t *table, uint32_t entries,
+                            int depth, uint64_t span, uint64_t base, uint64_t start, uint64_t end) {
+
+  uint32_t per_block = volume->block_size / 4;
+  uint32_t first = start > base ? (start - base) / span : 0;
+
+  for (uint32_t i = first; i < entries && base + i * span < end; i++) {
+    uint64_t entry_start = base + i * span;
+    uint64_t from = entry_start > start ? entry_start : start;
+    uint64_t to = entry_start + span < end ? entry_start + span : end;
+    int rv;
+
+    if (depth == 0 || table[i] == 0) {
+      rv = extent_add(b, from, table[i] ? table[i] + (from - entry_start) : 0, to - from);
+    } else {
+      uint32_t *child = b->tables + (depth - 1) * per_block;
+      if (read_block(volume, table[i], 0, volume->block_size, child) != volume->block_size)
+        return -1;
+      rv = walk_block_table(volume, b, child, per_block, depth - 1, span / per_block,
+                            entry_start, from, to);
+    }
+    if (rv != 0)
+      return rv;
+  }
+  return 0;
+}
+
+/* get_file_extents: Lists the data and hole extents of a file, as
+   described by its block map. Consecutive blocks stored contiguously
+   on disk are reported as a single extent, and so are consecutive
+   holes. Unallocated indirect blocks are skipped without reading
+   them.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode: Pointer to inode structure for the file.
+     first_block: Index of the first block of the file to report.
+     extents: Array where extents are stored, in increasing logical
+              order. Holes have a physical block number of 0.
+     max_extents: Number of elements in the array.
+
+   Returns:
+     The number of extents stored. If it is equal to max_extents,
+     there may be more extents, which can be obtained by calling this
+     function again with first_block set to the end of the last
+     extent. Returns -1 in case of error.
+ */
+int64_t get_file_extents(volume_t *volume, inode_t *inode, uint64_t first_block,
+                         file_extent_t *extents, size_t max_extents) {
+
+  uint64_t per_block = volume->block_size / 4;
+  uint64_t end = (inode_file_size(volume, inode) + volume->block_size - 1) / volume->block_size;
+  extent_builder_t b = { .extents = extents, .max_extents = max_extents };
+  int rv = 0;
+
+  if (max_extents == 0 || first_block >= end)
+    return 0;
+  if (inode_is_symlink(inode) && inode->i_size < sizeof(inode->i_symlink_target))
+    return 0; // Target is stored in the inode itself
+
+  b.tables = malloc(3 * volume->block_size);
+  if (!b.tables)
+    return -1;
+
+  // Direct blocks, followed by the 1-, 2- and 3-indirect trees
+  uint32_t roots[3] = { inode->i_block_1ind, inode->i_block_2ind, inode->i_block_3ind };
+  uint64_t base = 12, span = 1;
+  rv = walk_block_table(volume, &b, inode->i_block, 12, 0, 1, 0, first_block, end);
+  for (int depth = 1; depth <= 3 && rv == 0 && base < end; depth++) {
+    span *= per_block;
+    rv = walk_block_table(volume, &b, &roots[depth - 1], 1, depth, span, base, first_block, end);
+    base += span;
+  }
+  free(b.tables);
+
+  if (rv < 0)
+    return -1;
+  if (rv == 0 && b.current.length > 0 && b.count < max_extents)
+    extents[b.count++] = b.current;
+  return b.count;
+}
+
+/* file_seek_data: Finds the next data or hole region of a file, with
+   the same semantics as lseek with SEEK_DATA or SEEK_HOLE. The end of
+   the file counts as a hole.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode: Pointer to inode structure for the file.
+     offset: Offset, in bytes, where the search starts.
+     whence: SEEK_DATA or SEEK_HOLE.
+
+   Returns:
+     The offset of the first byte at or after 'offset' that is in a
+     region of the requested kind. Returns -1 and sets errno to ENXIO
+     if 'offset' is at or past the end of the file, or if there is no
+     data after 'offset'; sets errno to EINVAL or EIO in case of error.
+ */
+int64_t file_seek_data(volume_t *volume, inode_t *inode, uint64_t offset, int whence) {
+
+  file_extent_t extents[64];
+  uint64_t size = inode_file_size(volume, inode);
+  uint64_t block = offset / volume->block_size;
+  int64_t count, i;
+
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (offset >= size) {
+    errno = ENXIO;
+    return -1;
+  }
+
+  while ((count = get_file_extents(volume, inode, block, extents, 64)) > 0) {
+    for (i = 0; i < count; i++) {
+      if ((extents[i].physical != 0) == (whence == SEEK_DATA)) {
+        uint64_t found = extents[i].logical * volume->block_size;
+        found = found > offset ? found : offset;
+        if (found < size)
+          return found;
+        break;
+      }
+    }
+    if (i < count)
+      break;
+    block = extents[count - 1].logical + extents[count - 1].length;
+  }
+  if (count < 0) {
+    errno = EIO;
+    return -1;
+  }
+
+  if (whence == SEEK_HOLE)
+    return size;
+  errno = ENXIO;
+  return -1;
+}
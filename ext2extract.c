@@ -0,0 +1,614 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "ext2.h"
+
+/* ext2extract: Copies the whole content of a volume into a host
+   directory, or writes it to stdout as a tar stream.
+
+   Directories are walked by a pool of threads. File data is copied
+   one extent at a time: holes are skipped (leaving them sparse in the
+   output), and contiguous runs are copied with copy_file_range from
+   the volume file when possible, so data does not go through user
+   space at all.
+ */
+
+#define DEFAULT_THREADS  8
+#define COPY_BUFFER_SIZE (1 << 20)
+#define METADATA_CACHE   (32 << 20)
+// Files larger than this are queued as separate jobs rather than
+// being copied by the thread that found them
+#define LARGE_FILE_SIZE  (4 << 20)
+
+typedef struct job {
+  uint32_t inode_no;
+  char *path;
+  struct job *next;
+} job_t;
+
+typedef struct dir_fixup {
+  inode_t inode;
+  char *path;
+} dir_fixup_t;
+
+static volume_t *volume;
+static int is_root;
+static int errors;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static job_t *jobs;
+static unsigned int busy_threads;
+
+// Directories whose metadata is restored once their content is written
+static dir_fixup_t *fixups;
+static size_t num_fixups, max_fixups;
+
+// First path extracted for every inode with more than one link, and
+// whether the file has been created there yet
+#define LINK_PENDING 0
+#define LINK_CREATED 1
+#define LINK_FAILED  2
+
+static struct hard_link { uint32_t inode_no; int state; char *path; } *links;
+static size_t num_links, max_links;
+static pthread_cond_t link_done = PTHREAD_COND_INITIALIZER; // A link left LINK_PENDING
+
+static void report(const char *path, const char *what) {
+  fprintf(stderr, "%s: %s: %s\n", path, what, strerror(errno));
+  pthread_mutex_lock(&lock);
+  errors++;
+  pthread_mutex_unlock(&lock);
+}
+
+static uid_t inode_uid(inode_t *inode) {
+  return inode->i_uid | ((uint32_t) inode->l_i_uid_high << 16);
+}
+
+static gid_t inode_gid(inode_t *inode) {
+  return inode->i_gid | ((uint32_t) inode->l_i_gid_high << 16);
+}
+
+static dev_t inode_device(inode_t *inode) {
+  // Old encoding in the first block slot, new encoding in the second
+  if (inode->i_block[0])
+    return makedev((inode->i_block[0] >> 8) & 0xff, inode->i_block[0] & 0xff);
+  return makedev((inode->i_block[1] & 0xfff00) >> 8,
+                 (inode->i_block[1] & 0xff) | ((inode->i_block[1] >> 12) & 0xfff00));
+}
+
+static void push_job(uint32_t inode_no, const char *path) {
+  job_t *job = malloc(sizeof(job_t));
+  job->inode_no = inode_no;
+  job->path = strdup(path);
+  pthread_mutex_lock(&lock);
+  job->next = jobs;
+  jobs = job;
+  pthread_cond_signal(&work);
+  pthread_mutex_unlock(&lock);
+}
+
+/* find_hard_link: Looks up the path a multiply-linked inode was first
+   extracted to. The first time an inode is seen, 'path' is recorded,
+   and the caller must create the file and then call finish_hard_link.
+   Later callers wait until it has done so, so that they never link to
+   a file that does not exist yet.
+
+   Returns 1 with the first path in 'target' if that file exists, 0 if
+   'path' was recorded, or -1 if the first file could not be created
+   (ENOENT) or 'path' could not be recorded (ENOMEM).
+ */
+static int find_hard_link(uint32_t inode_no, const char *path, const char **target) {
+
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; i < num_links; i++) {
+    if (links[i].inode_no != inode_no)
+      continue;
+    while (links[i].state == LINK_PENDING)
+      pthread_cond_wait(&link_done, &lock);
+    int found = links[i].state == LINK_CREATED;
+    *target = links[i].path;
+    pthread_mutex_unlock(&lock);
+    if (!found)
+      errno = ENOENT;
+    return found ? 1 : -1;
+  }
+
+  char *copy = strdup(path);
+  if (copy && num_links == max_links) {
+    size_t new_max = max_links ? 2 * max_links : 64;
+    struct hard_link *grown = realloc(links, new_max * sizeof(*links));
+    if (grown) {
+      links = grown;
+      max_links = new_max;
+    }
+  }
+  if (!copy || num_links == max_links) {
+    pthread_mutex_unlock(&lock);
+    free(copy);
+    errno = ENOMEM;
+    return -1;
+  }
+  links[num_links++] = (struct hard_link) { inode_no, LINK_PENDING, copy };
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+/* finish_hard_link: Records whether the first file of a multiply-linked
+   inode was created, and wakes up the threads waiting to link to it.
+ */
+static void finish_hard_link(uint32_t inode_no, int created) {
+
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; i < num_links; i++) {
+    if (links[i].inode_no == inode_no) {
+      links[i].state = created ? LINK_CREATED : LINK_FAILED;
+      break;
+    }
+  }
+  pthread_cond_broadcast(&link_done);
+  pthread_mutex_unlock(&lock);
+}
+
+/* copy_range: Copies 'size' bytes at offset 'src' of the volume to
+   offset 'dst' of the output file.
+ */
+static int copy_range(int out_fd, uint64_t src, uint64_t dst, uint64_t size, char *buffer) {
+
+  if (volume->fd >= 0) {
+    loff_t in_off = src, out_off = dst;
+    while (size > 0) {
+      ssize_t rv = copy_file_range(volume->fd, &in_off, out_fd, &out_off, size, 0);
+      if (rv <= 0)
+        break;
+      size -= rv;
+    }
+    src = in_off;
+    dst = out_off;
+  }
+
+  // Backends other than plain files, or file systems without
+  // copy_file_range support, go through a buffer
+  while (size > 0) {
+    size_t chunk = size < COPY_BUFFER_SIZE ? size : COPY_BUFFER_SIZE;
+    ssize_t rv = volume_pread(volume, buffer, chunk, src);
+    if (rv <= 0 || pwrite(out_fd, buffer, rv, dst) != rv)
+      return -1;
+    src += rv;
+    dst += rv;
+    size -= rv;
+  }
+  return 0;
+}
+
+static int copy_file_data(inode_t *inode, int out_fd, char *buffer) {
+
+  uint64_t size = inode_file_size(volume, inode);
+  file_extent_t extents[64];
+  uint64_t block = 0;
+  int64_t count;
+
+  if (ftruncate(out_fd, size) == -1)
+    return -1;
+
+  while ((count = get_file_extents(volume, inode, block, extents, 64)) > 0) {
+    for (int64_t i = 0; i < count; i++) {
+      if (!extents[i].physical)
+        continue;
+      uint64_t offset = extents[i].logical * volume->block_size;
+      uint64_t length = extents[i].length * volume->block_size;
+      if (length > size - offset)
+        length = size - offset;
+      if (copy_range(out_fd, (uint64_t) extents[i].physical * volume->block_size,
+                     offset, length, buffer) < 0)
+        return -1;
+    }
+    block = extents[count - 1].logical + extents[count - 1].length;
+  }
+  return count < 0 ? -1 : 0;
+}
+
+static void restore_metadata(const char *path, inode_t *inode, int follow) {
+
+  struct timespec times[2] = { { inode->i_atime, 0 }, { inode->i_mtime, 0 } };
+  int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+
+  if (is_root && fchownat(AT_FDCWD, path, inode_uid(inode), inode_gid(inode), flags) == -1)
+    report(path, "chown");
+  if (follow && chmod(path, inode->i_mode & 07777) == -1)
+    report(path, "chmod");
+  if (utimensat(AT_FDCWD, path, times, flags) == -1)
+    report(path, "utimensat");
+}
+
+/* extract_file: Creates the regular file, symbolic link or special
+   file at 'path' from an inode.
+
+   Returns 0 if it was created (even if its content or metadata could
+   not all be copied), or -1 otherwise.
+ */
+static int extract_file(inode_t *inode, const char *path, char *buffer) {
+
+  if (inode_is_symlink(inode)) {
+    if (!read_symlink_target(volume, inode, buffer, PATH_MAX)) {
+      errno = EIO;
+      report(path, "readlink");
+      return -1;
+    }
+    if (symlink(buffer, path) == -1) {
+      report(path, "symlink");
+      return -1;
+    }
+    restore_metadata(path, inode, 0);
+    return 0;
+  }
+
+  if (!inode_is_regular_file(inode)) {
+    if (mknod(path, inode->i_mode, inode_device(inode)) == -1) {
+      report(path, "mknod");
+      return -1;
+    }
+    restore_metadata(path, inode, 1);
+    return 0;
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    report(path, "open");
+    return -1;
+  }
+  if (copy_file_data(inode, fd, buffer) < 0)
+    report(path, "copy");
+  close(fd);
+  restore_metadata(path, inode, 1);
+  return 0;
+}
+
+/* extract_entry: Creates the file, symbolic link or special file at
+   'path' from an inode. Directories are created and queued.
+ */
+static void extract_entry(uint32_t inode_no, inode_t *inode, const char *path, char *buffer) {
+
+  if (inode_is_directory(inode)) {
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+      report(path, "mkdir");
+      return;
+    }
+    pthread_mutex_lock(&lock);
+    if (num_fixups == max_fixups) {
+      max_fixups = max_fixups ? 2 * max_fixups : 256;
+      fixups = realloc(fixups, max_fixups * sizeof(dir_fixup_t));
+    }
+    fixups[num_fixups].inode = *inode;
+    fixups[num_fixups].path = strdup(path);
+    num_fixups++;
+    pthread_mutex_unlock(&lock);
+    push_job(inode_no, path);
+    return;
+  }
+
+  if (inode->i_links_count > 1) {
+    const char *target;
+    int rv = find_hard_link(inode_no, path, &target);
+    if (rv != 0) {
+      if (rv < 0 || link(target, path) == -1)
+        report(path, "link");
+      return;
+    }
+    finish_hard_link(inode_no, extract_file(inode, path, buffer) == 0);
+  } else {
+    extract_file(inode, path, buffer);
+  }
+}
+
+static void extract_directory(uint32_t inode_no, const char *path, char *buffer) {
+
+  inode_t dir_inode, inode;
+  dir_entry_t entry;
+  off_t offset = 0;
+  int64_t child_no;
+  char child_path[PATH_MAX];
+
+  if (read_inode(volume, inode_no, &dir_inode) < 0) {
+    errno = EIO;
+    report(path, "read inode");
+    return;
+  }
+
+  while ((child_no = next_directory_entry(volume, &dir_inode, &offset, &entry)) > 0) {
+    if (!strcmp(entry.de_name, ".") || !strcmp(entry.de_name, ".."))
+      continue;
+    if (snprintf(child_path, PATH_MAX, "%s/%s", path, entry.de_name) >= PATH_MAX) {
+      errno = ENAMETOOLONG;
+      report(path, entry.de_name);
+      continue;
+    }
+    if (read_inode(volume, child_no, &inode) < 0) {
+      errno = EIO;
+      report(child_path, "read inode");
+      continue;
+    }
+    if (inode_is_regular_file(&inode) && inode_file_size(volume, &inode) > LARGE_FILE_SIZE &&
+        inode.i_links_count == 1)
+      push_job(child_no, child_path);
+    else
+      extract_entry(child_no, &inode, child_path, buffer);
+  }
+  if (child_no < 0) {
+    errno = EIO;
+    report(path, "read directory");
+  }
+}
+
+static void *extract_thread(void *arg) {
+
+  char *buffer = malloc(COPY_BUFFER_SIZE);
+
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!jobs && busy_threads > 0)
+      pthread_cond_wait(&work, &lock);
+    if (!jobs)
+      break;
+    job_t *job = jobs;
+    jobs = job->next;
+    busy_threads++;
+    pthread_mutex_unlock(&lock);
+
+    inode_t inode;
+    if (read_inode(volume, job->inode_no, &inode) < 0) {
+      errno = EIO;
+      report(job->path, "read inode");
+    } else if (inode_is_directory(&inode)) {
+      extract_directory(job->inode_no, job->path, buffer);
+    } else {
+      extract_entry(job->inode_no, &inode, job->path, buffer);
+    }
+    free(job->path);
+    free(job);
+
+    pthread_mutex_lock(&lock);
+    busy_threads--;
+    if (busy_threads == 0 && !jobs)
+      pthread_cond_broadcast(&work);
+  }
+  pthread_mutex_unlock(&lock);
+  free(buffer);
+  return NULL;
+}
+
+static int compare_depth(const void *a, const void *b) {
+  return (int) strlen(((const dir_fixup_t *) b)->path) - (int) strlen(((const dir_fixup_t *) a)->path);
+}
+
+/* Tar output: POSIX ustar headers, with GNU long name records for
+   paths that do not fit in the header. Holes are written as zeros.
+ */
+
+static int tar_write(const void *data, size_t size) {
+  while (size > 0) {
+    ssize_t rv = write(STDOUT_FILENO, data, size);
+    if (rv <= 0)
+      return -1;
+    data = (const char *) data + rv;
+    size -= rv;
+  }
+  return 0;
+}
+
+static int tar_padding(uint64_t size) {
+  static const char zeros[512];
+  return size % 512 ? tar_write(zeros, 512 - size % 512) : 0;
+}
+
+static int tar_header(const char *name, char type, inode_t *inode, uint64_t size, const char *link) {
+
+  char header[512];
+
+  if (strlen(name) > 100 && type != 'L') {
+    if (tar_header("././@LongLink", 'L', inode, strlen(name) + 1, NULL) < 0 ||
+        tar_write(name, strlen(name) + 1) < 0 || tar_padding(strlen(name) + 1) < 0)
+      return -1;
+  }
+  if (link && strlen(link) > 100) {
+    if (tar_header("././@LongLink", 'K', inode, strlen(link) + 1, NULL) < 0 ||
+        tar_write(link, strlen(link) + 1) < 0 || tar_padding(strlen(link) + 1) < 0)
+      return -1;
+  }
+
+  memset(header, 0, sizeof(header));
+  strncpy(header, name, 100);
+  snprintf(header + 100, 8, "%07o", inode->i_mode & 07777);
+  snprintf(header + 108, 8, "%07o", inode_uid(inode) & 07777777);
+  snprintf(header + 116, 8, "%07o", inode_gid(inode) & 07777777);
+  snprintf(header + 124, 12, "%011llo", (unsigned long long) size);
+  snprintf(header + 136, 12, "%011o", inode->i_mtime);
+  memset(header + 148, ' ', 8);
+  header[156] = type;
+  if (link)
+    strncpy(header + 157, link, 100);
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+  if (type == '3' || type == '4') {
+    snprintf(header + 329, 8, "%07o", major(inode_device(inode)));
+    snprintf(header + 337, 8, "%07o", minor(inode_device(inode)));
+  }
+
+  unsigned int checksum = 0;
+  for (int i = 0; i < 512; i++)
+    checksum += (unsigned char) header[i];
+  snprintf(header + 148, 8, "%06o", checksum);
+  header[155] = ' ';
+  return tar_write(header, 512);
+}
+
+static int tar_file_data(inode_t *inode, char *buffer) {
+
+  uint64_t size = inode_file_size(volume, inode);
+  uint64_t written = 0;
+  file_extent_t extents[64];
+  uint64_t block = 0;
+  int64_t count;
+
+  while ((count = get_file_extents(volume, inode, block, extents, 64)) > 0) {
+    for (int64_t i = 0; i < count; i++) {
+      uint64_t offset = extents[i].logical * volume->block_size;
+      uint64_t length = extents[i].length * volume->block_size;
+      if (length > size - offset)
+        length = size - offset;
+      for (uint64_t done = 0; done < length; ) {
+        size_t chunk = length - done < COPY_BUFFER_SIZE ? length - done : COPY_BUFFER_SIZE;
+        if (!extents[i].physical)
+          memset(buffer, 0, chunk);
+        else if (volume_pread(volume, buffer, chunk,
+                              (uint64_t) extents[i].physical * volume->block_size + done) != chunk)
+          return -1;
+        if (tar_write(buffer, chunk) < 0)
+          return -1;
+        done += chunk;
+      }
+      written += length;
+    }
+    block = extents[count - 1].logical + extents[count - 1].length;
+  }
+  if (count < 0 || written != size)
+    return -1;
+  return tar_padding(size);
+}
+
+static int tar_directory(uint32_t dir_inode_no, const char *path, char *buffer) {
+
+  inode_t dir_inode, inode;
+  dir_entry_t entry;
+  off_t offset = 0;
+  int64_t child_no;
+  char child_path[PATH_MAX];
+
+  if (read_inode(volume, dir_inode_no, &dir_inode) < 0)
+    return -1;
+
+  while ((child_no = next_directory_entry(volume, &dir_inode, &offset, &entry)) > 0) {
+    if (!strcmp(entry.de_name, ".") || !strcmp(entry.de_name, ".."))
+      continue;
+    snprintf(child_path, PATH_MAX, "%s%s", path, entry.de_name);
+    if (read_inode(volume, child_no, &inode) < 0)
+      return -1;
+
+    // The archive is written by a single thread, in order: the first
+    // path of an inode is complete as soon as its entry is written
+    const char *target = NULL;
+    if (!inode_is_directory(&inode) && inode.i_links_count > 1) {
+      int found = find_hard_link(child_no, child_path, &target);
+      if (found < 0)
+        return -1;
+      if (found == 0) {
+        target = NULL;
+        finish_hard_link(child_no, 1);
+      }
+    }
+
+    int rv;
+    if (target) {
+      rv = tar_header(child_path, '1', &inode, 0, target);
+    } else if (inode_is_directory(&inode)) {
+      strcat(child_path, "/");
+      rv = tar_header(child_path, '5', &inode, 0, NULL);
+      if (rv == 0)
+        rv = tar_directory(child_no, child_path, buffer);
+    } else if (inode_is_symlink(&inode)) {
+      rv = read_symlink_target(volume, &inode, buffer, PATH_MAX) ?
+        tar_header(child_path, '2', &inode, 0, buffer) : -1;
+    } else if (inode_is_regular_file(&inode)) {
+      rv = tar_header(child_path, '0', &inode, inode_file_size(volume, &inode), NULL);
+      if (rv == 0)
+        rv = tar_file_data(&inode, buffer);
+    } else {
+      char type = S_ISCHR(inode.i_mode) ? '3' : S_ISBLK(inode.i_mode) ? '4' : S_ISFIFO(inode.i_mode) ? '6' : 0;
+      rv = type ? tar_header(child_path, type, &inode, 0, NULL) : 0;
+    }
+    if (rv < 0)
+      return -1;
+  }
+  return child_no < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int threads = DEFAULT_THREADS;
+  int tar = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:t")) != -1) {
+    switch (opt) {
+    case 'j': threads = strtoul(optarg, NULL, 10); break;
+    case 't': tar = 1; break;
+    default: goto usage;
+    }
+  }
+  if (argc - optind != (tar ? 1 : 2) || threads == 0) {
+  usage:
+    fprintf(stderr, "Usage: %s [-j threads] volume_file destination_directory\n"
+            "       %s -t volume_file > archive.tar\n", argv[0], argv[0]);
+    return 1;
+  }
+
+  volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 1;
+  }
+  // Directory and indirect blocks are cached; file data is not read
+  // through the cache
+  block_cache_t *cache = create_block_cache(METADATA_CACHE);
+  attach_block_cache(volume, cache);
+  is_root = geteuid() == 0;
+
+  if (tar) {
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    static const char end_of_archive[1024];
+    if (tar_directory(EXT2_ROOT_INO, "", buffer) < 0 || tar_write(end_of_archive, sizeof(end_of_archive)) < 0) {
+      fprintf(stderr, "Error writing archive: %s\n", strerror(errno ? errno : EIO));
+      errors++;
+    }
+    free(buffer);
+  } else {
+    const char *dest = argv[optind + 1];
+    inode_t root;
+    if (mkdir(dest, 0700) == -1 && errno != EEXIST) {
+      report(dest, "mkdir");
+      return 1;
+    }
+    if (read_inode(volume, EXT2_ROOT_INO, &root) < 0) {
+      fprintf(stderr, "Could not read root directory.\n");
+      return 1;
+    }
+
+    push_job(EXT2_ROOT_INO, dest);
+    run_workers(extract_thread, NULL, threads);
+
+    // Deepest directories first, so that setting a directory's times
+    // is not undone by changes to its subdirectories
+    qsort(fixups, num_fixups, sizeof(dir_fixup_t), compare_depth);
+    for (size_t i = 0; i < num_fixups; i++) {
+      restore_metadata(fixups[i].path, &fixups[i].inode, 1);
+      free(fixups[i].path);
+    }
+    restore_metadata(dest, &root, 1);
+    free(fixups);
+  }
+
+  for (size_t i = 0; i < num_links; i++)
+    free(links[i].path);
+  free(links);
+  close_volume_file(volume);
+  destroy_block_cache(cache);
+  return errors ? 1 : 0;
+}
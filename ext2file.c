@@ -24,15 +24,23 @@ ssize_t read_inode(volume_t *volume, uint32_t inode_no, inode_t *buffer)
   if (inode_no == 0 || inode_no > volume->super.s_inodes_count)
     return -1;
 
-  int inumber = inode_no - 1;
-  int group_no = inumber / volume->super.s_inodes_per_group;
-  int containing_block = volume->groups[group_no].bg_inode_table;
-
-  int inode_index = inumber % volume->super.s_inodes_per_group;
-
-  int offset = containing_block * volume->block_size + inode_index * sizeof(inode_t);
+  uint32_t inumber = inode_no - 1;
+  uint32_t group_no, inode_index;
+  if (volume->inode_group_shift >= 0)
+  {
+    group_no = inumber >> volume->inode_group_shift;
+    inode_index = inumber & (volume->super.s_inodes_per_group - 1);
+  }
+  else
+  {
+    group_no = inumber / volume->super.s_inodes_per_group;
+    inode_index = inumber % volume->super.s_inodes_per_group;
+  }
+  uint32_t containing_block = volume->groups[group_no].bg_inode_table;
 
-  return pread(volume->fd, buffer, sizeof(inode_t), offset);
+  // Going through read_block lets inode table blocks be served from
+  // the block cache, if one is attached to the volume.
+  return read_block(volume, containing_block, inode_index * volume->inode_size, sizeof(inode_t), buffer);
 }
 
 /* get_inode_block_no: Returns the block number containing the data
@@ -56,14 +64,17 @@ uint32_t get_inode_block_no(volume_t *volume, inode_t *inode, uint64_t block_idx
 
   /* TO BE COMPLETED BY THE STUDENT */
 
-  if (block_idx >= 0 && block_idx < 12)
+  if (block_idx < 12)
     return inode->i_block[block_idx];
 
-  int block_no_count = volume->block_size / 4;
+  // Each indirect block holds 2^addr_shift block numbers of 4 bytes,
+  // so the index at every level is a group of addr_shift bits
+  uint32_t addr_shift = volume->block_shift - 2;
+  uint64_t addr_mask = (1ULL << addr_shift) - 1;
 
   block_idx = block_idx - 12;
 
-  if (block_idx < block_no_count) // 1-indirect block
+  if (block_idx >> addr_shift == 0) // 1-indirect block
   {
     uint32_t block_no = 0;
     ssize_t b = read_block(volume, inode->i_block_1ind, block_idx * 4, 4, &block_no);
@@ -71,73 +82,50 @@ uint32_t get_inode_block_no(volume_t *volume, inode_t *inode, uint64_t block_idx
       return EXT2_INVALID_BLOCK_NUMBER;
     return block_no;
   }
-  else if (block_idx < (block_no_count * block_no_count + block_no_count)) // 2-indirect block
-  {
-    // inode->i_block_2ind stores start of 2-indirect table
-    // we need the index of this table - we get it by (block_idx - block_no_count) / block_no_count
-    block_idx = block_idx - block_no_count;
-    int first_index = block_idx / block_no_count;
 
-    // now we need to read block starting at inode->i_block_2ind with offset first_index
-    // this will return a block number, which is an index to a 1-indirect table
+  block_idx = block_idx - (1ULL << addr_shift);
 
+  if (block_idx >> (2 * addr_shift) == 0) // 2-indirect block
+  {
+    // The high bits select the 1-indirect table in inode->i_block_2ind,
+    // the low bits the entry within that table
     uint32_t second_index;
-    ssize_t b = read_block(volume, inode->i_block_2ind, first_index * 4, 4, &second_index);
+    ssize_t b = read_block(volume, inode->i_block_2ind, (block_idx >> addr_shift) * 4, 4, &second_index);
     if (b == -1)
       return EXT2_INVALID_BLOCK_NUMBER;
-    // now we have the index to the start of the 1-indirect table
-    // however, we still need the offset to this table
-    // we derive this offset by: (block_idx - block_no_count) % block_no_count
-    // then we call read_block and store its result in block_no
 
     uint32_t block_no = 0;
-    uint32_t offset = block_idx % block_no_count;
-    b = read_block(volume, second_index, offset * 4, 4, &block_no);
+    b = read_block(volume, second_index, (block_idx & addr_mask) * 4, 4, &block_no);
     if (b == -1)
       return EXT2_INVALID_BLOCK_NUMBER;
     return block_no;
   }
-  else if (block_idx < (block_no_count * block_no_count * block_no_count + block_no_count * block_no_count + block_no_count)) // 3-indirect block
-  {
-    // inode->i_block_3ind stores start of 3-indirect table
-    // we need the index of this table - we get it by (block_idx - block_no_count - block_no_count^2) / block_no_count^2
 
-    block_idx = block_idx - block_no_count - (block_no_count * block_no_count);
-    int first_index = block_idx / (block_no_count * block_no_count);
+  block_idx = block_idx - (1ULL << (2 * addr_shift));
 
-    // now we need to read block starting at inode->i_block_3ind with offset first_index
-    // this will return a block number, which is an index to a 2-indirect table
-
-    int second_index;
-    ssize_t b = read_block(volume, inode->i_block_3ind, first_index * 4, 4, &second_index);
+  if (block_idx >> (3 * addr_shift) == 0) // 3-indirect block
+  {
+    // Same as above, with one more level: the 2-indirect table in
+    // inode->i_block_3ind, then a 1-indirect table, then the entry
+    uint32_t second_index;
+    ssize_t b = read_block(volume, inode->i_block_3ind, (block_idx >> (2 * addr_shift)) * 4, 4, &second_index);
     if (b == -1)
       return EXT2_INVALID_BLOCK_NUMBER;
 
-    // now we have the index to the start of the 2-indirect table
-    // however, we still need the offset to this table
-    // we derive this offset by: (block_idx - block_no_count - block_no_count^2) % block_no_count^2
-    // then we call read_block and store its result in third_index
-
-    uint32_t offset = block_idx % (block_no_count * block_no_count);
-    // offset = offset / block_no_count;
-
     uint32_t third_index;
-    b = read_block(volume, second_index, (offset / block_no_count) * 4, 4, &third_index);
+    b = read_block(volume, second_index, ((block_idx >> addr_shift) & addr_mask) * 4, 4, &third_index);
     if (b == -1)
       return EXT2_INVALID_BLOCK_NUMBER;
 
-    // uint32_t final_offset = offset % block_no_count;
     uint32_t block_no = 0;
-    b = read_block(volume, third_index, (offset % block_no_count) * 4, 4, &block_no);
+    b = read_block(volume, third_index, (block_idx & addr_mask) * 4, 4, &block_no);
     if (b == -1)
       return EXT2_INVALID_BLOCK_NUMBER;
 
     return block_no;
   }
-  else
-  {
-    return EXT2_INVALID_BLOCK_NUMBER;
-  }
+
+  return EXT2_INVALID_BLOCK_NUMBER;
 }
 
 /* read_file_block: Returns the content of a specific file, limited to
@@ -165,11 +153,12 @@ ssize_t read_file_block(volume_t *volume, inode_t *inode, uint64_t offset, uint6
   if (offset + max_size > inode_file_size(volume, inode)){
     max_size = inode_file_size(volume, inode) - offset;
   }
-  if ((offset%volume->block_size) + max_size > volume->block_size){
-    max_size = volume->block_size - (offset%volume->block_size);
+  uint32_t block_offset = offset & (volume->block_size - 1);
+  if (block_offset + max_size > volume->block_size){
+    max_size = volume->block_size - block_offset;
   }
 
-  ssize_t rv = read_block(volume, get_inode_block_no(volume, inode, offset / volume->block_size), (offset % volume->block_size), max_size, buffer);
+  ssize_t rv = read_data_block(volume, inode, get_inode_block_no(volume, inode, offset >> volume->block_shift), block_offset, max_size, buffer);
 
   return rv;
 }
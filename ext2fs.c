@@ -6,6 +6,11 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <time.h>
 
 /* The FUSE version has to be defined before any call to relevant
    includes related to FUSE. */
@@ -14,8 +19,90 @@
 #endif
 #include <fuse.h>
 
-static volume_t *volume;
+#define DEFAULT_CACHE_SIZE_MB   64
+#define DEFAULT_IDLE_TIMEOUT_S  300
+#define NAME_INDEX_THREADS      8
+#define VERIFY_THREADS          8
+#define VERIFY_MAX_LISTED       20 // Problems shown per volume
 
+// Virtual directory, in the root of each image, answering name
+// queries: reading QUERY_DIR/PATTERN lists the path of every file
+// whose name matches the glob PATTERN, one per line
+#define QUERY_DIR "/.ext2query"
+
+/* Each volume file given on the command line is an image. With a
+   single image, its root is the root of the mount. With several
+   images, each one is shown as a directory in the mount root, named
+   after the file (without extension). Images are opened on first
+   access and closed again after being idle for a while; all of them
+   share a single block cache.
+ */
+typedef struct image {
+  char *name;          // Directory name under the mount root
+  char *filename;      // Volume file
+  volume_t *volume;    // NULL while the image is closed
+  unsigned int users;  // Operations currently using the volume
+  time_t last_used;
+
+  // Name index, built on the first query (or when the volume is
+  // opened, with -o name_index) and dropped when names change
+  name_index_t *index;
+  int index_building;
+  uint64_t index_generation; // Incremented whenever names change
+  char *query;               // Pattern of the last query, and its result
+  char *query_result;
+  size_t query_size;
+} image_t;
+
+static struct ext2fs_config {
+  unsigned long cache_size_mb;
+  unsigned int idle_timeout;
+  char *overlay;       // Delta file making the (single) image writable
+  int odirect;         // Read volume files with O_DIRECT
+  int name_index;      // Build the name index as soon as a volume is opened
+  int verify;          // Check every volume before mounting
+  char *record_trace;  // Trace file saved when the (single) image is unmounted
+  char *prefetch;      // Trace file replayed when the (single) image is mounted
+  char *verity;        // Hash tree every block read from the (single) image is verified against
+  char *verity_root;   // Expected root hash of the tree, in hexadecimal
+  unsigned int io_depth; // Reads in flight per volume with an I/O scheduler (0 for no scheduler)
+  char *mountpoint;
+} config = { DEFAULT_CACHE_SIZE_MB, DEFAULT_IDLE_TIMEOUT_S, NULL, 0, 0, 0, NULL, NULL, NULL, NULL, 0, NULL };
+
+#define EXT2FS_OPT(t, p) { t, offsetof(struct ext2fs_config, p), 1 }
+
+static const struct fuse_opt ext2fs_opts[] = {
+  EXT2FS_OPT("cache_size=%lu", cache_size_mb),
+  EXT2FS_OPT("idle_timeout=%u", idle_timeout),
+  EXT2FS_OPT("overlay=%s", overlay),
+  EXT2FS_OPT("odirect", odirect),
+  EXT2FS_OPT("name_index", name_index),
+  EXT2FS_OPT("verify", verify),
+  EXT2FS_OPT("record_trace=%s", record_trace),
+  EXT2FS_OPT("prefetch=%s", prefetch),
+  EXT2FS_OPT("verity=%s", verity),
+  EXT2FS_OPT("verity_root=%s", verity_root),
+  EXT2FS_OPT("io_depth=%u", io_depth),
+  FUSE_OPT_END
+};
+
+static image_t *images;
+static unsigned int num_images;
+static block_cache_t *cache;
+static unsigned char verity_root_hash[VERITY_HASH_SIZE]; // If config.verity_root is set
+
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+// Protects the name index and query result of every image; taken
+// after images_lock when both are needed
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t index_built = PTHREAD_COND_INITIALIZER;
+static unsigned int index_threads; // Threads building an index in the background
+static pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reaper_thread;
+static int reaper_running;
+
+static void start_index_thread(image_t *image);
+static void invalidate_name_index(image_t *image);
 static void *ext2_init(struct fuse_conn_info *conn);
 static void ext2_destroy(void *private_data);
 static int ext2_getattr(const char *path, struct stat *stbuf);
@@ -24,6 +111,18 @@ static int ext2_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int ext2_read(const char *path, char *buf, size_t size, off_t offset,
 		     struct fuse_file_info *fi);
 static int ext2_readlink(const char *path, char *buf, size_t size);
+static int ext2_getxattr(const char *path, const char *name, char *value, size_t size);
+static int ext2_listxattr(const char *path, char *list, size_t size);
+static int ext2_write(const char *path, const char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi);
+static int ext2_truncate(const char *path, off_t size);
+static int ext2_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+static int ext2_mkdir(const char *path, mode_t mode);
+static int ext2_unlink(const char *path);
+static int ext2_chmod(const char *path, mode_t mode);
+static int ext2_chown(const char *path, uid_t uid, gid_t gid);
+static int ext2_utimens(const char *path, const struct timespec tv[2]);
+static int ext2_fsync(const char *path, int datasync, struct fuse_file_info *fi);
 
 static const struct fuse_operations ext2_operations = {
   .init = ext2_init,
@@ -32,29 +131,605 @@ static const struct fuse_operations ext2_operations = {
   .getattr = ext2_getattr,
   .readdir = ext2_readdir,
   .readlink = ext2_readlink,
+  .getxattr = ext2_getxattr,
+  .listxattr = ext2_listxattr,
+  .write = ext2_write,
+  .truncate = ext2_truncate,
+  .create = ext2_create,
+  .mkdir = ext2_mkdir,
+  .unlink = ext2_unlink,
+  .rmdir = ext2_unlink,
+  .chmod = ext2_chmod,
+  .chown = ext2_chown,
+  .utimens = ext2_utimens,
+  .fsync = ext2_fsync,
 };
 
+/* add_image: Registers a volume file given on the command line. The
+   file is only checked for existence here; it is opened lazily.
+ */
+static int add_image(const char *filename) {
+
+  struct stat st;
+  if (!is_http_url(filename) && (stat(filename, &st) == -1 || !S_ISREG(st.st_mode))) {
+    fprintf(stderr, "Invalid volume file: '%s'.\n", filename);
+    return -1;
+  }
+
+  char *copy = strdup(filename);
+  char *name = strdup(basename(copy));
+  free(copy);
+  char *dot = strrchr(name, '.');
+  if (dot && dot != name)
+    *dot = '\0';
+
+  for (unsigned int i = 0; i < num_images; i++) {
+    if (!strcmp(images[i].name, name)) {
+      fprintf(stderr, "Duplicate volume name: '%s'.\n", name);
+      free(name);
+      return -1;
+    }
+  }
+
+  images = realloc(images, (num_images + 1) * sizeof(image_t));
+  images[num_images] = (image_t) { .name = name, .filename = strdup(filename) };
+  num_images++;
+  return 0;
+}
+
+/* open_image_volume: Opens the volume file of an image, with direct
+   I/O, an I/O scheduler, a hash tree and an overlay if requested.
+   Returns NULL, after reporting why, if the volume is invalid.
+ */
+static volume_t *open_image_volume(image_t *image) {
+
+  volume_t *volume = config.odirect ? open_volume_file_direct(image->filename) : open_volume_file(image->filename);
+  if (!volume) {
+    fprintf(stderr, "Invalid volume file: '%s'.\n", image->filename);
+    return NULL;
+  }
+  // Half of the reads in flight are kept for metadata
+  if (config.io_depth && attach_io_scheduler(volume, config.io_depth, config.io_depth / 2) < 0) {
+    fprintf(stderr, "Cannot schedule reads of '%s': %s.\n", image->filename, strerror(errno));
+    goto error;
+  }
+  if (config.verity && attach_verity_tree(volume, config.verity, config.verity_root ? verity_root_hash : NULL) < 0) {
+    fprintf(stderr, "Invalid hash tree: '%s' (%s).\n", config.verity,
+            errno == EIO ? "the volume does not match it" : strerror(errno));
+    goto error;
+  }
+  if (config.overlay && attach_overlay(volume, config.overlay) < 0) {
+    fprintf(stderr, "Invalid overlay file: '%s' (%s).\n", config.overlay, strerror(errno));
+    goto error;
+  }
+  return volume;
+
+error:
+  close_volume_file(volume);
+  return NULL;
+}
+
+/* print_check_problem: Shows a problem found by verify_images.
+ */
+static void print_check_problem(void *ctx, const check_problem_t *problem) {
+
+  unsigned int *listed = ctx;
+  if ((*listed)++ >= VERIFY_MAX_LISTED)
+    return;
+  fprintf(stderr, "  %s:", check_problem_name(problem->type));
+  if (problem->group != CHECK_SUPERBLOCK)
+    fprintf(stderr, " group %u", problem->group);
+  if (problem->inode_no)
+    fprintf(stderr, " inode %u", problem->inode_no);
+  if (problem->block_no)
+    fprintf(stderr, " block %u (%u)", problem->block_no, problem->count);
+  fprintf(stderr, " expected %lld, found %lld\n", (long long) problem->expected, (long long) problem->found);
+}
+
+/* verify_images: Checks the consistency of every volume (-o verify).
+   Volumes not opened yet are opened for the check only.
+
+   Returns 0 if all of them are consistent, or -1 otherwise.
+ */
+static int verify_images(void) {
+
+  int rv = 0;
+
+  for (unsigned int i = 0; i < num_images; i++) {
+    volume_t *volume = images[i].volume ? images[i].volume : open_image_volume(&images[i]);
+    unsigned int listed = 0;
+    if (!volume)
+      return -1;
+    int64_t problems = check_volume(volume, VERIFY_THREADS, print_check_problem, &listed, NULL);
+    if (problems < 0) {
+      fprintf(stderr, "Could not check volume file '%s': %s.\n", images[i].filename, strerror(errno));
+      rv = -1;
+    } else if (problems > 0) {
+      if (problems > VERIFY_MAX_LISTED)
+        fprintf(stderr, "  ...\n");
+      fprintf(stderr, "Volume file '%s' is inconsistent (%lld problems).\n", images[i].filename,
+              (long long) problems);
+      rv = -1;
+    }
+    if (volume != images[i].volume)
+      close_volume_file(volume);
+  }
+  return rv;
+}
+
+/* parse_root_hash: Converts a root hash given in hexadecimal
+   (-o verity_root=HASH) to VERITY_HASH_SIZE bytes.
+
+   Returns 0 on success, or -1 if the string is not a valid hash.
+ */
+static int parse_root_hash(const char *hex, unsigned char *hash) {
+
+  if (strlen(hex) != 2 * VERITY_HASH_SIZE)
+    return -1;
+  for (int i = 0; i < VERITY_HASH_SIZE; i++) {
+    unsigned int byte;
+    if (!isxdigit((unsigned char) hex[2 * i]) || !isxdigit((unsigned char) hex[2 * i + 1]) ||
+        sscanf(hex + 2 * i, "%2x", &byte) != 1)
+      return -1;
+    hash[i] = byte;
+  }
+  return 0;
+}
+
+/* ext2fs_opt_proc: Keeps the first non-option argument (the mount
+   point) for FUSE and takes every following one as a volume file.
+ */
+static int ext2fs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+
+  if (key != FUSE_OPT_KEY_NONOPT)
+    return 1;
+  if (!config.mountpoint) {
+    config.mountpoint = (char *) arg;
+    return 1;
+  }
+  return add_image(arg) == 0 ? 0 : -1;
+}
+
 int main(int argc, char *argv[]) {
   
-  char *volumefile = argv[--argc];
-  volume = open_volume_file(volumefile);
-  argv[argc] = NULL;
-  
-  if (!volume) {
-    fprintf(stderr, "Invalid volume file: '%s'.\n", volumefile);
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+  if (fuse_opt_parse(&args, &config, ext2fs_opts, ext2fs_opt_proc) == -1)
+    exit(1);
+
+  if (num_images == 0) {
+    fprintf(stderr, "Usage: %s [options] mountpoint volume_file [volume_file...]\n"
+            "  -o cache_size=N     block cache shared by all volumes, in MiB (default %d)\n"
+            "  -o idle_timeout=N   close volumes unused for N seconds (default %d)\n"
+            "  -o overlay=PATH     make a single volume writable, keeping the changes in PATH\n"
+            "  -o odirect          read volume files with O_DIRECT, caching blocks only once\n"
+            "  -o name_index       index the names of all files when a volume is opened\n"
+            "  -o verify           check the consistency of every volume before mounting\n"
+            "  -o record_trace=PATH  save the blocks read from a single volume to PATH on unmount\n"
+            "  -o prefetch=PATH    load the blocks listed in trace PATH into the cache when mounted\n"
+            "  -o verity=PATH      verify every block read from a single volume against hash tree PATH\n"
+            "  -o verity_root=HASH expected root hash of the hash tree (hexadecimal)\n"
+            "  -o io_depth=N       schedule reads, metadata first, with at most N in flight per volume\n",
+            argv[0], DEFAULT_CACHE_SIZE_MB, DEFAULT_IDLE_TIMEOUT_S);
+    exit(1);
+  }
+  if (config.odirect && config.cache_size_mb == 0) {
+    fprintf(stderr, "The odirect option requires a block cache (cache_size > 0).\n");
+    exit(1);
+  }
+  if (config.overlay && num_images > 1) {
+    fprintf(stderr, "An overlay can only be used with a single volume file.\n");
+    exit(1);
+  }
+  if ((config.record_trace || config.prefetch) && num_images > 1) {
+    fprintf(stderr, "Access traces can only be used with a single volume file.\n");
+    exit(1);
+  }
+  if (config.prefetch && config.cache_size_mb == 0) {
+    fprintf(stderr, "The prefetch option requires a block cache (cache_size > 0).\n");
+    exit(1);
+  }
+  if (config.io_depth == 1) {
+    fprintf(stderr, "The io_depth option requires at least 2 reads in flight.\n");
+    exit(1);
+  }
+  if (config.verity && (num_images > 1 || config.overlay)) {
+    fprintf(stderr, "A hash tree can only be used with a single, read-only volume file.\n");
+    exit(1);
+  }
+  if (config.verity_root && (!config.verity || parse_root_hash(config.verity_root, verity_root_hash) < 0)) {
+    fprintf(stderr, "The verity_root option requires a hash tree and %d hexadecimal digits.\n",
+            2 * VERITY_HASH_SIZE);
+    exit(1);
+  }
+
+  // A single volume is opened right away, so that an invalid file, hash
+  // tree or overlay is reported before mounting. It is closed again and
+  // reopened by ext2_init: FUSE daemonizes (forks) in between, and the
+  // threads of the volume's backend (chunk readahead, I/O scheduler)
+  // would not survive, leaving their chunks and locks taken for good.
+  if (num_images == 1 && !(images[0].volume = open_image_volume(&images[0])))
+    exit(1);
+  if (config.verify && verify_images() < 0)
+    exit(1);
+  if (images[0].volume) {
+    close_volume_file(images[0].volume);
+    images[0].volume = NULL;
+  }
+
+  cache = create_block_cache((size_t) config.cache_size_mb << 20);
+  if (!cache) {
+    fprintf(stderr, "Cannot create a block cache of %lu MiB.\n", config.cache_size_mb);
     exit(1);
   }
   
-  fuse_main(argc, argv, &ext2_operations, volume);
+  int rv = fuse_main(args.argc, args.argv, &ext2_operations, NULL);
+  fuse_opt_free_args(&args);
   
+  return rv;
+}
+
+/* load_image: Opens the volume of an image, attaches the block cache
+   to it and starts building its name index if requested. Must be
+   called with images_lock held.
+
+   Returns 0 on success, or -1 if the volume could not be opened.
+ */
+static int load_image(image_t *image) {
+
+  image->volume = open_image_volume(image);
+  if (!image->volume)
+    return -1;
+  attach_block_cache(image->volume, cache);
+  if (config.name_index)
+    start_index_thread(image);
   return 0;
 }
 
+/* acquire_image: Finds the image a mount path belongs to, opening
+   its volume if needed, and marks it as in use until the matching
+   call to release_image.
+
+   Parameters:
+     path: Path inside the mount.
+     image: Set to the image the path belongs to, or NULL if the path
+            is the root of a multi-image mount.
+     image_path: Set to the path of the file inside the image.
+
+   Returns:
+     0 on success, -ENOENT if no image has that name, or -EIO if the
+     volume file could not be opened.
+ */
+static int acquire_image(const char *path, image_t **image, const char **image_path) {
+
+  image_t *found = NULL;
+
+  arena_reset(); // Every operation starts by acquiring its image
+
+  if (num_images == 1) {
+    found = &images[0];
+    *image_path = path;
+  } else {
+    const char *name = path + strspn(path, "/");
+    size_t len = strcspn(name, "/");
+    if (len == 0) {
+      *image = NULL;
+      *image_path = path;
+      return 0;
+    }
+    for (unsigned int i = 0; i < num_images && !found; i++)
+      if (strlen(images[i].name) == len && !strncmp(images[i].name, name, len))
+        found = &images[i];
+    if (!found)
+      return -ENOENT;
+    *image_path = name[len] ? name + len : "/";
+  }
+
+  pthread_mutex_lock(&images_lock);
+  if (!found->volume && load_image(found) < 0) {
+    pthread_mutex_unlock(&images_lock);
+    return -EIO;
+  }
+  found->users++;
+  found->last_used = time(NULL);
+  pthread_mutex_unlock(&images_lock);
+
+  *image = found;
+  return 0;
+}
+
+/* release_image: Marks the end of an operation started with
+   acquire_image. Accepts NULL (multi-image root).
+ */
+static void release_image(image_t *image) {
+
+  if (!image)
+    return;
+  pthread_mutex_lock(&images_lock);
+  image->users--;
+  image->last_used = time(NULL);
+  pthread_mutex_unlock(&images_lock);
+}
+
+/* close_idle_images: Thread that closes volumes that have not been
+   used for idle_timeout seconds. Their cached blocks are released
+   along with them.
+ */
+static void *close_idle_images(void *arg) {
+
+  pthread_mutex_lock(&images_lock);
+  while (reaper_running) {
+    struct timespec wakeup;
+    clock_gettime(CLOCK_REALTIME, &wakeup);
+    wakeup.tv_sec += config.idle_timeout / 4 + 1;
+    pthread_cond_timedwait(&reaper_cond, &images_lock, &wakeup);
+
+    time_t now = time(NULL);
+    for (unsigned int i = 0; i < num_images; i++) {
+      if (images[i].volume && images[i].users == 0 &&
+          now - images[i].last_used >= config.idle_timeout) {
+        invalidate_name_index(&images[i]);
+        close_volume_file(images[i].volume);
+        images[i].volume = NULL;
+      }
+    }
+  }
+  pthread_mutex_unlock(&images_lock);
+  return NULL;
+}
+
+/* get_name_index: Returns the name index of an image, building it
+   if needed, or waiting for the thread building it. Must be called
+   with index_lock held, which is released while the index is built.
+
+   Returns:
+     The index, or NULL with errno set if it could not be built.
+ */
+static name_index_t *get_name_index(image_t *image) {
+
+  while (!image->index) {
+    if (image->index_building) {
+      pthread_cond_wait(&index_built, &index_lock);
+      continue;
+    }
+    uint64_t generation = image->index_generation;
+    image->index_building = 1;
+    pthread_mutex_unlock(&index_lock);
+    name_index_t *index = build_name_index(image->volume, NAME_INDEX_THREADS);
+    int saved_errno = errno;
+    pthread_mutex_lock(&index_lock);
+    image->index_building = 0;
+    pthread_cond_broadcast(&index_built);
+    if (!index) {
+      errno = saved_errno;
+      return NULL;
+    }
+    if (generation == image->index_generation)
+      image->index = index;
+    else
+      destroy_name_index(index); // Names changed during the scan
+  }
+  return image->index;
+}
+
+/* invalidate_name_index: Drops the name index of an image and the
+   last query result, after names were added or removed (or before
+   closing the volume).
+ */
+static void invalidate_name_index(image_t *image) {
+
+  pthread_mutex_lock(&index_lock);
+  image->index_generation++;
+  destroy_name_index(image->index);
+  image->index = NULL;
+  free(image->query);
+  free(image->query_result);
+  image->query = image->query_result = NULL;
+  pthread_mutex_unlock(&index_lock);
+}
+
+/* index_image_thread: Builds the name index of an image in the
+   background (-o name_index). The image was acquired for the thread.
+ */
+static void *index_image_thread(void *arg) {
+
+  image_t *image = arg;
+
+  pthread_mutex_lock(&index_lock);
+  get_name_index(image);
+  pthread_mutex_unlock(&index_lock);
+  release_image(image);
+
+  pthread_mutex_lock(&index_lock);
+  index_threads--;
+  pthread_cond_broadcast(&index_built);
+  pthread_mutex_unlock(&index_lock);
+  return NULL;
+}
+
+/* start_index_thread: Starts building the name index of an image
+   whose volume was just opened. Must be called with images_lock held.
+ */
+static void start_index_thread(image_t *image) {
+
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  image->users++;
+  pthread_mutex_lock(&index_lock);
+  index_threads++;
+  pthread_mutex_unlock(&index_lock);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, index_image_thread, image) != 0) {
+    image->users--;
+    pthread_mutex_lock(&index_lock);
+    index_threads--;
+    pthread_mutex_unlock(&index_lock);
+  }
+  pthread_attr_destroy(&attr);
+}
+
+/* query_pattern: Returns the pattern of a path in the virtual query
+   directory, an empty string for the directory itself, or NULL for
+   any other path.
+ */
+static const char *query_pattern(const char *image_path) {
+
+  size_t len = strlen(QUERY_DIR);
+  if (strncmp(image_path, QUERY_DIR, len) || (image_path[len] && image_path[len] != '/') ||
+      (image_path[len] && strchr(image_path + len + 1, '/')))
+    return NULL;
+  return image_path[len] ? image_path + len + 1 : "";
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* run_query: Finds the files matching a pattern, keeping the sorted
+   list of their paths (one per line) in image->query_result. The
+   result of the previous query is reused if the pattern is the same.
+   Must be called with index_lock held.
+
+   Returns 0 on success, or -ENOMEM or -EIO.
+ */
+static int run_query(image_t *image, const char *pattern) {
+
+  if (image->query && !strcmp(image->query, pattern))
+    return 0;
+
+  name_index_t *index = get_name_index(image);
+  uint32_t *matches;
+  int64_t count;
+  if (!index || (count = search_name_index(index, pattern, &matches)) < 0)
+    return -errno;
+
+  // Paths are stored null-terminated, sorted, then copied one per line
+  size_t size = 0;
+  for (int64_t i = 0; i < count; i++)
+    size += name_index_path(index, matches[i], NULL, 0, NULL) + 1;
+  char *paths = malloc(size ? size : 1);
+  char **sorted = malloc((count ? count : 1) * sizeof(char *));
+  char *result = malloc(size ? size : 1);
+  char *query = strdup(pattern);
+  if (!paths || !sorted || !result || !query) {
+    free(matches);
+    free(paths);
+    free(sorted);
+    free(result);
+    free(query);
+    return -ENOMEM;
+  }
+  char *p = paths;
+  for (int64_t i = 0; i < count; i++) {
+    sorted[i] = p;
+    p += name_index_path(index, matches[i], p, paths + size - p, NULL) + 1;
+  }
+  qsort(sorted, count, sizeof(char *), compare_paths);
+  p = result;
+  for (int64_t i = 0; i < count; i++) {
+    size_t len = strlen(sorted[i]);
+    memcpy(p, sorted[i], len);
+    p[len] = '\n';
+    p += len + 1;
+  }
+  free(matches);
+  free(paths);
+  free(sorted);
+
+  free(image->query);
+  free(image->query_result);
+  image->query = query;
+  image->query_result = result;
+  image->query_size = size;
+  return 0;
+}
+
+/* query_getattr: Implements ext2_getattr for paths in the virtual
+   query directory. The query is run right away, to know its size.
+ */
+static int query_getattr(image_t *image, const char *pattern, struct stat *stbuf) {
+
+  int rv = 0;
+
+  memset(stbuf, 0, sizeof(struct stat));
+  if (!*pattern) {
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+  pthread_mutex_lock(&index_lock);
+  rv = run_query(image, pattern);
+  stbuf->st_mode = S_IFREG | 0444;
+  stbuf->st_nlink = 1;
+  stbuf->st_size = rv == 0 ? image->query_size : 0;
+  pthread_mutex_unlock(&index_lock);
+  return rv;
+}
+
+/* query_read: Implements ext2_read for paths in the virtual query
+   directory.
+ */
+static int query_read(image_t *image, const char *pattern, char *buf, size_t size, off_t offset) {
+
+  if (!*pattern)
+    return -EISDIR;
+  pthread_mutex_lock(&index_lock);
+  int rv = run_query(image, pattern);
+  if (rv == 0 && offset < image->query_size) {
+    rv = size < image->query_size - offset ? size : image->query_size - offset;
+    memcpy(buf, image->query_result + offset, rv);
+  }
+  pthread_mutex_unlock(&index_lock);
+  return rv;
+}
+
+/* fill_stat: Converts the metadata in an inode into a struct stat.
+ */
+static void fill_stat(volume_t *volume, uint32_t inode_no, inode_t *inode, struct stat *stbuf) {
+
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = inode_no;
+  stbuf->st_mode = inode->i_mode;
+  stbuf->st_nlink = inode->i_links_count;
+  stbuf->st_uid = inode->i_uid | ((uint32_t) inode->l_i_uid_high << 16);
+  stbuf->st_gid = inode->i_gid | ((uint32_t) inode->l_i_gid_high << 16);
+  stbuf->st_size = inode_file_size(volume, inode);
+  stbuf->st_blocks = inode->i_blocks;
+  stbuf->st_blksize = volume->block_size;
+  stbuf->st_atime = inode->i_atime;
+  stbuf->st_mtime = inode->i_mtime;
+  stbuf->st_ctime = inode->i_ctime;
+}
+
 /* ext2_init: Function called when the FUSE file system is mounted.
  */
 static void *ext2_init(struct fuse_conn_info *conn) {
   
   printf("init()\n");
+
+  // With a single image the volume stays open for the whole mount
+  if (num_images > 1 && config.idle_timeout > 0) {
+    reaper_running = 1;
+    pthread_create(&reaper_thread, NULL, close_idle_images, NULL);
+  }
+  // Threads do not survive FUSE daemonizing, so a single image (with
+  // the threads of its backend and its name index) is only opened here.
+  // If it cannot be opened anymore, operations retry and fail with EIO.
+  if (num_images == 1) {
+    pthread_mutex_lock(&images_lock);
+    load_image(&images[0]);
+    pthread_mutex_unlock(&images_lock);
+  }
+  if (config.record_trace && images[0].volume && start_access_trace(images[0].volume) < 0)
+    fprintf(stderr, "Cannot record an access trace: %s.\n", strerror(errno));
+  // Same for the prefetch threads. There is no trace yet on the first
+  // mount with the same prefetch and record_trace file.
+  if (config.prefetch && images[0].volume && start_prefetch(images[0].volume, config.prefetch,
+                                        (config.cache_size_mb << 20) / 2) < 0 && errno != ENOENT)
+    fprintf(stderr, "Cannot prefetch from trace '%s': %s.\n", config.prefetch, strerror(errno));
   
   return NULL;
 }
@@ -65,8 +740,30 @@ static void *ext2_init(struct fuse_conn_info *conn) {
 static void ext2_destroy(void *private_data) {
   
   printf("destroy()\n");
-  
-  close_volume_file(volume);
+
+  if (reaper_running) {
+    pthread_mutex_lock(&images_lock);
+    reaper_running = 0;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&images_lock);
+    pthread_join(reaper_thread, NULL);
+  }
+  pthread_mutex_lock(&index_lock);
+  while (index_threads > 0)
+    pthread_cond_wait(&index_built, &index_lock);
+  pthread_mutex_unlock(&index_lock);
+
+  if (config.record_trace && images[0].volume && stop_access_trace(images[0].volume, config.record_trace) < 0)
+    fprintf(stderr, "Cannot save access trace '%s': %s.\n", config.record_trace, strerror(errno));
+  for (unsigned int i = 0; i < num_images; i++) {
+    invalidate_name_index(&images[i]);
+    if (images[i].volume)
+      close_volume_file(images[i].volume);
+    free(images[i].name);
+    free(images[i].filename);
+  }
+  free(images);
+  destroy_block_cache(cache);
 }
 
 /* ext2_getattr: Function called when a process requests the metadata
@@ -85,8 +782,35 @@ static void ext2_destroy(void *private_data) {
  */
 static int ext2_getattr(const char *path, struct stat *stbuf) {
   
-  /* TO BE COMPLETED BY THE STUDENT */
-  return -ENOSYS;
+  image_t *image;
+  const char *image_path;
+  inode_t inode;
+  uint32_t inode_no;
+
+  int rv = acquire_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+
+  if (!image) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2 + num_images;
+    return 0;
+  }
+
+  const char *pattern = query_pattern(image_path);
+  if (pattern) {
+    rv = query_getattr(image, pattern, stbuf);
+    release_image(image);
+    return rv;
+  }
+
+  inode_no = find_file_from_path(image->volume, image_path, &inode);
+  if (inode_no)
+    fill_stat(image->volume, inode_no, &inode, stbuf);
+  release_image(image);
+  
+  return inode_no ? 0 : -ENOENT;
 }
 
 /* ext2_readdir: Function called when a process requests the listing
@@ -109,6 +833,12 @@ static int ext2_getattr(const char *path, struct stat *stbuf) {
              the offset parameter. Optional.
      fi: Not used in this implementation of readdir.
 
+   Each entry is passed to filler with the byte offset of the entry
+   that follows it in the directory, so once the kernel's buffer is
+   full, the next call resumes at that entry instead of rescanning
+   the directory. Entries also carry their inode number and file
+   type, taken from the directory entry without reading the inode.
+
    Returns:
      In case of success, returns 0, and calls the filler function for
      each entry in the provided directory. If the directory doesn't
@@ -117,8 +847,64 @@ static int ext2_getattr(const char *path, struct stat *stbuf) {
 static int ext2_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi) {
   
-  /* TO BE COMPLETED BY THE STUDENT */
-  return -ENOSYS;
+  image_t *image;
+  const char *image_path;
+  inode_t inode;
+  dir_iterator_t iterator;
+  dir_entry_view_t entry;
+  char name[256]; // Names are at most 255 bytes long
+  struct stat st;
+  void *block;
+  int64_t entry_inode_no;
+
+  int rv = acquire_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+
+  if (!image) {
+    // Cookies are positions in the list ".", "..", then the images
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR;
+    for (off_t i = offset; i < 2 + (off_t) num_images; i++)
+      if (filler(buf, i == 0 ? "." : i == 1 ? ".." : images[i - 2].name, &st, i + 1))
+        break;
+    return 0;
+  }
+
+  const char *pattern = query_pattern(image_path);
+  if (pattern) {
+    // The query directory cannot be listed; its files are looked up
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR;
+    if (*pattern)
+      rv = -ENOTDIR;
+    else if (offset == 0 && !filler(buf, ".", &st, 1))
+      filler(buf, "..", &st, 2);
+    else if (offset == 1)
+      filler(buf, "..", &st, 2);
+  } else if (!find_file_from_path(image->volume, image_path, &inode)) {
+    rv = -ENOENT;
+  } else if (!inode_is_directory(&inode)) {
+    rv = -ENOTDIR;
+  } else if (!(block = arena_alloc(image->volume->block_size))) {
+    rv = -ENOMEM;
+  } else {
+    open_directory_iterator(&iterator, image->volume, &inode, offset, block);
+    memset(&st, 0, sizeof(st));
+    while ((entry_inode_no = next_directory_view(&iterator, &entry)) > 0) {
+      memcpy(name, entry.name, entry.name_len);
+      name[entry.name_len] = '\0';
+      st.st_ino = entry.inode_no;
+      st.st_mode = dir_entry_type_mode(entry.file_type);
+      if (filler(buf, name, &st, iterator.offset))
+        break;
+    }
+    if (entry_inode_no < 0)
+      rv = -EIO;
+  }
+  release_image(image);
+
+  return rv;
 }
 
 /* ext2_read: Function called when a process reads data from a file in
@@ -147,8 +933,36 @@ static int ext2_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int ext2_read(const char *path, char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi) {
   
-  /* TO BE COMPLETED BY THE STUDENT */
-  return -ENOSYS;
+  image_t *image;
+  const char *image_path;
+  inode_t inode;
+  uint32_t inode_no;
+  ssize_t bytes;
+
+  int rv = acquire_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+  if (!image)
+    return -EISDIR;
+
+  const char *pattern = query_pattern(image_path);
+  if (pattern)
+    rv = query_read(image, pattern, buf, size, offset);
+  else if (!(inode_no = find_file_from_path(image->volume, image_path, &inode)))
+    rv = -ENOENT;
+  else if (inode_is_directory(&inode))
+    rv = -EISDIR;
+  else if (offset >= inode_file_size(image->volume, &inode))
+    rv = 0;
+  else {
+    // Reads of the same file are one stream for the I/O scheduler
+    set_io_stream(((uint64_t) (image - images) << 32) | inode_no);
+    bytes = read_file_content(image->volume, &inode, offset, size, buf);
+    rv = bytes < 0 ? -EIO : bytes;
+  }
+  release_image(image);
+
+  return rv;
 }
 
 /* ext2_readlink: Function called when FUSE needs to obtain the target of
@@ -170,6 +984,321 @@ static int ext2_read(const char *path, char *buf, size_t size, off_t offset,
  */
 static int ext2_readlink(const char *path, char *buf, size_t size) {
   
-  /* TO BE COMPLETED BY THE STUDENT */
-  return -ENOSYS;
+  image_t *image;
+  const char *image_path;
+  inode_t inode;
+
+  int rv = acquire_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+  if (!image)
+    return -EINVAL;
+
+  if (!find_file_from_path(image->volume, image_path, &inode))
+    rv = -ENOENT;
+  else if (!inode_is_symlink(&inode))
+    rv = -EINVAL;
+  else if (!read_symlink_target(image->volume, &inode, buf, size))
+    rv = -EIO;
+  release_image(image);
+
+  return rv;
+}
+
+/* ext2_getxattr: Function called when a process reads an extended
+   attribute of a file.
+
+   Parameters:
+     path: Path of the file.
+     name: Full name of the attribute (e.g., "security.selinux").
+     value: Pointer where the value is expected to be stored.
+     size: Size of the buffer. If 0, only the size of the value is
+           requested.
+   Returns:
+     In case of success, returns the size of the value. In case of
+     error, may return one of these error codes:
+       -ENOENT: If the file does not exist;
+       -ENODATA: If the file has no such attribute;
+       -ERANGE: If the value does not fit in the buffer;
+       -EIO: If there was an I/O error trying to obtain the data.
+ */
+static int ext2_getxattr(const char *path, const char *name, char *value, size_t size) {
+
+  image_t *image;
+  const char *image_path;
+  inode_t inode;
+  uint32_t inode_no;
+  ssize_t bytes;
+
+  int rv = acquire_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+  if (!image)
+    return -ENODATA;
+
+  if (!(inode_no = find_file_from_path(image->volume, image_path, &inode)))
+    rv = -ENOENT;
+  else if ((bytes = get_xattr(image->volume, inode_no, &inode, name, value, size)) < 0)
+    rv = -errno;
+  else
+    rv = bytes;
+  release_image(image);
+
+  return rv;
+}
+
+/* ext2_listxattr: Function called when a process lists the extended
+   attributes of a file.
+
+   Parameters:
+     path: Path of the file.
+     list: Pointer where the names are expected to be stored, each one
+           followed by a NULL byte.
+     size: Size of the buffer. If 0, only the size of the list is
+           requested.
+   Returns:
+     In case of success, returns the size of the list. In case of
+     error, may return one of these error codes:
+       -ENOENT: If the file does not exist;
+       -ERANGE: If the list does not fit in the buffer;
+       -EIO: If there was an I/O error trying to obtain the data.
+ */
+static int ext2_listxattr(const char *path, char *list, size_t size) {
+
+  image_t *image;
+  const char *image_path;
+  inode_t inode;
+  uint32_t inode_no;
+  ssize_t bytes;
+
+  int rv = acquire_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+  if (!image)
+    return 0;
+
+  if (!(inode_no = find_file_from_path(image->volume, image_path, &inode)))
+    rv = -ENOENT;
+  else if ((bytes = list_xattrs(image->volume, inode_no, &inode, list, size)) < 0)
+    rv = -errno;
+  else
+    rv = bytes;
+  release_image(image);
+
+  return rv;
+}
+
+/* Operations that modify the volume. They are only available when an
+   overlay is given (-o overlay=PATH, with a single image); otherwise
+   they fail with -EROFS. Errors from the write routines are returned
+   as -errno.
+ */
+
+/* acquire_writable_image: Same as acquire_image, for operations that
+   modify the volume.
+ */
+static int acquire_writable_image(const char *path, image_t **image, const char **image_path) {
+  if (!config.overlay)
+    return -EROFS;
+  return acquire_image(path, image, image_path);
+}
+
+/* find_parent_directory: Finds the directory holding a path.
+
+   Parameters:
+     volume: Pointer to volume.
+     path: Path of the file inside the image.
+     name: Set to the last component of the path (in arena memory).
+
+   Returns:
+     The inode number of the directory, or 0 if it does not exist.
+ */
+static uint32_t find_parent_directory(volume_t *volume, const char *path, const char **name) {
+
+  size_t len = strlen(path);
+  char *parent = arena_alloc(len + 2);
+  if (!parent)
+    return 0;
+  memcpy(parent, path, len + 1);
+  char *slash = strrchr(parent, '/');
+  if (!slash || slash[1] == '\0')
+    return 0;
+  *name = path + (slash - parent) + 1;
+  if (slash == parent)
+    slash++; // Keeps the "/" of the root directory
+  *slash = '\0';
+  return find_file_from_path(volume, parent, NULL);
+}
+
+/* ext2_write: Function called when a process writes data to a file.
+   Returns the number of bytes written, or a negative error code.
+ */
+static int ext2_write(const char *path, const char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+
+  image_t *image;
+  const char *image_path;
+  inode_t inode;
+  uint32_t inode_no;
+  ssize_t bytes;
+
+  int rv = acquire_writable_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+
+  if (!(inode_no = find_file_from_path(image->volume, image_path, &inode)))
+    rv = -ENOENT;
+  else if ((bytes = write_file_content(image->volume, inode_no, &inode, offset, size, buf)) < 0)
+    rv = -errno;
+  else
+    rv = bytes;
+  release_image(image);
+
+  return rv;
+}
+
+/* ext2_truncate: Function called when a process changes the size of a
+   file.
+ */
+static int ext2_truncate(const char *path, off_t size) {
+
+  image_t *image;
+  const char *image_path;
+  inode_t inode;
+  uint32_t inode_no;
+
+  int rv = acquire_writable_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+
+  if (!(inode_no = find_file_from_path(image->volume, image_path, &inode)))
+    rv = -ENOENT;
+  else if (truncate_file(image->volume, inode_no, &inode, size) < 0)
+    rv = -errno;
+  release_image(image);
+
+  return rv;
+}
+
+/* make_file: Creates a regular file or directory for ext2_create and
+   ext2_mkdir, owned by the calling process.
+ */
+static int make_file(const char *path, mode_t mode) {
+
+  image_t *image;
+  const char *image_path;
+  const char *name;
+  uint32_t dir_inode_no;
+  struct fuse_context *context = fuse_get_context();
+
+  int rv = acquire_writable_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+
+  if (!(dir_inode_no = find_parent_directory(image->volume, image_path, &name)))
+    rv = -ENOENT;
+  else if (create_file(image->volume, dir_inode_no, name, mode, context->uid, context->gid, NULL) < 0)
+    rv = -errno;
+  else
+    invalidate_name_index(image);
+  release_image(image);
+
+  return rv;
+}
+
+static int ext2_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  return make_file(path, (mode & ~S_IFMT) | S_IFREG);
+}
+
+static int ext2_mkdir(const char *path, mode_t mode) {
+  return make_file(path, (mode & ~S_IFMT) | S_IFDIR);
+}
+
+/* ext2_unlink: Function called to remove a file (ext2_unlink) or an
+   empty directory (ext2_rmdir); the kernel checks the file type.
+ */
+static int ext2_unlink(const char *path) {
+
+  image_t *image;
+  const char *image_path;
+  const char *name;
+  uint32_t dir_inode_no;
+
+  int rv = acquire_writable_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+
+  if (!(dir_inode_no = find_parent_directory(image->volume, image_path, &name)))
+    rv = -ENOENT;
+  else if (remove_file(image->volume, dir_inode_no, name) < 0)
+    rv = -errno;
+  else
+    invalidate_name_index(image);
+  release_image(image);
+
+  return rv;
+}
+
+/* change_attributes: Implements ext2_chmod, ext2_chown and
+   ext2_utimens; -1 leaves an attribute unchanged.
+ */
+static int change_attributes(const char *path, int32_t mode, int64_t uid, int64_t gid,
+                             int64_t atime, int64_t mtime) {
+
+  image_t *image;
+  const char *image_path;
+  uint32_t inode_no;
+
+  int rv = acquire_writable_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+
+  if (!(inode_no = find_file_from_path(image->volume, image_path, NULL)))
+    rv = -ENOENT;
+  else if (set_file_attributes(image->volume, inode_no, mode, uid, gid, atime, mtime) < 0)
+    rv = -errno;
+  release_image(image);
+
+  return rv;
+}
+
+static int ext2_chmod(const char *path, mode_t mode) {
+  return change_attributes(path, mode & 07777, -1, -1, -1, -1);
+}
+
+static int ext2_chown(const char *path, uid_t uid, gid_t gid) {
+  return change_attributes(path, -1, uid == (uid_t) -1 ? -1 : (int64_t) uid,
+                           gid == (gid_t) -1 ? -1 : (int64_t) gid, -1, -1);
+}
+
+/* timespec_seconds: Converts a time passed to utimens, which may be
+   UTIME_NOW or UTIME_OMIT.
+ */
+static int64_t timespec_seconds(const struct timespec *ts) {
+  if (ts->tv_nsec == UTIME_OMIT)
+    return -1;
+  return ts->tv_nsec == UTIME_NOW ? time(NULL) : ts->tv_sec;
+}
+
+static int ext2_utimens(const char *path, const struct timespec tv[2]) {
+  return change_attributes(path, -1, -1, -1, timespec_seconds(&tv[0]), timespec_seconds(&tv[1]));
+}
+
+/* ext2_fsync: Function called when a process flushes a file. Makes
+   every write to the volume durable in the overlay, not only the
+   file's.
+ */
+static int ext2_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+
+  image_t *image;
+  const char *image_path;
+
+  int rv = acquire_writable_image(path, &image, &image_path);
+  if (rv < 0)
+    return rv;
+  if (sync_overlay(image->volume) < 0)
+    rv = -errno;
+  release_image(image);
+
+  return rv;
 }
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include "ext2.h"
+
+/* ext2hashtree: Builds the hash tree of a volume, used to verify every
+   block read from it (ext2fs -o verity=PATH), and prints its root hash
+   in hexadecimal. The root hash should be kept apart from the volume
+   and the tree, and given back with -o verity_root=HASH.
+
+   Exit status: 0 on success, 1 if the tree could not be built.
+ */
+
+#define DEFAULT_THREADS 8
+
+int main(int argc, char *argv[]) {
+
+  unsigned int threads = DEFAULT_THREADS;
+  int verbose = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:v")) != -1) {
+    switch (opt) {
+    case 'j': threads = strtoul(optarg, NULL, 10); break;
+    case 'v': verbose = 1; break;
+    default: goto usage;
+    }
+  }
+  if (argc - optind != 2 || threads == 0) {
+  usage:
+    fprintf(stderr, "Usage: %s [-j threads] [-v] volume_file tree_file\n"
+            "  -j  number of threads hashing blocks (default %d)\n"
+            "  -v  print the size of the volume and the hashing throughput to stderr\n",
+            argv[0], DEFAULT_THREADS);
+    return 1;
+  }
+
+  volume_t *volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 1;
+  }
+
+  struct timespec start, end;
+  unsigned char root_hash[VERITY_HASH_SIZE];
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int rv = build_verity_tree(volume, argv[optind + 1], threads, root_hash);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (rv < 0) {
+    perror("Could not build hash tree");
+    close_volume_file(volume);
+    return 1;
+  }
+
+  for (int i = 0; i < VERITY_HASH_SIZE; i++)
+    printf("%02x", root_hash[i]);
+  putchar('\n');
+  if (verbose) {
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double mib = (double) volume->super.s_blocks_count * volume->block_size / 1048576.0;
+    fprintf(stderr, "%" PRIu32 " blocks of %" PRIu32 " bytes (%.1f MiB) hashed in %.3f s (%.1f MiB/s)\n",
+            volume->super.s_blocks_count, volume->block_size, mib, seconds, mib / seconds);
+  }
+  close_volume_file(volume);
+  return 0;
+}
@@ -0,0 +1,338 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Volumes stored on an HTTP server (e.g., an object store), read with
+   Range requests instead of being downloaded first. Data is fetched
+   in chunks much larger than a block, so the blocks read by a path
+   lookup or a directory listing, which are usually close together,
+   are served by a few requests. Fetched chunks are kept in a chunk
+   cache, whose worker threads fetch the chunks ahead of sequential
+   readers, with several requests in flight at once. Connections are
+   kept alive and reused.
+
+   Only plain http:// URLs are supported (no TLS, no redirects, no
+   chunked transfer encoding).
+ */
+
+#define HTTP_CHUNK_SIZE  (256 << 10)
+#define HTTP_CACHE_SIZE  (64 << 20)
+#define HTTP_READAHEAD   8
+#define HTTP_THREADS     4
+#define HTTP_MAX_IDLE    8       // Connections kept open for reuse
+#define HTTP_TIMEOUT_S   30
+#define HTTP_HEADER_SIZE 8192
+
+typedef struct http_backend {
+  volume_backend_t backend;
+  char *host;                    // Host header value (with port)
+  char *path;
+  struct addrinfo *addresses;
+
+  pthread_mutex_t lock;
+  int idle[HTTP_MAX_IDLE];       // Open connections not in use
+  unsigned int num_idle;
+
+  chunk_cache_t *chunks;
+} http_backend_t;
+
+/* is_http_url: Returns 1 if a volume name is an http:// URL.
+ */
+int is_http_url(const char *name) {
+  return !strncmp(name, "http://", 7);
+}
+
+/* http_connect: Takes an idle connection, or opens a new one.
+
+   Returns the socket, or -1 in case of error.
+ */
+static int http_connect(http_backend_t *http) {
+
+  pthread_mutex_lock(&http->lock);
+  if (http->num_idle > 0) {
+    int fd = http->idle[--http->num_idle];
+    pthread_mutex_unlock(&http->lock);
+    return fd;
+  }
+  pthread_mutex_unlock(&http->lock);
+
+  for (struct addrinfo *ai = http->addresses; ai; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1)
+      continue;
+    struct timeval timeout = { HTTP_TIMEOUT_S, 0 };
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      return fd;
+    close(fd);
+  }
+  errno = EHOSTUNREACH;
+  return -1;
+}
+
+/* http_release: Keeps a connection for reuse, or closes it if there
+   are enough idle connections already.
+ */
+static void http_release(http_backend_t *http, int fd) {
+
+  pthread_mutex_lock(&http->lock);
+  if (http->num_idle < HTTP_MAX_IDLE) {
+    http->idle[http->num_idle++] = fd;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&http->lock);
+  if (fd != -1)
+    close(fd);
+}
+
+static int send_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t bytes = send(fd, data, size, MSG_NOSIGNAL);
+    if (bytes <= 0)
+      return -1;
+    data += bytes;
+    size -= bytes;
+  }
+  return 0;
+}
+
+/* find_header: Returns the value of a header in a response header
+   block (null-terminated), or NULL if it is not present.
+ */
+static const char *find_header(const char *headers, const char *name) {
+  size_t len = strlen(name);
+  for (const char *line = strstr(headers, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n")) {
+    if (!strncasecmp(line + 2, name, len) && line[2 + len] == ':') {
+      const char *value = line + 3 + len;
+      while (*value == ' ')
+        value++;
+      return value;
+    }
+  }
+  return NULL;
+}
+
+/* http_request: Sends one Range request on a connection and reads the
+   response.
+
+   Parameters:
+     fd: Connection.
+     offset, size: Byte range requested.
+     buffer: Where the data is stored (at least 'size' bytes).
+     total_size: If not NULL, set to the size of the whole resource,
+                 from the Content-Range header.
+     keep_alive: Set to 1 if the connection can be reused.
+
+   Returns:
+     The number of bytes stored in buffer, or -1 in case of error.
+ */
+static ssize_t http_request(http_backend_t *http, int fd, uint64_t offset, size_t size, void *buffer,
+                            uint64_t *total_size, int *keep_alive) {
+
+  char headers[HTTP_HEADER_SIZE];
+  int len = snprintf(headers, sizeof(headers),
+                     "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%llu-%llu\r\n\r\n",
+                     http->path, http->host, (unsigned long long) offset,
+                     (unsigned long long) (offset + size - 1));
+  *keep_alive = 0;
+  if (len >= (int) sizeof(headers) || send_all(fd, headers, len) < 0)
+    return -1;
+
+  // Reads up to the end of the headers; anything after that is body
+  size_t received = 0;
+  char *end = NULL;
+  while (!end) {
+    if (received == sizeof(headers) - 1)
+      return -1;
+    ssize_t bytes = recv(fd, headers + received, sizeof(headers) - 1 - received, 0);
+    if (bytes <= 0)
+      return -1;
+    received += bytes;
+    headers[received] = '\0';
+    end = strstr(headers, "\r\n\r\n");
+  }
+  size_t body_received = received - (end + 4 - headers);
+  end[2] = '\0'; // Keeps the last "\r\n" for find_header
+
+  int status = 0;
+  if (sscanf(headers, "HTTP/1.%*d %d", &status) != 1 || status != 206) {
+    // 200 means the server ignored the Range header
+    errno = status == 404 ? ENOENT : status == 200 || status == 416 ? EINVAL : EIO;
+    return -1;
+  }
+  const char *length_value = find_header(headers, "Content-Length");
+  const char *range_value = find_header(headers, "Content-Range");
+  unsigned long long first, last, total;
+  if (!length_value || !range_value ||
+      sscanf(range_value, "bytes %llu-%llu/%llu", &first, &last, &total) != 3 ||
+      first != offset || last < first || last - first + 1 > size ||
+      strtoull(length_value, NULL, 10) != last - first + 1 || body_received > last - first + 1) {
+    errno = EIO;
+    return -1;
+  }
+  if (total_size)
+    *total_size = total;
+
+  size_t length = last - first + 1;
+  memcpy(buffer, end + 4, body_received);
+  while (body_received < length) {
+    ssize_t bytes = recv(fd, (char *) buffer + body_received, length - body_received, 0);
+    if (bytes <= 0)
+      return -1;
+    body_received += bytes;
+  }
+  const char *connection = find_header(headers, "Connection");
+  *keep_alive = !connection || strncasecmp(connection, "close", 5);
+  return length;
+}
+
+/* http_get_range: Fetches a byte range, retrying once on a new
+   connection if a reused one was closed by the server.
+ */
+static ssize_t http_get_range(http_backend_t *http, uint64_t offset, size_t size, void *buffer,
+                              uint64_t *total_size) {
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int keep_alive;
+    int fd = http_connect(http);
+    if (fd == -1)
+      return -1;
+    ssize_t bytes = http_request(http, fd, offset, size, buffer, total_size, &keep_alive);
+    if (keep_alive)
+      http_release(http, fd);
+    else
+      close(fd);
+    if (bytes >= 0 || errno == EINVAL || errno == ENOENT)
+      return bytes;
+  }
+  return -1;
+}
+
+static int http_load_chunk(void *ctx, uint64_t chunk_no, void *buffer) {
+
+  http_backend_t *http = ctx;
+  uint64_t offset = chunk_no * HTTP_CHUNK_SIZE;
+  size_t expected = HTTP_CHUNK_SIZE;
+  if (expected > http->backend.size - offset)
+    expected = http->backend.size - offset;
+
+  if (http_get_range(http, offset, expected, buffer, NULL) != expected)
+    return -1;
+  memset((char *) buffer + expected, 0, HTTP_CHUNK_SIZE - expected);
+  return 0;
+}
+
+static ssize_t http_pread(volume_backend_t *backend, void *buffer, size_t size, uint64_t offset) {
+  return chunk_cache_read(((http_backend_t *) backend)->chunks, buffer, size, offset);
+}
+
+static void http_close(volume_backend_t *backend) {
+
+  http_backend_t *http = (http_backend_t *) backend;
+  if (http->chunks)
+    destroy_chunk_cache(http->chunks);
+  while (http->num_idle > 0)
+    close(http->idle[--http->num_idle]);
+  if (http->addresses)
+    freeaddrinfo(http->addresses);
+  pthread_mutex_destroy(&http->lock);
+  free(http->host);
+  free(http->path);
+  free(http);
+}
+
+/* open_http_backend: Creates a storage backend that reads volume data
+   from an HTTP server supporting Range requests.
+
+   Parameters:
+     url: URL of the volume, of the form http://host[:port]/path.
+
+   Returns:
+     A pointer to the new backend, or NULL with errno set in case of
+     error (EINVAL if the URL is invalid or the server does not
+     support Range requests, ENOENT if the server has no such file).
+ */
+volume_backend_t *open_http_backend(const char *url) {
+
+  if (!is_http_url(url)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  const char *host = url + 7;
+  const char *slash = strchr(host, '/');
+  size_t host_len = slash ? (size_t) (slash - host) : strlen(host);
+  if (host_len == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  http_backend_t *http = calloc(1, sizeof(http_backend_t));
+  if (!http)
+    return NULL;
+  pthread_mutex_init(&http->lock, NULL);
+  http->host = strndup(host, host_len);
+  http->path = strdup(slash ? slash : "/");
+  if (!http->host || !http->path) {
+    http_close(&http->backend);
+    return NULL;
+  }
+
+  // Splits "name:port" (or "[address]:port")
+  char *name = strdup(http->host);
+  if (!name) {
+    http_close(&http->backend);
+    return NULL;
+  }
+  char *port = strrchr(name, ':');
+  if (port && !strchr(port, ']'))
+    *port++ = '\0';
+  else
+    port = "80";
+  if (name[0] == '[') {
+    memmove(name, name + 1, strlen(name));
+    name[strcspn(name, "]")] = '\0';
+  }
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  int rv = getaddrinfo(name, port, &hints, &http->addresses);
+  free(name);
+  if (rv != 0) {
+    http->addresses = NULL;
+    http_close(&http->backend);
+    errno = EHOSTUNREACH;
+    return NULL;
+  }
+
+  // The first byte is fetched to learn the size of the volume
+  char first_byte;
+  uint64_t size;
+  if (http_get_range(http, 0, 1, &first_byte, &size) != 1) {
+    int saved_errno = errno;
+    http_close(&http->backend);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  http->backend.pread = http_pread;
+  http->backend.close = http_close;
+  http->backend.size = size;
+  http->chunks = create_chunk_cache(HTTP_CHUNK_SIZE, size, HTTP_CACHE_SIZE, HTTP_READAHEAD,
+                                    HTTP_THREADS, http_load_chunk, http);
+  if (!http->chunks) {
+    http_close(&http->backend);
+    return NULL;
+  }
+  return &http->backend;
+}
@@ -0,0 +1,526 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+/* In-memory index of the names of every file in a volume, answering
+   name, glob and substring queries without reading any directory.
+
+   Names are kept in a single string table, and every entry records
+   the entry of its parent directory, so full paths are rebuilt by
+   following parent links. The volume is scanned once, by a pool of
+   threads listing directories in parallel.
+
+   Queries are narrowed with a trigram index: for every (hashed)
+   trigram, the sorted list of entries whose name contains it. The
+   literal parts of a glob pattern give the trigrams every match must
+   contain, and only the entries in all of their lists are matched
+   against the pattern. Patterns without a literal run of 3 or more
+   characters are matched against every name.
+ */
+
+#define MIN_TRIGRAM_BUCKETS (1U << 12)
+#define MAX_TRIGRAM_BUCKETS (1U << 22)
+
+typedef struct name_entry {
+  uint32_t name;     // Offset of the name in the string table (null-terminated)
+  uint32_t parent;   // Index of the parent directory's entry (root is its own parent)
+  uint32_t inode_no;
+  uint16_t mode;     // File type (S_IF* bits), 0 if unknown
+  uint8_t  name_len;
+} name_entry_t;
+
+struct name_index {
+  name_entry_t *entries;
+  uint32_t num_entries;
+  char *names;           // String table
+  size_t names_size;
+  uint32_t errors;       // Directories that could not be listed
+
+  uint32_t bucket_shift; // 32 - log2(number of buckets)
+  uint32_t *buckets;     // Start of each bucket's postings (one more than buckets)
+  uint32_t *postings;    // Entry indices, sorted within each bucket
+};
+
+// Directory waiting to be listed
+typedef struct scan_item {
+  uint32_t entry;
+  uint32_t inode_no;
+} scan_item_t;
+
+typedef struct index_scan {
+  volume_t *volume;
+  name_index_t *index;
+  size_t entries_capacity;
+  size_t names_capacity;
+  uint8_t *visited;      // Bitmap of directory inodes already queued
+  int failed;            // Out of memory
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  scan_item_t *queue;
+  size_t queue_len;
+  size_t queue_capacity;
+  unsigned int busy;
+} index_scan_t;
+
+// Entries of one directory, collected before adding them to the index
+typedef struct scan_batch {
+  name_entry_t *entries;
+  size_t num_entries;
+  size_t entries_capacity;
+  char *names;
+  size_t names_size;
+  size_t names_capacity;
+} scan_batch_t;
+
+static int grow(void **array, size_t *capacity, size_t needed, size_t item_size) {
+  if (needed <= *capacity)
+    return 0;
+  size_t new_capacity = *capacity ? *capacity : 64;
+  while (new_capacity < needed)
+    new_capacity *= 2;
+  void *new_array = realloc(*array, new_capacity * item_size);
+  if (!new_array)
+    return -1;
+  *array = new_array;
+  *capacity = new_capacity;
+  return 0;
+}
+
+/* add_batch: Appends the entries of a listed directory to the index,
+   and queues its subdirectories. Must be called with the lock held.
+ */
+static int add_batch(index_scan_t *scan, uint32_t parent, scan_batch_t *batch) {
+
+  name_index_t *index = scan->index;
+  if (batch->num_entries > UINT32_MAX - 1 - index->num_entries ||
+      grow((void **) &index->entries, &scan->entries_capacity, index->num_entries + batch->num_entries,
+           sizeof(name_entry_t)) < 0 ||
+      grow((void **) &index->names, &scan->names_capacity, index->names_size + batch->names_size, 1) < 0 ||
+      index->names_size + batch->names_size > UINT32_MAX)
+    return -1;
+
+  for (size_t i = 0; i < batch->num_entries; i++) {
+    name_entry_t *entry = &index->entries[index->num_entries];
+    *entry = batch->entries[i];
+    entry->name += index->names_size;
+    entry->parent = parent;
+    if ((entry->mode & S_IFMT) == S_IFDIR && entry->inode_no <= scan->volume->super.s_inodes_count &&
+        !(scan->visited[entry->inode_no / 8] & (1 << entry->inode_no % 8))) {
+      scan->visited[entry->inode_no / 8] |= 1 << entry->inode_no % 8;
+      if (grow((void **) &scan->queue, &scan->queue_capacity, scan->queue_len + 1, sizeof(scan_item_t)) < 0)
+        return -1;
+      scan->queue[scan->queue_len++] = (scan_item_t) { index->num_entries, entry->inode_no };
+      pthread_cond_signal(&scan->work);
+    }
+    index->num_entries++;
+  }
+  if (batch->names_size > 0)
+    memcpy(index->names + index->names_size, batch->names, batch->names_size);
+  index->names_size += batch->names_size;
+  return 0;
+}
+
+/* list_directory: Collects the entries of a directory (except "."
+   and ".."), reading the inode of entries whose type is not recorded
+   in the directory.
+
+   Returns 0 on success, -1 if the directory could not be read, or -2
+   if memory could not be allocated.
+ */
+static int list_directory(volume_t *volume, uint32_t inode_no, void *block, scan_batch_t *batch) {
+
+  inode_t inode, child;
+  dir_iterator_t iterator;
+  dir_entry_view_t view;
+  int64_t rv;
+
+  batch->num_entries = batch->names_size = 0;
+  if (read_inode(volume, inode_no, &inode) < 0 || !inode_is_directory(&inode))
+    return -1;
+  open_directory_iterator(&iterator, volume, &inode, 0, block);
+  while ((rv = next_directory_view(&iterator, &view)) > 0) {
+    if ((view.name_len == 1 && view.name[0] == '.') ||
+        (view.name_len == 2 && view.name[0] == '.' && view.name[1] == '.'))
+      continue;
+    if (grow((void **) &batch->entries, &batch->entries_capacity, batch->num_entries + 1, sizeof(name_entry_t)) < 0 ||
+        grow((void **) &batch->names, &batch->names_capacity, batch->names_size + view.name_len + 1, 1) < 0)
+      return -2;
+    mode_t mode = dir_entry_type_mode(view.file_type);
+    if (!mode && read_inode(volume, view.inode_no, &child) >= 0)
+      mode = child.i_mode & S_IFMT;
+    batch->entries[batch->num_entries++] = (name_entry_t) {
+      .name = batch->names_size, .inode_no = view.inode_no, .mode = mode, .name_len = view.name_len
+    };
+    memcpy(batch->names + batch->names_size, view.name, view.name_len);
+    batch->names[batch->names_size + view.name_len] = '\0';
+    batch->names_size += view.name_len + 1;
+  }
+  return rv < 0 ? -1 : 0;
+}
+
+static void *scan_thread(void *arg) {
+
+  index_scan_t *scan = arg;
+  scan_batch_t batch = { 0 };
+  void *block = malloc(scan->volume->block_size);
+
+  pthread_mutex_lock(&scan->lock);
+  if (!block)
+    scan->failed = 1;
+  for (;;) {
+    while (scan->queue_len == 0 && scan->busy > 0 && !scan->failed)
+      pthread_cond_wait(&scan->work, &scan->lock);
+    if (scan->queue_len == 0 || scan->failed)
+      break;
+    scan_item_t item = scan->queue[--scan->queue_len];
+    scan->busy++;
+    pthread_mutex_unlock(&scan->lock);
+
+    int rv = list_directory(scan->volume, item.inode_no, block, &batch);
+
+    pthread_mutex_lock(&scan->lock);
+    // Entries read before an error are kept
+    if (rv == -2 || add_batch(scan, item.entry, &batch) < 0)
+      scan->failed = 1;
+    else if (rv < 0)
+      scan->index->errors++;
+    scan->busy--;
+    if ((scan->busy == 0 && scan->queue_len == 0) || scan->failed)
+      pthread_cond_broadcast(&scan->work);
+  }
+  pthread_mutex_unlock(&scan->lock);
+  free(batch.entries);
+  free(batch.names);
+  free(block);
+  return NULL;
+}
+
+static uint32_t trigram_bucket(name_index_t *index, const char *s) {
+  uint32_t trigram = (uint32_t) (unsigned char) s[0] << 16 | (uint32_t) (unsigned char) s[1] << 8 |
+                     (unsigned char) s[2];
+  return (trigram * 2654435761u) >> index->bucket_shift;
+}
+
+/* name_buckets: Stores the distinct trigram buckets of a string, in
+   increasing order. Returns how many there are.
+ */
+static unsigned int name_buckets(name_index_t *index, const char *name, size_t len, uint32_t *buckets) {
+
+  unsigned int count = 0;
+  for (size_t i = 0; i + 3 <= len; i++) {
+    uint32_t bucket = trigram_bucket(index, name + i);
+    unsigned int j = count;
+    while (j > 0 && buckets[j - 1] > bucket)
+      j--;
+    if (j > 0 && buckets[j - 1] == bucket)
+      continue;
+    memmove(&buckets[j + 1], &buckets[j], (count - j) * sizeof(uint32_t));
+    buckets[j] = bucket;
+    count++;
+  }
+  return count;
+}
+
+/* build_trigrams: Builds the postings of every trigram bucket, with a
+   counting sort over the entries (so each list is sorted).
+ */
+static int build_trigrams(name_index_t *index) {
+
+  uint32_t num_buckets = MIN_TRIGRAM_BUCKETS;
+  while (num_buckets < index->num_entries && num_buckets < MAX_TRIGRAM_BUCKETS)
+    num_buckets <<= 1;
+  index->bucket_shift = 32;
+  for (uint32_t n = num_buckets; n > 1; n >>= 1)
+    index->bucket_shift--;
+
+  uint32_t buckets[255];
+  uint64_t total = 0;
+  index->buckets = calloc(num_buckets + 1, sizeof(uint32_t));
+  if (!index->buckets)
+    return -1;
+  for (uint32_t e = 0; e < index->num_entries; e++) {
+    name_entry_t *entry = &index->entries[e];
+    unsigned int count = name_buckets(index, index->names + entry->name, entry->name_len, buckets);
+    for (unsigned int i = 0; i < count; i++)
+      index->buckets[buckets[i] + 1]++;
+    total += count;
+  }
+  if (total > UINT32_MAX)
+    return -1;
+  for (uint32_t b = 0; b < num_buckets; b++)
+    index->buckets[b + 1] += index->buckets[b];
+
+  index->postings = malloc((total ? total : 1) * sizeof(uint32_t));
+  uint32_t *next = malloc(num_buckets * sizeof(uint32_t));
+  if (!index->postings || !next) {
+    free(next);
+    return -1;
+  }
+  memcpy(next, index->buckets, num_buckets * sizeof(uint32_t));
+  for (uint32_t e = 0; e < index->num_entries; e++) {
+    name_entry_t *entry = &index->entries[e];
+    unsigned int count = name_buckets(index, index->names + entry->name, entry->name_len, buckets);
+    for (unsigned int i = 0; i < count; i++)
+      index->postings[next[buckets[i]]++] = e;
+  }
+  free(next);
+  return 0;
+}
+
+/* build_name_index: Scans every directory of a volume and builds an
+   index of the names of all files.
+
+   Parameters:
+     volume: Pointer to volume.
+     threads: Number of threads listing directories in parallel (see
+              run_workers).
+
+   Directories that cannot be read are skipped (see name_index_stats).
+   The index is not updated if the volume is modified afterwards.
+
+   Returns:
+     A pointer to the new index, or NULL (with errno set to ENOMEM or
+     EIO) if it could not be built.
+ */
+name_index_t *build_name_index(volume_t *volume, unsigned int threads) {
+
+  index_scan_t scan = { .volume = volume };
+  name_index_t *index = calloc(1, sizeof(name_index_t));
+  scan.index = index;
+  scan.visited = calloc(volume->super.s_inodes_count / 8 + 1, 1);
+  if (!index || !scan.visited) {
+    free(scan.visited);
+    free(index);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  // The root directory is entry 0, with an empty name
+  scan_batch_t root = { .entries = &(name_entry_t) { .inode_no = EXT2_ROOT_INO, .mode = S_IFDIR },
+                        .num_entries = 1, .names = (char *) "", .names_size = 1 };
+  pthread_mutex_init(&scan.lock, NULL);
+  pthread_cond_init(&scan.work, NULL);
+  if (add_batch(&scan, 0, &root) < 0)
+    scan.failed = 1;
+
+  run_workers(scan_thread, &scan, scan.failed ? 0 : threads);
+  pthread_cond_destroy(&scan.work);
+  pthread_mutex_destroy(&scan.lock);
+  free(scan.queue);
+  free(scan.visited);
+
+  if (scan.failed || build_trigrams(index) < 0) {
+    destroy_name_index(index);
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (index->num_entries == 1 && index->errors) {
+    destroy_name_index(index); // Not even the root directory was read
+    errno = EIO;
+    return NULL;
+  }
+  return index;
+}
+
+void destroy_name_index(name_index_t *index) {
+  if (!index)
+    return;
+  free(index->entries);
+  free(index->names);
+  free(index->buckets);
+  free(index->postings);
+  free(index);
+}
+
+/* pattern_buckets: Finds the trigram buckets every name matching a
+   glob pattern must contain: those of each run of literal characters
+   (outside of bracket expressions, with escapes resolved).
+
+   Returns the number of buckets stored (at most 'max').
+ */
+static unsigned int pattern_buckets(name_index_t *index, const char *pattern, uint32_t *buckets,
+                                    unsigned int max) {
+
+  char run[256];
+  size_t run_len = 0;
+  unsigned int count = 0;
+
+  for (const char *p = pattern; ; p++) {
+    int literal = *p && *p != '*' && *p != '?' && *p != '[' && !(*p == '\\' && !p[1]);
+    if (literal && *p == '\\')
+      p++;
+    if (literal && run_len < sizeof(run)) {
+      run[run_len++] = *p;
+      continue;
+    }
+
+    // End of a run: adds its buckets that are not there yet
+    uint32_t run_buckets[256];
+    unsigned int run_count = name_buckets(index, run, run_len, run_buckets);
+    for (unsigned int i = 0; i < run_count && count < max; i++) {
+      unsigned int j = 0;
+      while (j < count && buckets[j] != run_buckets[i])
+        j++;
+      if (j == count)
+        buckets[count++] = run_buckets[i];
+    }
+    run_len = 0;
+
+    if (!*p)
+      break;
+    if (*p == '[') {
+      // Skips the bracket expression (']' right after '[' or '[!' is literal)
+      const char *end = p + 1;
+      if (*end == '!' || *end == '^')
+        end++;
+      if (*end == ']')
+        end++;
+      end = strchr(end, ']');
+      if (end)
+        p = end;
+    }
+  }
+  return count;
+}
+
+/* search_name_index: Finds the files whose name matches a glob
+   pattern, as in "find -name". An exact name is a pattern without
+   wildcards, and a substring query is "*substring*".
+
+   Parameters:
+     index: Index built with build_name_index.
+     pattern: Pattern, with the syntax of fnmatch(3) (no flags).
+     matches: Set to a newly allocated array with the entry of each
+              matching file, in no particular order, to be freed by
+              the caller (NULL if there are no matches).
+
+   Returns:
+     The number of matches, or -1 (ENOMEM) in case of error.
+ */
+int64_t search_name_index(name_index_t *index, const char *pattern, uint32_t **matches) {
+
+  uint32_t buckets[64];
+  unsigned int num_buckets = pattern_buckets(index, pattern, buckets, 64);
+  const uint32_t *candidates = NULL;
+  uint32_t *scratch = NULL;
+  uint64_t num_candidates = index->num_entries;
+
+  *matches = NULL;
+  if (num_buckets > 0) {
+    // Intersects the postings lists, starting with the shortest one
+    unsigned int shortest = 0;
+    for (unsigned int i = 1; i < num_buckets; i++)
+      if (index->buckets[buckets[i] + 1] - index->buckets[buckets[i]] <
+          index->buckets[buckets[shortest] + 1] - index->buckets[buckets[shortest]])
+        shortest = i;
+    candidates = index->postings + index->buckets[buckets[shortest]];
+    num_candidates = index->buckets[buckets[shortest] + 1] - index->buckets[buckets[shortest]];
+    for (unsigned int i = 0; i < num_buckets && num_candidates > 0; i++) {
+      if (i == shortest)
+        continue;
+      if (!scratch && !(scratch = malloc(num_candidates * sizeof(uint32_t)))) {
+        errno = ENOMEM;
+        return -1;
+      }
+      const uint32_t *list = index->postings + index->buckets[buckets[i]];
+      uint32_t list_len = index->buckets[buckets[i] + 1] - index->buckets[buckets[i]];
+      uint64_t kept = 0;
+      for (uint64_t c = 0, l = 0; c < num_candidates && l < list_len; ) {
+        if (candidates[c] < list[l])
+          c++;
+        else if (candidates[c] > list[l])
+          l++;
+        else {
+          scratch[kept++] = candidates[c++];
+          l++;
+        }
+      }
+      candidates = scratch;
+      num_candidates = kept;
+    }
+  }
+
+  uint32_t *results = malloc((num_candidates ? num_candidates : 1) * sizeof(uint32_t));
+  if (!results) {
+    free(scratch);
+    errno = ENOMEM;
+    return -1;
+  }
+  int64_t count = 0;
+  for (uint64_t c = 0; c < num_candidates; c++) {
+    uint32_t e = candidates ? candidates[c] : c;
+    if (e != 0 && fnmatch(pattern, index->names + index->entries[e].name, 0) == 0)
+      results[count++] = e;
+  }
+  free(scratch);
+  if (count == 0)
+    free(results);
+  else
+    *matches = results;
+  return count;
+}
+
+/* name_index_path: Builds the full path of an entry of the index.
+
+   Parameters:
+     index: Index built with build_name_index.
+     entry: Entry, as returned by search_name_index.
+     buffer: Where the path is stored, null-terminated (truncated if
+             it does not fit).
+     size: Size of the buffer.
+     inode_no: If not NULL, set to the inode number of the file.
+
+   Returns:
+     The length of the full path (which may be 'size' or more if it
+     was truncated), or -1 (EINVAL) if the entry does not exist.
+ */
+ssize_t name_index_path(name_index_t *index, uint32_t entry, char *buffer, size_t size, uint32_t *inode_no) {
+
+  if (entry >= index->num_entries) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (inode_no)
+    *inode_no = index->entries[entry].inode_no;
+
+  size_t length = 0;
+  for (uint32_t e = entry; e != 0; e = index->entries[e].parent)
+    length += 1 + index->entries[e].name_len;
+  if (length == 0)
+    length = 1; // Root directory
+
+  if (size > 0) {
+    size_t end = length < size ? length : size - 1;
+    buffer[end] = '\0';
+    size_t pos = length;
+    for (uint32_t e = entry; e != 0; e = index->entries[e].parent) {
+      name_entry_t *node = &index->entries[e];
+      pos -= node->name_len;
+      for (size_t i = 0; i < node->name_len; i++)
+        if (pos + i < end)
+          buffer[pos + i] = index->names[node->name + i];
+      if (--pos < end)
+        buffer[pos] = '/';
+    }
+    if (entry == 0 && end > 0)
+      buffer[0] = '/';
+  }
+  return length;
+}
+
+/* name_index_stats: Returns the number of entries in an index
+   (including the root directory), the memory it uses, and how many
+   directories could not be read when it was built.
+ */
+void name_index_stats(name_index_t *index, uint32_t *entries, size_t *bytes, uint32_t *errors) {
+  *entries = index->num_entries;
+  *bytes = sizeof(name_index_t) + index->num_entries * sizeof(name_entry_t) + index->names_size +
+           ((1U << (32 - index->bucket_shift)) + 1 + index->buckets[1U << (32 - index->bucket_shift)]) *
+           sizeof(uint32_t);
+  *errors = index->errors;
+}
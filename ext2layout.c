@@ -0,0 +1,131 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Walks the block map of a file, in the order a sequential read
+   visits it, and accumulates a file_layout_t.
+ */
+typedef struct layout_walker {
+  volume_t *volume;
+  file_layout_t *layout;
+  uint32_t *tables;       // One block of entries per level of indirection
+  uint32_t last_accessed; // Last block read from the volume (0 if none)
+  uint32_t last_data;     // Last data block (0 if none)
+  uint64_t last_logical;  // Logical index of last_data
+} layout_walker_t;
+
+/* layout_access: Records that a sequential read reads block
+   'block_no' from the volume next.
+ */
+static void layout_access(layout_walker_t *w, uint32_t block_no) {
+  if (w->last_accessed == 0 || block_no != w->last_accessed + 1)
+    w->layout->seeks++;
+  w->last_accessed = block_no;
+}
+
+/* layout_walk_table: Adds the blocks in [base, end) mapped by a table
+   of block numbers, where entry i covers 'span' blocks starting at
+   logical block base + i * span. With depth 0, each entry is a data
+   block; otherwise it is a table of the next level. 'chain' is the
+   number of allocated tables read to reach this one, which the read
+   path reads again for every block it maps.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int layout_walk_table(layout_walker_t *w, uint32_t *table, uint32_t entries, int depth,
+                             uint64_t span, uint64_t base, uint64_t end, uint32_t chain) {
+
+  volume_t *volume = w->volume;
+  file_layout_t *layout = w->layout;
+  uint32_t per_block = volume->block_size / 4;
+
+  for (uint32_t i = 0; i < entries && base + i * span < end; i++) {
+    uint64_t start = base + i * span;
+    uint64_t count = start + span < end ? span : end - start;
+
+    if (table[i] == 0) {
+      layout->hole_blocks += count;
+      layout->block_preads += count * chain;
+    } else if (depth == 0) {
+      layout->data_blocks++;
+      layout->block_preads += chain + 1;
+      layout_access(w, table[i]);
+      if (w->last_data == 0 || table[i] != w->last_data + 1 || start != w->last_logical + 1)
+        layout->fragments++;
+      w->last_data = table[i];
+      w->last_logical = start;
+    } else {
+      uint32_t *child = w->tables + (depth - 1) * per_block;
+      layout->indirect_blocks++;
+      layout_access(w, table[i]);
+      if (read_block(volume, table[i], 0, volume->block_size, child) != volume->block_size)
+        return -1;
+      if (layout_walk_table(w, child, per_block, depth - 1, span / per_block, start, end, chain + 1) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* get_file_layout: Describes how the data of a file is laid out on
+   disk, and predicts the cost of reading it sequentially.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode: Pointer to inode structure for the file.
+     layout: Structure where the results are stored:
+       data_blocks: Allocated data blocks.
+       hole_blocks: Blocks within the file size that are not allocated.
+       fragments: Runs of data blocks that are contiguous both in the
+                  file and on disk.
+       indirect_blocks: Indirect blocks read to map the data.
+       seeks: Discontinuities in the sequence of blocks a sequential
+              read visits, reading each indirect block once (the
+              first block counts as one).
+       block_preads: Reads issued by read_file_content for a
+                     sequential read without a block cache, which
+                     reads the indirect blocks again for every block.
+
+   Returns:
+     0 on success, or -1 in case of error.
+ */
+int get_file_layout(volume_t *volume, inode_t *inode, file_layout_t *layout) {
+
+  uint64_t per_block = volume->block_size / 4;
+  uint64_t end = (inode_file_size(volume, inode) + volume->block_size - 1) / volume->block_size;
+  layout_walker_t w = { .volume = volume, .layout = layout };
+  int rv = 0;
+
+  memset(layout, 0, sizeof(file_layout_t));
+  if (end == 0)
+    return 0;
+  if (inode_is_symlink(inode) && inode->i_size < sizeof(inode->i_symlink_target))
+    return 0; // Target is stored in the inode itself
+
+  w.tables = malloc(3 * volume->block_size);
+  if (!w.tables)
+    return -1;
+
+  // Direct blocks, followed by the 1-, 2- and 3-indirect trees
+  uint32_t roots[3] = { inode->i_block_1ind, inode->i_block_2ind, inode->i_block_3ind };
+  uint64_t base = 12, span = 1;
+  rv = layout_walk_table(&w, inode->i_block, 12, 0, 1, 0, end, 0);
+  for (int depth = 1; depth <= 3 && rv == 0 && base < end; depth++) {
+    span *= per_block;
+    rv = layout_walk_table(&w, &roots[depth - 1], 1, depth, span, base, end, 0);
+    base += span;
+  }
+  free(w.tables);
+  return rv;
+}
+
+/* file_layout_contiguity: Returns the fraction of consecutive pairs of
+   data blocks that are also adjacent on disk: 1 for a file stored in
+   a single fragment, 0 if no two blocks are adjacent.
+ */
+double file_layout_contiguity(const file_layout_t *layout) {
+  if (layout->data_blocks <= 1)
+    return 1.0;
+  return (double) (layout->data_blocks - layout->fragments) / (layout->data_blocks - 1);
+}
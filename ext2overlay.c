@@ -0,0 +1,523 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Copy-on-write overlays. An overlay backend sits between a volume
+   and its (read-only) storage backend: blocks that were written are
+   stored in a per-mount delta file, and every other block is read
+   from the base backend, which is never modified. Creating an
+   overlay only writes the delta file header, so any number of
+   writable mounts can share one base image (and its page cache).
+
+   Delta file format:
+
+     header (DELTA_HEADER_SIZE bytes)
+     slot 0, slot 1, ...   (one volume block each)
+     remap table           (one uint32_t block number per slot)
+
+   Slots are appended as blocks are first written; the remap table
+   records which block each slot holds. It is kept in memory while the
+   overlay is open and written after the last slot by sync_overlay. A
+   header with table_offset 0 marks a delta file that was not synced
+   after its last new slot, which cannot be reopened.
+ */
+
+#define DELTA_MAGIC       "EXT2DLTA"
+#define DELTA_VERSION     1
+#define DELTA_HEADER_SIZE 4096
+
+typedef struct delta_header {
+  char     magic[8];      // DELTA_MAGIC
+  uint32_t version;       // DELTA_VERSION
+  uint32_t block_size;    // Size of each slot
+  uint64_t base_size;     // Size of the base volume the delta applies to
+  uint32_t num_slots;
+  uint32_t reserved;
+  uint64_t table_offset;  // Offset of the remap table, or 0 if not synced
+} delta_header_t;
+
+typedef struct overlay_backend {
+  volume_backend_t backend;
+  volume_backend_t *base;
+  int delta_fd;
+  delta_header_t header;
+  uint32_t block_shift;
+  int dirty;              // Slots were added since the last sync
+
+  pthread_rwlock_t map_lock;
+  uint32_t *keys;         // Hash table of block number + 1 (0 if empty)
+  uint32_t *slots;        // Slot of each key
+  uint32_t map_mask;      // Table size - 1 (a power of two minus one)
+  uint32_t *slot_blocks;  // Block held by each slot (the remap table)
+  uint32_t max_slots;     // Capacity of slot_blocks
+
+  pthread_mutex_t write_lock;
+  char *scratch;          // One block, used to complete partial writes
+} overlay_backend_t;
+
+static inline uint64_t slot_offset(overlay_backend_t *o, uint32_t slot) {
+  return DELTA_HEADER_SIZE + ((uint64_t) slot << o->block_shift);
+}
+
+static inline uint32_t map_hash(uint32_t block_no) {
+  return block_no * 2654435761u;
+}
+
+/* write_delta_header: Writes the header at the start of a delta file.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int write_delta_header(int delta_fd, const delta_header_t *header) {
+  return pwrite(delta_fd, header, sizeof(delta_header_t), 0) == sizeof(delta_header_t) ? 0 : -1;
+}
+
+/* overlay_lookup: Returns the slot holding a block, or -1 if the block
+   was never written. Must be called with map_lock held.
+ */
+static int64_t overlay_lookup(overlay_backend_t *o, uint64_t block_no) {
+  if (!o->keys || block_no >= UINT32_MAX)
+    return -1;
+  for (uint32_t i = map_hash(block_no) & o->map_mask; o->keys[i]; i = (i + 1) & o->map_mask)
+    if (o->keys[i] == block_no + 1)
+      return o->slots[i];
+  return -1;
+}
+
+/* overlay_insert: Records that 'slot' holds 'block_no', growing the
+   hash table and remap table as needed. Must be called with map_lock
+   held for writing.
+
+   Returns 0 on success, or -1 if memory could not be allocated.
+ */
+static int overlay_insert(overlay_backend_t *o, uint32_t block_no, uint32_t slot) {
+
+  if (slot >= o->max_slots) {
+    uint32_t max_slots = o->max_slots ? o->max_slots * 2 : 1024;
+    uint32_t *slot_blocks = realloc(o->slot_blocks, max_slots * sizeof(uint32_t));
+    if (!slot_blocks)
+      return -1;
+    o->slot_blocks = slot_blocks;
+    o->max_slots = max_slots;
+  }
+
+  if (2 * (slot + 1) > o->map_mask) {
+    uint32_t mask = o->map_mask ? o->map_mask * 2 + 1 : 2047;
+    uint32_t *keys = calloc(mask + 1, sizeof(uint32_t));
+    uint32_t *slots = malloc((mask + 1) * sizeof(uint32_t));
+    if (!keys || !slots) {
+      free(keys);
+      free(slots);
+      return -1;
+    }
+    for (uint32_t s = 0; s < slot; s++) {
+      uint32_t i = map_hash(o->slot_blocks[s]) & mask;
+      while (keys[i])
+        i = (i + 1) & mask;
+      keys[i] = o->slot_blocks[s] + 1;
+      slots[i] = s;
+    }
+    free(o->keys);
+    free(o->slots);
+    o->keys = keys;
+    o->slots = slots;
+    o->map_mask = mask;
+  }
+
+  uint32_t i = map_hash(block_no) & o->map_mask;
+  while (o->keys[i])
+    i = (i + 1) & o->map_mask;
+  o->keys[i] = block_no + 1;
+  o->slots[i] = slot;
+  o->slot_blocks[slot] = block_no;
+  return 0;
+}
+
+/* overlay_pread: Reads data block by block from the delta file or the
+   base backend. Runs of blocks that were never written are read from
+   the base with a single call.
+ */
+static ssize_t overlay_pread(volume_backend_t *backend, void *buffer, size_t size, uint64_t offset) {
+
+  overlay_backend_t *o = (overlay_backend_t *) backend;
+  uint32_t block_size = 1U << o->block_shift;
+  size_t done = 0;
+
+  pthread_rwlock_rdlock(&o->map_lock);
+  while (done < size) {
+    uint64_t pos = offset + done;
+    uint64_t block_no = pos >> o->block_shift;
+    size_t chunk = block_size - (pos & (block_size - 1));
+    if (chunk > size - done)
+      chunk = size - done;
+
+    ssize_t bytes;
+    int64_t slot = overlay_lookup(o, block_no);
+    if (slot >= 0) {
+      bytes = pread(o->delta_fd, (char *) buffer + done, chunk,
+                    slot_offset(o, slot) + (pos & (block_size - 1)));
+    } else {
+      while (done + chunk < size && overlay_lookup(o, ++block_no) < 0)
+        chunk += size - done - chunk < block_size ? size - done - chunk : block_size;
+      bytes = o->base->pread(o->base, (char *) buffer + done, chunk, pos);
+    }
+    if (bytes <= 0) {
+      pthread_rwlock_unlock(&o->map_lock);
+      return done ? (ssize_t) done : bytes;
+    }
+    done += bytes;
+    if ((size_t) bytes < chunk)
+      break;
+  }
+  pthread_rwlock_unlock(&o->map_lock);
+  return done;
+}
+
+/* overlay_pwrite: Writes data to the delta file. The first write to a
+   block copies it into a new slot (completing partial writes with the
+   base data); later writes update the slot in place.
+ */
+static ssize_t overlay_pwrite(volume_backend_t *backend, const void *buffer, size_t size, uint64_t offset) {
+
+  overlay_backend_t *o = (overlay_backend_t *) backend;
+  uint32_t block_size = 1U << o->block_shift;
+  size_t done = 0;
+
+  if (offset + size > o->backend.size) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  pthread_mutex_lock(&o->write_lock);
+  while (done < size) {
+    uint64_t pos = offset + done;
+    uint64_t block_no = pos >> o->block_shift;
+    uint32_t in_block = pos & (block_size - 1);
+    size_t chunk = block_size - in_block;
+    if (chunk > size - done)
+      chunk = size - done;
+
+    pthread_rwlock_rdlock(&o->map_lock);
+    int64_t slot = overlay_lookup(o, block_no);
+    pthread_rwlock_unlock(&o->map_lock);
+
+    if (slot >= 0) {
+      if (pwrite(o->delta_fd, (const char *) buffer + done, chunk, slot_offset(o, slot) + in_block) != chunk)
+        goto error;
+    } else {
+      if (!o->dirty) {
+        // Invalidates the table on disk before it is overwritten
+        o->header.table_offset = 0;
+        if (write_delta_header(o->delta_fd, &o->header) < 0)
+          goto error;
+        o->dirty = 1;
+      }
+      slot = o->header.num_slots;
+      if (chunk < block_size) {
+        ssize_t bytes = o->base->pread(o->base, o->scratch, block_size, block_no << o->block_shift);
+        if (bytes < 0)
+          goto error;
+        memset(o->scratch + bytes, 0, block_size - bytes);
+        memcpy(o->scratch + in_block, (const char *) buffer + done, chunk);
+        if (pwrite(o->delta_fd, o->scratch, block_size, slot_offset(o, slot)) != block_size)
+          goto error;
+      } else if (pwrite(o->delta_fd, (const char *) buffer + done, chunk, slot_offset(o, slot)) != chunk) {
+        goto error;
+      }
+      pthread_rwlock_wrlock(&o->map_lock);
+      int rv = overlay_insert(o, block_no, slot);
+      pthread_rwlock_unlock(&o->map_lock);
+      if (rv < 0)
+        goto error;
+      o->header.num_slots++;
+    }
+    done += chunk;
+  }
+  pthread_mutex_unlock(&o->write_lock);
+  return done;
+
+error:
+  pthread_mutex_unlock(&o->write_lock);
+  return -1;
+}
+
+/* overlay_sync: Writes the remap table and header of the delta file
+   and flushes it to disk. Must be called with write_lock held.
+ */
+static int overlay_sync(overlay_backend_t *o) {
+
+  uint64_t table_offset = slot_offset(o, o->header.num_slots);
+  size_t table_size = o->header.num_slots * sizeof(uint32_t);
+
+  if (table_size > 0 && pwrite(o->delta_fd, o->slot_blocks, table_size, table_offset) != table_size)
+    return -1;
+  if (ftruncate(o->delta_fd, table_offset + table_size) == -1)
+    return -1;
+  o->header.table_offset = table_offset;
+  if (write_delta_header(o->delta_fd, &o->header) < 0 ||
+      fsync(o->delta_fd) == -1)
+    return -1;
+  o->dirty = 0;
+  return 0;
+}
+
+/* overlay_close_detached: Frees an overlay without closing its base
+   backend.
+ */
+static void overlay_close_detached(overlay_backend_t *o) {
+
+  if (o->dirty)
+    overlay_sync(o);
+  close(o->delta_fd);
+  pthread_rwlock_destroy(&o->map_lock);
+  pthread_mutex_destroy(&o->write_lock);
+  free(o->keys);
+  free(o->slots);
+  free(o->slot_blocks);
+  free(o->scratch);
+  free(o);
+}
+
+static void overlay_close(volume_backend_t *backend) {
+  overlay_backend_t *o = (overlay_backend_t *) backend;
+  volume_backend_t *base = o->base;
+  overlay_close_detached(o);
+  base->close(base);
+}
+
+/* read_delta_header: Reads and validates the header of a delta file,
+   and its remap table if 'table' is not NULL (to be freed by the
+   caller).
+
+   Returns 0 on success, or -1 with errno set (EINVAL if the file is
+   not a valid, synced delta file, or remaps a block beyond the end of
+   the base volume).
+ */
+static int read_delta_header(int delta_fd, delta_header_t *header, uint32_t **table) {
+
+  if (pread(delta_fd, header, sizeof(delta_header_t), 0) != sizeof(delta_header_t) ||
+      memcmp(header->magic, DELTA_MAGIC, sizeof(header->magic)) || header->version != DELTA_VERSION ||
+      header->block_size < 1024 || (header->block_size & (header->block_size - 1)) ||
+      (header->num_slots > 0 && header->table_offset == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!table)
+    return 0;
+
+  size_t table_size = header->num_slots * sizeof(uint32_t);
+  *table = malloc(table_size ? table_size : 1);
+  if (!*table)
+    return -1;
+  if (table_size > 0 && pread(delta_fd, *table, table_size, header->table_offset) != table_size)
+    goto invalid;
+  // Every remapped block must lie within the base volume
+  for (uint32_t s = 0; s < header->num_slots; s++)
+    if (((uint64_t) (*table)[s] + 1) * header->block_size > header->base_size)
+      goto invalid;
+  return 0;
+
+invalid:
+  free(*table);
+  errno = EINVAL;
+  return -1;
+}
+
+/* attach_overlay: Makes a volume writable without modifying its
+   storage: from now on, written blocks are kept in a delta file, and
+   reads return the latest data. If the delta file does not exist, it
+   is created (in constant time); otherwise the writes it holds are
+   applied again.
+
+   Parameters:
+     volume: Pointer to volume.
+     delta_path: Path of the delta file.
+
+   Returns:
+     0 on success. Returns -1 and sets errno in case of error (EINVAL
+     if the delta file is invalid, was not synced, or belongs to a
+     volume of a different size or block size, or if the volume has a
+     hash tree attached).
+ */
+int attach_overlay(volume_t *volume, const char *delta_path) {
+
+  if (volume->verity) {
+    // Written blocks would no longer match the tree
+    errno = EINVAL;
+    return -1;
+  }
+  overlay_backend_t *o = calloc(1, sizeof(overlay_backend_t));
+  if (!o)
+    return -1;
+  o->delta_fd = open(delta_path, O_RDWR | O_CREAT, 0644);
+  o->scratch = malloc(volume->block_size);
+  if (o->delta_fd == -1 || !o->scratch)
+    goto error;
+  o->block_shift = volume->block_shift;
+
+  struct stat st;
+  uint32_t *table = NULL;
+  if (fstat(o->delta_fd, &st) == -1)
+    goto error;
+  if (st.st_size == 0) {
+    memcpy(o->header.magic, DELTA_MAGIC, sizeof(o->header.magic));
+    o->header.version = DELTA_VERSION;
+    o->header.block_size = volume->block_size;
+    o->header.base_size = volume->backend->size;
+    o->header.table_offset = DELTA_HEADER_SIZE;
+    if (write_delta_header(o->delta_fd, &o->header) < 0 ||
+        ftruncate(o->delta_fd, DELTA_HEADER_SIZE) == -1)
+      goto error;
+  } else if (read_delta_header(o->delta_fd, &o->header, &table) < 0) {
+    goto error;
+  } else if (o->header.block_size != volume->block_size || o->header.base_size != volume->backend->size) {
+    free(table);
+    errno = EINVAL;
+    goto error;
+  }
+
+  for (uint32_t s = 0; s < o->header.num_slots; s++) {
+    if (overlay_insert(o, table[s], s) < 0) {
+      free(table);
+      goto error;
+    }
+  }
+  free(table);
+
+  pthread_rwlock_init(&o->map_lock, NULL);
+  pthread_mutex_init(&o->write_lock, NULL);
+  o->base = volume->backend;
+  o->backend.pread = overlay_pread;
+  o->backend.pwrite = overlay_pwrite;
+  o->backend.close = overlay_close;
+  o->backend.size = o->base->size;
+
+  // Blocks cached from the base, and the metadata read when the volume
+  // was opened, may have been overwritten by the delta file
+  block_cache_t *cache = volume->cache;
+  detach_block_cache(volume);
+  volume->backend = &o->backend;
+  volume->fd = -1; // Reads may no longer bypass the backend
+  if (o->header.num_slots > 0 &&
+      (volume_pread(volume, &volume->super, sizeof(superblock_t), 1024) != sizeof(superblock_t) ||
+       volume_pread(volume, volume->groups, volume->num_groups * sizeof(group_desc_t),
+                    volume->block_size == 1024 ? 2048 : volume->block_size) < 0)) {
+    volume->backend = o->base; // The caller still owns the volume
+    overlay_close_detached(o);
+    errno = EIO;
+    return -1;
+  }
+  if (cache)
+    attach_block_cache(volume, cache);
+  return 0;
+
+error:
+  if (o->delta_fd != -1)
+    close(o->delta_fd);
+  free(o->keys);
+  free(o->slots);
+  free(o->slot_blocks);
+  free(o->scratch);
+  free(o);
+  return -1;
+}
+
+/* sync_overlay: Makes the writes to a volume with an overlay durable,
+   so that the delta file can be reopened after a crash.
+
+   Returns:
+     0 on success, or -1 in case of error (including if the volume
+     has no overlay).
+ */
+int sync_overlay(volume_t *volume) {
+
+  if (volume->backend->close != overlay_close) {
+    errno = EINVAL;
+    return -1;
+  }
+  overlay_backend_t *o = (overlay_backend_t *) volume->backend;
+  pthread_mutex_lock(&o->write_lock);
+  int rv = o->dirty ? overlay_sync(o) : fsync(o->delta_fd);
+  pthread_mutex_unlock(&o->write_lock);
+  return rv;
+}
+
+/* commit_delta: Applies the writes held in a delta file to the volume
+   file it was created for. The delta file is left unchanged (see
+   discard_delta).
+
+   Parameters:
+     delta_fd: Delta file, open for reading.
+     base_fd: Volume file, open for reading and writing.
+
+   Returns:
+     The number of blocks written, or -1 with errno set in case of
+     error (EINVAL if the delta file is invalid or does not match the
+     volume file).
+ */
+int64_t commit_delta(int delta_fd, int base_fd) {
+
+  delta_header_t header;
+  uint32_t *table;
+  struct stat st;
+
+  if (read_delta_header(delta_fd, &header, &table) < 0)
+    return -1;
+  if (fstat(base_fd, &st) == -1 || (uint64_t) st.st_size != header.base_size) {
+    free(table);
+    errno = EINVAL;
+    return -1;
+  }
+
+  char *block = malloc(header.block_size);
+  int64_t rv = block ? header.num_slots : -1;
+  for (uint32_t s = 0; s < header.num_slots && rv >= 0; s++) {
+    if (pread(delta_fd, block, header.block_size, DELTA_HEADER_SIZE + (uint64_t) s * header.block_size)
+        != header.block_size ||
+        pwrite(base_fd, block, header.block_size, (uint64_t) table[s] * header.block_size) != header.block_size)
+      rv = -1;
+  }
+  if (rv >= 0 && fsync(base_fd) == -1)
+    rv = -1;
+  free(block);
+  free(table);
+  return rv;
+}
+
+/* discard_delta: Drops all the writes held in a delta file, which then
+   behaves as if it had just been created.
+
+   Parameters:
+     delta_fd: Delta file, open for reading and writing.
+
+   Returns:
+     The number of blocks dropped, or -1 with errno set in case of
+     error.
+ */
+int64_t discard_delta(int delta_fd) {
+
+  delta_header_t header;
+  if (read_delta_header(delta_fd, &header, NULL) < 0)
+    return -1;
+
+  uint32_t num_slots = header.num_slots;
+  header.num_slots = 0;
+  header.table_offset = DELTA_HEADER_SIZE;
+  if (ftruncate(delta_fd, DELTA_HEADER_SIZE) == -1 ||
+      write_delta_header(delta_fd, &header) < 0 ||
+      fsync(delta_fd) == -1)
+    return -1;
+  return num_slots;
+}
+
+/* count_delta_blocks: Returns the number of blocks held in a delta
+   file, or -1 with errno set if it is not a valid delta file.
+ */
+int64_t count_delta_blocks(int delta_fd) {
+  delta_header_t header;
+  return read_delta_header(delta_fd, &header, NULL) < 0 ? -1 : header.num_slots;
+}
@@ -0,0 +1,306 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* I/O scheduler. A scheduler backend sits between a volume and its
+   storage backend, and limits how many reads are issued to the
+   storage at once, so that a few clients streaming large files cannot
+   fill the device queue and delay every lookup behind them.
+
+   Reads are either metadata (inode tables, bitmaps, directory and
+   indirect blocks: anything a lookup or getattr may wait for) or bulk
+   (the content of regular files). The class is set per thread with
+   set_io_class; read_data_block marks the data reads of regular files
+   as bulk, and everything else is metadata.
+
+   At most 'depth' reads are in flight, and bulk reads may only use
+   'bulk_depth' of these slots, so that a metadata read never waits for
+   more than the bulk reads already in flight. Waiting metadata reads
+   are always started first, in arrival order. Waiting bulk reads are
+   grouped in streams (one per file, see set_io_stream), which are
+   served in turn, one read each; bulk reads larger than
+   SCHED_MAX_BULK_READ are split, so that streams share the bandwidth
+   in equal pieces. Every waiting thread has a single read queued, so
+   queues are bounded by the number of reading threads.
+
+   Reads are done by the threads that request them: the scheduler only
+   decides when each one may start.
+ */
+
+#define SCHED_MAX_BULK_READ (128 << 10)
+
+typedef struct io_request {
+  pthread_cond_t cond;
+  int started;
+  struct io_request *next;
+} io_request_t;
+
+// Bulk reads waiting for the same file
+typedef struct io_stream {
+  uint64_t key;
+  io_request_t *head, *tail;
+  struct io_stream *prev, *next; // Ring of the streams with waiting reads
+} io_stream_t;
+
+struct io_scheduler {
+  volume_backend_t backend;
+  volume_backend_t *base;
+  unsigned int depth;      // Reads in flight at most
+  unsigned int bulk_depth; // Bulk reads in flight at most
+
+  pthread_mutex_t lock;    // Protects all fields below
+  unsigned int in_flight;
+  unsigned int bulk_in_flight;
+  io_request_t *metadata_head, *metadata_tail;
+  io_stream_t *streams;    // Next stream to be served, or NULL
+  io_stream_t *spare;      // Streams kept for reuse, linked through next
+  io_scheduler_stats_t stats;
+};
+
+static __thread io_class_t thread_io_class = IO_METADATA;
+static __thread uint64_t thread_io_stream;
+
+/* set_io_class: Sets the class of the reads made by the calling thread
+   from now on (IO_METADATA by default).
+
+   Returns the previous class.
+ */
+io_class_t set_io_class(io_class_t io_class) {
+  io_class_t previous = thread_io_class;
+  thread_io_class = io_class;
+  return previous;
+}
+
+/* set_io_stream: Sets the stream the bulk reads of the calling thread
+   belong to, e.g. the inode number of the file being read. Bulk reads
+   of the same stream are served in order, and streams are served in
+   turn. With 0 (the default), each thread is a stream of its own.
+ */
+void set_io_stream(uint64_t stream) {
+  thread_io_stream = stream;
+}
+
+/* start_waiting: Starts as many waiting reads as the free slots allow,
+   metadata first. Must be called with the scheduler lock held.
+ */
+static void start_waiting(struct io_scheduler *s) {
+
+  while (s->in_flight < s->depth) {
+    io_request_t *request = s->metadata_head;
+    if (request) {
+      s->metadata_head = request->next;
+    } else if (s->streams && s->bulk_in_flight < s->bulk_depth) {
+      io_stream_t *stream = s->streams;
+      request = stream->head;
+      stream->head = request->next;
+      s->streams = stream->next;
+      if (!stream->head) {
+        // The stream has nothing left to read: it leaves the ring
+        if (stream->next == stream) {
+          s->streams = NULL;
+        } else {
+          stream->prev->next = stream->next;
+          stream->next->prev = stream->prev;
+        }
+        stream->next = s->spare;
+        s->spare = stream;
+      }
+      s->bulk_in_flight++;
+    } else {
+      break;
+    }
+    s->in_flight++;
+    request->started = 1;
+    pthread_cond_signal(&request->cond);
+  }
+}
+
+/* queue_bulk: Adds a bulk read at the end of its stream, adding the
+   stream to the ring (just before the next stream to be served) if it
+   had no waiting reads. Must be called with the scheduler lock held.
+
+   Returns 0 on success, or -1 if the stream could not be allocated.
+ */
+static int queue_bulk(struct io_scheduler *s, uint64_t key, io_request_t *request) {
+
+  io_stream_t *stream = s->streams;
+  if (stream) {
+    do {
+      if (stream->key == key) {
+        stream->tail->next = request;
+        stream->tail = request;
+        return 0;
+      }
+      stream = stream->next;
+    } while (stream != s->streams);
+  }
+
+  stream = s->spare;
+  if (stream)
+    s->spare = stream->next;
+  else if (!(stream = malloc(sizeof(io_stream_t))))
+    return -1;
+  stream->key = key;
+  stream->head = stream->tail = request;
+  if (s->streams) {
+    stream->next = s->streams;
+    stream->prev = s->streams->prev;
+    stream->prev->next = stream;
+    s->streams->prev = stream;
+  } else {
+    stream->next = stream->prev = stream;
+    s->streams = stream;
+  }
+  return 0;
+}
+
+/* begin_read: Waits until a read of the given class may start. */
+static void begin_read(struct io_scheduler *s, io_class_t io_class) {
+
+  io_request_t request = { .started = 0, .next = NULL };
+  int bulk = io_class == IO_BULK;
+
+  pthread_mutex_lock(&s->lock);
+  if (bulk)
+    s->stats.bulk_reads++;
+  else
+    s->stats.metadata_reads++;
+
+  // Reads start right away if nothing is waiting and a slot is free
+  if (s->in_flight < s->depth && !s->metadata_head &&
+      (!bulk || (!s->streams && s->bulk_in_flight < s->bulk_depth))) {
+    s->in_flight++;
+    s->bulk_in_flight += bulk;
+    pthread_mutex_unlock(&s->lock);
+    return;
+  }
+
+  pthread_cond_init(&request.cond, NULL);
+  if (!bulk) {
+    s->stats.metadata_waits++;
+    if (s->metadata_head)
+      s->metadata_tail->next = &request;
+    else
+      s->metadata_head = &request;
+    s->metadata_tail = &request;
+  } else {
+    s->stats.bulk_waits++;
+    if (queue_bulk(s, thread_io_stream ? thread_io_stream : (uint64_t) pthread_self(), &request) < 0) {
+      // Without memory for a stream, the read just goes ahead
+      s->in_flight++;
+      s->bulk_in_flight++;
+      request.started = 1;
+    }
+  }
+  start_waiting(s);
+  while (!request.started)
+    pthread_cond_wait(&request.cond, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+  pthread_cond_destroy(&request.cond);
+}
+
+/* end_read: Frees the slot of a finished read, and starts the next
+   waiting ones.
+ */
+static void end_read(struct io_scheduler *s, io_class_t io_class) {
+
+  pthread_mutex_lock(&s->lock);
+  s->in_flight--;
+  s->bulk_in_flight -= io_class == IO_BULK;
+  start_waiting(s);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static ssize_t scheduler_pread(volume_backend_t *backend, void *buffer, size_t size, uint64_t offset) {
+
+  struct io_scheduler *s = (struct io_scheduler *) backend;
+  io_class_t io_class = thread_io_class;
+  size_t done = 0;
+
+  // Metadata reads are never split
+  size_t max_read = io_class == IO_BULK ? SCHED_MAX_BULK_READ : size;
+  do {
+    size_t piece = size - done < max_read ? size - done : max_read;
+    begin_read(s, io_class);
+    ssize_t bytes = s->base->pread(s->base, (char *) buffer + done, piece, offset + done);
+    end_read(s, io_class);
+    if (bytes < 0)
+      return done > 0 ? (ssize_t) done : -1;
+    done += bytes;
+    if ((size_t) bytes < piece)
+      break;
+  } while (done < size);
+  return done;
+}
+
+static void scheduler_close(volume_backend_t *backend) {
+
+  struct io_scheduler *s = (struct io_scheduler *) backend;
+  s->base->close(s->base);
+  while (s->spare) {
+    io_stream_t *next = s->spare->next;
+    free(s->spare);
+    s->spare = next;
+  }
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+}
+
+/* attach_io_scheduler: Makes the reads of a volume go through an I/O
+   scheduler, which serves metadata reads before bulk reads and shares
+   the bandwidth left to bulk reads between the files being read. The
+   scheduler is released with the volume.
+
+   Parameters:
+     volume: Pointer to volume. Must not have an overlay attached (the
+             overlay must be attached after the scheduler).
+     depth: Maximum number of reads in flight.
+     bulk_depth: Maximum number of bulk reads in flight; must be
+                 smaller than 'depth', so that metadata reads always
+                 find a free slot soon.
+
+   Returns:
+     0 on success, or -1 (EINVAL if the depths are invalid, the volume
+     already has a scheduler or has an overlay; ENOMEM).
+ */
+int attach_io_scheduler(volume_t *volume, unsigned int depth, unsigned int bulk_depth) {
+
+  if (volume->scheduler || volume->backend->pwrite || bulk_depth == 0 || bulk_depth >= depth) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct io_scheduler *s = calloc(1, sizeof(struct io_scheduler));
+  if (!s)
+    return -1;
+  s->base = volume->backend;
+  s->depth = depth;
+  s->bulk_depth = bulk_depth;
+  pthread_mutex_init(&s->lock, NULL);
+  s->backend.pread = scheduler_pread;
+  s->backend.pwrite = NULL;
+  s->backend.close = scheduler_close;
+  s->backend.size = s->base->size;
+
+  volume->backend = &s->backend;
+  volume->scheduler = s;
+  return 0;
+}
+
+/* io_scheduler_stats: Reports the number of reads of each class issued
+   through the scheduler of a volume, and how many of them had to wait
+   for a free slot. All counts are 0 if the volume has no scheduler.
+ */
+void io_scheduler_stats(volume_t *volume, io_scheduler_stats_t *stats) {
+
+  struct io_scheduler *s = volume->scheduler;
+  if (!s) {
+    memset(stats, 0, sizeof(io_scheduler_stats_t));
+    return;
+  }
+  pthread_mutex_lock(&s->lock);
+  *stats = s->stats;
+  pthread_mutex_unlock(&s->lock);
+}
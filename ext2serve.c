@@ -0,0 +1,215 @@
+#define _GNU_SOURCE // strcasestr
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Minimal HTTP server for volume files, supporting the Range requests
+   used by the http:// backend, so that it can be tested and
+   benchmarked without any network access. Serves the files of one
+   directory on the loopback interface, with one thread per
+   connection. An artificial delay can be added before each response
+   to simulate the latency of a remote object store.
+ */
+
+#define DEFAULT_PORT   8080
+#define HEADER_SIZE    8192
+#define COPY_SIZE      (256 << 10)
+
+static const char *root;
+static unsigned int latency_ms;
+static int verbose;
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-p port] [-l latency_ms] [-v] directory\n"
+          "  -p  TCP port to listen on, on 127.0.0.1 (default %d)\n"
+          "  -l  delay added before every response, in milliseconds (default 0)\n"
+          "  -v  log every request to stderr\n",
+          prog, DEFAULT_PORT);
+}
+
+static int send_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t bytes = send(fd, data, size, MSG_NOSIGNAL);
+    if (bytes <= 0)
+      return -1;
+    data += bytes;
+    size -= bytes;
+  }
+  return 0;
+}
+
+static int send_status(int fd, int status, const char *reason, const char *extra) {
+  char response[512];
+  int len = snprintf(response, sizeof(response), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n%s\r\n",
+                     status, reason, extra ? extra : "");
+  return send_all(fd, response, len);
+}
+
+/* serve_request: Answers one request, whose headers are in 'request'.
+
+   Returns 0 if the connection can be used for another request, or -1
+   if it must be closed.
+ */
+static int serve_request(int fd, char *request) {
+
+  char method[8], path[1024];
+  if (sscanf(request, "%7s %1023s HTTP/1.%*d", method, path) != 2) {
+    send_status(fd, 400, "Bad Request", NULL);
+    return -1;
+  }
+  int head = !strcmp(method, "HEAD");
+  if (!head && strcmp(method, "GET")) {
+    send_status(fd, 405, "Method Not Allowed", NULL);
+    return -1;
+  }
+  int keep_alive = !strcasestr(request, "\r\nConnection: close");
+  if (latency_ms)
+    usleep(latency_ms * 1000);
+
+  // Only files directly inside the served directory
+  char filename[2048];
+  if (path[0] != '/' || strchr(path + 1, '/') || !strcmp(path, "/.") || !strcmp(path, "/..") ||
+      snprintf(filename, sizeof(filename), "%s%s", root, path) >= (int) sizeof(filename))
+    return send_status(fd, 404, "Not Found", NULL) < 0 || !keep_alive ? -1 : 0;
+  int file = open(filename, O_RDONLY);
+  struct stat st;
+  if (file == -1 || fstat(file, &st) == -1 || !S_ISREG(st.st_mode)) {
+    if (file != -1)
+      close(file);
+    return send_status(fd, 404, "Not Found", NULL) < 0 || !keep_alive ? -1 : 0;
+  }
+
+  uint64_t size = st.st_size, first = 0, last = size ? size - 1 : 0;
+  int ranged = 0;
+  const char *range = strcasestr(request, "\r\nRange: bytes=");
+  if (range) {
+    unsigned long long a, b;
+    int n = sscanf(range + 15, "%llu-%llu", &a, &b);
+    if (n < 1 || a >= size) {
+      char extra[64];
+      snprintf(extra, sizeof(extra), "Content-Range: bytes */%llu\r\n", (unsigned long long) size);
+      close(file);
+      return send_status(fd, 416, "Range Not Satisfiable", extra) < 0 || !keep_alive ? -1 : 0;
+    }
+    first = a;
+    last = n == 2 && b < size ? b : size - 1;
+    ranged = 1;
+  }
+  uint64_t length = size ? last - first + 1 : 0;
+
+  char headers[512];
+  int len;
+  if (ranged)
+    len = snprintf(headers, sizeof(headers),
+                   "HTTP/1.1 206 Partial Content\r\nContent-Length: %llu\r\n"
+                   "Content-Range: bytes %llu-%llu/%llu\r\nAccept-Ranges: bytes\r\n%s\r\n",
+                   (unsigned long long) length, (unsigned long long) first, (unsigned long long) last,
+                   (unsigned long long) size, keep_alive ? "" : "Connection: close\r\n");
+  else
+    len = snprintf(headers, sizeof(headers),
+                   "HTTP/1.1 200 OK\r\nContent-Length: %llu\r\nAccept-Ranges: bytes\r\n%s\r\n",
+                   (unsigned long long) length, keep_alive ? "" : "Connection: close\r\n");
+  if (verbose)
+    fprintf(stderr, "%s %s %llu-%llu\n", method, path, (unsigned long long) first, (unsigned long long) last);
+
+  int rv = send_all(fd, headers, len);
+  char *buffer = malloc(COPY_SIZE);
+  for (uint64_t done = 0; !head && rv == 0 && done < length; ) {
+    size_t chunk = length - done < COPY_SIZE ? length - done : COPY_SIZE;
+    ssize_t bytes = buffer ? pread(file, buffer, chunk, first + done) : -1;
+    if (bytes <= 0 || send_all(fd, buffer, bytes) < 0)
+      rv = -1;
+    done += bytes;
+  }
+  free(buffer);
+  close(file);
+  return rv < 0 || !keep_alive ? -1 : 0;
+}
+
+/* serve_connection: Thread serving the requests of one connection
+   until the client closes it.
+ */
+static void *serve_connection(void *arg) {
+
+  int fd = (int) (intptr_t) arg;
+  char request[HEADER_SIZE];
+  size_t received = 0;
+
+  for (;;) {
+    char *end = NULL;
+    while (!(end = received ? strstr(request, "\r\n\r\n") : NULL)) {
+      if (received == sizeof(request) - 1)
+        goto out;
+      ssize_t bytes = recv(fd, request + received, sizeof(request) - 1 - received, 0);
+      if (bytes <= 0)
+        goto out;
+      received += bytes;
+      request[received] = '\0';
+    }
+    end[2] = '\0';
+    size_t used = end + 4 - request;
+    if (serve_request(fd, request) < 0)
+      break;
+    // Keeps any pipelined request that was already received
+    memmove(request, request + used, received - used + 1);
+    received -= used;
+  }
+out:
+  close(fd);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int port = DEFAULT_PORT;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:l:v")) != -1) {
+    switch (opt) {
+    case 'p': port = strtoul(optarg, NULL, 10); break;
+    case 'l': latency_ms = strtoul(optarg, NULL, 10); break;
+    case 'v': verbose = 1; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind != 1 || port == 0 || port > 65535) {
+    usage(argv[0]);
+    return 1;
+  }
+  root = argv[optind];
+
+  int server = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (server == -1 || bind(server, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+      listen(server, 64) == -1) {
+    fprintf(stderr, "Cannot listen on port %u: %s\n", port, strerror(errno));
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "Serving %s on http://127.0.0.1:%u/\n", root, port);
+
+  for (;;) {
+    int fd = accept(server, NULL, NULL);
+    if (fd == -1)
+      continue;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_connection, (void *) (intptr_t) fd) == 0)
+      pthread_detach(thread);
+    else
+      close(fd);
+  }
+}
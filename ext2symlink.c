@@ -41,9 +41,11 @@ int32_t read_symlink_target(volume_t *volume, inode_t *inode, char *buffer, size
       buffer[i] = inode->i_symlink_target[i];
     }
   }
-  // else {
-
-  // }
+  else {
+    // Longer targets are stored in data blocks, like file content
+    if (read_file_content(volume, inode, 0, read_size, buffer) != read_size)
+      return 0;
+  }
   buffer[read_size] = '\0';
 
   return inode->i_size;
@@ -1,10 +1,28 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "ext2.h"
 
+#ifndef __SANITIZE_ADDRESS__
+// Counts heap allocations made by the program, to check that lookups
+// in a warmed-up volume do not allocate.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile unsigned long num_allocations;
+
+void *malloc(size_t size) { num_allocations++; return __libc_malloc(size); }
+void *calloc(size_t count, size_t size) { num_allocations++; return __libc_calloc(count, size); }
+void *realloc(void *ptr, size_t size) { num_allocations++; return __libc_realloc(ptr, size); }
+#endif
+
 static void print_inode_blocks(volume_t *volume, inode_t *inode) {
   int num_blocks = (inode_file_size(volume, inode) - 1) / volume->block_size + 1;
   if (num_blocks > 50) num_blocks = 50;
@@ -19,6 +37,29 @@ static void print_inode_blocks(volume_t *volume, inode_t *inode) {
   if (!*prefix) printf(" NONE");
 }
 
+static void print_inode_extents(volume_t *volume, inode_t *inode) {
+  file_extent_t extents[8];
+  int64_t count = get_file_extents(volume, inode, 0, extents, 8);
+  if (count < 0) printf(" ERROR!!!");
+  for (int i = 0; i < count; i++) {
+    if (extents[i].physical)
+      printf(" [%" PRIu64 "+%" PRIu64 " @ %" PRIu32 "]", extents[i].logical, extents[i].length, extents[i].physical);
+    else
+      printf(" [%" PRIu64 "+%" PRIu64 " hole]", extents[i].logical, extents[i].length);
+  }
+  if (count == 0) printf(" NONE");
+}
+
+static void print_inode_layout(volume_t *volume, inode_t *inode) {
+  file_layout_t layout;
+  if (get_file_layout(volume, inode, &layout) < 0) {
+    printf(" ERROR!!!");
+    return;
+  }
+  printf(" %" PRIu64 " fragments, %" PRIu64 " indirect, %" PRIu64 " holes, %" PRIu64 " seeks, %" PRIu64 " preads",
+         layout.fragments, layout.indirect_blocks, layout.hole_blocks, layout.seeks, layout.block_preads);
+}
+
 static void print_inode_metadata(volume_t *volume, uint32_t inode_no, inode_t *inode) {
   printf("  Inode number : %#" PRIx32 "\n", inode_no);
   printf("  Mode         : %#" PRIo32 "\n", inode->i_mode);
@@ -37,6 +78,11 @@ static void print_dir_entries(volume_t *volume, inode_t *inode) {
     printf("    %#8" PRIx32 ": %s\n", entry.de_inode_no, entry.de_name);
 }
 
+static void print_diff_entry(void *ctx, const diff_entry_t *entry) {
+
+  printf("    %c %s\n", "ADM"[entry->kind], entry->path);
+}
+
 static void print_dir_entries_recursive(volume_t *volume, const char *name,
                                         uint32_t dir_inode_no, unsigned int recursion_level) {
   
@@ -58,6 +104,163 @@ static void print_dir_entries_recursive(volume_t *volume, const char *name,
     print_dir_entries_recursive(volume, entry.de_name, entry.de_inode_no, recursion_level + 1);
 }
 
+// Backend reading a volume file with some bytes replaced, to check that
+// verified reads detect changes and to add attributes to a volume
+#define MAX_PATCHES 2
+
+typedef struct patch {
+  uint64_t offset;
+  uint32_t size;
+  const char *data;
+} patch_t;
+
+typedef struct patched_backend {
+  volume_backend_t backend;
+  int fd;
+  unsigned int num_patches;
+  patch_t patches[MAX_PATCHES]; // Their data follows the structure
+} patched_backend_t;
+
+static ssize_t patched_pread(volume_backend_t *backend, void *buffer, size_t size, uint64_t offset) {
+  patched_backend_t *patched = (patched_backend_t *) backend;
+  ssize_t bytes = pread(patched->fd, buffer, size, offset);
+  for (unsigned int i = 0; bytes > 0 && i < patched->num_patches; i++) {
+    patch_t *patch = &patched->patches[i];
+    uint64_t start = patch->offset > offset ? patch->offset : offset;
+    uint64_t end = patch->offset + patch->size < offset + bytes ? patch->offset + patch->size : offset + bytes;
+    if (start < end)
+      memcpy((char *) buffer + (start - offset), patch->data + (start - patch->offset), end - start);
+  }
+  return bytes;
+}
+
+static void patched_close(volume_backend_t *backend) {
+  close(((patched_backend_t *) backend)->fd);
+  free(backend);
+}
+
+static volume_t *open_patched_volume(const char *filename, const patch_t *patches, unsigned int num_patches) {
+  size_t data_size = 0;
+  for (unsigned int i = 0; i < num_patches; i++)
+    data_size += patches[i].size;
+  patched_backend_t *patched = malloc(sizeof(patched_backend_t) + data_size);
+  struct stat st;
+  if (!patched || (patched->fd = open(filename, O_RDONLY)) == -1 || fstat(patched->fd, &st) == -1) {
+    free(patched);
+    return NULL;
+  }
+  patched->backend = (volume_backend_t) { patched_pread, NULL, patched_close, st.st_size };
+  patched->num_patches = num_patches;
+  char *data = (char *) (patched + 1);
+  for (unsigned int i = 0; i < num_patches; i++) {
+    patched->patches[i] = (patch_t) { patches[i].offset, patches[i].size, data };
+    memcpy(data, patches[i].data, patches[i].size);
+    data += patches[i].size;
+  }
+  return open_volume_backend(&patched->backend, -1);
+}
+
+// Opens a volume file with the lowest bit of one byte flipped
+static volume_t *open_tampered_volume(const char *filename, uint64_t offset) {
+  char byte;
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  ssize_t bytes = pread(fd, &byte, 1, offset);
+  close(fd);
+  if (bytes != 1)
+    return NULL;
+  byte ^= 1;
+  return open_patched_volume(filename, &(patch_t) { offset, 1, &byte }, 1);
+}
+
+// Stores the entry of a "user." attribute at offset 'entry' of an EA
+// block or inode, with its value at offset 'value' (relative to 'base')
+static void put_user_xattr(char *data, uint32_t entry, uint32_t base, uint32_t value, const char *name,
+                           const char *content) {
+  uint8_t name_len = strlen(name), name_index = 1;
+  uint16_t value_offs = value - base;
+  uint32_t value_size = strlen(content);
+  memset(data + entry, 0, 16);
+  memcpy(data + entry, &name_len, 1);
+  memcpy(data + entry + 1, &name_index, 1);
+  memcpy(data + entry + 2, &value_offs, 2);
+  memcpy(data + entry + 8, &value_size, 4);
+  memcpy(data + entry + 16, name, name_len);
+  memcpy(data + value, content, value_size);
+}
+
+static void read_traced_files(volume_t *volume) {
+
+  inode_t inode;
+  char buffer[4096];
+  find_file_from_path(volume, "/d1/d2/missing", NULL);
+  if (!find_file_from_path(volume, "/termcap", &inode))
+    return;
+  for (uint64_t offset = 0; offset < inode.i_size; offset += sizeof(buffer))
+    if (read_file_content(volume, &inode, offset, sizeof(buffer), buffer) <= 0)
+      break;
+}
+
+/* compare_directory: Compares the entries of a directory in two
+   volumes, and the content of the regular files it holds (up to 4 MiB
+   each).
+
+   Returns the number of differences, or -1 if the directory is not
+   found in the first volume. Adds the entries and bytes compared to
+   *entries and *bytes.
+ */
+static int compare_directory(volume_t *a, volume_t *b, const char *path, int *entries, uint64_t *bytes) {
+
+  inode_t dir_a, dir_b;
+  if (!find_file_from_path(a, path, &dir_a))
+    return -1;
+  if (!find_file_from_path(b, path, &dir_b))
+    return 1;
+
+  char *block_a = malloc(a->block_size), *block_b = malloc(b->block_size);
+  char data_a[65536], data_b[65536];
+  dir_iterator_t it_a, it_b;
+  dir_entry_view_t view_a, view_b;
+  int64_t rv_a, rv_b;
+  int differences = 0;
+  open_directory_iterator(&it_a, a, &dir_a, 0, block_a);
+  open_directory_iterator(&it_b, b, &dir_b, 0, block_b);
+  do {
+    rv_a = next_directory_view(&it_a, &view_a);
+    rv_b = next_directory_view(&it_b, &view_b);
+    if (rv_a != rv_b || (rv_a > 0 && (view_a.name_len != view_b.name_len ||
+                                      memcmp(view_a.name, view_b.name, view_a.name_len)))) {
+      differences++;
+      break;
+    }
+    if (rv_a <= 0)
+      break;
+    (*entries)++;
+    inode_t file_a, file_b;
+    if (read_inode(a, rv_a, &file_a) < 0 || read_inode(b, rv_b, &file_b) < 0 ||
+        memcmp(&file_a, &file_b, sizeof(inode_t))) {
+      differences++;
+      continue;
+    }
+    if (!inode_is_regular_file(&file_a))
+      continue;
+    uint64_t size = inode_file_size(a, &file_a);
+    for (uint64_t offset = 0; offset < size && offset < (4 << 20); offset += sizeof(data_a)) {
+      ssize_t read_a = read_file_content(a, &file_a, offset, sizeof(data_a), data_a);
+      ssize_t read_b = read_file_content(b, &file_b, offset, sizeof(data_b), data_b);
+      if (read_a <= 0 || read_a != read_b || memcmp(data_a, data_b, read_a)) {
+        differences++;
+        break;
+      }
+      *bytes += read_a;
+    }
+  } while (1);
+  free(block_a);
+  free(block_b);
+  return differences;
+}
+
 int main(int argc, char *argv[]) {
   
   volume_t *volume;
@@ -167,6 +370,8 @@ int main(int argc, char *argv[]) {
     printf("  NOT FOUND!!!\n");
   } else {
     print_inode_metadata(volume, inode_no, &inode);
+    printf("  Extents      :"); print_inode_extents(volume, &inode); printf("\n");
+    printf("  Layout       :"); print_inode_layout(volume, &inode); printf("\n");
   }
   
   printf("\nFile d1/File1.txt:\n");
@@ -184,6 +389,10 @@ int main(int argc, char *argv[]) {
     printf("  NOT FOUND!!!\n");
   } else {
     print_inode_metadata(volume, inode_no, &inode);
+    printf("  Extents      :"); print_inode_extents(volume, &inode); printf("\n");
+    printf("  Layout       :"); print_inode_layout(volume, &inode); printf("\n");
+    printf("  First data   : %" PRId64 "\n", file_seek_data(volume, &inode, 0, SEEK_DATA));
+    printf("  First hole   : %" PRId64 "\n", file_seek_data(volume, &inode, 0, SEEK_HOLE));
   }
   
   printf("\nSymlink ImageInst.txt:\n");
@@ -198,8 +407,403 @@ int main(int argc, char *argv[]) {
       printf("  Could not read target!!!\n");
   }
 
+  printf("\nBatch lookup:\n");
+  const char *batch_paths[] = { "/", "/d1", "/d1/File1.txt", "/termcap", "/d1/d2/d3/d4/d5",
+                                "/d1/missing", "/termcap/child", "//d1//d2/", "/d1/d2/sparse/Bigfile2.txt" };
+  size_t batch_count = sizeof(batch_paths) / sizeof(batch_paths[0]);
+  path_lookup_t batch_results[sizeof(batch_paths) / sizeof(batch_paths[0])];
+  if (find_files_from_paths(volume, batch_paths, batch_count, batch_results, 4) < 0) {
+    printf("  FAILED!!!\n");
+  } else {
+    for (size_t i = 0; i < batch_count; i++) {
+      uint32_t expected = find_file_from_path(volume, batch_paths[i], NULL);
+      printf("  %-28s: %#8" PRIx32 " status %3d%s\n", batch_paths[i], batch_results[i].inode_no,
+             batch_results[i].status, batch_results[i].inode_no == expected ? "" : " MISMATCH!!!");
+    }
+  }
+
+#ifndef __SANITIZE_ADDRESS__
+  // The first of two passes warms up the caches and the thread arena;
+  // the second one must not allocate at all
+  printf("\nAllocations after warm-up:\n");
+  inode_t root_inode, listed_file;
+  uint32_t listed_file_no = 0;
+  if (read_inode(volume, EXT2_ROOT_INO, &root_inode) < 0) {
+    printf("  Root         : ERROR!!!\n");
+  } else {
+    const char *operations[] = { "Lookup", "Listing", "Read" };
+    for (int op = 0; op < 3; op++) {
+      unsigned long allocated = 0;
+      for (int pass = 0; pass < 2; pass++) {
+        unsigned long before = num_allocations;
+        for (int i = 0; i < 100; i++) {
+          char data[4096];
+          dir_entry_t entry;
+          off_t offset = 0;
+          int64_t entry_no;
+          switch (op) {
+          case 0:
+            find_file_from_path(volume, "/d1/d2/d3/d4/d5", NULL);
+            break;
+          case 1:
+            // Also picks the first regular file of the root directory, to be read
+            while ((entry_no = next_directory_entry(volume, &root_inode, &offset, &entry)) > 0)
+              if (!listed_file_no && read_inode(volume, entry_no, &listed_file) >= 0 &&
+                  inode_is_regular_file(&listed_file))
+                listed_file_no = entry_no;
+            break;
+          case 2:
+            if (listed_file_no)
+              read_file_content(volume, &listed_file, 0, sizeof(data), data);
+            break;
+          }
+        }
+        allocated = num_allocations - before;
+      }
+      printf("  %-13s: %lu per 100 %s\n", operations[op], allocated, allocated == 0 ? "OK" : "ERROR!!!");
+    }
+  }
+#endif
+
+  printf("\nShared block cache:\n");
+  volume_t *first = open_volume_file(argv[1]), *second = open_volume_file(argv[1]);
+  // Room for 8 blocks, shared by two instances of the volume
+  block_cache_t *shared = create_block_cache(8 * volume->block_size);
+  if (!first || !second || !shared) {
+    printf("  Create       : ERROR!!! %s\n", strerror(errno));
+  } else {
+    uint32_t table = volume->groups[0].bg_inode_table;
+    char block[64];
+    size_t used;
+    uint64_t hits, misses;
+    attach_block_cache(first, shared);
+    attach_block_cache(second, shared);
+    read_block(first, table, 0, sizeof(block), block);
+    read_block(first, table, 0, sizeof(block), block);
+    read_block(second, table, 0, sizeof(block), block); // Same block number, other volume: a miss
+    block_cache_stats(shared, &used, &hits, &misses);
+    printf("  Two volumes  : %" PRIu64 " hits, %" PRIu64 " misses, %zu blocks %s\n", hits, misses,
+           used / volume->block_size, hits == 1 && misses == 2 && used == 2 * volume->block_size ? "OK" : "ERROR!!!");
+    // The first volume reads more than the budget: its own blocks are evicted, not the second's
+    for (uint32_t i = 1; i <= 16; i++)
+      read_block(first, table + i, 0, sizeof(block), block);
+    read_block(second, table, 0, sizeof(block), block);
+    uint64_t before = hits;
+    block_cache_stats(shared, &used, &hits, &misses);
+    printf("  Eviction     : %zu blocks, %s\n", used / volume->block_size,
+           used <= 8 * volume->block_size && hits == before + 1 ? "OK" : "ERROR!!!");
+    detach_block_cache(first);
+    detach_block_cache(second);
+    block_cache_stats(shared, &used, NULL, NULL);
+    printf("  Detached     : %zu blocks %s\n", used / volume->block_size, used == 0 ? "OK" : "ERROR!!!");
+  }
+  if (first)
+    close_volume_file(first);
+  if (second)
+    close_volume_file(second);
+  if (shared)
+    destroy_block_cache(shared);
+
+  printf("\nCompressed image:\n");
+  char zimage_path[] = "/tmp/ext2test-zimage-XXXXXX";
+  int zimage_fd = volume->fd == -1 ? -1 : mkstemp(zimage_path);
+  if (volume->fd == -1) {
+    printf("  Skipped (the volume is not a plain file)\n");
+  } else if (zimage_fd == -1 || convert_to_zimage(volume->fd, zimage_fd, 64 << 10, 1, 4) < 0) {
+    printf("  Convert      : ERROR!!! %s\n", strerror(errno));
+  } else {
+    volume_t *compressed = open_volume_file(zimage_path);
+    if (!compressed) {
+      printf("  Open         : ERROR!!! %s\n", strerror(errno));
+    } else {
+      const char *compare_paths[] = { "/", "/d1" };
+      for (int i = 0; i < 2; i++) {
+        int entries = 0;
+        uint64_t bytes = 0;
+        int differences = compare_directory(volume, compressed, compare_paths[i], &entries, &bytes);
+        if (differences >= 0)
+          printf("  %-13s: %d entries, %" PRIu64 " bytes of content %s\n", compare_paths[i], entries, bytes,
+                 differences ? "DIFFERENT!!!" : "OK");
+      }
+      close_volume_file(compressed);
+    }
+  }
+  if (zimage_fd != -1) {
+    close(zimage_fd);
+    unlink(zimage_path);
+  }
+
+  printf("\nExtended attributes:\n");
+  const char *xattr_paths[] = { "/", "/termcap", "/d1/File1.txt" };
+  for (int i = 0; i < 3; i++) {
+    char names[1024], value[256];
+    uint32_t inode_no = find_file_from_path(volume, xattr_paths[i], &inode);
+    if (!inode_no)
+      continue;
+    ssize_t list_size = list_xattrs(volume, inode_no, &inode, names, sizeof(names));
+    printf("  %-14s:%s\n", xattr_paths[i], list_size < 0 ? " ERROR!!!" : list_size == 0 ? " NONE" : "");
+    for (ssize_t n = 0; n < list_size; n += strlen(names + n) + 1) {
+      ssize_t value_size = get_xattr(volume, inode_no, &inode, names + n, value, sizeof(value));
+      printf("    %s (%zd bytes)\n", names + n, value_size);
+    }
+  }
+
+  // Gives the root directory a new EA block, in the last block of the
+  // volume, and an attribute stored in the inode if there is room for it
+  if (volume->fd == -1) {
+    printf("  Added        : Skipped (the volume is not a plain file)\n");
+  } else {
+    uint32_t table_block = volume->groups[0].bg_inode_table;
+    uint32_t ea_block_no = volume->super.s_blocks_count - 1;
+    uint32_t inode_offset = (EXT2_ROOT_INO - 1) * volume->inode_size;
+    int in_inode = volume->inode_size >= 256;
+    char *ea_block = calloc(1, volume->block_size);
+    char *raw_inode = malloc(volume->inode_size);
+    volume_t *patched = NULL;
+    if (ea_block && raw_inode &&
+        read_block(volume, table_block, inode_offset, volume->inode_size, raw_inode) == volume->inode_size) {
+      uint32_t *header = (uint32_t *) ea_block;
+      header[0] = EXT2_XATTR_MAGIC;
+      header[1] = header[2] = 1;
+      put_user_xattr(ea_block, 32, 0, volume->block_size - 8, "comment", "block");
+      memcpy(raw_inode + 104, &ea_block_no, 4); // i_file_acl
+      if (in_inode) {
+        uint16_t extra_isize = 32;
+        uint32_t magic = EXT2_XATTR_MAGIC, start = 128 + extra_isize + 4;
+        memset(raw_inode + 128, 0, volume->inode_size - 128);
+        memcpy(raw_inode + 128, &extra_isize, 2);
+        memcpy(raw_inode + start - 4, &magic, 4);
+        put_user_xattr(raw_inode, start, start, volume->inode_size - 8, "inode", "inline");
+      }
+      patch_t patches[] = {
+        { (uint64_t) ea_block_no * volume->block_size, volume->block_size, ea_block },
+        { (uint64_t) table_block * volume->block_size + inode_offset, volume->inode_size, raw_inode }
+      };
+      patched = open_patched_volume(argv[1], patches, 2);
+    }
+    if (!patched || read_inode(patched, EXT2_ROOT_INO, &inode) < 0) {
+      printf("  Added        : ERROR!!! %s\n", strerror(errno));
+    } else {
+      const char *expected = in_inode ? "user.inode\0user.comment" : "user.comment";
+      size_t expected_size = in_inode ? sizeof("user.inode") + sizeof("user.comment") : sizeof("user.comment");
+      char names[64], value[16];
+      int ok = list_xattrs(patched, EXT2_ROOT_INO, &inode, NULL, 0) == (ssize_t) expected_size &&
+               list_xattrs(patched, EXT2_ROOT_INO, &inode, names, sizeof(names)) == (ssize_t) expected_size &&
+               !memcmp(names, expected, expected_size) &&
+               get_xattr(patched, EXT2_ROOT_INO, &inode, "user.comment", value, sizeof(value)) == 5 &&
+               !memcmp(value, "block", 5) &&
+               get_xattr(patched, EXT2_ROOT_INO, &inode, "user.missing", value, sizeof(value)) < 0 && errno == ENODATA;
+      if (in_inode)
+        ok = ok && get_xattr(patched, EXT2_ROOT_INO, &inode, "user.inode", value, sizeof(value)) == 6 &&
+             !memcmp(value, "inline", 6) &&
+             get_xattr(patched, EXT2_ROOT_INO, &inode, "user.inode", value, 2) < 0 && errno == ERANGE;
+      printf("  Added        : %suser.comment %s\n", in_inode ? "user.inode (in the inode), " : "",
+             ok ? "OK" : "ERROR!!!");
+    }
+    if (patched)
+      close_volume_file(patched);
+    free(ea_block);
+    free(raw_inode);
+  }
+
+  printf("\nName index:\n");
+  name_index_t *name_index = build_name_index(volume, 4);
+  if (!name_index) {
+    printf("  Build        : ERROR!!! %s\n", strerror(errno));
+  } else {
+    uint32_t index_entries, index_errors;
+    size_t index_bytes;
+    name_index_stats(name_index, &index_entries, &index_bytes, &index_errors);
+    printf("  Entries      : %" PRIu32 " (%" PRIu32 " errors)\n", index_entries, index_errors);
+    const char *patterns[] = { "termcap", "*.txt", "*ile*", "d?", "[Ff]ile[0-9].*", "missing" };
+    for (int i = 0; i < 6; i++) {
+      uint32_t *matches;
+      int64_t count = search_name_index(name_index, patterns[i], &matches);
+      printf("  %-13s: %" PRId64 " matches\n", patterns[i], count);
+      // Matches are unordered: checks each one against a path lookup
+      for (int64_t m = 0; m < count; m++) {
+        char path[1024];
+        uint32_t inode_no;
+        name_index_path(name_index, matches[m], path, sizeof(path), &inode_no);
+        if (find_file_from_path(volume, path, NULL) != inode_no)
+          printf("    %s MISMATCH!!!\n", path);
+      }
+      free(matches);
+    }
+    destroy_name_index(name_index);
+  }
+
+  printf("\nAccess trace:\n");
+  char trace_path[] = "/tmp/ext2test-trace-XXXXXX";
+  int trace_fd = mkstemp(trace_path);
+  if (trace_fd != -1)
+    close(trace_fd);
+  if (trace_fd == -1 || start_access_trace(volume) == -1) {
+    printf("  Record       : ERROR!!! %s\n", strerror(errno));
+  } else {
+    read_traced_files(volume);
+    int64_t traced = stop_access_trace(volume, trace_path);
+    printf("  Traced       : %" PRId64 " blocks\n", traced);
+    // Replays the trace on a second, cached instance of the volume: the same reads should not miss
+    volume_t *replay = open_volume_file(argv[1]);
+    block_cache_t *cache = create_block_cache(8 << 20);
+    if (traced > 0 && replay && cache) {
+      attach_block_cache(replay, cache);
+      int64_t prefetched = start_prefetch(replay, trace_path, 4 << 20) == 0 ? end_prefetch(replay, 0) : -1;
+      printf("  Prefetched   : %" PRId64 " blocks\n", prefetched);
+      uint64_t hits, misses;
+      read_traced_files(replay);
+      block_cache_stats(cache, NULL, &hits, &misses);
+      printf("  Replayed     : %" PRIu64 " hits, %" PRIu64 " misses %s\n", hits, misses, misses ? "ERROR!!!" : "OK");
+      detach_block_cache(replay);
+    }
+    if (replay)
+      close_volume_file(replay);
+    if (cache)
+      destroy_block_cache(cache);
+    unlink(trace_path);
+  }
+
+  printf("\nVerified reads:\n");
+  char tree_path[] = "/tmp/ext2test-tree-XXXXXX";
+  unsigned char root_hash[VERITY_HASH_SIZE];
+  int tree_fd = mkstemp(tree_path);
+  if (tree_fd != -1)
+    close(tree_fd);
+  if (tree_fd == -1 || build_verity_tree(volume, tree_path, 4, root_hash) < 0) {
+    printf("  Build        : ERROR!!! %s\n", strerror(errno));
+  } else {
+    uint32_t table_block = volume->groups[0].bg_inode_table;
+    char block[64];
+    volume_t *verified = open_volume_file(argv[1]);
+    if (!verified || attach_verity_tree(verified, tree_path, root_hash) < 0) {
+      printf("  Attach       : ERROR!!! %s\n", strerror(errno));
+    } else {
+      uint64_t blocks, nodes, failures;
+      read_traced_files(verified);
+      verity_stats(verified, &blocks, &nodes, &failures);
+      printf("  Verified     : %" PRIu64 " blocks, %" PRIu64 " hash blocks, %" PRIu64 " failures %s\n",
+             blocks, nodes, failures, blocks > 0 && failures == 0 ? "OK" : "ERROR!!!");
+    }
+    if (verified)
+      close_volume_file(verified);
+
+    unsigned char wrong_hash[VERITY_HASH_SIZE];
+    memcpy(wrong_hash, root_hash, sizeof(wrong_hash));
+    wrong_hash[0] ^= 1;
+    verified = open_volume_file(argv[1]);
+    printf("  Wrong root   : %s\n", verified && attach_verity_tree(verified, tree_path, wrong_hash) < 0 &&
+           errno == EINVAL ? "OK" : "ERROR!!!");
+    if (verified)
+      close_volume_file(verified);
+
+    // Changes a byte of the first inode table block, read with and without a block cache
+    verified = volume->fd == -1 ? NULL :
+      open_tampered_volume(argv[1], (uint64_t) table_block * volume->block_size + 100);
+    if (volume->fd == -1) {
+      printf("  Tampered     : Skipped (the volume is not a plain file)\n");
+    } else if (!verified || attach_verity_tree(verified, tree_path, root_hash) < 0) {
+      printf("  Tampered     : ERROR!!! %s\n", strerror(errno));
+    } else {
+      int uncached = read_block(verified, table_block, 0, sizeof(block), block) < 0 && errno == EIO;
+      int other = read_block(verified, table_block + 1, 0, sizeof(block), block) == sizeof(block);
+      block_cache_t *cache = create_block_cache(1 << 20);
+      attach_block_cache(verified, cache);
+      int cached = read_block(verified, table_block, 0, sizeof(block), block) < 0 && errno == EIO;
+      detach_block_cache(verified);
+      destroy_block_cache(cache);
+      printf("  Tampered     : %s\n", uncached && cached && other ? "OK (EIO)" : "ERROR!!!");
+    }
+    if (verified)
+      close_volume_file(verified);
+    unlink(tree_path);
+  }
+
+  printf("\nI/O scheduler:\n");
+  volume_t *scheduled = open_volume_file(argv[1]);
+  if (!scheduled || attach_io_scheduler(scheduled, 4, 2) < 0) {
+    printf("  Attach       : ERROR!!! %s\n", strerror(errno));
+  } else {
+    // The same reads, classified: file content is bulk, everything else metadata
+    char plain[4096], through[4096];
+    ssize_t plain_size = -1, through_size = -2;
+    inode_t file_inode;
+    if (find_file_from_path(volume, "/d1/File1.txt", &file_inode))
+      plain_size = read_file_content(volume, &file_inode, 0, sizeof(plain), plain);
+    if (find_file_from_path(scheduled, "/d1/File1.txt", &file_inode))
+      through_size = read_file_content(scheduled, &file_inode, 0, sizeof(through), through);
+    io_scheduler_stats_t stats;
+    io_scheduler_stats(scheduled, &stats);
+    if (plain_size < 0)
+      printf("  Content      : NOT FOUND\n");
+    else
+      printf("  Content      : %s\n", plain_size == through_size &&
+             !memcmp(plain, through, plain_size) ? "OK" : "ERROR!!!");
+    printf("  Reads        : %" PRIu64 " metadata, %" PRIu64 " bulk\n", stats.metadata_reads, stats.bulk_reads);
+  }
+  if (scheduled)
+    close_volume_file(scheduled);
+
+  printf("\nConsistency check:\n");
+  check_summary_t check_summary;
+  int64_t problems = check_volume(volume, 4, NULL, NULL, &check_summary);
+  if (problems < 0)
+    printf("  Check        : ERROR!!! %s\n", strerror(errno));
+  else
+    printf("  Groups       : %" PRIu32 "\n  Inodes       : %" PRIu64 " (%" PRIu64 " directories)\n"
+           "  Blocks       : %" PRIu64 "\n  Entries      : %" PRIu64 "\n  Problems     : %" PRId64 "%s\n",
+           check_summary.groups, check_summary.inodes, check_summary.directories, check_summary.blocks,
+           check_summary.entries, problems, problems ? " ERROR!!!" : "");
+
   printf("\nFull list of files:\n");
   print_dir_entries_recursive(volume, "", EXT2_ROOT_INO, 0);
+
+  // Runs last, since it makes the volume writable. The volume file is
+  // not modified: changes go to a temporary delta file.
+  printf("\nCopy-on-write overlay:\n");
+  char delta_path[] = "/tmp/ext2test-XXXXXX";
+  int delta_fd = mkstemp(delta_path);
+  if (delta_fd == -1 || attach_overlay(volume, delta_path) < 0) {
+    printf("  Attach       : ERROR!!! %s\n", strerror(errno));
+  } else {
+    char data[32] = { 0 };
+    int64_t new_inode_no = create_file(volume, EXT2_ROOT_INO, "overlay-test.txt", S_IFREG | 0644, 0, 0, &inode);
+    ssize_t written = new_inode_no > 0 ?
+      write_file_content(volume, new_inode_no, &inode, 5000, 14, "Hello, overlay") : -1;
+    uint32_t found = find_file_from_path(volume, "/overlay-test.txt", &inode);
+    printf("  Create/write : %s\n", new_inode_no > 0 && written == 14 && found == new_inode_no ? "OK" : "ERROR!!!");
+    printf("  Size         : %" PRIu64 "\n", inode_file_size(volume, &inode));
+    read_file_content(volume, &inode, 5000, sizeof(data) - 1, data);
+    printf("  Content      : %s\n", data);
+    sync_overlay(volume);
+    printf("  Delta blocks : %s\n", count_delta_blocks(delta_fd) > 0 ? "> 0" : "ERROR!!!");
+    volume_t *original = open_volume_file(argv[1]);
+    if (original) {
+      printf("  Diff         :\n");
+      int64_t changes = diff_volumes(original, volume, 2, print_diff_entry, NULL, NULL);
+      printf("  Changes      : %" PRId64 "%s\n", changes, changes == 1 ? "" : " ERROR!!!");
+      changes = diff_volumes(original, original, 2, NULL, NULL, NULL);
+      printf("  Unchanged    : %s\n", changes == 0 ? "OK" : "ERROR!!!");
+      close_volume_file(original);
+    }
+    printf("  Remove       : %s\n", remove_file(volume, EXT2_ROOT_INO, "overlay-test.txt") == 0 &&
+           !find_file_from_path(volume, "/overlay-test.txt", NULL) ? "OK" : "ERROR!!!");
+  }
+  close_volume_file(volume);
+  if (delta_fd != -1) {
+    // A remap table entry beyond the end of the volume must be rejected
+    uint64_t table_offset = 0;
+    uint32_t beyond = UINT32_MAX;
+    volume_t *reopened = open_volume_file(argv[1]);
+    int rejected = pread(delta_fd, &table_offset, sizeof(table_offset), 32) == sizeof(table_offset) &&
+                   table_offset && pwrite(delta_fd, &beyond, sizeof(beyond), table_offset) == sizeof(beyond) &&
+                   reopened && attach_overlay(reopened, delta_path) < 0 && errno == EINVAL;
+    printf("  Bad remap    : %s\n", rejected ? "OK (EINVAL)" : "ERROR!!!");
+    if (reopened)
+      close_volume_file(reopened);
+    close(delta_fd);
+    unlink(delta_path);
+  }
   
   return 0;
 }
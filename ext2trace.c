@@ -0,0 +1,344 @@
+#include "ext2.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Access traces, to warm up the block cache of a volume that is read
+   the same way every time (e.g., by services starting up).
+
+   While a trace is recorded, read_block marks every block it reads in
+   a bitmap; reading an inode marks the inode table block holding it.
+   The trace file lists the runs of consecutive blocks that were read,
+   in increasing block order. The order of the original reads is
+   deliberately not kept: replaying the trace reads the runs in block
+   order, merging runs separated by small gaps, so that the random
+   reads of the recorded run become a few large sequential ones.
+
+   A replay runs in the background, with a few threads inserting the
+   blocks into the volume's block cache ahead of the reads that will
+   need them. A read that gets to a block first just loads it itself.
+   Volumes without a block cache, but read from a plain file, get the
+   same reads as readahead hints for the page cache instead.
+ */
+
+#define PREFETCH_THREADS  4
+#define PREFETCH_MAX_GAP  8         // Unused blocks read to merge two runs
+#define PREFETCH_MAX_READ (1 << 20) // Bytes read at a time
+
+typedef struct trace_header {
+  char magic[8];            // TRACE_MAGIC
+  uint32_t block_size;      // Of the volume the trace was recorded on
+  uint32_t blocks_count;
+  uint32_t num_runs;
+  uint32_t reserved;
+} trace_header_t;
+
+typedef struct trace_run {
+  uint32_t block_no;
+  uint32_t count;
+} trace_run_t;
+
+struct prefetch {
+  volume_t *volume;
+  trace_run_t *runs;
+  uint32_t num_runs;
+  uint64_t max_blocks;      // Blocks read at most (within the cache budget)
+  pthread_t threads[PREFETCH_THREADS];
+  unsigned int num_threads;
+
+  pthread_mutex_t lock;     // Protects the fields below
+  uint32_t next_run;
+  uint64_t blocks_read;
+  uint64_t blocks_loaded;   // Added to the cache (or hinted)
+  int cancel;
+};
+
+/* start_access_trace: Starts recording the blocks read from a volume.
+   Must not be called while other threads read from the volume.
+
+   Returns 0 on success, or -1 (ENOMEM, or EBUSY if a trace is already
+   being recorded).
+ */
+int start_access_trace(volume_t *volume) {
+
+  if (volume->trace_blocks) {
+    errno = EBUSY;
+    return -1;
+  }
+  volume->trace_blocks = calloc(volume->super.s_blocks_count / 64 + 1, sizeof(uint64_t));
+  return volume->trace_blocks ? 0 : -1;
+}
+
+/* record_block_access: Marks blocks as read in the trace being
+   recorded. Called by read_block; may be called concurrently.
+ */
+void record_block_access(volume_t *volume, uint32_t block_no, uint32_t count) {
+
+  uint64_t *blocks = volume->trace_blocks;
+  for (uint64_t b = block_no; b < (uint64_t) block_no + count && b < volume->super.s_blocks_count; b++)
+    if (!(blocks[b / 64] & (1ULL << (b % 64))))
+      __atomic_fetch_or(&blocks[b / 64], 1ULL << (b % 64), __ATOMIC_RELAXED);
+}
+
+/* stop_access_trace: Stops recording the blocks read from a volume,
+   and saves the trace. Must not be called while other threads read
+   from the volume.
+
+   Parameters:
+     volume: Pointer to volume.
+     path: File where the trace is saved (replacing it atomically), or
+           NULL to discard the trace.
+
+   Returns:
+     The number of blocks in the trace, or -1 if no trace was being
+     recorded (EINVAL) or the trace could not be saved.
+ */
+int64_t stop_access_trace(volume_t *volume, const char *path) {
+
+  uint64_t *blocks = volume->trace_blocks;
+  uint32_t blocks_count = volume->super.s_blocks_count;
+  trace_run_t *runs = NULL;
+  uint32_t num_runs = 0, capacity = 0;
+  int64_t total = 0, rv = -1;
+
+  volume->trace_blocks = NULL;
+  if (!blocks) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!path) {
+    free(blocks);
+    return 0;
+  }
+
+  for (uint64_t word = 0; word <= blocks_count / 64; word++) {
+    for (uint64_t bits = blocks[word]; bits; bits &= bits - 1) {
+      uint32_t b = word * 64 + __builtin_ctzll(bits);
+      total++;
+      if (num_runs > 0 && runs[num_runs - 1].block_no + runs[num_runs - 1].count == b) {
+        runs[num_runs - 1].count++;
+        continue;
+      }
+      if (num_runs == capacity) {
+        capacity = capacity ? capacity * 2 : 256;
+        trace_run_t *new_runs = realloc(runs, capacity * sizeof(trace_run_t));
+        if (!new_runs)
+          goto out;
+        runs = new_runs;
+      }
+      runs[num_runs++] = (trace_run_t) { b, 1 };
+    }
+  }
+
+  trace_header_t header = { .block_size = volume->block_size, .blocks_count = blocks_count, .num_runs = num_runs };
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  char temp_path[4096];
+  if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int) sizeof(temp_path)) {
+    errno = ENAMETOOLONG;
+    goto out;
+  }
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    goto out;
+  size_t runs_size = (size_t) num_runs * sizeof(trace_run_t);
+  errno = 0;
+  if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+      (runs_size && write(fd, runs, runs_size) != (ssize_t) runs_size) || fsync(fd) == -1) {
+    if (errno == 0)
+      errno = EIO;
+    close(fd);
+    unlink(temp_path);
+    goto out;
+  }
+  close(fd);
+  if (rename(temp_path, path) == -1) {
+    unlink(temp_path);
+    goto out;
+  }
+  rv = total;
+
+out:
+  free(runs);
+  free(blocks);
+  return rv;
+}
+
+/* prefetch_thread: Reads runs of the trace, merged into reads of up
+   to PREFETCH_MAX_READ bytes, until all runs are read, the budget is
+   used up, or the prefetch is cancelled.
+ */
+static void *prefetch_thread(void *arg) {
+
+  struct prefetch *prefetch = arg;
+  volume_t *volume = prefetch->volume;
+  uint32_t max_count = PREFETCH_MAX_READ / volume->block_size ? PREFETCH_MAX_READ / volume->block_size : 1;
+  char *buffer = volume->cache ? malloc((size_t) max_count * volume->block_size) : NULL;
+
+  // Prefetching must not delay the reads it is meant to speed up
+  set_io_class(IO_BULK);
+
+  for (;;) {
+    pthread_mutex_lock(&prefetch->lock);
+    if (prefetch->cancel || prefetch->next_run >= prefetch->num_runs || (volume->cache && !buffer)) {
+      pthread_mutex_unlock(&prefetch->lock);
+      break;
+    }
+    trace_run_t *run = &prefetch->runs[prefetch->next_run++];
+    uint32_t first = run->block_no, end = run->block_no + run->count;
+    if (end - first > max_count) {
+      // Runs longer than a read are split
+      run->block_no += max_count;
+      run->count -= max_count;
+      prefetch->next_run--;
+      end = first + max_count;
+    }
+    while (prefetch->next_run < prefetch->num_runs) {
+      trace_run_t *next = &prefetch->runs[prefetch->next_run];
+      if (next->block_no - end > PREFETCH_MAX_GAP || next->block_no + next->count - first > max_count)
+        break;
+      end = next->block_no + next->count;
+      prefetch->next_run++;
+    }
+    if (prefetch->blocks_read + (end - first) > prefetch->max_blocks) {
+      prefetch->next_run = prefetch->num_runs;
+      pthread_mutex_unlock(&prefetch->lock);
+      break;
+    }
+    prefetch->blocks_read += end - first;
+    pthread_mutex_unlock(&prefetch->lock);
+
+    ssize_t loaded;
+    if (volume->cache)
+      loaded = prefetch_cached_blocks(volume, first, end - first, buffer);
+    else
+      loaded = posix_fadvise(volume->fd, (off_t) first * volume->block_size,
+                             (off_t) (end - first) * volume->block_size, POSIX_FADV_WILLNEED) == 0 ? end - first : 0;
+    if (loaded > 0) {
+      pthread_mutex_lock(&prefetch->lock);
+      prefetch->blocks_loaded += loaded;
+      pthread_mutex_unlock(&prefetch->lock);
+    }
+  }
+  free(buffer);
+  return NULL;
+}
+
+/* start_prefetch: Starts replaying a trace saved by stop_access_trace
+   in the background, loading the blocks it lists into the volume's
+   block cache. Volumes without a cache must be read from a plain file;
+   the kernel is then asked to read the blocks ahead (posix_fadvise).
+
+   Parameters:
+     volume: Pointer to volume.
+     path: Trace file.
+     max_bytes: Maximum amount of data to prefetch; blocks past the
+                limit (in block order) are not prefetched. Should be
+                well below the size of the cache, so that prefetched
+                blocks do not evict each other.
+
+   Returns:
+     0 if the prefetch was started, or -1 if the trace could not be
+     read (errno as set by open or read), does not match the volume
+     (EINVAL), or the volume cannot be prefetched (EINVAL).
+ */
+int start_prefetch(volume_t *volume, const char *path, size_t max_bytes) {
+
+  struct prefetch *prefetch = NULL;
+  trace_header_t header;
+  int fd = -1;
+
+  if (volume->prefetch || (!volume->cache && volume->fd == -1)) {
+    errno = EINVAL;
+    return -1;
+  }
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) || header.block_size != volume->block_size ||
+      header.blocks_count != volume->super.s_blocks_count || header.num_runs > header.blocks_count) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  prefetch = calloc(1, sizeof(struct prefetch));
+  if (!prefetch)
+    goto fail;
+  prefetch->volume = volume;
+  prefetch->num_runs = header.num_runs;
+  prefetch->max_blocks = max_bytes / volume->block_size;
+  size_t runs_size = (size_t) header.num_runs * sizeof(trace_run_t);
+  prefetch->runs = malloc(runs_size ? runs_size : sizeof(trace_run_t));
+  if (!prefetch->runs)
+    goto fail;
+  if (runs_size && read(fd, prefetch->runs, runs_size) != (ssize_t) runs_size) {
+    errno = EINVAL;
+    goto fail;
+  }
+  for (uint32_t r = 0; r < prefetch->num_runs; r++) {
+    trace_run_t *run = &prefetch->runs[r];
+    if (run->count == 0 || run->block_no >= header.blocks_count || run->count > header.blocks_count - run->block_no ||
+        (r > 0 && run->block_no < run[-1].block_no + run[-1].count)) {
+      errno = EINVAL;
+      goto fail;
+    }
+  }
+  close(fd);
+  fd = -1;
+
+  pthread_mutex_init(&prefetch->lock, NULL);
+  while (prefetch->num_threads < PREFETCH_THREADS &&
+         pthread_create(&prefetch->threads[prefetch->num_threads], NULL, prefetch_thread, prefetch) == 0)
+    prefetch->num_threads++;
+  if (prefetch->num_threads == 0) {
+    pthread_mutex_destroy(&prefetch->lock);
+    errno = EAGAIN;
+    goto fail;
+  }
+  volume->prefetch = prefetch;
+  return 0;
+
+fail:
+  if (fd != -1)
+    close(fd);
+  if (prefetch)
+    free(prefetch->runs);
+  free(prefetch);
+  return -1;
+}
+
+/* end_prefetch: Waits until the prefetch of a volume is done (or stops
+   it as soon as possible, if 'cancel' is set), and releases it.
+   close_volume_file cancels any prefetch still running.
+
+   Returns:
+     The number of blocks loaded into the cache (or hinted to the
+     kernel), or -1 (EINVAL) if there is no prefetch.
+ */
+int64_t end_prefetch(volume_t *volume, int cancel) {
+
+  struct prefetch *prefetch = volume->prefetch;
+  if (!prefetch) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (cancel) {
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->cancel = 1;
+    pthread_mutex_unlock(&prefetch->lock);
+  }
+  for (unsigned int t = 0; t < prefetch->num_threads; t++)
+    pthread_join(prefetch->threads[t], NULL);
+
+  int64_t loaded = prefetch->blocks_loaded;
+  volume->prefetch = NULL;
+  pthread_mutex_destroy(&prefetch->lock);
+  free(prefetch->runs);
+  free(prefetch);
+  return loaded;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include "ext2.h"
+
+/* ext2verify: Checks the consistency of a volume (bitmaps, inodes,
+   link counts, directory entries and free counts) and prints a JSON
+   report. Block groups are checked in parallel.
+
+   Exit status: 0 if the volume is consistent, 1 if problems were
+   found, 2 if the volume could not be checked.
+ */
+
+#define DEFAULT_THREADS      8
+#define DEFAULT_MAX_PROBLEMS 1000
+
+static unsigned long max_problems = DEFAULT_MAX_PROBLEMS;
+static unsigned long listed;
+
+static void print_string(const char *s) {
+  putchar('"');
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (c < 0x20)
+      printf("\\u%04x", c);
+    else
+      putchar(c);
+  }
+  putchar('"');
+}
+
+static void print_problem(void *ctx, const check_problem_t *problem) {
+
+  if (listed >= max_problems)
+    return;
+  printf("%s\n    {\"type\": \"%s\", \"group\": ", listed ? "," : "", check_problem_name(problem->type));
+  if (problem->group == CHECK_SUPERBLOCK)
+    printf("null");
+  else
+    printf("%" PRIu32, problem->group);
+  printf(", \"inode\": %" PRIu32 ", \"block\": %" PRIu32 ", \"count\": %" PRIu32 ", \"expected\": %" PRId64
+         ", \"found\": %" PRId64 "}", problem->inode_no, problem->block_no, problem->count,
+         problem->expected, problem->found);
+  listed++;
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int threads = DEFAULT_THREADS;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:m:")) != -1) {
+    switch (opt) {
+    case 'j': threads = strtoul(optarg, NULL, 10); break;
+    case 'm': max_problems = strtoul(optarg, NULL, 10); break;
+    default: goto usage;
+    }
+  }
+  if (argc - optind != 1 || threads == 0) {
+  usage:
+    fprintf(stderr, "Usage: %s [-j threads] [-m max_problems] volume_file\n"
+            "  -j  number of block groups checked in parallel (default %d)\n"
+            "  -m  maximum number of problems listed in the report (default %d)\n",
+            argv[0], DEFAULT_THREADS, DEFAULT_MAX_PROBLEMS);
+    return 2;
+  }
+
+  volume_t *volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 2;
+  }
+
+  struct timespec start, end;
+  check_summary_t summary;
+  printf("{\n  \"volume\": ");
+  print_string(argv[optind]);
+  printf(",\n  \"problems\": [");
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int64_t problems = check_volume(volume, threads, print_problem, NULL, &summary);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  close_volume_file(volume);
+  if (problems < 0) {
+    printf("\n  ]\n}\n");
+    perror("Could not check volume");
+    return 2;
+  }
+
+  printf("\n  ],\n  \"summary\": {\"groups\": %" PRIu32 ", \"inodes\": %" PRIu64 ", \"directories\": %" PRIu64
+         ", \"blocks\": %" PRIu64 ", \"entries\": %" PRIu64 ", \"problems\": %" PRIu64
+         ", \"problems_listed\": %lu, \"seconds\": %.3f},\n  \"consistent\": %s\n}\n",
+         summary.groups, summary.inodes, summary.directories, summary.blocks, summary.entries,
+         summary.problems, listed,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, problems ? "false" : "true");
+  return problems ? 1 : 0;
+}
@@ -0,0 +1,481 @@
+#include "ext2.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+/* Verified reads, in the style of dm-verity: a hash tree file built
+   over all the blocks of a volume lets every block be checked when it
+   is read, without hashing the whole volume when it is opened.
+
+   The leaves of the tree are the SHA-256 hashes of the volume blocks,
+   packed 128 to a 4 KiB hash block. Each level above holds the hashes
+   of the hash blocks of the level below, up to a single hash block,
+   whose hash is the root hash. The tree file starts with a header
+   block, followed by the levels from the top one down to the leaves.
+
+   Hash blocks are read from the tree file the first time they are
+   needed, checked against their parent (or the root hash), and then
+   kept in memory, so that verifying a block read from the volume
+   costs a single hash once its leaf hash block has been loaded. With
+   a block cache, blocks are verified once per miss; without one,
+   every read hashes the whole blocks it touches.
+
+   The root hash stored in the tree file only protects against
+   corruption; to detect tampering, the expected root hash must come
+   from a trusted source and be given to attach_verity_tree.
+ */
+
+#define VERITY_HASH_BLOCK       4096
+#define VERITY_HASHES_PER_BLOCK (VERITY_HASH_BLOCK / VERITY_HASH_SIZE)
+#define VERITY_MAX_LEVELS       8
+#define VERITY_BUILD_READ       (1 << 20) // Bytes read at a time while building
+
+typedef struct verity_header {
+  char magic[8];            // VERITY_MAGIC
+  uint32_t block_size;      // Of the volume the tree was built for
+  uint32_t blocks_count;
+  uint32_t hash_block_size; // VERITY_HASH_BLOCK
+  uint32_t levels;
+  unsigned char root_hash[VERITY_HASH_SIZE];
+} verity_header_t;
+
+struct verity {
+  int fd; // Tree file
+  EVP_MD *md;
+  uint32_t blocks_count;
+  unsigned int levels;
+  uint64_t level_nodes[VERITY_MAX_LEVELS];  // Hash blocks in each level (0 = leaves)
+  uint64_t level_offset[VERITY_MAX_LEVELS]; // Offset of each level in the tree file
+  unsigned char **nodes[VERITY_MAX_LEVELS]; // Verified hash blocks, NULL until loaded
+  unsigned char root_hash[VERITY_HASH_SIZE];
+  pthread_mutex_t lock; // Serializes the loading of hash blocks
+
+  // Statistics, updated atomically
+  uint64_t blocks_verified;
+  uint64_t nodes_loaded;
+  uint64_t failures;
+};
+
+typedef struct build_pass {
+  volume_t *volume;
+  EVP_MD *md;
+  unsigned char *leaves;
+  uint32_t blocks_per_read;
+  uint32_t next_block; // Protected by lock
+  int failed;
+  pthread_mutex_t lock;
+} build_pass_t;
+
+/* tree_geometry: Computes the number of hash blocks in each level of
+   the tree of a volume with 'blocks_count' blocks, and their offsets
+   in the tree file.
+
+   Returns the number of levels.
+ */
+static unsigned int tree_geometry(uint32_t blocks_count, uint64_t *level_nodes, uint64_t *level_offset) {
+
+  unsigned int levels = 0;
+  uint64_t hashes = blocks_count ? blocks_count : 1;
+  do {
+    level_nodes[levels] = (hashes + VERITY_HASHES_PER_BLOCK - 1) / VERITY_HASHES_PER_BLOCK;
+    hashes = level_nodes[levels++];
+  } while (hashes > 1);
+
+  uint64_t offset = VERITY_HASH_BLOCK; // After the header
+  for (unsigned int l = levels; l-- > 0; ) {
+    level_offset[l] = offset;
+    offset += level_nodes[l] * VERITY_HASH_BLOCK;
+  }
+  return levels;
+}
+
+static inline int hash_data(EVP_MD *md, const void *data, size_t size, unsigned char *hash) {
+  return EVP_Digest(data, size, hash, NULL, md, NULL) ? 0 : -1;
+}
+
+/* build_thread: Hashes the blocks of the volume, VERITY_BUILD_READ
+   bytes at a time, into the leaves of the tree.
+ */
+static void *build_thread(void *arg) {
+
+  build_pass_t *pass = arg;
+  volume_t *volume = pass->volume;
+  char *buffer = malloc((size_t) pass->blocks_per_read * volume->block_size);
+
+  for (;;) {
+    pthread_mutex_lock(&pass->lock);
+    uint32_t first = pass->next_block;
+    uint32_t count = volume->super.s_blocks_count - first;
+    if (count > pass->blocks_per_read)
+      count = pass->blocks_per_read;
+    pass->next_block += count;
+    if (!buffer)
+      pass->failed = 1;
+    int done = pass->failed || count == 0;
+    pthread_mutex_unlock(&pass->lock);
+    if (done)
+      break;
+
+    size_t size = (size_t) count * volume->block_size;
+    int failed = volume_pread(volume, buffer, size, (uint64_t) first * volume->block_size) != (ssize_t) size;
+    for (uint32_t i = 0; i < count && !failed; i++)
+      failed = hash_data(pass->md, buffer + (size_t) i * volume->block_size, volume->block_size,
+                         pass->leaves + (uint64_t) (first + i) * VERITY_HASH_SIZE) < 0;
+    if (failed) {
+      pthread_mutex_lock(&pass->lock);
+      pass->failed = 1;
+      pthread_mutex_unlock(&pass->lock);
+    }
+  }
+  free(buffer);
+  return NULL;
+}
+
+/* build_verity_tree: Hashes every block of a volume and saves the hash
+   tree of the volume to a file.
+
+   Parameters:
+     volume: Pointer to volume. Must not have an overlay attached.
+     path: File where the tree is saved (replacing it atomically).
+     threads: Number of threads hashing blocks in parallel (see
+              run_workers).
+     root_hash: Where the root hash of the tree is stored
+                (VERITY_HASH_SIZE bytes; may be NULL).
+
+   Returns:
+     0 on success, or -1 if the volume could not be read (EIO) or the
+     tree could not be saved.
+ */
+int build_verity_tree(volume_t *volume, const char *path, unsigned int threads, unsigned char *root_hash) {
+
+  uint64_t level_nodes[VERITY_MAX_LEVELS], level_offset[VERITY_MAX_LEVELS];
+  unsigned int levels = tree_geometry(volume->super.s_blocks_count, level_nodes, level_offset);
+  uint64_t tree_size = level_offset[0] + level_nodes[0] * VERITY_HASH_BLOCK;
+  int rv = -1, fd = -1;
+  char temp_path[4096];
+
+  // The whole file is built in memory: the header, then the levels
+  unsigned char *tree = calloc(1, tree_size);
+  build_pass_t pass = { volume, EVP_MD_fetch(NULL, "SHA256", NULL), tree ? tree + level_offset[0] : NULL };
+  if (!tree || !pass.md) {
+    errno = ENOMEM;
+    goto out;
+  }
+  pass.blocks_per_read = VERITY_BUILD_READ / volume->block_size ? VERITY_BUILD_READ / volume->block_size : 1;
+  pthread_mutex_init(&pass.lock, NULL);
+  run_workers(build_thread, &pass, threads);
+  pthread_mutex_destroy(&pass.lock);
+  if (pass.failed) {
+    errno = EIO;
+    goto out;
+  }
+
+  // Each level above the leaves hashes the hash blocks of the one below
+  for (unsigned int l = 0; l + 1 < levels; l++)
+    for (uint64_t n = 0; n < level_nodes[l]; n++)
+      if (hash_data(pass.md, tree + level_offset[l] + n * VERITY_HASH_BLOCK, VERITY_HASH_BLOCK,
+                    tree + level_offset[l + 1] + n * VERITY_HASH_SIZE) < 0) {
+        errno = EIO;
+        goto out;
+      }
+
+  verity_header_t *header = (verity_header_t *) tree;
+  memcpy(header->magic, VERITY_MAGIC, sizeof(header->magic));
+  header->block_size = volume->block_size;
+  header->blocks_count = volume->super.s_blocks_count;
+  header->hash_block_size = VERITY_HASH_BLOCK;
+  header->levels = levels;
+  if (hash_data(pass.md, tree + level_offset[levels - 1], VERITY_HASH_BLOCK, header->root_hash) < 0) {
+    errno = EIO;
+    goto out;
+  }
+
+  if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int) sizeof(temp_path)) {
+    errno = ENAMETOOLONG;
+    goto out;
+  }
+  fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    goto out;
+  errno = 0;
+  for (uint64_t written = 0; written < tree_size; ) {
+    ssize_t bytes = write(fd, tree + written, tree_size - written);
+    if (bytes <= 0)
+      goto write_failed;
+    written += bytes;
+  }
+  if (fsync(fd) == -1)
+    goto write_failed;
+  close(fd);
+  fd = -1;
+  if (rename(temp_path, path) == -1) {
+    unlink(temp_path);
+    goto out;
+  }
+  if (root_hash)
+    memcpy(root_hash, header->root_hash, VERITY_HASH_SIZE);
+  rv = 0;
+  goto out;
+
+write_failed:
+  if (errno == 0)
+    errno = EIO;
+  close(fd);
+  fd = -1;
+  unlink(temp_path);
+out:
+  EVP_MD_free(pass.md);
+  free(tree);
+  return rv;
+}
+
+/* load_node: Returns a hash block of the tree, reading it from the
+   tree file and checking it against its parent if it has not been
+   loaded yet. Must be called with the verity lock held.
+
+   Returns:
+     The hash block, or NULL (EIO) if it could not be read or does not
+     match its parent.
+ */
+static unsigned char *load_node(struct verity *verity, unsigned int level, uint64_t index) {
+
+  unsigned char *node = verity->nodes[level][index];
+  if (node)
+    return node;
+
+  const unsigned char *expected = verity->root_hash;
+  if (level + 1 < verity->levels) {
+    const unsigned char *parent = load_node(verity, level + 1, index / VERITY_HASHES_PER_BLOCK);
+    if (!parent)
+      return NULL;
+    expected = parent + (index % VERITY_HASHES_PER_BLOCK) * VERITY_HASH_SIZE;
+  }
+
+  unsigned char hash[VERITY_HASH_SIZE];
+  node = malloc(VERITY_HASH_BLOCK);
+  if (!node)
+    return NULL;
+  if (pread(verity->fd, node, VERITY_HASH_BLOCK, verity->level_offset[level] + index * VERITY_HASH_BLOCK)
+      != VERITY_HASH_BLOCK || hash_data(verity->md, node, VERITY_HASH_BLOCK, hash) < 0 ||
+      memcmp(hash, expected, VERITY_HASH_SIZE)) {
+    free(node);
+    __atomic_fetch_add(&verity->failures, 1, __ATOMIC_RELAXED);
+    errno = EIO;
+    return NULL;
+  }
+  // Readers look hash blocks up without the lock
+  __atomic_store_n(&verity->nodes[level][index], node, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&verity->nodes_loaded, 1, __ATOMIC_RELAXED);
+  return node;
+}
+
+/* verify_block: Checks the content of a whole volume block against the
+   hash tree attached to the volume. May be called concurrently.
+
+   Parameters:
+     volume: Pointer to volume. Must have a hash tree attached.
+     block_no: Block number of the data.
+     data: Content of the block, as read from the volume.
+
+   Returns:
+     0 if the block matches the tree, or -1 (EIO) if it does not, or
+     if the hash blocks needed to check it are invalid.
+ */
+int verify_block(volume_t *volume, uint32_t block_no, const void *data) {
+
+  struct verity *verity = volume->verity;
+  unsigned char hash[VERITY_HASH_SIZE];
+
+  if (block_no >= verity->blocks_count) {
+    errno = EIO;
+    return -1;
+  }
+  uint64_t index = block_no / VERITY_HASHES_PER_BLOCK;
+  const unsigned char *leaf = __atomic_load_n(&verity->nodes[0][index], __ATOMIC_ACQUIRE);
+  if (!leaf) {
+    pthread_mutex_lock(&verity->lock);
+    leaf = load_node(verity, 0, index);
+    pthread_mutex_unlock(&verity->lock);
+    if (!leaf)
+      return -1;
+  }
+  if (hash_data(verity->md, data, volume->block_size, hash) < 0 ||
+      memcmp(hash, leaf + (block_no % VERITY_HASHES_PER_BLOCK) * VERITY_HASH_SIZE, VERITY_HASH_SIZE)) {
+    __atomic_fetch_add(&verity->failures, 1, __ATOMIC_RELAXED);
+    errno = EIO;
+    return -1;
+  }
+  __atomic_fetch_add(&verity->blocks_verified, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* read_verified_blocks: Same as read_block, for a volume with a hash
+   tree and no block cache: every block the data is part of is read
+   whole and verified. Block 0 is read like any other block.
+
+   Returns:
+     In case of success, returns 'size'. In case of error, returns -1
+     (EIO if a block does not match the tree).
+ */
+ssize_t read_verified_blocks(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_t size, void *buffer) {
+
+  char *block = NULL; // Holds the blocks only partly copied to 'buffer'
+  uint32_t read_so_far = 0;
+
+  block_no += offset >> volume->block_shift;
+  offset &= volume->block_size - 1;
+  while (read_so_far < size) {
+    uint32_t chunk = volume->block_size - offset;
+    if (chunk > size - read_so_far)
+      chunk = size - read_so_far;
+    char *data = (char *) buffer + read_so_far;
+    if (chunk < volume->block_size) {
+      if (!block && !(block = malloc(volume->block_size)))
+        return -1;
+      data = block;
+    }
+    if (volume_pread(volume, data, volume->block_size, (uint64_t) block_no * volume->block_size)
+        != volume->block_size) {
+      free(block);
+      errno = EIO;
+      return -1;
+    }
+    if (verify_block(volume, block_no, data) < 0) {
+      free(block);
+      return -1;
+    }
+    if (data == block)
+      memcpy((char *) buffer + read_so_far, block + offset, chunk);
+    read_so_far += chunk;
+    block_no++;
+    offset = 0;
+  }
+  free(block);
+  return read_so_far;
+}
+
+/* attach_verity_tree: Makes every block read from a volume be verified
+   against a hash tree built by build_verity_tree. The superblock and
+   group descriptors, read when the volume was opened, are verified
+   right away. Must be called before a block cache is attached, so that
+   no unverified block is cached.
+
+   Parameters:
+     volume: Pointer to volume. Must not have an overlay attached.
+     path: Tree file.
+     root_hash: Expected root hash of the tree (VERITY_HASH_SIZE bytes),
+                from a trusted source, or NULL to use the one stored
+                in the tree file.
+
+   Returns:
+     0 on success, or -1 if the tree could not be read (errno as set by
+     open or read), does not match the volume or the root hash
+     (EINVAL), the volume cannot be verified (EINVAL or EBUSY), or the
+     metadata read when the volume was opened does not match the tree
+     (EIO).
+ */
+int attach_verity_tree(volume_t *volume, const char *path, const unsigned char *root_hash) {
+
+  verity_header_t header;
+
+  if (volume->verity || volume->cache) {
+    errno = EBUSY;
+    return -1;
+  }
+  if (volume->backend->pwrite) {
+    // Blocks written through an overlay cannot match the tree
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct verity *verity = calloc(1, sizeof(struct verity));
+  if (!verity)
+    return -1;
+  verity->fd = open(path, O_RDONLY);
+  if (verity->fd == -1) {
+    free(verity);
+    return -1;
+  }
+  verity->blocks_count = volume->super.s_blocks_count;
+  verity->levels = tree_geometry(verity->blocks_count, verity->level_nodes, verity->level_offset);
+  struct stat st;
+  if (pread(verity->fd, &header, sizeof(header), 0) != sizeof(header) || fstat(verity->fd, &st) == -1 ||
+      memcmp(header.magic, VERITY_MAGIC, sizeof(header.magic)) || header.block_size != volume->block_size ||
+      header.blocks_count != verity->blocks_count || header.hash_block_size != VERITY_HASH_BLOCK ||
+      header.levels != verity->levels ||
+      (uint64_t) st.st_size < verity->level_offset[0] + verity->level_nodes[0] * VERITY_HASH_BLOCK ||
+      (root_hash && memcmp(root_hash, header.root_hash, VERITY_HASH_SIZE))) {
+    close(verity->fd);
+    free(verity);
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(verity->root_hash, header.root_hash, VERITY_HASH_SIZE);
+  verity->md = EVP_MD_fetch(NULL, "SHA256", NULL);
+  for (unsigned int l = 0; l < verity->levels; l++)
+    verity->nodes[l] = calloc(verity->level_nodes[l], sizeof(unsigned char *));
+  pthread_mutex_init(&verity->lock, NULL);
+  volume->verity = verity;
+  for (unsigned int l = 0; l < verity->levels; l++)
+    if (!verity->md || !verity->nodes[l]) {
+      detach_verity_tree(volume);
+      errno = ENOMEM;
+      return -1;
+    }
+
+  // Same offsets as in open_volume_backend
+  size_t groups_size = volume->num_groups * sizeof(group_desc_t);
+  char *metadata = malloc(sizeof(superblock_t) + groups_size);
+  uint32_t groups_offset = volume->block_size == 1024 ? 2048 : volume->block_size;
+  int failed = !metadata ||
+    read_verified_blocks(volume, 0, 1024, sizeof(superblock_t), metadata) < 0 ||
+    read_verified_blocks(volume, 0, groups_offset, groups_size, metadata + sizeof(superblock_t)) < 0 ||
+    memcmp(metadata, &volume->super, sizeof(superblock_t)) ||
+    memcmp(metadata + sizeof(superblock_t), volume->groups, groups_size);
+  free(metadata);
+  if (failed) {
+    detach_verity_tree(volume);
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* detach_verity_tree: Stops verifying the blocks read from a volume,
+   and releases its hash tree. Must not be called while other threads
+   read from the volume. close_volume_file detaches the tree.
+ */
+void detach_verity_tree(volume_t *volume) {
+
+  struct verity *verity = volume->verity;
+  if (!verity)
+    return;
+  volume->verity = NULL;
+  for (unsigned int l = 0; l < verity->levels; l++) {
+    for (uint64_t n = 0; verity->nodes[l] && n < verity->level_nodes[l]; n++)
+      free(verity->nodes[l][n]);
+    free(verity->nodes[l]);
+  }
+  pthread_mutex_destroy(&verity->lock);
+  EVP_MD_free(verity->md);
+  close(verity->fd);
+  free(verity);
+}
+
+/* verity_stats: Reports how many blocks were verified, how many hash
+   blocks were loaded from the tree file, and how many blocks or hash
+   blocks did not match. Any of the output pointers may be NULL.
+ */
+void verity_stats(volume_t *volume, uint64_t *blocks, uint64_t *nodes, uint64_t *failures) {
+
+  struct verity *verity = volume->verity;
+  if (blocks) *blocks = verity ? __atomic_load_n(&verity->blocks_verified, __ATOMIC_RELAXED) : 0;
+  if (nodes) *nodes = verity ? __atomic_load_n(&verity->nodes_loaded, __ATOMIC_RELAXED) : 0;
+  if (failures) *failures = verity ? __atomic_load_n(&verity->failures, __ATOMIC_RELAXED) : 0;
+}
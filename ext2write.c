@@ -0,0 +1,899 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Modification of volumes whose backend supports writes (see
+   attach_overlay). Writes are done in place, in the same layout the
+   kernel driver uses, so the result can be checked with e2fsck once
+   committed. Every public function holds a single lock for its whole
+   duration: updates are infrequent compared to reads, and this keeps
+   the bitmaps, counters and directories consistent with each other.
+
+   Not supported: hard links, renames, creating symbolic links and
+   device files, and writing extended attributes.
+ */
+
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* write_group: Writes the superblock and the descriptor of a group
+   after their free counts changed.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int write_group(volume_t *volume, uint32_t group_no) {
+
+  volume->super.s_wtime = time(NULL);
+  if (write_block(volume, 0, 1024, sizeof(superblock_t), &volume->super) < 0)
+    return -1;
+  // Descriptors start in the block following the superblock
+  if (write_block(volume, volume->super.s_first_data_block + 1, group_no * sizeof(group_desc_t),
+                  sizeof(group_desc_t), &volume->groups[group_no]) < 0)
+    return -1;
+  return 0;
+}
+
+/* allocate_bit: Finds a clear bit in a bitmap block and sets it.
+
+   Parameters:
+     volume: Pointer to volume.
+     bitmap_block: Block number of the bitmap.
+     bits: Number of valid bits in the bitmap.
+
+   Returns:
+     The index of the bit that was set, or -1 if all bits are set or
+     in case of error.
+ */
+static int64_t allocate_bit(volume_t *volume, uint32_t bitmap_block, uint32_t bits) {
+
+  uint8_t *bitmap = malloc(volume->block_size);
+  int64_t rv = -1;
+
+  if (!bitmap || read_block(volume, bitmap_block, 0, volume->block_size, bitmap) != volume->block_size) {
+    free(bitmap);
+    return -1;
+  }
+  for (uint32_t byte = 0; byte * 8 < bits && rv < 0; byte++) {
+    if (bitmap[byte] == 0xff)
+      continue;
+    for (uint32_t bit = 0; bit < 8 && byte * 8 + bit < bits; bit++) {
+      if (!(bitmap[byte] & (1 << bit))) {
+        bitmap[byte] |= 1 << bit;
+        if (write_block(volume, bitmap_block, byte, 1, &bitmap[byte]) == 1)
+          rv = byte * 8 + bit;
+        break;
+      }
+    }
+  }
+  free(bitmap);
+  return rv;
+}
+
+/* clear_bit: Clears a bit in a bitmap block.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int clear_bit(volume_t *volume, uint32_t bitmap_block, uint32_t bit) {
+
+  uint8_t byte;
+  if (read_block(volume, bitmap_block, bit / 8, 1, &byte) != 1)
+    return -1;
+  byte &= ~(1 << (bit % 8));
+  return write_block(volume, bitmap_block, bit / 8, 1, &byte) == 1 ? 0 : -1;
+}
+
+/* allocate_block: Allocates a block, preferably in the same group as
+   an inode, and fills it with zeros.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Inode the block will belong to.
+
+   Returns:
+     The number of the allocated block. Returns 0 and sets errno in
+     case of error (ENOSPC if the volume is full).
+ */
+static uint32_t allocate_block(volume_t *volume, uint32_t inode_no) {
+
+  uint32_t goal = (inode_no - 1) / volume->super.s_inodes_per_group;
+  uint32_t per_group = volume->super.s_blocks_per_group;
+
+  for (uint32_t i = 0; i < volume->num_groups; i++) {
+    uint32_t group_no = (goal + i) % volume->num_groups;
+    group_desc_t *group = &volume->groups[group_no];
+    if (group->bg_free_blocks_count == 0)
+      continue;
+
+    uint32_t first = volume->super.s_first_data_block + group_no * per_group;
+    uint32_t bits = volume->super.s_blocks_count - first < per_group ?
+      volume->super.s_blocks_count - first : per_group;
+    int64_t bit = allocate_bit(volume, group->bg_block_bitmap, bits);
+    if (bit < 0)
+      continue; // Counter was wrong, or the bitmap could not be read
+
+    group->bg_free_blocks_count--;
+    volume->super.s_free_blocks_count--;
+    void *zeros = calloc(1, volume->block_size);
+    if (!zeros || write_block(volume, first + bit, 0, volume->block_size, zeros) < 0 ||
+        write_group(volume, group_no) < 0) {
+      free(zeros);
+      return 0;
+    }
+    free(zeros);
+    return first + bit;
+  }
+  errno = ENOSPC;
+  return 0;
+}
+
+/* free_block: Returns a block to the free pool.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int free_block(volume_t *volume, uint32_t block_no) {
+
+  if (block_no < volume->super.s_first_data_block || block_no >= volume->super.s_blocks_count) {
+    errno = EIO;
+    return -1;
+  }
+  uint32_t index = block_no - volume->super.s_first_data_block;
+  uint32_t group_no = index / volume->super.s_blocks_per_group;
+  group_desc_t *group = &volume->groups[group_no];
+
+  if (clear_bit(volume, group->bg_block_bitmap, index % volume->super.s_blocks_per_group) < 0)
+    return -1;
+  group->bg_free_blocks_count++;
+  volume->super.s_free_blocks_count++;
+  return write_group(volume, group_no);
+}
+
+/* write_inode: Writes an inode back to the inode table.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Number of the inode.
+     inode: Inode contents. Fields of larger on-disk inodes that are
+            not part of inode_t are left unchanged.
+
+   Returns:
+     0 on success, or -1 with errno set in case of error.
+ */
+int write_inode(volume_t *volume, uint32_t inode_no, inode_t *inode) {
+
+  if (inode_no == 0 || inode_no > volume->super.s_inodes_count) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint32_t inumber = inode_no - 1;
+  uint32_t group_no = inumber / volume->super.s_inodes_per_group;
+  uint32_t index = inumber % volume->super.s_inodes_per_group;
+
+  return write_block(volume, volume->groups[group_no].bg_inode_table, index * volume->inode_size,
+                     sizeof(inode_t), inode) < 0 ? -1 : 0;
+}
+
+/* set_file_size: Stores the size of a file in an inode.
+
+   Returns 0 on success, or -1 (EFBIG) if the size cannot be
+   represented on this volume.
+ */
+static int set_file_size(volume_t *volume, inode_t *inode, uint64_t size) {
+
+  if (inode_is_regular_file(inode) &&
+      (volume->super.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+    inode->i_dir_acl = size >> 32;
+  } else if (size > UINT32_MAX) {
+    errno = EFBIG;
+    return -1;
+  }
+  inode->i_size = (uint32_t) size;
+  return 0;
+}
+
+/* map_block: Returns the block holding a given block of a file,
+   allocating it (and the indirect blocks leading to it) if it is a
+   hole. The caller writes the inode back.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Number of the inode.
+     inode: Inode of the file. Its block pointers and i_blocks are
+            updated as blocks are allocated.
+     index: Index of the block inside the file.
+
+   Returns:
+     The block number, or 0 with errno set in case of error.
+ */
+static uint32_t map_block(volume_t *volume, uint32_t inode_no, inode_t *inode, uint64_t index) {
+
+  uint64_t per_block = volume->block_size / 4;
+  uint32_t *root;
+  int depth;
+
+  if (index < 12) {
+    root = &inode->i_block[index];
+    depth = 0;
+  } else if ((index -= 12) < per_block) {
+    root = &inode->i_block_1ind;
+    depth = 1;
+  } else if ((index -= per_block) < per_block * per_block) {
+    root = &inode->i_block_2ind;
+    depth = 2;
+  } else if ((index -= per_block * per_block) < per_block * per_block * per_block) {
+    root = &inode->i_block_3ind;
+    depth = 3;
+  } else {
+    errno = EFBIG;
+    return 0;
+  }
+
+  if (*root == 0) {
+    if (!(*root = allocate_block(volume, inode_no)))
+      return 0;
+    inode->i_blocks += volume->block_size / 512;
+  }
+
+  uint32_t block_no = *root;
+  uint64_t span = 1;
+  for (int level = 1; level < depth; level++)
+    span *= per_block;
+  for (int level = depth; level > 0; level--, span /= per_block) {
+    uint32_t entry_offset = (index / span) * 4;
+    uint32_t entry;
+    index %= span;
+    if (read_block(volume, block_no, entry_offset, 4, &entry) != 4)
+      return 0;
+    if (entry == 0) {
+      if (!(entry = allocate_block(volume, inode_no)))
+        return 0;
+      inode->i_blocks += volume->block_size / 512;
+      if (write_block(volume, block_no, entry_offset, 4, &entry) != 4)
+        return 0;
+    }
+    block_no = entry;
+  }
+  return block_no;
+}
+
+/* truncate_tree: Frees the blocks of a subtree of the block map that
+   hold logical blocks at or beyond 'keep'.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode: Inode the subtree belongs to (i_blocks is updated).
+     block_no: Root of the subtree; set to 0 if the root is freed.
+     depth: 0 for a data block, otherwise the levels of indirection.
+     base: Logical index of the first block the subtree maps.
+     keep: Number of logical blocks to keep.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int truncate_tree(volume_t *volume, inode_t *inode, uint32_t *block_no, int depth,
+                         uint64_t base, uint64_t keep) {
+
+  uint64_t per_block = volume->block_size / 4;
+  uint64_t span = 1;
+  for (int level = 0; level < depth; level++)
+    span *= per_block;
+  if (*block_no == 0 || base + span <= keep)
+    return 0;
+
+  if (depth > 0) {
+    uint32_t *table = malloc(volume->block_size);
+    int changed = 0, rv = 0;
+    if (!table || read_block(volume, *block_no, 0, volume->block_size, table) != volume->block_size) {
+      free(table);
+      return -1;
+    }
+    for (uint64_t i = 0; i < per_block && rv == 0; i++) {
+      uint32_t entry = table[i];
+      rv = truncate_tree(volume, inode, &table[i], depth - 1, base + i * (span / per_block), keep);
+      changed |= table[i] != entry;
+    }
+    if (rv == 0 && changed && base < keep &&
+        write_block(volume, *block_no, 0, volume->block_size, table) != volume->block_size)
+      rv = -1;
+    free(table);
+    if (rv < 0)
+      return -1;
+  }
+
+  if (base >= keep) {
+    if (free_block(volume, *block_no) < 0)
+      return -1;
+    inode->i_blocks -= volume->block_size / 512;
+    *block_no = 0;
+  }
+  return 0;
+}
+
+/* truncate_blocks: Frees the blocks of a file beyond its first 'keep'
+   blocks.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int truncate_blocks(volume_t *volume, inode_t *inode, uint64_t keep) {
+
+  uint64_t per_block = volume->block_size / 4;
+  uint32_t *roots[3] = { &inode->i_block_1ind, &inode->i_block_2ind, &inode->i_block_3ind };
+  uint64_t base = 12, span = 1;
+
+  for (int i = 0; i < 12; i++)
+    if (truncate_tree(volume, inode, &inode->i_block[i], 0, i, keep) < 0)
+      return -1;
+  for (int depth = 1; depth <= 3; depth++) {
+    span *= per_block;
+    if (truncate_tree(volume, inode, roots[depth - 1], depth, base, keep) < 0)
+      return -1;
+    base += span;
+  }
+  return 0;
+}
+
+/* has_data_blocks: Returns whether the block pointers of an inode
+   point to data (not for devices, FIFOs, sockets, or symbolic links
+   whose target is stored in the inode).
+ */
+static int has_data_blocks(inode_t *inode) {
+  if (inode_is_symlink(inode))
+    return inode->i_size >= sizeof(inode->i_symlink_target);
+  return inode_is_regular_file(inode) || inode_is_directory(inode);
+}
+
+/* write_content: write_file_content, without taking the lock.
+ */
+static ssize_t write_content(volume_t *volume, uint32_t inode_no, inode_t *inode, uint64_t offset,
+                             uint64_t size, const void *buffer) {
+
+  uint64_t done = 0;
+  if (read_inode(volume, inode_no, inode) < 0)
+    return -1;
+  if (inode_is_directory(inode)) {
+    errno = EISDIR;
+    return -1;
+  }
+  while (done < size) {
+    uint64_t pos = offset + done;
+    uint32_t in_block = pos & (volume->block_size - 1);
+    uint64_t chunk = volume->block_size - in_block;
+    if (chunk > size - done)
+      chunk = size - done;
+
+    uint32_t block_no = map_block(volume, inode_no, inode, pos >> volume->block_shift);
+    if (block_no == 0 || write_block(volume, block_no, in_block, chunk, (const char *) buffer + done) < 0)
+      break;
+    done += chunk;
+  }
+
+  if (offset + done > inode_file_size(volume, inode) && set_file_size(volume, inode, offset + done) < 0)
+    return -1;
+  inode->i_mtime = inode->i_ctime = time(NULL);
+  // Blocks may have been allocated even if the write failed
+  if (write_inode(volume, inode_no, inode) < 0)
+    return -1;
+  return done > 0 || size == 0 ? (ssize_t) done : -1;
+}
+
+/* write_file_content: Writes data to a file, allocating blocks for
+   holes and extending the file as needed.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Number of the inode.
+     inode: Set to the updated inode. The inode is read again once
+            other writers are done, so concurrent writes to the same
+            file do not undo each other's changes.
+     offset: Offset in the file where the data is written.
+     size: Number of bytes to write.
+     buffer: Data to be written.
+
+   Returns:
+     The number of bytes written, which is less than 'size' only if
+     the volume is full. Returns -1 with errno set in case of error.
+ */
+ssize_t write_file_content(volume_t *volume, uint32_t inode_no, inode_t *inode, uint64_t offset,
+                           uint64_t size, const void *buffer) {
+
+  pthread_mutex_lock(&write_lock);
+  ssize_t rv = write_content(volume, inode_no, inode, offset, size, buffer);
+  pthread_mutex_unlock(&write_lock);
+  return rv;
+}
+
+/* truncate_file: Changes the size of a regular file. Blocks beyond the
+   new size are freed; growing a file leaves a hole.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Number of the inode.
+     inode: Set to the updated inode (see write_file_content).
+     size: New size of the file.
+
+   Returns:
+     0 on success, or -1 with errno set in case of error.
+ */
+int truncate_file(volume_t *volume, uint32_t inode_no, inode_t *inode, uint64_t size) {
+
+  pthread_mutex_lock(&write_lock);
+  uint64_t keep = (size + volume->block_size - 1) >> volume->block_shift;
+  uint32_t tail = size & (volume->block_size - 1);
+  int rv = read_inode(volume, inode_no, inode) < 0 ? -1 : 0;
+
+  if (rv == 0 && !inode_is_regular_file(inode)) {
+    errno = inode_is_directory(inode) ? EISDIR : EINVAL;
+    rv = -1;
+  }
+  if (rv == 0 && size < inode_file_size(volume, inode)) {
+    rv = truncate_blocks(volume, inode, keep);
+    // Data past the end of the last block must read as zeros if the
+    // file grows again
+    uint32_t block_no = rv == 0 && tail ? get_inode_block_no(volume, inode, keep - 1) : 0;
+    if (block_no != 0 && block_no != EXT2_INVALID_BLOCK_NUMBER) {
+      void *zeros = calloc(1, volume->block_size - tail);
+      if (!zeros || write_block(volume, block_no, tail, volume->block_size - tail, zeros) < 0)
+        rv = -1;
+      free(zeros);
+    }
+  }
+  if (rv == 0)
+    rv = set_file_size(volume, inode, size);
+  if (rv == 0) {
+    inode->i_mtime = inode->i_ctime = time(NULL);
+    rv = write_inode(volume, inode_no, inode);
+  }
+  pthread_mutex_unlock(&write_lock);
+  return rv;
+}
+
+/* set_file_attributes: Changes the permissions, owner or timestamps
+   of a file.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Number of the inode.
+     mode: New permission bits, or -1 to leave them unchanged.
+     uid, gid: New owner, or -1 to leave them unchanged.
+     atime, mtime: New timestamps, or -1 to leave them unchanged.
+
+   Returns:
+     0 on success, or -1 with errno set in case of error.
+ */
+int set_file_attributes(volume_t *volume, uint32_t inode_no, int32_t mode, int64_t uid, int64_t gid,
+                        int64_t atime, int64_t mtime) {
+
+  inode_t inode;
+  int rv = -1;
+
+  pthread_mutex_lock(&write_lock);
+  if (read_inode(volume, inode_no, &inode) >= 0) {
+    if (mode >= 0)
+      inode.i_mode = (inode.i_mode & S_IFMT) | (mode & 07777);
+    if (uid >= 0) {
+      inode.i_uid = uid & 0xffff;
+      inode.l_i_uid_high = uid >> 16;
+    }
+    if (gid >= 0) {
+      inode.i_gid = gid & 0xffff;
+      inode.l_i_gid_high = gid >> 16;
+    }
+    if (atime >= 0)
+      inode.i_atime = atime;
+    if (mtime >= 0)
+      inode.i_mtime = mtime;
+    inode.i_ctime = time(NULL);
+    rv = write_inode(volume, inode_no, &inode);
+  }
+  pthread_mutex_unlock(&write_lock);
+  return rv;
+}
+
+static inline uint32_t dir_entry_size(uint32_t name_len) {
+  return (DIR_ENTRY_HEADER_SIZE + name_len + 3) & ~3U;
+}
+
+/* add_dir_entry: Adds an entry to a directory, in the first gap large
+   enough to hold it, or in a new block at the end of the directory.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int add_dir_entry(volume_t *volume, uint32_t dir_inode_no, inode_t *dir_inode, const char *name,
+                         uint32_t inode_no, uint16_t mode) {
+
+  uint32_t name_len = strlen(name);
+  uint32_t needed = dir_entry_size(name_len);
+  uint64_t dir_size = inode_file_size(volume, dir_inode);
+  char *block = malloc(volume->block_size);
+  uint32_t block_no = 0, offset = 0;
+  dir_entry_t *entry = NULL;
+
+  if (!block)
+    return -1;
+
+  for (uint64_t index = 0; index < dir_size >> volume->block_shift && !entry; index++) {
+    block_no = get_inode_block_no(volume, dir_inode, index);
+    if (block_no == 0 || block_no == EXT2_INVALID_BLOCK_NUMBER ||
+        read_block(volume, block_no, 0, volume->block_size, block) != volume->block_size) {
+      free(block);
+      errno = EIO;
+      return -1;
+    }
+    for (offset = 0; offset + DIR_ENTRY_HEADER_SIZE <= volume->block_size; ) {
+      dir_entry_t *e = (dir_entry_t *) (block + offset);
+      if (e->de_rec_len < DIR_ENTRY_HEADER_SIZE || offset + e->de_rec_len > volume->block_size)
+        break;
+      uint32_t used = e->de_inode_no ? dir_entry_size(e->de_name_len) : 0;
+      if (e->de_rec_len - used >= needed) {
+        // Splits the entry, keeping its used part
+        if (used) {
+          uint16_t rec_len = e->de_rec_len - used;
+          e->de_rec_len = used;
+          offset += used;
+          e = (dir_entry_t *) (block + offset);
+          e->de_rec_len = rec_len;
+        }
+        entry = e;
+        break;
+      }
+      offset += e->de_rec_len;
+    }
+  }
+
+  if (!entry) {
+    // No room: the entry fills a new block
+    block_no = map_block(volume, dir_inode_no, dir_inode, dir_size >> volume->block_shift);
+    if (block_no == 0) {
+      free(block);
+      return -1;
+    }
+    memset(block, 0, volume->block_size);
+    offset = 0;
+    entry = (dir_entry_t *) block;
+    entry->de_rec_len = volume->block_size;
+    dir_size += volume->block_size;
+    set_file_size(volume, dir_inode, dir_size);
+  }
+
+  entry->de_inode_no = inode_no;
+  entry->de_name_len = name_len;
+  entry->de_file_type = 0;
+  if (volume->super.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) {
+    for (uint8_t type = 1; type < 8; type++)
+      if (dir_entry_type_mode(type) == (mode & S_IFMT))
+        entry->de_file_type = type;
+  }
+  memcpy(entry->de_name, name, name_len);
+
+  // The split entry may precede the new one in the same block
+  int rv = write_block(volume, block_no, 0, volume->block_size, block) < 0 ? -1 : 0;
+  free(block);
+
+  // The hash index is not maintained, so it is dropped: the directory
+  // is still valid as a linear directory
+  dir_inode->i_flags &= ~EXT2_INDEX_FL;
+  dir_inode->i_mtime = dir_inode->i_ctime = time(NULL);
+  return rv;
+}
+
+/* allocate_inode: Allocates an inode, preferably in the same group as
+   its parent directory.
+
+   Returns:
+     The number of the allocated inode. Returns 0 and sets errno in
+     case of error (ENOSPC if there are no free inodes).
+ */
+static uint32_t allocate_inode(volume_t *volume, uint32_t dir_inode_no, int is_directory) {
+
+  uint32_t per_group = volume->super.s_inodes_per_group;
+  uint32_t goal = (dir_inode_no - 1) / per_group;
+  uint32_t first_ino = volume->super.s_rev_level ? volume->super.s_first_ino : 11;
+
+  for (uint32_t i = 0; i < volume->num_groups; i++) {
+    uint32_t group_no = (goal + i) % volume->num_groups;
+    group_desc_t *group = &volume->groups[group_no];
+    if (group->bg_free_inodes_count == 0)
+      continue;
+
+    int64_t bit = allocate_bit(volume, group->bg_inode_bitmap, per_group);
+    if (bit < 0)
+      continue;
+    if (group_no * per_group + bit + 1 < first_ino) {
+      // Reserved inodes are always marked as used; the bitmap is wrong
+      errno = EIO;
+      return 0;
+    }
+    group->bg_free_inodes_count--;
+    volume->super.s_free_inodes_count--;
+    if (is_directory)
+      group->bg_used_dirs_count++;
+    if (write_group(volume, group_no) < 0)
+      return 0;
+    return group_no * per_group + bit + 1;
+  }
+  errno = ENOSPC;
+  return 0;
+}
+
+/* free_inode: Returns an inode to the free pool.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int free_inode(volume_t *volume, uint32_t inode_no, int is_directory) {
+
+  uint32_t group_no = (inode_no - 1) / volume->super.s_inodes_per_group;
+  group_desc_t *group = &volume->groups[group_no];
+
+  if (clear_bit(volume, group->bg_inode_bitmap, (inode_no - 1) % volume->super.s_inodes_per_group) < 0)
+    return -1;
+  group->bg_free_inodes_count++;
+  volume->super.s_free_inodes_count++;
+  if (is_directory)
+    group->bg_used_dirs_count--;
+  return write_group(volume, group_no);
+}
+
+/* drop_xattr_block_ref: Drops an inode's reference to its extended
+   attribute block, freeing the block when no inode uses it anymore.
+
+   Returns 0 on success, or -1 in case of error.
+ */
+static int drop_xattr_block_ref(volume_t *volume, inode_t *inode) {
+
+  uint32_t header[2]; // Magic number and reference count
+  if (read_block(volume, inode->i_file_acl, 0, sizeof(header), header) != sizeof(header))
+    return -1;
+  if (header[0] == EXT2_XATTR_MAGIC && header[1] > 1) {
+    header[1]--;
+    if (write_block(volume, inode->i_file_acl, 4, 4, &header[1]) != 4)
+      return -1;
+  } else if (free_block(volume, inode->i_file_acl) < 0) {
+    return -1;
+  } else {
+    inode->i_blocks -= volume->block_size / 512;
+  }
+  inode->i_file_acl = 0;
+  return 0;
+}
+
+/* create_file: Creates an empty regular file or directory.
+
+   Parameters:
+     volume: Pointer to volume.
+     dir_inode_no: Directory where the file is created.
+     name: Name of the new file.
+     mode: File type (S_IFREG or S_IFDIR) and permissions.
+     uid, gid: Owner of the file.
+     inode: If not NULL, set to the inode of the new file.
+
+   Returns:
+     The inode number of the new file. Returns -1 and sets errno in
+     case of error (EEXIST if the name is in use, ENOSPC if the volume
+     is full).
+ */
+int64_t create_file(volume_t *volume, uint32_t dir_inode_no, const char *name, uint16_t mode,
+                    uint32_t uid, uint32_t gid, inode_t *inode) {
+
+  int is_directory = (mode & S_IFMT) == S_IFDIR;
+  inode_t dir_inode, new_inode;
+  uint32_t inode_no = 0;
+  int64_t rv = -1;
+
+  if ((mode & S_IFMT) != S_IFREG && !is_directory) {
+    errno = EPERM;
+    return -1;
+  }
+  if (strlen(name) == 0 || strlen(name) > 255) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  pthread_mutex_lock(&write_lock);
+  if (read_inode(volume, dir_inode_no, &dir_inode) < 0 || !inode_is_directory(&dir_inode)) {
+    errno = ENOTDIR;
+    goto out;
+  }
+  int64_t existing = find_file_in_directory(volume, &dir_inode, name, NULL);
+  if (existing != 0) {
+    errno = existing > 0 ? EEXIST : EIO;
+    goto out;
+  }
+  if (is_directory && dir_inode.i_links_count == UINT16_MAX) {
+    errno = EMLINK;
+    goto out;
+  }
+  if (!(inode_no = allocate_inode(volume, dir_inode_no, is_directory)))
+    goto out;
+
+  // The whole on-disk inode is cleared, including any fields beyond
+  // inode_t
+  void *zeros = calloc(1, volume->inode_size);
+  uint32_t group_no = (inode_no - 1) / volume->super.s_inodes_per_group;
+  uint32_t index = (inode_no - 1) % volume->super.s_inodes_per_group;
+  if (!zeros || write_block(volume, volume->groups[group_no].bg_inode_table, index * volume->inode_size,
+                            volume->inode_size, zeros) < 0) {
+    free(zeros);
+    goto out;
+  }
+  free(zeros);
+
+  memset(&new_inode, 0, sizeof(inode_t));
+  new_inode.i_mode = mode;
+  new_inode.i_uid = uid & 0xffff;
+  new_inode.l_i_uid_high = uid >> 16;
+  new_inode.i_gid = gid & 0xffff;
+  new_inode.l_i_gid_high = gid >> 16;
+  new_inode.i_atime = new_inode.i_ctime = new_inode.i_mtime = time(NULL);
+  new_inode.i_links_count = 1;
+
+  if (is_directory) {
+    // Entries for "." and "..", which fill the first block
+    char entries[24] = { 0 };
+    dir_entry_t *dot = (dir_entry_t *) entries, *dotdot = (dir_entry_t *) (entries + 12);
+    int filetype = volume->super.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE;
+    dot->de_inode_no = inode_no;
+    dot->de_rec_len = 12;
+    dot->de_name_len = 1;
+    dot->de_file_type = filetype ? 2 : 0;
+    memcpy(dot->de_name, ".", 1);
+    dotdot->de_inode_no = dir_inode_no;
+    dotdot->de_rec_len = volume->block_size - 12;
+    dotdot->de_name_len = 2;
+    dotdot->de_file_type = filetype ? 2 : 0;
+    memcpy(dotdot->de_name, "..", 2);
+
+    new_inode.i_links_count = 2;
+    new_inode.i_size = volume->block_size;
+    uint32_t block_no = map_block(volume, inode_no, &new_inode, 0);
+    if (block_no == 0 || write_block(volume, block_no, 0, sizeof(entries), entries) < 0) {
+      write_inode(volume, inode_no, &new_inode);
+      goto out;
+    }
+    dir_inode.i_links_count++;
+  }
+
+  if (write_inode(volume, inode_no, &new_inode) < 0 ||
+      add_dir_entry(volume, dir_inode_no, &dir_inode, name, inode_no, mode) < 0 ||
+      write_inode(volume, dir_inode_no, &dir_inode) < 0)
+    goto out;
+
+  if (inode)
+    *inode = new_inode;
+  rv = inode_no;
+
+out:
+  pthread_mutex_unlock(&write_lock);
+  return rv;
+}
+
+/* is_empty_directory: Returns 1 if a directory only holds "." and
+   "..", 0 if it holds other entries, or -1 in case of error.
+ */
+static int is_empty_directory(volume_t *volume, inode_t *inode) {
+
+  dir_iterator_t iterator;
+  dir_entry_view_t view;
+  char *block = malloc(volume->block_size);
+  int64_t rv;
+  int empty = 1;
+
+  if (!block)
+    return -1;
+  open_directory_iterator(&iterator, volume, inode, 0, block);
+  while (empty && (rv = next_directory_view(&iterator, &view)) > 0) {
+    if (!(view.name_len == 1 && view.name[0] == '.') &&
+        !(view.name_len == 2 && view.name[0] == '.' && view.name[1] == '.'))
+      empty = 0;
+  }
+  free(block);
+  return rv < 0 ? -1 : empty;
+}
+
+/* remove_file: Removes a directory entry (unlink, or rmdir if the
+   entry is a directory). The inode and its blocks are freed when no
+   other entry refers to it.
+
+   Parameters:
+     volume: Pointer to volume.
+     dir_inode_no: Directory holding the entry.
+     name: Name of the entry.
+
+   Returns:
+     0 on success. Returns -1 and sets errno in case of error (ENOENT
+     if the entry does not exist, ENOTEMPTY for a directory that is
+     not empty).
+ */
+int remove_file(volume_t *volume, uint32_t dir_inode_no, const char *name) {
+
+  uint32_t name_len = strlen(name);
+  inode_t dir_inode, inode;
+  char *block = malloc(volume->block_size);
+  int rv = -1;
+
+  if (!block)
+    return -1;
+  if (!strcmp(name, ".") || !strcmp(name, "..")) {
+    free(block);
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&write_lock);
+  if (read_inode(volume, dir_inode_no, &dir_inode) < 0 || !inode_is_directory(&dir_inode)) {
+    errno = ENOTDIR;
+    goto out;
+  }
+
+  // Finds the entry, and the one before it in the same block
+  uint64_t dir_size = inode_file_size(volume, &dir_inode);
+  uint32_t block_no = 0, offset = 0, prev = 0;
+  dir_entry_t *entry = NULL;
+  for (uint64_t index = 0; index < dir_size >> volume->block_shift && !entry; index++) {
+    block_no = get_inode_block_no(volume, &dir_inode, index);
+    if (block_no == 0 || block_no == EXT2_INVALID_BLOCK_NUMBER ||
+        read_block(volume, block_no, 0, volume->block_size, block) != volume->block_size) {
+      errno = EIO;
+      goto out;
+    }
+    prev = UINT32_MAX;
+    for (offset = 0; offset + DIR_ENTRY_HEADER_SIZE <= volume->block_size; ) {
+      dir_entry_t *e = (dir_entry_t *) (block + offset);
+      if (e->de_rec_len < DIR_ENTRY_HEADER_SIZE || offset + e->de_rec_len > volume->block_size)
+        break;
+      if (e->de_inode_no && e->de_name_len == name_len && !memcmp(e->de_name, name, name_len)) {
+        entry = e;
+        break;
+      }
+      prev = offset;
+      offset += e->de_rec_len;
+    }
+  }
+  if (!entry) {
+    errno = ENOENT;
+    goto out;
+  }
+
+  uint32_t inode_no = entry->de_inode_no;
+  if (read_inode(volume, inode_no, &inode) < 0)
+    goto out;
+  int is_directory = inode_is_directory(&inode);
+  if (is_directory) {
+    int empty = is_empty_directory(volume, &inode);
+    if (empty <= 0) {
+      errno = empty < 0 ? EIO : ENOTEMPTY;
+      goto out;
+    }
+  }
+
+  if (prev != UINT32_MAX)
+    ((dir_entry_t *) (block + prev))->de_rec_len += entry->de_rec_len;
+  else
+    entry->de_inode_no = 0;
+  if (write_block(volume, block_no, 0, volume->block_size, block) < 0)
+    goto out;
+
+  dir_inode.i_mtime = dir_inode.i_ctime = time(NULL);
+  if (is_directory)
+    dir_inode.i_links_count--; // The ".." entry of the removed directory
+  if (write_inode(volume, dir_inode_no, &dir_inode) < 0)
+    goto out;
+
+  // A directory is only referred to by its entry and its own "."
+  inode.i_links_count = is_directory ? 0 : inode.i_links_count - 1;
+  inode.i_ctime = time(NULL);
+  if (inode.i_links_count == 0) {
+    if ((has_data_blocks(&inode) && truncate_blocks(volume, &inode, 0) < 0) ||
+        (inode.i_file_acl && drop_xattr_block_ref(volume, &inode) < 0))
+      goto out;
+    inode.i_dtime = inode.i_ctime;
+    if (free_inode(volume, inode_no, is_directory) < 0)
+      goto out;
+  }
+  rv = write_inode(volume, inode_no, &inode);
+
+out:
+  pthread_mutex_unlock(&write_lock);
+  free(block);
+  return rv;
+}
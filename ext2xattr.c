@@ -0,0 +1,568 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Read-only support for extended attributes. An inode's i_file_acl
+   field points to an EA block holding its attributes, and inodes with
+   identical attributes share a single block (tracked by its reference
+   count). Parsed blocks are therefore cached by block number, so
+   looking up attributes of many files reads each distinct EA block
+   only once.
+
+   Inodes larger than 128 bytes may also hold attributes themselves,
+   after their extra fields (i_extra_isize bytes from offset 128): the
+   area starts with EXT2_XATTR_MAGIC, followed by entries in the same
+   format as in EA blocks, with value offsets counted from the first
+   entry. mke2fs stores small attributes there when inodes are 256
+   bytes, its default. These are read along with the inode each time.
+ */
+
+#define XATTR_CACHE_BLOCKS  512  // Parsed EA blocks kept per volume
+#define XATTR_CACHE_BUCKETS 1024 // Must be a power of two
+
+#define XATTR_HEADER_SIZE 32
+#define XATTR_INODE_START 128    // Offset of i_extra_isize in large inodes
+#define XATTR_ENTRY_SIZE  16     // Entry header, without the name
+#define XATTR_PAD         4
+
+// Values of e_name_index with an ACL in ext2 format as value
+#define XATTR_INDEX_POSIX_ACL_ACCESS  2
+#define XATTR_INDEX_POSIX_ACL_DEFAULT 3
+
+typedef struct xattr_header {
+  uint32_t h_magic;       // EXT2_XATTR_MAGIC
+  uint32_t h_refcount;    // Number of inodes using this block
+  uint32_t h_blocks;      // Number of blocks used (always 1)
+  uint32_t h_hash;
+  uint32_t h_reserved[4];
+} xattr_header_t;
+
+typedef struct xattr_disk_entry {
+  uint8_t  e_name_len;    // Length of the name, without the prefix
+  uint8_t  e_name_index;  // Prefix of the name (see xattr_prefixes)
+  uint16_t e_value_offs;  // Offset of the value within the block (or
+                          // from the first entry, in an inode)
+  uint32_t e_value_inum;  // Inode holding the value (not supported)
+  uint32_t e_value_size;
+  uint32_t e_hash;
+  char     e_name[];
+} xattr_disk_entry_t;
+
+typedef struct xattr_entry {
+  uint8_t name_index;
+  uint8_t name_len;
+  uint32_t value_offs;    // Offset of the value within the data parsed
+  uint32_t value_size;
+  const char *name;       // Points into the data parsed, not null-terminated
+} xattr_entry_t;
+
+typedef struct xattr_block {
+  uint32_t block_no;
+  uint32_t num_entries;
+  unsigned int users;     // Callers currently using the block
+  int cached;             // Whether the block is still in the cache
+  struct xattr_block *hash_next;
+  struct xattr_block *lru_prev;
+  struct xattr_block *lru_next;
+  const char *data;       // Copy of the block
+  xattr_entry_t entries[];
+} xattr_block_t;
+
+struct xattr_cache {
+  pthread_mutex_t lock;
+  unsigned int count;
+  xattr_block_t *buckets[XATTR_CACHE_BUCKETS];
+  xattr_block_t lru;      // Sentinel: lru.lru_next is the most recently used
+};
+
+// Name prefixes for each e_name_index. ACLs have an empty name, so the
+// prefix is the full name of the attribute.
+static const char *const xattr_prefixes[] = {
+  [1] = "user.",
+  [XATTR_INDEX_POSIX_ACL_ACCESS] = "system.posix_acl_access",
+  [XATTR_INDEX_POSIX_ACL_DEFAULT] = "system.posix_acl_default",
+  [4] = "trusted.",
+  [6] = "security.",
+  [7] = "system.",
+  [8] = "system.richacl",
+};
+
+static const char *xattr_prefix(uint8_t name_index) {
+  return name_index < sizeof(xattr_prefixes) / sizeof(xattr_prefixes[0]) ? xattr_prefixes[name_index] : NULL;
+}
+
+/* create_xattr_cache: Creates an empty cache of parsed EA blocks for
+   one volume.
+
+   Returns:
+     A pointer to the cache, or NULL if memory could not be allocated.
+ */
+xattr_cache_t *create_xattr_cache(void) {
+
+  xattr_cache_t *cache = calloc(1, sizeof(xattr_cache_t));
+  if (!cache)
+    return NULL;
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->lru.lru_next = cache->lru.lru_prev = &cache->lru;
+  return cache;
+}
+
+/* destroy_xattr_cache: Frees a cache of parsed EA blocks. No block may
+   be in use.
+ */
+void destroy_xattr_cache(xattr_cache_t *cache) {
+
+  if (!cache)
+    return;
+  while (cache->lru.lru_next != &cache->lru) {
+    xattr_block_t *block = cache->lru.lru_next;
+    cache->lru.lru_next = block->lru_next;
+    free(block);
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+/* parse_xattr_entries: Indexes the list of entries found at offset
+   'start' of 'data', which ends with four null bytes. Entries whose
+   value is stored in a separate inode, or whose name prefix is
+   unknown, are skipped.
+
+   Parameters:
+     data: EA block or raw inode.
+     start: Offset of the first entry.
+     end: Size of the data; entries and values must lie below it.
+     value_base: Offset that e_value_offs is relative to.
+     entries: Array where the entries are stored; it must have room
+              for (end - start) / XATTR_ENTRY_SIZE of them.
+
+   Returns:
+     The number of entries stored, or -1 if the list is malformed.
+ */
+static int64_t parse_xattr_entries(const char *data, uint32_t start, uint32_t end, uint32_t value_base,
+                                   xattr_entry_t *entries) {
+
+  uint32_t offset = start, num_entries = 0;
+  for (;;) {
+    if (offset + 4 > end)
+      return -1;
+    if (*(uint32_t *) (data + offset) == 0)
+      break; // End of the list
+    xattr_disk_entry_t *entry = (xattr_disk_entry_t *) (data + offset);
+    if (offset + XATTR_ENTRY_SIZE + entry->e_name_len > end)
+      return -1;
+    if (entry->e_value_inum == 0 && xattr_prefix(entry->e_name_index)) {
+      if ((uint64_t) value_base + entry->e_value_offs + entry->e_value_size > end)
+        return -1;
+      entries[num_entries++] = (xattr_entry_t) {
+        .name_index = entry->e_name_index, .name_len = entry->e_name_len,
+        .value_offs = value_base + entry->e_value_offs, .value_size = entry->e_value_size,
+        .name = entry->e_name
+      };
+    }
+    offset += (XATTR_ENTRY_SIZE + entry->e_name_len + XATTR_PAD - 1) & ~(XATTR_PAD - 1);
+  }
+  return num_entries;
+}
+
+/* parse_xattr_block: Reads an EA block and indexes its entries.
+
+   Returns:
+     A newly allocated block, or NULL in case of error.
+ */
+static xattr_block_t *parse_xattr_block(volume_t *volume, uint32_t block_no) {
+
+  uint32_t max_entries = (volume->block_size - XATTR_HEADER_SIZE) / XATTR_ENTRY_SIZE;
+  xattr_block_t *block = malloc(sizeof(xattr_block_t) + max_entries * sizeof(xattr_entry_t) +
+                                volume->block_size);
+  if (!block)
+    return NULL;
+  char *data = (char *) &block->entries[max_entries];
+
+  if (block_no >= volume->super.s_blocks_count ||
+      read_block(volume, block_no, 0, volume->block_size, data) != volume->block_size)
+    goto invalid;
+
+  xattr_header_t *header = (xattr_header_t *) data;
+  if (header->h_magic != EXT2_XATTR_MAGIC || header->h_blocks != 1)
+    goto invalid;
+
+  int64_t num_entries = parse_xattr_entries(data, XATTR_HEADER_SIZE, volume->block_size, 0, block->entries);
+  if (num_entries < 0)
+    goto invalid;
+  block->block_no = block_no;
+  block->num_entries = num_entries;
+  block->data = data;
+  return block;
+
+invalid:
+  free(block);
+  return NULL;
+}
+
+/* read_inode_xattrs: Reads the attributes stored inside an inode, if
+   its size leaves room for them. The raw inode and its entries are
+   allocated from the thread arena.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Number of the inode.
+     data: Where a pointer to the raw inode is stored.
+     entries: Where a pointer to the entries is stored.
+
+   Returns:
+     The number of entries (0 if the inode holds no attributes), or -1
+     in case of error.
+ */
+static int64_t read_inode_xattrs(volume_t *volume, uint32_t inode_no, const char **data,
+                                 xattr_entry_t **entries) {
+
+  uint32_t inode_size = volume->inode_size;
+  if (inode_size <= XATTR_INODE_START + 2)
+    return 0;
+  if (inode_no == 0 || inode_no > volume->super.s_inodes_count)
+    return -1;
+
+  uint32_t inumber = inode_no - 1;
+  uint32_t group_no = inumber / volume->super.s_inodes_per_group;
+  uint32_t index = inumber % volume->super.s_inodes_per_group;
+  char *raw = arena_alloc(inode_size);
+  *entries = arena_alloc((inode_size - XATTR_INODE_START) / XATTR_ENTRY_SIZE * sizeof(xattr_entry_t));
+  if (!raw || !*entries)
+    return -1;
+  if (read_block(volume, volume->groups[group_no].bg_inode_table, index * inode_size, inode_size, raw) != inode_size)
+    return -1;
+  *data = raw;
+
+  uint32_t extra_isize = *(uint16_t *) (raw + XATTR_INODE_START);
+  uint32_t start = XATTR_INODE_START + extra_isize;
+  if (extra_isize % 4 || start + 4 > inode_size || *(uint32_t *) (raw + start) != EXT2_XATTR_MAGIC)
+    return 0;
+  start += 4;
+  return parse_xattr_entries(raw, start, inode_size, start, *entries);
+}
+
+static inline xattr_block_t **xattr_bucket(xattr_cache_t *cache, uint32_t block_no) {
+  return &cache->buckets[(block_no * 2654435761u) & (XATTR_CACHE_BUCKETS - 1)];
+}
+
+static inline void xattr_lru_unlink(xattr_block_t *block) {
+  block->lru_prev->lru_next = block->lru_next;
+  block->lru_next->lru_prev = block->lru_prev;
+}
+
+static inline void xattr_lru_push_front(xattr_cache_t *cache, xattr_block_t *block) {
+  block->lru_prev = &cache->lru;
+  block->lru_next = cache->lru.lru_next;
+  cache->lru.lru_next->lru_prev = block;
+  cache->lru.lru_next = block;
+}
+
+/* xattr_evict: Removes the least recently used block from the cache.
+   It is freed once its last user releases it. Must be called with the
+   lock held.
+ */
+static void xattr_evict(xattr_cache_t *cache) {
+
+  xattr_block_t *victim = cache->lru.lru_prev;
+  xattr_block_t **link = xattr_bucket(cache, victim->block_no);
+  while (*link != victim)
+    link = &(*link)->hash_next;
+  *link = victim->hash_next;
+  xattr_lru_unlink(victim);
+  cache->count--;
+  victim->cached = 0;
+  if (victim->users == 0)
+    free(victim);
+}
+
+/* acquire_xattr_block: Returns the parsed EA block with the given
+   number, from the volume's cache if possible. The block must be
+   released with release_xattr_block.
+
+   Returns:
+     A pointer to the block, or NULL if it could not be read or is not
+     a valid EA block.
+ */
+static xattr_block_t *acquire_xattr_block(volume_t *volume, uint32_t block_no) {
+
+  xattr_cache_t *cache = volume->xattr_cache;
+  xattr_block_t *block, *parsed;
+
+  if (cache) {
+    pthread_mutex_lock(&cache->lock);
+    for (block = *xattr_bucket(cache, block_no); block && block->block_no != block_no; block = block->hash_next)
+      ;
+    if (block) {
+      block->users++;
+      xattr_lru_unlink(block);
+      xattr_lru_push_front(cache, block);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (block)
+      return block;
+  }
+
+  // The lock is not held while the block is read, so two threads may
+  // parse the same block; the second one to finish drops its copy.
+  parsed = parse_xattr_block(volume, block_no);
+  if (!parsed || !cache) {
+    if (parsed) {
+      parsed->users = 1;
+      parsed->cached = 0;
+    }
+    return parsed;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  for (block = *xattr_bucket(cache, block_no); block && block->block_no != block_no; block = block->hash_next)
+    ;
+  if (block) {
+    block->users++;
+    free(parsed);
+  } else {
+    block = parsed;
+    block->users = 1;
+    block->cached = 1;
+    if (cache->count == XATTR_CACHE_BLOCKS)
+      xattr_evict(cache);
+    xattr_block_t **bucket = xattr_bucket(cache, block_no);
+    block->hash_next = *bucket;
+    *bucket = block;
+    xattr_lru_push_front(cache, block);
+    cache->count++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return block;
+}
+
+static void release_xattr_block(volume_t *volume, xattr_block_t *block) {
+
+  xattr_cache_t *cache = volume->xattr_cache;
+  if (cache)
+    pthread_mutex_lock(&cache->lock);
+  if (--block->users == 0 && !block->cached)
+    free(block);
+  if (cache)
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* convert_acl: Converts an ACL stored in ext2 format, where entries
+   without an ID are shortened, into the format used by the
+   system.posix_acl_* attributes of the Linux VFS.
+
+   Returns:
+     The size of the converted ACL, which is only stored if it fits in
+     'size' bytes. Returns -1 if the ACL is malformed.
+ */
+static ssize_t convert_acl(const char *acl, size_t acl_size, char *out, size_t size) {
+
+  enum { ACL_USER_OBJ = 1, ACL_USER = 2, ACL_GROUP_OBJ = 4, ACL_GROUP = 8, ACL_MASK = 16, ACL_OTHER = 32 };
+  size_t offset = 4, out_size = 4;
+
+  if (acl_size < 4 || *(uint32_t *) acl != 1)
+    return -1;
+  if (size >= 4)
+    *(uint32_t *) out = 2;
+
+  while (offset < acl_size) {
+    if (offset + 4 > acl_size)
+      return -1;
+    uint16_t tag = *(uint16_t *) (acl + offset);
+    uint16_t perm = *(uint16_t *) (acl + offset + 2);
+    uint32_t id = UINT32_MAX; // ACL_UNDEFINED_ID
+    if (tag == ACL_USER || tag == ACL_GROUP) {
+      if (offset + 8 > acl_size)
+        return -1;
+      id = *(uint32_t *) (acl + offset + 4);
+      offset += 8;
+    } else if (tag == ACL_USER_OBJ || tag == ACL_GROUP_OBJ || tag == ACL_MASK || tag == ACL_OTHER) {
+      offset += 4;
+    } else {
+      return -1;
+    }
+    if (out_size + 8 <= size) {
+      memcpy(out + out_size, &tag, 2);
+      memcpy(out + out_size + 2, &perm, 2);
+      memcpy(out + out_size + 4, &id, 4);
+    }
+    out_size += 8;
+  }
+  return out_size;
+}
+
+/* find_xattr: Returns the entry with the given full name, or NULL if
+   there is none.
+ */
+static const xattr_entry_t *find_xattr(const xattr_entry_t *entries, uint32_t num_entries, const char *name) {
+
+  size_t name_len = strlen(name);
+  for (uint32_t i = 0; i < num_entries; i++) {
+    const xattr_entry_t *entry = &entries[i];
+    const char *prefix = xattr_prefix(entry->name_index);
+    size_t prefix_len = strlen(prefix);
+    if (prefix_len + entry->name_len == name_len && !memcmp(name, prefix, prefix_len) &&
+        !memcmp(name + prefix_len, entry->name, entry->name_len))
+      return entry;
+  }
+  return NULL;
+}
+
+/* copy_xattr_value: Copies the value of an entry found in 'data', with
+   the semantics of get_xattr.
+ */
+static ssize_t copy_xattr_value(const char *data, const xattr_entry_t *entry, void *value, size_t size) {
+
+  ssize_t rv;
+  data += entry->value_offs;
+  if (entry->name_index == XATTR_INDEX_POSIX_ACL_ACCESS ||
+      entry->name_index == XATTR_INDEX_POSIX_ACL_DEFAULT) {
+    rv = convert_acl(data, entry->value_size, value, size);
+    errno = EIO;
+  } else {
+    rv = entry->value_size;
+    if (size >= entry->value_size)
+      memcpy(value, data, entry->value_size);
+  }
+  if (rv >= 0 && size > 0 && (size_t) rv > size) {
+    rv = -1;
+    errno = ERANGE;
+  }
+  return rv;
+}
+
+/* list_xattr_names: Appends the full names of some entries to a list
+   holding 'total' bytes, as far as they fit in 'size' bytes.
+
+   Returns:
+     The size of the list with the names appended.
+ */
+static size_t list_xattr_names(const xattr_entry_t *entries, uint32_t num_entries, char *list, size_t size,
+                               size_t total) {
+
+  for (uint32_t i = 0; i < num_entries; i++) {
+    const xattr_entry_t *entry = &entries[i];
+    const char *prefix = xattr_prefix(entry->name_index);
+    size_t prefix_len = strlen(prefix);
+    size_t len = prefix_len + entry->name_len + 1;
+    if (size > 0 && total + len <= size) {
+      memcpy(list + total, prefix, prefix_len);
+      memcpy(list + total + prefix_len, entry->name, entry->name_len);
+      list[total + len - 1] = '\0';
+    }
+    total += len;
+  }
+  return total;
+}
+
+/* get_xattr: Obtains the value of an extended attribute of a file,
+   with the same semantics as getxattr(2). Attributes stored inside the
+   inode are looked up before those of its EA block.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Number of the inode, to read the attributes it holds.
+     inode: Pointer to inode structure for the file.
+     name: Full name of the attribute, including its namespace prefix
+           (e.g., "user.comment" or "security.selinux").
+     value: Buffer where the value is stored.
+     size: Size of the buffer. If 0, only the size of the value is
+           returned.
+
+   Returns:
+     The size of the value. Returns -1 and sets errno to ENODATA if the
+     file has no such attribute, to ERANGE if the buffer is too small,
+     or to EIO in case of error.
+ */
+ssize_t get_xattr(volume_t *volume, uint32_t inode_no, inode_t *inode, const char *name, void *value,
+                  size_t size) {
+
+  arena_mark_t mark = arena_mark();
+  const char *data = NULL;
+  xattr_entry_t *entries = NULL;
+  const xattr_entry_t *entry;
+  ssize_t rv;
+
+  int64_t num_entries = read_inode_xattrs(volume, inode_no, &data, &entries);
+  if (num_entries < 0) {
+    arena_release(mark);
+    errno = EIO;
+    return -1;
+  }
+  if ((entry = find_xattr(entries, num_entries, name))) {
+    rv = copy_xattr_value(data, entry, value, size);
+    arena_release(mark);
+    return rv;
+  }
+  arena_release(mark);
+
+  if (inode->i_file_acl == 0) {
+    errno = ENODATA;
+    return -1;
+  }
+  xattr_block_t *block = acquire_xattr_block(volume, inode->i_file_acl);
+  if (!block) {
+    errno = EIO;
+    return -1;
+  }
+  if ((entry = find_xattr(block->entries, block->num_entries, name))) {
+    rv = copy_xattr_value(block->data, entry, value, size);
+  } else {
+    rv = -1;
+    errno = ENODATA;
+  }
+  release_xattr_block(volume, block);
+  return rv;
+}
+
+/* list_xattrs: Lists the names of the extended attributes of a file,
+   with the same semantics as listxattr(2): first those stored inside
+   the inode, then those of its EA block.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Number of the inode, to read the attributes it holds.
+     inode: Pointer to inode structure for the file.
+     list: Buffer where the full names of the attributes are stored,
+           each one followed by a null byte.
+     size: Size of the buffer. If 0, only the size of the list is
+           returned.
+
+   Returns:
+     The size of the list. Returns -1 and sets errno to ERANGE if the
+     buffer is too small, or to EIO in case of error.
+ */
+ssize_t list_xattrs(volume_t *volume, uint32_t inode_no, inode_t *inode, char *list, size_t size) {
+
+  arena_mark_t mark = arena_mark();
+  const char *data = NULL;
+  xattr_entry_t *entries = NULL;
+
+  int64_t num_entries = read_inode_xattrs(volume, inode_no, &data, &entries);
+  if (num_entries < 0) {
+    arena_release(mark);
+    errno = EIO;
+    return -1;
+  }
+  size_t total = list_xattr_names(entries, num_entries, list, size, 0);
+  arena_release(mark);
+
+  if (inode->i_file_acl != 0) {
+    xattr_block_t *block = acquire_xattr_block(volume, inode->i_file_acl);
+    if (!block) {
+      errno = EIO;
+      return -1;
+    }
+    total = list_xattr_names(block->entries, block->num_entries, list, size, total);
+    release_xattr_block(volume, block);
+  }
+
+  if (size > 0 && total > size) {
+    errno = ERANGE;
+    return -1;
+  }
+  return total;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ext2.h"
+
+#define DEFAULT_CHUNK_KIB 1024
+#define DEFAULT_LEVEL     3
+#define DEFAULT_THREADS   4
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-c chunk_kib] [-l level] [-j threads] volume_file compressed_file\n"
+          "       %s -d compressed_file volume_file\n"
+          "  -c  volume data per independently compressed chunk, in KiB (default %d)\n"
+          "  -l  zstd compression level (default %d)\n"
+          "  -j  number of chunks compressed in parallel (default %d)\n"
+          "  -d  decompress an image back into a plain volume file\n",
+          prog, prog, DEFAULT_CHUNK_KIB, DEFAULT_LEVEL, DEFAULT_THREADS);
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned long chunk_kib = DEFAULT_CHUNK_KIB;
+  int level = DEFAULT_LEVEL;
+  unsigned int threads = DEFAULT_THREADS;
+  int decompress = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:l:j:d")) != -1) {
+    switch (opt) {
+    case 'c': chunk_kib = strtoul(optarg, NULL, 10); break;
+    case 'l': level = atoi(optarg); break;
+    case 'j': threads = strtoul(optarg, NULL, 10); break;
+    case 'd': decompress = 1; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind != 2 || chunk_kib == 0 || chunk_kib > 1024 * 1024) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int in_fd = open(argv[optind], O_RDONLY);
+  if (in_fd == -1) {
+    fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+  if (decompress && !is_zimage_file(in_fd)) {
+    fprintf(stderr, "%s: not a compressed volume image\n", argv[optind]);
+    return 1;
+  }
+  int out_fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd == -1) {
+    fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(errno));
+    return 1;
+  }
+
+  int rv = decompress ? convert_from_zimage(in_fd, out_fd) :
+    convert_to_zimage(in_fd, out_fd, chunk_kib * 1024, level, threads);
+  if (rv < 0 || close(out_fd) == -1) {
+    fprintf(stderr, "Conversion failed: %s\n", errno ? strerror(errno) : "invalid data");
+    return 1;
+  }
+  close(in_fd);
+  return 0;
+}
@@ -0,0 +1,286 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zstd.h>
+
+/* Seekable compressed volume images. The volume data is split into
+   fixed-size chunks, each compressed as an independent zstd frame, so
+   any chunk can be decompressed without touching the others:
+
+     header | frame 0 | frame 1 | ... | frame N-1 | index
+
+   The index holds N+1 file offsets: frame i spans index[i] up to
+   index[i+1]. All integers are stored little-endian.
+ */
+
+#define ZIMAGE_VERSION 1
+
+// Memory used for decompressed chunks, and how far ahead of a
+// sequential reader chunks are decompressed.
+#define ZIMAGE_CACHE_SIZE   (64 << 20)
+#define ZIMAGE_READAHEAD    8
+#define ZIMAGE_THREADS      4
+
+typedef struct zimage_header {
+  char     magic[8];     // ZIMAGE_MAGIC
+  uint32_t version;      // ZIMAGE_VERSION
+  uint32_t chunk_size;   // Bytes of volume data per chunk
+  uint64_t image_size;   // Bytes of volume data
+  uint64_t num_chunks;   // Number of frames
+  uint64_t index_offset; // File offset of the frame index
+} zimage_header_t;
+
+typedef struct zimage_backend {
+  volume_backend_t backend;
+  int fd;
+  zimage_header_t header;
+  uint64_t *index;
+  chunk_cache_t *chunks;
+} zimage_backend_t;
+
+/* is_zimage_file: Returns 1 if the file starts with a compressed image
+   header, 0 otherwise.
+ */
+int is_zimage_file(int fd) {
+
+  char magic[sizeof(ZIMAGE_MAGIC) - 1];
+  return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+    !memcmp(magic, ZIMAGE_MAGIC, sizeof(magic));
+}
+
+static int zimage_load_chunk(void *ctx, uint64_t chunk_no, void *buffer) {
+
+  zimage_backend_t *zimage = ctx;
+  uint64_t frame_offset = zimage->index[chunk_no];
+  size_t frame_size = zimage->index[chunk_no + 1] - frame_offset;
+  uint64_t data_offset = chunk_no * zimage->header.chunk_size;
+  size_t expected = zimage->header.chunk_size;
+  if (expected > zimage->header.image_size - data_offset)
+    expected = zimage->header.image_size - data_offset;
+
+  void *frame = malloc(frame_size);
+  if (!frame)
+    return -1;
+  if (pread(zimage->fd, frame, frame_size, frame_offset) != frame_size) {
+    free(frame);
+    return -1;
+  }
+  size_t rv = ZSTD_decompress(buffer, zimage->header.chunk_size, frame, frame_size);
+  free(frame);
+  if (ZSTD_isError(rv) || rv != expected)
+    return -1;
+
+  memset((char *) buffer + expected, 0, zimage->header.chunk_size - expected);
+  return 0;
+}
+
+static ssize_t zimage_pread(volume_backend_t *backend, void *buffer, size_t size, uint64_t offset) {
+  return chunk_cache_read(((zimage_backend_t *) backend)->chunks, buffer, size, offset);
+}
+
+static void zimage_close(volume_backend_t *backend) {
+
+  zimage_backend_t *zimage = (zimage_backend_t *) backend;
+  if (zimage->chunks)
+    destroy_chunk_cache(zimage->chunks);
+  close(zimage->fd);
+  free(zimage->index);
+  free(zimage);
+}
+
+/* open_zimage_backend: Creates a storage backend that reads volume
+   data from a compressed image. The backend takes ownership of the
+   file descriptor if successful.
+
+   Parameters:
+     fd: File descriptor of the compressed image.
+
+   Returns:
+     A pointer to the new backend, or NULL if the image is invalid.
+ */
+volume_backend_t *open_zimage_backend(int fd) {
+
+  zimage_backend_t *zimage = calloc(1, sizeof(zimage_backend_t));
+  if (!zimage)
+    return NULL;
+
+  zimage_header_t *header = &zimage->header;
+  if (pread(fd, header, sizeof(zimage_header_t), 0) != sizeof(zimage_header_t) ||
+      memcmp(header->magic, ZIMAGE_MAGIC, sizeof(header->magic)) ||
+      header->version != ZIMAGE_VERSION || header->chunk_size == 0 ||
+      header->num_chunks != (header->image_size + header->chunk_size - 1) / header->chunk_size) {
+    free(zimage);
+    return NULL;
+  }
+
+  size_t index_size = (header->num_chunks + 1) * sizeof(uint64_t);
+  zimage->index = malloc(index_size);
+  if (!zimage->index || pread(fd, zimage->index, index_size, header->index_offset) != index_size) {
+    free(zimage->index);
+    free(zimage);
+    return NULL;
+  }
+  for (uint64_t i = 0; i < header->num_chunks; i++) {
+    if (zimage->index[i] > zimage->index[i + 1]) {
+      free(zimage->index);
+      free(zimage);
+      return NULL;
+    }
+  }
+
+  zimage->fd = fd;
+  zimage->backend.pread = zimage_pread;
+  zimage->backend.close = zimage_close;
+  zimage->backend.size = header->image_size;
+  zimage->chunks = create_chunk_cache(header->chunk_size, header->image_size, ZIMAGE_CACHE_SIZE,
+                                      ZIMAGE_READAHEAD, ZIMAGE_THREADS, zimage_load_chunk, zimage);
+  if (!zimage->chunks) {
+    free(zimage->index);
+    free(zimage);
+    return NULL;
+  }
+  return &zimage->backend;
+}
+
+typedef struct compress_job {
+  pthread_t thread;
+  int started; // Whether 'thread' was created (otherwise the job ran inline)
+  int in_fd;
+  uint64_t offset;
+  size_t size;
+  int level;
+  void *data;
+  void *frame;
+  size_t frame_capacity;
+  size_t frame_size;
+} compress_job_t;
+
+static void *compress_chunk(void *arg) {
+
+  compress_job_t *job = arg;
+  job->frame_size = 0;
+  if (pread(job->in_fd, job->data, job->size, job->offset) != job->size)
+    return NULL;
+  size_t rv = ZSTD_compress(job->frame, job->frame_capacity, job->data, job->size, job->level);
+  if (!ZSTD_isError(rv))
+    job->frame_size = rv;
+  return NULL;
+}
+
+/* convert_to_zimage: Writes a compressed image of a volume file.
+
+   Parameters:
+     in_fd: File descriptor of the (uncompressed) volume file.
+     out_fd: File descriptor where the compressed image is written,
+             starting at offset zero.
+     chunk_size: Number of bytes of volume data per compressed chunk.
+     level: zstd compression level.
+     threads: Number of chunks compressed in parallel.
+
+   Returns:
+     0 on success, -1 on error.
+ */
+int convert_to_zimage(int in_fd, int out_fd, uint32_t chunk_size, int level, unsigned int threads) {
+
+  struct stat st;
+  if (fstat(in_fd, &st) == -1 || chunk_size == 0)
+    return -1;
+  if (threads == 0)
+    threads = 1;
+
+  zimage_header_t header = { .version = ZIMAGE_VERSION, .chunk_size = chunk_size,
+                             .image_size = st.st_size };
+  memcpy(header.magic, ZIMAGE_MAGIC, sizeof(header.magic));
+  header.num_chunks = (header.image_size + chunk_size - 1) / chunk_size;
+
+  uint64_t *index = malloc((header.num_chunks + 1) * sizeof(uint64_t));
+  compress_job_t *jobs = calloc(threads, sizeof(compress_job_t));
+  int rv = index && jobs ? 0 : -1;
+  for (unsigned int t = 0; t < threads && rv == 0; t++) {
+    jobs[t].in_fd = in_fd;
+    jobs[t].level = level;
+    jobs[t].frame_capacity = ZSTD_compressBound(chunk_size);
+    jobs[t].data = malloc(chunk_size);
+    jobs[t].frame = malloc(jobs[t].frame_capacity);
+    if (!jobs[t].data || !jobs[t].frame)
+      rv = -1;
+  }
+
+  uint64_t out_offset = sizeof(zimage_header_t);
+  for (uint64_t chunk_no = 0; chunk_no < header.num_chunks && rv == 0; chunk_no += threads) {
+    unsigned int batch = header.num_chunks - chunk_no < threads ? header.num_chunks - chunk_no : threads;
+    for (unsigned int t = 0; t < batch; t++) {
+      jobs[t].offset = (chunk_no + t) * chunk_size;
+      jobs[t].size = header.image_size - jobs[t].offset < chunk_size ?
+        header.image_size - jobs[t].offset : chunk_size;
+      // Without a thread, the chunk is compressed by this one
+      jobs[t].started = pthread_create(&jobs[t].thread, NULL, compress_chunk, &jobs[t]) == 0;
+      if (!jobs[t].started)
+        compress_chunk(&jobs[t]);
+    }
+    for (unsigned int t = 0; t < batch; t++) {
+      if (jobs[t].started)
+        pthread_join(jobs[t].thread, NULL);
+      index[chunk_no + t] = out_offset;
+      if (rv == 0 && (jobs[t].frame_size == 0 ||
+                      pwrite(out_fd, jobs[t].frame, jobs[t].frame_size, out_offset) != jobs[t].frame_size))
+        rv = -1;
+      out_offset += jobs[t].frame_size;
+    }
+  }
+
+  if (rv == 0) {
+    size_t index_size = (header.num_chunks + 1) * sizeof(uint64_t);
+    index[header.num_chunks] = out_offset;
+    header.index_offset = out_offset;
+    if (pwrite(out_fd, index, index_size, out_offset) != index_size ||
+        pwrite(out_fd, &header, sizeof(header), 0) != sizeof(header))
+      rv = -1;
+  }
+
+  for (unsigned int t = 0; jobs && t < threads; t++) {
+    free(jobs[t].data);
+    free(jobs[t].frame);
+  }
+  free(jobs);
+  free(index);
+  return rv;
+}
+
+/* convert_from_zimage: Writes the uncompressed volume data contained
+   in a compressed image.
+
+   Parameters:
+     in_fd: File descriptor of the compressed image. Not closed.
+     out_fd: File descriptor where the volume data is written,
+             starting at offset zero.
+
+   Returns:
+     0 on success, -1 on error.
+ */
+int convert_from_zimage(int in_fd, int out_fd) {
+
+  int fd = dup(in_fd);
+  volume_backend_t *backend = fd == -1 ? NULL : open_zimage_backend(fd);
+  if (!backend) {
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+
+  zimage_backend_t *zimage = (zimage_backend_t *) backend;
+  void *buffer = malloc(zimage->header.chunk_size);
+  int rv = buffer ? 0 : -1;
+  for (uint64_t offset = 0; offset < backend->size && rv == 0; offset += zimage->header.chunk_size) {
+    ssize_t bytes = backend->pread(backend, buffer, zimage->header.chunk_size, offset);
+    if (bytes <= 0 || pwrite(out_fd, buffer, bytes, offset) != bytes)
+      rv = -1;
+  }
+  free(buffer);
+  backend->close(backend);
+  return rv;
+}
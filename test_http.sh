@@ -0,0 +1,84 @@
+#!/bin/sh
+# Runs ext2test on volumes read both from their files and through the
+# HTTP backend, from ext2serve on the loopback interface, and checks
+# that both runs print the same results. On a URL, ext2test skips the
+# checks that need a plain volume file (compressed image, patched
+# volumes), which are left out of the comparison.
+#
+# Usage: ./test_http.sh [-p port] volume_file...
+
+PORT=18080
+if [ "$1" = "-p" ]; then
+  PORT=$2
+  shift 2
+fi
+
+if [ $# -eq 0 ]; then
+  echo "Usage: $0 [-p port] volume_file..." >&2
+  exit 1
+fi
+
+SCRATCH=$(mktemp -d)
+SERVER=
+
+cleanup() {
+  [ -n "$SERVER" ] && kill "$SERVER" 2> /dev/null
+  rm -rf "$SCRATCH"
+}
+trap cleanup EXIT
+
+# ext2serve serves a single directory: links every volume into one
+i=0
+for VOLUME in "$@"; do
+  i=$((i + 1))
+  ln -s "$(realpath "$VOLUME")" "$SCRATCH/volume$i.ext2"
+done
+
+./ext2serve -p "$PORT" "$SCRATCH" 2> "$SCRATCH/server.log" &
+SERVER=$!
+tries=0
+until grep -q "^Serving" "$SCRATCH/server.log"; do
+  tries=$((tries + 1))
+  if ! kill -0 "$SERVER" 2> /dev/null || [ $tries -gt 50 ]; then
+    echo "ext2serve did not start:" >&2
+    cat "$SCRATCH/server.log" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+# Prints ext2test output without the checks skipped in $SCRATCH/url.txt:
+# a labelled line ("  Label : Skipped ...") drops the lines with the
+# same label in that section, an unlabelled one drops the whole section.
+filter() {
+  awk -v skipped="$(awk '/^[A-Z][^:]*:$/ { section = $0 }
+                        /Skipped/ { print section "|" ($0 ~ /^  [^ ]+ *:/ ? substr($0, 1, index($0, ":")) : "*") }' \
+                        "$SCRATCH/url.txt")" '
+    BEGIN { n = split(skipped, s, "\n"); for (i = 1; i <= n; i++) skip[s[i]] = 1 }
+    /^[A-Z][^:]*:$/ { section = $0; print; next }
+    (skip[section "|*"] && /^  /) || skip[section "|" substr($0, 1, index($0, ":"))] { next }
+    { print }' "$1"
+}
+
+status=0
+i=0
+for VOLUME in "$@"; do
+  i=$((i + 1))
+  URL=http://127.0.0.1:$PORT/volume$i.ext2
+  ./ext2test "$VOLUME" > "$SCRATCH/file.txt" 2>&1
+  ./ext2test "$URL" > "$SCRATCH/url.txt" 2>&1
+  filter "$SCRATCH/file.txt" > "$SCRATCH/file.filtered"
+  filter "$SCRATCH/url.txt" > "$SCRATCH/url.filtered"
+  if ! diff "$SCRATCH/file.filtered" "$SCRATCH/url.filtered" > "$SCRATCH/diff.txt"; then
+    echo "$VOLUME: DIFFERENT over HTTP"
+    cat "$SCRATCH/diff.txt"
+    status=1
+  elif grep -q "ERROR" "$SCRATCH/url.filtered"; then
+    echo "$VOLUME: ERROR over HTTP"
+    grep "ERROR" "$SCRATCH/url.filtered"
+    status=1
+  else
+    echo "$VOLUME: OK ($(grep -c Skipped "$SCRATCH/url.txt") checks skipped)"
+  fi
+done
+exit $status
@@ -0,0 +1,85 @@
+#!/bin/sh
+# Mounts volumes with ext2fs in the background (without -f, so that
+# FUSE daemonizes) from their files, from compressed images made with
+# ext2zconv, and over HTTP from ext2serve on the loopback interface,
+# and checks that every mount shows the same files as ext2extract.
+# A mount whose file system does not answer within TIMEOUT seconds is
+# reported as hung.
+#
+# Usage: ./test_mount.sh [-p port] volume_file...
+
+PORT=18090
+TIMEOUT=60
+if [ "$1" = "-p" ]; then
+  PORT=$2
+  shift 2
+fi
+
+if [ $# -eq 0 ]; then
+  echo "Usage: $0 [-p port] volume_file..." >&2
+  exit 1
+fi
+
+SCRATCH=$(mktemp -d)
+MNT=$SCRATCH/mnt
+SERVER=
+mkdir -p "$MNT" "$SCRATCH/served"
+
+cleanup() {
+  fusermount -u -z "$MNT" 2> /dev/null
+  [ -n "$SERVER" ] && kill "$SERVER" 2> /dev/null
+  rm -rf "$SCRATCH"
+}
+trap cleanup EXIT
+
+# Lists every path with its type (and link target), and the checksum
+# of every regular file, in the current directory
+LIST='find . -printf "%y %p %l\n" | sort && find . -type f -exec cksum {} + | sort -k 3'
+
+./ext2serve -p "$PORT" -l 20 "$SCRATCH/served" 2> "$SCRATCH/server.log" &
+SERVER=$!
+tries=0
+until grep -q "^Serving" "$SCRATCH/server.log"; do
+  tries=$((tries + 1))
+  if ! kill -0 "$SERVER" 2> /dev/null || [ $tries -gt 50 ]; then
+    echo "ext2serve did not start:" >&2
+    cat "$SCRATCH/server.log" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+status=0
+i=0
+for VOLUME in "$@"; do
+  i=$((i + 1))
+  rm -rf "$SCRATCH/extract"
+  if ! ./ext2extract "$VOLUME" "$SCRATCH/extract" > /dev/null; then
+    echo "$VOLUME: ext2extract failed"
+    status=1
+    continue
+  fi
+  (cd "$SCRATCH/extract" && sh -c "$LIST") > "$SCRATCH/expected.txt"
+  ln -s "$(realpath "$VOLUME")" "$SCRATCH/served/volume$i.ext2"
+  ./ext2zconv "$VOLUME" "$SCRATCH/volume$i.zimg" > /dev/null
+
+  for SOURCE in "$VOLUME" "$SCRATCH/volume$i.zimg" "http://127.0.0.1:$PORT/volume$i.ext2"; do
+    if ! ./ext2fs "$MNT" "$SOURCE" > /dev/null; then
+      echo "$VOLUME: $SOURCE: mount failed"
+      status=1
+      continue
+    fi
+    if ! timeout -k 5 "$TIMEOUT" sh -c "cd '$MNT' && $LIST" > "$SCRATCH/mounted.txt"; then
+      echo "$VOLUME: $SOURCE: HUNG or failed"
+      status=1
+    elif ! diff "$SCRATCH/expected.txt" "$SCRATCH/mounted.txt" > /dev/null; then
+      echo "$VOLUME: $SOURCE: DIFFERENT from ext2extract"
+      status=1
+    else
+      echo "$VOLUME: $SOURCE: OK"
+    fi
+    fusermount -u -z "$MNT"
+  done
+  rm -f "$SCRATCH/volume$i.zimg"
+done
+exit $status